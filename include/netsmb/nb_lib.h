@@ -70,6 +70,7 @@ struct nb_ifdesc {
 };
 
 struct sockaddr;
+struct sockaddr_in;
 
 __BEGIN_DECLS
 
@@ -96,6 +97,8 @@ int nb_enum_if(struct nb_ifdesc **, int);
 int nb_error_to_errno(int error);
 
 int nb_ctx_resolve(struct nb_ctx *ctx, CFArrayRef WINSAddresses);
+int nb_ctx_resolve_wins(struct nb_ctx *ctx, CFArrayRef WINSAddresses, 
+						struct sockaddr_in **outServers, int *outCount);
 __END_DECLS
 
 #endif /* !_NETSMB_NB_LIB_H_ */
@@ -179,6 +179,7 @@ int  smb_ctx_setdomain(struct smb_ctx *, const char *);
 int  smb_ctx_setpassword(struct smb_ctx *, const char *, int /*setFlags*/);
 
 uint16_t smb_ctx_connstate(struct smb_ctx *ctx);
+char *smb_gss_default_principal(void);
 int  smb_smb_open_print_file(struct smb_ctx *, int, int, const char *, smbfh*);
 int  smb_smb_close_print_file(struct smb_ctx *, smbfh);
 int  smb_read(struct smb_ctx *, smbfh, off_t, uint32_t, char *);
@@ -54,7 +54,11 @@ typedef enum _SMB2_DURABLE_HANDLE_FLAGS
     SMB2_DURABLE_HANDLE_REQUEST = 0x0001,
     SMB2_DURABLE_HANDLE_RECONNECT = 0x0002,
     SMB2_DURABLE_HANDLE_GRANTED = 0x0004,
-    SMB2_LEASE_GRANTED = 0x0008
+    SMB2_LEASE_GRANTED = 0x0008,
+    SMB2_DURABLE_HANDLE_V2 = 0x0010,        /* Use DH2Q/DH2C instead of DHnQ/DHnC */
+    SMB2_PERSISTENT_HANDLE = 0x0020,        /* Ask for a persistent handle */
+    SMB2_PERSISTENT_HANDLE_GRANTED = 0x0040,
+    SMB2_LEASE_REQUEST_WRITE = 0x0080       /* Ask for a RWH lease instead of RH */
 } _SMB2_DURABLE_HANDLE_FLAGS;
 
 struct smb2_durable_handle {
@@ -63,9 +67,13 @@ struct smb2_durable_handle {
     uint64_t lease_key_hi;      /* atomic increment number */
     uint64_t lease_key_low;     /* node hash value */
     uint32_t lease_state;
-    uint32_t pad;
+    uint32_t timeout;           /* DH2Q timeout in milliseconds granted by server */
+    uint8_t create_guid[16];    /* DH2Q/DH2C CreateGuid */
 };
 
+/* SMB 2/3 Durable Handle V2 Flags, 2.2.13.2.11 */
+#define SMB2_DHANDLE_FLAG_PERSISTENT    0x00000002
+
 /* 
  * Apple SMB 2/3 "AAPL" Create Context extensions
  */
@@ -474,6 +482,8 @@ struct finder_info {
 #define SMB2_CREATE_SD_BUFFER                   0x53656344 /* "SecD" */
 #define SMB2_CREATE_DURABLE_HANDLE_REQUEST      0x44486e51 /* "DHnQ" */
 #define SMB2_CREATE_DURABLE_HANDLE_RECONNECT    0x44486e43 /* "DHnC" */
+#define SMB2_CREATE_DURABLE_HANDLE_REQUEST_V2   0x44483251 /* "DH2Q" */
+#define SMB2_CREATE_DURABLE_HANDLE_RECONNECT_V2 0x44483243 /* "DH2C" */
 #define SMB2_CREATE_ALLOCATION_SIZE             0x416c5369 /* "AISi" */
 #define SMB2_CREATE_QUERY_MAXIMAL_ACCESS        0x4d784163 /* "MxAc" */
 #define SMB2_CREATE_TIMEWARP_TOKEN              0x54577270 /* "Twrp" */
@@ -541,6 +541,10 @@ static int smb_vc_create(struct smbioc_negotiate *vcspec,
         vcp->vc_resp_wait_timeout = SMB_RESP_WAIT_TIMO;
     }
     
+    /* Socket buffer sizes from nsmb.conf, otherwise the transport tunes them */
+    vcp->vc_tcp_sndbuf = vcspec->ioc_tcp_sndbuf;
+    vcp->vc_tcp_rcvbuf = vcspec->ioc_tcp_rcvbuf;
+    
 	smb_sm_lockvclist();
 	smb_co_addchild(&smb_vclist, VCTOCP(vcp));
 	smb_sm_unlockvclist();
@@ -923,7 +927,7 @@ static void smb_share_free(struct smb_connobj *cp)
 	SMB_FREE(share->ss_name, M_SMBSTR);
 	lck_mtx_destroy(&share->ss_stlock, ssst_lck_group);
 	lck_mtx_destroy(&share->ss_shlock, ssst_lck_group);
-	lck_mtx_destroy(&share->ss_fid_lock, fid_lck_grp);
+	smb_fid_table_destroy(share);
 	smb_co_done(SSTOCP(share));
 	SMB_FREE(share, M_SMBCONN);
 }
@@ -958,7 +962,7 @@ smb_share_create(struct smb_vc *vcp, struct smbioc_share *shspec,
 				 struct smb_share **outShare, vfs_context_t context)
 {
 	struct smb_share *share;
-    int i;
+    int error;
 	
 	/* Should never happen, but just to be safe */
 	if (context == NULL)
@@ -973,20 +977,19 @@ smb_share_create(struct smb_vc *vcp, struct smbioc_share *shspec,
 		SMB_FREE(share, M_SMBCONN);
 		return ENOMEM;
 	}
+    /* alloc FID mapping stuff */
+    error = smb_fid_table_init(share);
+    if (error) {
+        SMB_FREE(share->ss_name, M_SMBSTR);
+        SMB_FREE(share, M_SMBCONN);
+        return error;
+    }
+
 	/* The smb_co_init routine locks the share and takes a reference */
 	smb_co_init(SSTOCP(share), SMBL_SHARE, "smbss", vfs_context_proc(context));
 	share->obj.co_free = smb_share_free;
 	share->obj.co_gone = smb_share_gone;
 
-    /* alloc FID mapping stuff */
-    lck_mtx_init(&share->ss_fid_lock, fid_lck_grp, fid_lck_attr);
-    for (i = 0; i < SMB_FID_TABLE_SIZE; i++) {
-        LIST_INIT(&share->ss_fid_table[i].fid_list);
-    }
-    share->ss_fid_collisions = 0;
-    share->ss_fid_inserted = 0;
-    share->ss_fid_max_iter = 0;
-    
     lck_mtx_init(&share->ss_shlock, ssst_lck_group, ssst_lck_attr);
 	lck_mtx_init(&share->ss_stlock, ssst_lck_group, ssst_lck_attr);
 	lck_mtx_lock(&share->ss_shlock);
@@ -156,6 +156,12 @@
  */
 #define SMBV_SMB21_OR_LATER(vcp) (((vcp)->vc_flags & (SMBV_SMB21 | SMBV_SMB30 | SMBV_SMB302)) != 0)
 
+/*
+ * True if dialect is SMB 3.0 or later (i.e., SMB 3.0, SMB 3.02, ...)
+ * Important: Remember to update this when adding new dialects.
+ */
+#define SMBV_SMB30_OR_LATER(vcp) (((vcp)->vc_flags & (SMBV_SMB30 | SMBV_SMB302)) != 0)
+
 #define kSMB_64K 65536      /* For the QueryDir and QueryInfo limits */
 #define kSMB_63K 65534      /* <14281932> Max Net App can handle in IOCTL */
 #define kSMB_MAX_TX 1048576 /* 1 MB max transaction size to match Win Clients */
@@ -167,6 +173,7 @@
 #define SMBS_RECONNECTING	0x0002
 #define SMBS_CONNECTED		0x0004
 #define SMBS_GOING_AWAY		0x0008
+#define SMBS_NO_COPYCHUNK	0x0010	/* Server failed a copychunk, copy the data ourselves */
 #define	SMBS_GONE			SMBO_GONE		/* 0x80000000 - Reserved see above for more details */
 
 /*
@@ -399,6 +406,11 @@ struct smb_vc {
 	char                *vc_model_info;     /* SMB 2/3 server model string */
     int32_t             vc_lease_key;       /* SMB 2/3 lease key incrementer to keep it unique */
     uint32_t            vc_resp_wait_timeout; /* max time to wait for any response to arrive */
+    uint32_t            vc_tcp_sndbuf;      /* nsmb.conf socket buffer sizes, zero means auto tune */
+    uint32_t            vc_tcp_rcvbuf;
+    uint32_t            vc_tcp_cur_sndbuf;  /* socket buffer sizes the transport is using */
+    uint32_t            vc_tcp_cur_rcvbuf;
+    uint64_t            vc_tcp_rtt_usecs;   /* last measured round trip time */
 };
 
 #define vc_maxmux	vc_sopt.sv_maxmux
@@ -446,11 +458,16 @@ struct smb_share {
 	uint32_t		maxGuestAccessRights;
 	
 	/* SMB 2/3 FID mapping support */
-	lck_mtx_t		ss_fid_lock;
-	uint64_t		ss_fid_collisions;
-	uint64_t		ss_fid_inserted;
+	lck_rw_t		ss_fid_table_lock;	/* shared for lookups, exclusive to resize */
+	FID_HASH_TABLE_SLOT	*ss_fid_table;
+	uint32_t		ss_fid_table_size;
+	uint32_t		ss_fid_table_mask;
+	FID_LOCK_STRIPE	ss_fid_stripes[SMB_FID_LOCK_STRIPES];
+	volatile SInt64	ss_fid_count;
+	volatile SInt64	ss_fid_collisions;
+	volatile SInt64	ss_fid_inserted;
 	uint64_t		ss_fid_max_iter;
-	FID_HASH_TABLE_SLOT	ss_fid_table[SMB_FID_TABLE_SIZE];
+	uint32_t		ss_fid_resizes;
 };
 
 #define	ss_flags	obj.co_flags
@@ -622,6 +639,7 @@ int  smb_iod_rq_enqueue(struct smb_rq *rqp);
 int  smb_iod_waitrq(struct smb_rq *rqp);
 int  smb_iod_removerq(struct smb_rq *rqp);
 void smb_iod_errorout_share_request(struct smb_share *share, int error);
+void smb_iod_errorout_request(struct smb_rq *rqp, int error);
 
 extern lck_grp_attr_t *co_grp_attr;
 extern lck_grp_t *co_lck_group;
@@ -26,6 +26,14 @@
 
 #ifdef _KERNEL
 
+/*
+ * Called by smb2_smb_parse_change_notify for each FILE_NOTIFY_INFORMATION
+ * entry. The name is the raw UTF-16 file name, relative to the directory the
+ * notify was sent on.
+ */
+typedef void (*smb2_notify_entry_fn)(void *arg, uint32_t action,
+                                     char *name, uint32_t name_len);
+
 int smb2_smb_change_notify(struct smb_share *share, void *args_ptr, 
                            struct smb_rq **in_rqp, vfs_context_t context);
 int smb2_smb_close(struct smb_share *share, void *arg_ptr, 
@@ -56,13 +64,17 @@ int smb2_smb_lease_break_ack(struct smb_share *share, uint64_t lease_key_hi, uin
                              uint32_t lease_state, uint32_t *ret_lease_state, vfs_context_t context);
 int smb2_smb_lock(struct smb_share *share, int op, SMBFID fid,
                   off_t offset, uint64_t length, vfs_context_t context);
+int smb2_smb_lock_elements(struct smb_share *share, SMBFID fid,
+                           struct smb2_lock_element *elements, uint32_t count,
+                           vfs_context_t context);
 int smb2_smb_negotiate(struct smb_vc *vcp, struct smb_rq *rqp,
                        int inReconnect, vfs_context_t user_context,
                        vfs_context_t context);
 int smb_smb_negotiate(struct smb_vc *vcp, vfs_context_t user_context, 
                       int inReconnect, vfs_context_t context);
 int smb_smb_nomux(struct smb_vc *vcp, const char *name, vfs_context_t context);
-int smb2_smb_parse_change_notify(struct smb_rq *rqp, uint32_t *events);
+int smb2_smb_parse_change_notify(struct smb_rq *rqp, uint32_t *events,
+                                 smb2_notify_entry_fn entry_fn, void *entry_arg);
 int smb2_smb_parse_create(struct smb_share *share, struct mdchain *mdp,
                           struct smb2_create_rq *createp);
 int smb2_smb_parse_close(struct mdchain *mdp, struct smb2_close_rq *closep);
@@ -103,6 +115,11 @@ int smb2_smb_read(struct smb_share *share, void *arg_ptr,
                   vfs_context_t context);
 int smb_smb_read(struct smb_share *share, SMBFID fid, uio_t uio, 
                  vfs_context_t context);
+int smb2_smb_rw_async(struct smb_share *share, struct smb2_rw_rq *rwp,
+                      uint32_t do_read, void (*callback)(void *),
+                      void *callback_args, struct smb_rq **out_rqp);
+int smb2_smb_rw_async_reply(struct smb_rq *rqp, struct smb2_rw_rq *rwp,
+                            uint32_t do_read, user_ssize_t *rresid);
 int smb2_smb_set_info(struct smb_share *share, void *args_ptr,
                       struct smb_rq **compound_rqp, vfs_context_t context);
 int smb1_smb_ssnclose(struct smb_vc *vcp, vfs_context_t context);
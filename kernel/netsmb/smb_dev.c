@@ -486,6 +486,9 @@ static int nsmb_dev_ioctl(dev_t dev, u_long cmd, caddr_t data, int flag,
 				properties->txmax = vcp->vc_txmax;				
 				properties->rxmax = vcp->vc_rxmax;
                 properties->wxmax = vcp->vc_wxmax;
+                properties->tcp_sndbuf = vcp->vc_tcp_cur_sndbuf;
+                properties->tcp_rcvbuf = vcp->vc_tcp_cur_rcvbuf;
+                properties->tcp_rtt_usecs = vcp->vc_tcp_rtt_usecs;
                 memset(properties->model_info, 0, (SMB_MAXFNAMELEN * 2));
                 /* only when we are mac to mac */
                 if ((vcp->vc_misc_flags & SMBV_OSX_SERVER) && vcp->vc_model_info) {
@@ -57,7 +57,7 @@
  * correct structure. Only needs to be changed when the
  * structure in this routine are changed.
  */
-#define SMB_IOC_STRUCT_VERSION		170
+#define SMB_IOC_STRUCT_VERSION		171
 
 /*
  * The structure passed into the kernel must be less than or equal to 4K. If the
@@ -126,6 +126,8 @@ struct smbioc_negotiate {
 	uint32_t	ioc_negotiate_token_len __attribute((aligned(8)));   /* Server provided init token length */
 	user_addr_t	ioc_negotiate_token __attribute((aligned(8))); /* Server provided init token */
 	int32_t     ioc_max_resp_timeout;
+	uint32_t	ioc_tcp_sndbuf;		/* Socket buffer sizes, zero means auto tune */
+	uint32_t	ioc_tcp_rcvbuf;
 	uint64_t	ioc_reserved __attribute((aligned(8))); /* Force correct size always */
 };
 
@@ -260,6 +262,9 @@ struct smbioc_vc_properties {
 	uint64_t	txmax;				
 	uint64_t	rxmax;				
 	uint64_t	wxmax;
+	uint32_t	tcp_sndbuf;			/* Socket buffer sizes in use */
+	uint32_t	tcp_rcvbuf;
+	uint64_t	tcp_rtt_usecs;
     char        model_info[SMB_MAXFNAMELEN * 2] __attribute((aligned(8)));
 };
 
@@ -61,7 +61,75 @@
 #include <netsmb/smb_converter.h>
 
 static void smb_fid_insert_new_node(struct smb_share *share, SMB_FID_NODE *node);
-static uint32_t smb_fid_one_at_a_time(uint8_t *key, uint32_t len);
+static uint32_t smb_fid_hash64(uint64_t key);
+static SMB_FID_NODE *smb_fid_node_alloc(FID_LOCK_STRIPE *stripe);
+static void smb_fid_node_free(FID_LOCK_STRIPE *stripe, SMB_FID_NODE *node);
+static void smb_fid_table_grow(struct smb_share *share, uint32_t old_size);
+
+int
+smb_fid_table_init(struct smb_share *share)
+{
+    uint32_t table_index;
+    
+    SMB_MALLOC(share->ss_fid_table, FID_HASH_TABLE_SLOT *,
+               sizeof(FID_HASH_TABLE_SLOT) * SMB_FID_TABLE_SIZE,
+               M_TEMP, M_WAITOK);
+    if (share->ss_fid_table == NULL) {
+        SMBERROR("malloc failed\n");
+        return ENOMEM;
+    }
+    
+    for (table_index = 0; table_index < SMB_FID_TABLE_SIZE; table_index += 1) {
+        LIST_INIT(&share->ss_fid_table[table_index].fid_list);
+    }
+    share->ss_fid_table_size = SMB_FID_TABLE_SIZE;
+    share->ss_fid_table_mask = SMB_FID_TABLE_SIZE - 1;
+    lck_rw_init(&share->ss_fid_table_lock, fid_lck_grp, fid_lck_attr);
+    
+    for (table_index = 0; table_index < SMB_FID_LOCK_STRIPES; table_index += 1) {
+        lck_mtx_init(&share->ss_fid_stripes[table_index].fid_lock,
+                     fid_lck_grp, fid_lck_attr);
+        LIST_INIT(&share->ss_fid_stripes[table_index].free_list);
+        LIST_INIT(&share->ss_fid_stripes[table_index].slab_list);
+    }
+    
+    share->ss_fid_count = 0;
+    share->ss_fid_collisions = 0;
+    share->ss_fid_inserted = 0;
+    share->ss_fid_max_iter = 0;
+    share->ss_fid_resizes = 0;
+    return (0);
+}
+
+/*
+ * Called when the share is being freed, nobody else can be using the table
+ * at this point. Any nodes still in the table live in the slabs, so freeing
+ * the slabs frees them too.
+ */
+void
+smb_fid_table_destroy(struct smb_share *share)
+{
+    FID_LOCK_STRIPE *stripe;
+    SMB_FID_SLAB *slab, *temp_slab;
+    uint32_t i;
+    
+    for (i = 0; i < SMB_FID_LOCK_STRIPES; i += 1) {
+        stripe = &share->ss_fid_stripes[i];
+        
+        LIST_FOREACH_SAFE(slab, &stripe->slab_list, link, temp_slab) {
+            LIST_REMOVE(slab, link);
+            SMB_FREE(slab, M_TEMP);
+        }
+        LIST_INIT(&stripe->free_list);
+        lck_mtx_destroy(&stripe->fid_lock, fid_lck_grp);
+    }
+    
+    if (share->ss_fid_table != NULL) {
+        SMB_FREE(share->ss_fid_table, M_TEMP);
+    }
+    share->ss_fid_table_size = 0;
+    lck_rw_destroy(&share->ss_fid_table_lock, fid_lck_grp);
+}
 
 /* smb_fid_count_all() is used for Debugging */
 uint64_t
@@ -77,13 +145,11 @@ smb_fid_count_all(struct smb_share *share)
         return (0);
     }
     
-    smb_fid_table_lock(share);
+    /* Exclusive keeps every stripe out while we walk the whole table */
+    smb_fid_table_lock_exclusive(share);
     
-    for (table_index = 0; table_index < SMB_FID_TABLE_SIZE; table_index += 1) {
+    for (table_index = 0; table_index < share->ss_fid_table_size; table_index += 1) {
         slotPtr = &share->ss_fid_table[table_index];
-        if (slotPtr == NULL) {
-            continue;
-        }
         
         LIST_FOREACH_SAFE(node, &slotPtr->fid_list, link, temp_node) {
             count++;
@@ -107,19 +173,18 @@ smb_fid_delete_all(struct smb_share *share)
         return;
     }
     
-    smb_fid_table_lock(share);
+    smb_fid_table_lock_exclusive(share);
     
-    for (table_index = 0; table_index < SMB_FID_TABLE_SIZE; table_index += 1) {
+    for (table_index = 0; table_index < share->ss_fid_table_size; table_index += 1) {
         slotPtr = &share->ss_fid_table[table_index];
-        if (slotPtr == NULL) {
-            continue;
-        }
         
         LIST_FOREACH_SAFE(node, &slotPtr->fid_list, link, temp_node) {
             LIST_REMOVE(node, link);
-            SMB_FREE(node, M_TEMP);
+            smb_fid_node_free(&share->ss_fid_stripes[table_index & SMB_FID_STRIPE_MASK],
+                              node);
         }
     }
+    share->ss_fid_count = 0;
     
     smb_fid_table_unlock(share);
 }
@@ -129,6 +194,7 @@ smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
                        SMB2FID *smb2_fid)
 {
     FID_HASH_TABLE_SLOT *slotPtr;
+    FID_LOCK_STRIPE *stripe;
     SMB_FID_NODE *node;
     uint32_t table_index, iter;
     uint32_t found_it = 0;
@@ -148,21 +214,14 @@ smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
         return (0);
     }
     
-    smb_fid_table_lock(share);
+    smb_fid_table_lock_shared(share);
     
     /* calculate the slot */
-    table_index = fid & SMB_FID_TABLE_MASK;
-    if (table_index >= SMB_FID_TABLE_SIZE) {
-        SMBERROR("Bad table_index: %u for fid %llx\n", table_index, fid);
-        goto exit;
-    };
-    
+    table_index = fid & share->ss_fid_table_mask;
     slotPtr = &share->ss_fid_table[table_index];
-    if (slotPtr == NULL) {
-        SMBERROR("slotPtr is null for table_index %u, fid %llx\n", 
-                 table_index, fid);
-        goto exit;
-    };
+    stripe = &share->ss_fid_stripes[table_index & SMB_FID_STRIPE_MASK];
+    
+    smb_fid_stripe_lock(stripe);
     
     iter = 0;
     LIST_FOREACH(node, &slotPtr->fid_list, link) {
@@ -176,13 +235,17 @@ smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
                          node->smb2_fid.fid_volatile,
                          fid);*/
                 LIST_REMOVE(node, link);
-				SMB_FREE(node, M_TEMP);
+                smb_fid_node_free(stripe, node);
+                OSAddAtomic64(-1, &share->ss_fid_count);
             }
             break;
         }
         iter++;
     }
     
+    smb_fid_stripe_unlock(stripe);
+    
+    /* Debugging stat only, so a racy update is fine */
     if (iter >= share->ss_fid_max_iter) {
         share->ss_fid_max_iter = iter;
     }
@@ -197,7 +260,7 @@ smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
     else {
         SMBERROR("No SMB 2/3 fid found for fid %llx\n", fid);
     }
-exit:    
+
     smb_fid_table_unlock(share);
     return (error);
 }
@@ -206,7 +269,10 @@ int
 smb_fid_get_user_fid(struct smb_share *share, SMB2FID smb2_fid, SMBFID *ret_fid)
 {
     uint64_t fid, val1, val2;
+    FID_LOCK_STRIPE *stripe;
     SMB_FID_NODE *node;
+    uint32_t table_size;
+    int grow = 0;
     int error = EINVAL;
     
     if (share == NULL) {
@@ -214,16 +280,17 @@ smb_fid_get_user_fid(struct smb_share *share, SMB2FID smb2_fid, SMBFID *ret_fid)
         return EINVAL;
     };    
     
-    smb_fid_table_lock(share);
-    
-    val1 = smb_fid_one_at_a_time((uint8_t *)&smb2_fid.fid_persistent,
-                                 sizeof(smb2_fid.fid_persistent));
-    val2 = smb_fid_one_at_a_time((uint8_t *)&smb2_fid.fid_volatile,
-                                 sizeof(smb2_fid.fid_volatile));
+    val1 = smb_fid_hash64(smb2_fid.fid_persistent);
+    val2 = smb_fid_hash64(smb2_fid.fid_volatile);
     
     fid = (val1 << 32) | val2;
     
-    SMB_MALLOC(node, SMB_FID_NODE *, sizeof(SMB_FID_NODE), M_TEMP, M_WAITOK);
+    smb_fid_table_lock_shared(share);
+    
+    stripe = &share->ss_fid_stripes[fid & SMB_FID_STRIPE_MASK];
+    smb_fid_stripe_lock(stripe);
+    
+    node = smb_fid_node_alloc(stripe);
     if (node != NULL) {
         node->fid = fid;
         node->smb2_fid = smb2_fid;
@@ -242,10 +309,27 @@ smb_fid_get_user_fid(struct smb_share *share, SMB2FID smb2_fid, SMBFID *ret_fid)
         error = ENOMEM;
     }
     
+    smb_fid_stripe_unlock(stripe);
+    
+    table_size = share->ss_fid_table_size;
+    if ((error == 0) &&
+        (table_size < SMB_FID_TABLE_MAX_SIZE) &&
+        (OSAddAtomic64(1, &share->ss_fid_count) + 1 > ((SInt64) table_size * SMB_FID_TABLE_LOAD))) {
+        grow = 1;
+    }
+    
     smb_fid_table_unlock(share);
+    
+    if (grow) {
+        smb_fid_table_grow(share, table_size);
+    }
     return (error);
 }
 
+/*
+ * Must be called with the table lock held shared and the stripe that owns
+ * the node's slot locked.
+ */
 static void
 smb_fid_insert_new_node(struct smb_share *share, SMB_FID_NODE *node)
 {
@@ -253,39 +337,121 @@ smb_fid_insert_new_node(struct smb_share *share, SMB_FID_NODE *node)
     uint32_t table_index;
     
     // calculate the slot
-    table_index = node->fid & SMB_FID_TABLE_MASK;
-    DBG_ASSERT(table_index < SMB_FID_TABLE_SIZE);
+    table_index = node->fid & share->ss_fid_table_mask;
+    DBG_ASSERT(table_index < share->ss_fid_table_size);
     
     slotPtr = &share->ss_fid_table[table_index];
     
-    if (LIST_EMPTY(&slotPtr->fid_list)) {
-    } 
-    else {
-        share->ss_fid_collisions++;
+    if (!LIST_EMPTY(&slotPtr->fid_list)) {
+        OSAddAtomic64(1, &share->ss_fid_collisions);
     }
     LIST_INSERT_HEAD(&slotPtr->fid_list, node, link);
-    share->ss_fid_inserted++;
+    OSAddAtomic64(1, &share->ss_fid_inserted);
 }
 
-/* A quick little hash function
- * Written by Bob Jenkins, and put in the public domain
- * See http://burtleburtle.net/bob/hash/doobs.html
+/*
+ * Double the size of the hash table. The new table is allocated before we
+ * take the table lock exclusive so we never block lookups on the malloc.
+ * If someone else already grew the table, just throw ours away.
  */
-static uint32_t 
-smb_fid_one_at_a_time(uint8_t *key, uint32_t len)
+static void
+smb_fid_table_grow(struct smb_share *share, uint32_t old_size)
+{
+    FID_HASH_TABLE_SLOT *new_table, *old_table;
+    SMB_FID_NODE *node, *temp_node;
+    uint32_t new_size, new_mask, table_index;
+    
+    new_size = old_size * 2;
+    SMB_MALLOC(new_table, FID_HASH_TABLE_SLOT *,
+               sizeof(FID_HASH_TABLE_SLOT) * new_size, M_TEMP, M_WAITOK);
+    if (new_table == NULL) {
+        /* Not fatal, we just keep using the smaller table */
+        SMBERROR("malloc failed for %u slots\n", new_size);
+        return;
+    }
+    
+    for (table_index = 0; table_index < new_size; table_index += 1) {
+        LIST_INIT(&new_table[table_index].fid_list);
+    }
+    new_mask = new_size - 1;
+    
+    smb_fid_table_lock_exclusive(share);
+    
+    if (share->ss_fid_table_size != old_size) {
+        smb_fid_table_unlock(share);
+        SMB_FREE(new_table, M_TEMP);
+        return;
+    }
+    
+    old_table = share->ss_fid_table;
+    for (table_index = 0; table_index < old_size; table_index += 1) {
+        LIST_FOREACH_SAFE(node, &old_table[table_index].fid_list, link, temp_node) {
+            LIST_REMOVE(node, link);
+            LIST_INSERT_HEAD(&new_table[node->fid & new_mask].fid_list, node, link);
+        }
+    }
+    
+    share->ss_fid_table = new_table;
+    share->ss_fid_table_size = new_size;
+    share->ss_fid_table_mask = new_mask;
+    share->ss_fid_resizes++;
+    share->ss_fid_max_iter = 0;
+    
+    smb_fid_table_unlock(share);
+    
+    SMB_FREE(old_table, M_TEMP);
+}
+
+/*
+ * Must be called with the stripe locked. Grab a node off the free list,
+ * adding a new slab to the stripe if the free list is empty.
+ */
+static SMB_FID_NODE *
+smb_fid_node_alloc(FID_LOCK_STRIPE *stripe)
 {
-    uint32_t   hash, i;
+    SMB_FID_SLAB *slab;
+    SMB_FID_NODE *node;
+    uint32_t i;
     
-    for (hash = 0, i = 0; i < len; ++i)
-    {
-        hash += key[i];
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
+    node = LIST_FIRST(&stripe->free_list);
+    if (node == NULL) {
+        SMB_MALLOC(slab, SMB_FID_SLAB *, sizeof(SMB_FID_SLAB), M_TEMP, M_WAITOK);
+        if (slab == NULL) {
+            return (NULL);
+        }
+        LIST_INSERT_HEAD(&stripe->slab_list, slab, link);
+        
+        for (i = 0; i < SMB_FID_SLAB_NODES; i += 1) {
+            LIST_INSERT_HEAD(&stripe->free_list, &slab->nodes[i], link);
+        }
+        node = LIST_FIRST(&stripe->free_list);
     }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-    return (hash);
+    
+    LIST_REMOVE(node, link);
+    return (node);
+}
+
+/* Must be called with the stripe locked or the table lock held exclusive */
+static void
+smb_fid_node_free(FID_LOCK_STRIPE *stripe, SMB_FID_NODE *node)
+{
+    node->fid = 0;
+    LIST_INSERT_HEAD(&stripe->free_list, node, link);
 }
 
+/*
+ * Mix all 64 bits of one half of the SMB 2/3 file id down into 32 bits. This
+ * replaces the byte at a time hash we used to use, the low bits are used to
+ * pick the slot so they need to depend on every bit of the key.
+ */
+static uint32_t 
+smb_fid_hash64(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return ((uint32_t) (key ^ (key >> 32)));
+}
 
@@ -26,12 +26,9 @@
 
 #include <netsmb/smb_2.h>
 
-#define	smb_fid_table_lock(share)	(lck_mtx_lock(&(share)->ss_fid_lock))
-#define	smb_fid_table_unlock(share)	(lck_mtx_unlock(&(share)->ss_fid_lock))
-
 LIST_HEAD(fid_list_head, fid_node_t);
 
-// An element in the global fid hash table
+// An element in the fid hash table
 typedef struct fid_node_t
 {
 	SMBFID  fid;
@@ -46,10 +43,55 @@ typedef struct fid_hash_table_slot
 	
 } FID_HASH_TABLE_SLOT;
 
-// Global fid hash table
+/*
+ * Nodes are carved out of slabs that belong to a lock stripe. A node that
+ * gets removed from the hash table goes back on its stripe's free list and
+ * the slabs are only released when the share goes away.
+ */
+#define SMB_FID_SLAB_NODES 128
+
+LIST_HEAD(fid_slab_head, fid_slab_t);
+
+typedef struct fid_slab_t
+{
+	LIST_ENTRY(fid_slab_t) link;
+	SMB_FID_NODE nodes[SMB_FID_SLAB_NODES];
+	
+} SMB_FID_SLAB;
+
+/*
+ * Bucket i of the hash table is protected by stripe (i & SMB_FID_STRIPE_MASK).
+ * Since the table size is always a power of two that is a multiple of the
+ * stripe count, a fid stays on the same stripe when the table is resized.
+ */
+#define SMB_FID_LOCK_STRIPES 64
+#define SMB_FID_STRIPE_MASK (SMB_FID_LOCK_STRIPES - 1)
+
+typedef struct fid_lock_stripe
+{
+	lck_mtx_t fid_lock;
+	struct fid_list_head free_list;
+	struct fid_slab_head slab_list;
+	
+} FID_LOCK_STRIPE;
+
+// Per share fid hash table, grows once the average chain gets too long
 #define SMB_FID_TABLE_SIZE 4096
-#define SMB_FID_TABLE_MASK 0x0000000000000fff
+#define SMB_FID_TABLE_MAX_SIZE (256 * 1024)
+#define SMB_FID_TABLE_LOAD 4
+
+/*
+ * Lookups and inserts take the table lock shared plus the stripe lock. 
+ * Resizing the table takes the table lock exclusive.
+ */
+#define	smb_fid_table_lock_shared(share)	(lck_rw_lock_shared(&(share)->ss_fid_table_lock))
+#define	smb_fid_table_lock_exclusive(share)	(lck_rw_lock_exclusive(&(share)->ss_fid_table_lock))
+#define	smb_fid_table_unlock(share)	(lck_rw_done(&(share)->ss_fid_table_lock))
+#define	smb_fid_stripe_lock(stripe)	(lck_mtx_lock(&(stripe)->fid_lock))
+#define	smb_fid_stripe_unlock(stripe)	(lck_mtx_unlock(&(stripe)->fid_lock))
 
+int smb_fid_table_init(struct smb_share *share);
+void smb_fid_table_destroy(struct smb_share *share);
 void smb_fid_delete_all(struct smb_share *share);
 int smb_fid_get_kernel_fid(struct smb_share *share, SMBFID fid, int remove_fid,
                            SMB2FID *smb2_fid);
@@ -106,7 +106,7 @@ smb_iod_rqprocessed(struct smb_rq *rqp, int error, int flags)
 	rqp->sr_lerror = error;
 	rqp->sr_rpgen++;
 	rqp->sr_state = SMBRQ_NOTIFIED;
-	if (rqp->sr_flags & SMBR_ASYNC) {
+	if (rqp->sr_flags & (SMBR_ASYNC | SMBR_CALLBACK)) {
 		DBG_ASSERT(rqp->sr_callback);
 		rqp->sr_callback(rqp->sr_callback_args);
 	} else 
@@ -653,6 +653,7 @@ smb_iod_recvall(struct smbiod *iod)
     boolean_t smb1_allowed = true;
 	struct mdchain *mdp = NULL;
     int skip_wakeup = 0;
+    int rcvready = 0;
 
 	switch (iod->iod_state) {
 	    case SMBIOD_ST_NOTCONN:
@@ -1030,6 +1031,13 @@ smb_iod_recvall(struct smbiod *iod)
 		}
 	}
 
+    /*
+     * We can stop with whole responses already read ahead off the socket.
+     * No upcall is coming for those, so make sure we come back for them.
+     */
+    if ((SMB_TRAN_GETPARAM(vcp, SMBTP_RCVREADY, &rcvready) == 0) && rcvready) {
+        iod->iod_workflag = 1;
+    }
 	return 0;
 }
 
@@ -1365,6 +1373,25 @@ smb_iod_errorout_share_request(struct smb_share *share, int error)
 	SMB_IOD_RQUNLOCK(iod);
 }
 
+/*
+ * Error out a single request that is still waiting on its reply. Used by
+ * callers of callback requests that give up waiting on them, the callback
+ * still gets called and the request still needs to be freed by the caller.
+ */
+void
+smb_iod_errorout_request(struct smb_rq *rqp, int error)
+{
+	struct smbiod *iod = rqp->sr_vc->vc_iod;
+
+	SMB_IOD_RQLOCK(iod);
+	if (rqp->sr_state != SMBRQ_NOTIFIED) {
+		/* pretend like it did not get sent to recover SMB 2/3 credits */
+		rqp->sr_extflags &= ~SMB2_REQ_SENT;
+		smb_iod_rqprocessed(rqp, error, 0);
+	}
+	SMB_IOD_RQUNLOCK(iod);
+}
+
 int
 smb_iod_sendall(struct smbiod *iod)
 {
@@ -1376,10 +1403,23 @@ smb_iod_sendall(struct smbiod *iod)
 	struct timespec oldest_timesent = {0, 0};
     uint32_t pending_reply = 0;
     uint32_t need_wakeup = 0;
+	int cork, corked = 0;
 
 	herror = 0;
 	echo = 0;
     
+	/*
+	 * Hold the sends made on this pass in the transport, so the requests that
+	 * are ready go out in as few socket writes as possible. The transport
+	 * pushes them out early once enough is queued, otherwise uncorking below
+	 * does.
+	 */
+	if ((vcp->vc_tdata != NULL) && (iod->iod_state == SMBIOD_ST_VCACTIVE)) {
+		cork = 1;
+		if (SMB_TRAN_SETPARAM(vcp, SMBTP_CORK, &cork) == 0)
+			corked = 1;
+	}
+    
 	/*
 	 * Loop through the list of requests and send them if possible
 	 */
@@ -1609,6 +1649,17 @@ retry:
     if (drop_req_lock)
         SMB_IOD_RQUNLOCK(iod);
     
+	if (corked) {
+		int error;
+		
+		cork = 0;
+		error = SMB_TRAN_SETPARAM(vcp, SMBTP_CORK, &cork);
+		if (error) {
+			/* Those requests are marked sent, let the reconnect resend them */
+			herror = ENOTCONN;
+		}
+	}
+    
 	if (herror == ENOTCONN) {
 		smb_iod_start_reconnect(iod);		
 	}	/* no echo message while we are reconnecting */
@@ -1992,6 +2043,8 @@ exit:
 			smb_share_ref(share);
 			lck_mtx_lock(&share->ss_stlock);
 			share->ss_flags &= ~SMBS_RECONNECTING;	/* Turn off reconnecting flag */
+			/* Could be a different server now, give copychunk another try */
+			share->ss_flags &= ~SMBS_NO_COPYCHUNK;
 			lck_mtx_unlock(&share->ss_stlock);
 			wakeup(&share->ss_flags);	/* Wakeup the volumes. */
 			smb_share_rele(share, iod->iod_context);			
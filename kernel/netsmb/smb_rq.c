@@ -66,6 +66,141 @@ MALLOC_DEFINE(M_SMBRQ, "SMBRQ", "SMB request");
 
 #define ALIGN4(a)	(((a) + 3) & ~3)
 
+/*
+ * Request structure caches
+ *
+ * Every SMB request allocates a smb_rq, and the transaction calls also
+ * allocate a smb_t2rq or smb_ntrq, only to free them a few milliseconds
+ * later. Keep a small free list of each so metadata heavy loads don't go
+ * back to the allocator for every operation. The init routines still bzero
+ * the structure, so a cached entry looks just like a fresh allocation.
+ */
+#define SMB_RQ_CACHE_MAX	64
+
+struct smb_rq_cache_entry {
+	struct smb_rq_cache_entry *ce_next;
+};
+
+struct smb_rq_cache {
+	struct smb_rq_cache_entry *rc_free;
+	size_t		rc_size;
+	uint32_t	rc_count;	/* entries on the free list */
+	uint32_t	rc_inuse;	/* entries handed out */
+};
+
+static struct smb_rq_cache smb_rq_cache = { NULL, sizeof(struct smb_rq), 0, 0 };
+static struct smb_rq_cache smb_t2_cache = { NULL, sizeof(struct smb_t2rq), 0, 0 };
+static struct smb_rq_cache smb_nt_cache = { NULL, sizeof(struct smb_ntrq), 0, 0 };
+static lck_mtx_t *smb_rq_cache_lock = NULL;
+
+static int smb_rq_cache_max = SMB_RQ_CACHE_MAX;
+static uint64_t smb_rq_cache_hits = 0;
+static uint64_t smb_rq_cache_misses = 0;
+static uint32_t smb_rq_cache_highwater = 0;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_INT(_net_smb_fs, OID_AUTO, rq_cache_max, CTLFLAG_RW, &smb_rq_cache_max, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, rq_cache_hits, CTLFLAG_RD, &smb_rq_cache_hits, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, rq_cache_misses, CTLFLAG_RD, &smb_rq_cache_misses, "");
+SYSCTL_UINT(_net_smb_fs, OID_AUTO, rq_cache_highwater, CTLFLAG_RD, &smb_rq_cache_highwater, 0, "");
+
+static void *
+smb_rq_cache_get(struct smb_rq_cache *rc)
+{
+	struct smb_rq_cache_entry *ce = NULL;
+	
+	if (smb_rq_cache_lock != NULL) {
+		lck_mtx_lock(smb_rq_cache_lock);
+		ce = rc->rc_free;
+		if (ce != NULL) {
+			rc->rc_free = ce->ce_next;
+			rc->rc_count--;
+			smb_rq_cache_hits++;
+		} else {
+			smb_rq_cache_misses++;
+		}
+		rc->rc_inuse++;
+		/* The high water mark is for the smb_rq's, the others follow them */
+		if ((rc == &smb_rq_cache) && (rc->rc_inuse > smb_rq_cache_highwater)) {
+			smb_rq_cache_highwater = rc->rc_inuse;
+		}
+		lck_mtx_unlock(smb_rq_cache_lock);
+	}
+	if (ce == NULL) {
+		SMB_MALLOC(ce, struct smb_rq_cache_entry *, rc->rc_size, M_SMBRQ, M_WAITOK);
+		if ((ce == NULL) && (smb_rq_cache_lock != NULL)) {
+			lck_mtx_lock(smb_rq_cache_lock);
+			rc->rc_inuse--;
+			lck_mtx_unlock(smb_rq_cache_lock);
+		}
+	}
+	return ce;
+}
+
+static void
+smb_rq_cache_put(struct smb_rq_cache *rc, void *ptr)
+{
+	struct smb_rq_cache_entry *ce = ptr;
+	
+	if (smb_rq_cache_lock != NULL) {
+		lck_mtx_lock(smb_rq_cache_lock);
+		rc->rc_inuse--;
+		if ((smb_rq_cache_max > 0) && (rc->rc_count < (uint32_t)smb_rq_cache_max)) {
+			ce->ce_next = rc->rc_free;
+			rc->rc_free = ce;
+			rc->rc_count++;
+			ce = NULL;
+		}
+		lck_mtx_unlock(smb_rq_cache_lock);
+	}
+	if (ce != NULL) {
+		SMB_FREE(ce, M_SMBRQ);
+	}
+}
+
+static void
+smb_rq_cache_drain(struct smb_rq_cache *rc)
+{
+	struct smb_rq_cache_entry *ce;
+	
+	while ((ce = rc->rc_free) != NULL) {
+		rc->rc_free = ce->ce_next;
+		SMB_FREE(ce, M_SMBRQ);
+	}
+	rc->rc_count = 0;
+}
+
+void
+smb_rq_cache_init(void)
+{
+	smb_rq_cache_lock = lck_mtx_alloc_init(srs_lck_group, srs_lck_attr);
+}
+
+/*
+ * Only called on unload, so no requests can be outstanding.
+ */
+void
+smb_rq_cache_uninit(void)
+{
+	if (smb_rq_cache_lock == NULL) {
+		return;
+	}
+	smb_rq_cache_drain(&smb_rq_cache);
+	smb_rq_cache_drain(&smb_t2_cache);
+	smb_rq_cache_drain(&smb_nt_cache);
+	lck_mtx_free(smb_rq_cache_lock, srs_lck_group);
+	smb_rq_cache_lock = NULL;
+}
+
+/*
+ * Used by smb2_rq_alloc, which has its own init routine.
+ */
+struct smb_rq *
+smb_rq_cache_alloc(void)
+{
+	return smb_rq_cache_get(&smb_rq_cache);
+}
+
 /*
  * Given an object return the share or vc associated with that object. If the 
  * object is a share then return the parent which should be the vc. In all cases
@@ -250,7 +385,7 @@ smb_rq_alloc(struct smb_connobj *obj, u_char cmd, uint16_t flags2,
 	struct smb_rq *rqp;
 	int error;
 
-	SMB_MALLOC(rqp, struct smb_rq *, sizeof(*rqp), M_SMBRQ, M_WAITOK);
+	rqp = smb_rq_cache_get(&smb_rq_cache);
 	if (rqp == NULL)
 		return ENOMEM;
 	error = smb_rq_init_internal(rqp, obj, cmd, SMBR_ALLOCED, flags2, context);
@@ -296,7 +431,7 @@ smb_rq_done(struct smb_rq *rqp)
 	md_done(mdp);
 	lck_mtx_destroy(&rqp->sr_slock, srs_lck_group);
 	if (rqp->sr_flags & SMBR_ALLOCED)
-		SMB_FREE(rqp, M_SMBRQ);
+		smb_rq_cache_put(&smb_rq_cache, rqp);
 }
 
 /*
@@ -311,8 +446,8 @@ smb_rq_reply(struct smb_rq *rqp)
 	uint8_t tb;
 	int error = 0, rperror = 0;
 
-	/* If an async call then just remove it from the queue, no waiting required */
-	if (rqp->sr_flags & SMBR_ASYNC) {
+	/* If an async or callback request then just remove it from the queue, no waiting required */
+	if (rqp->sr_flags & (SMBR_ASYNC | SMBR_CALLBACK)) {
 		smb_iod_removerq(rqp);
 		error = rqp->sr_lerror;
 	} else {
@@ -454,6 +589,19 @@ smb_rq_simple(struct smb_rq *rqp)
 	return (smb_rq_simple_timed(rqp, rqp->sr_vc->vc_timo));
 }
 
+/*
+ * Send the request but do not wait for the reply. The caller must call
+ * smb_rq_reply to get the reply. This lets the caller have several requests
+ * outstanding at once and then collect the replies.
+ */
+int
+smb_rq_enqueue(struct smb_rq *rqp)
+{
+	rqp->sr_timo = rqp->sr_vc->vc_timo;	/* in seconds */
+	rqp->sr_state = SMBRQ_NOTSENT;
+	return (smb_iod_rq_enqueue(rqp));
+}
+
 void
 smb_rq_wstart(struct smb_rq *rqp)
 {
@@ -568,7 +716,7 @@ smb_nt_alloc(struct smb_connobj *obj, u_short fn,
 	struct smb_ntrq *ntp;
 	int error;
 	
-	SMB_MALLOC(ntp, struct smb_ntrq *, sizeof(*ntp), M_SMBRQ, M_WAITOK);
+	ntp = smb_rq_cache_get(&smb_nt_cache);
 	if (ntp == NULL)
 		return ENOMEM;
 	error = smb_nt_init(ntp, obj, SMBT2_ALLOCED, fn, context);
@@ -596,7 +744,7 @@ smb_nt_done(struct smb_ntrq *ntp)
 	md_done(&ntp->nt_rparam);
 	md_done(&ntp->nt_rdata);
 	if (ntp->nt_flags & SMBT2_ALLOCED)
-		SMB_FREE(ntp, M_SMBRQ);
+		smb_rq_cache_put(&smb_nt_cache, ntp);
 }
 
 /*
@@ -658,7 +806,7 @@ smb_t2_alloc(struct smb_connobj *obj, u_short setup, int setupcnt,
 	struct smb_t2rq *t2p;
 	int error;
 
-	SMB_MALLOC(t2p, struct smb_t2rq *, sizeof(*t2p), M_SMBRQ, M_WAITOK);
+	t2p = smb_rq_cache_get(&smb_t2_cache);
 	if (t2p == NULL)
 		return ENOMEM;
 	error = smb_t2_init_internal(t2p, obj, SMBT2_ALLOCED, &setup, setupcnt, context);
@@ -685,7 +833,7 @@ smb_t2_done(struct smb_t2rq *t2p)
 	md_done(&t2p->t2_rparam);
 	md_done(&t2p->t2_rdata);
 	if (t2p->t2_flags & SMBT2_ALLOCED)
-		SMB_FREE(t2p, M_SMBRQ);
+		smb_rq_cache_put(&smb_t2_cache, t2p);
 }
 
 static int 
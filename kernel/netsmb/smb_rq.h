@@ -51,6 +51,7 @@
 #define	SMBR_NO_TIMEOUT     0x0200  /* Do not timeout, long-running request (i.e. Mac-to-Mac COPYCHUNK IOCTL) */
                                     /* Note: we need to remove this in Sarah */
 #define	SMBR_SIGNED         0x0400	/* SMB 2/3 sign this packet */
+#define	SMBR_CALLBACK		0x0800	/* Normal request, but call sr_callback instead of waking a waiter */
 #define	SMBR_MOREDATA		0x8000	/* our buffer was too small */
 
 /* smb_t2rq t2_flags and smb_ntrq nt_flags */
@@ -206,6 +207,9 @@ int smb_rq_alloc(struct smb_connobj *obj, u_char cmd, uint16_t flags2,
 int smb_rq_init(struct smb_rq *rqp, struct smb_connobj *obj, u_char cmd, 
 			uint16_t flags2, vfs_context_t context);
 void smb_rq_done(struct smb_rq *rqp);
+void smb_rq_cache_init(void);
+void smb_rq_cache_uninit(void);
+struct smb_rq *smb_rq_cache_alloc(void);
 int  smb_rq_getrequest(struct smb_rq *rqp, struct mbchain **mbpp);
 int  smb_rq_getreply(struct smb_rq *rqp, struct mdchain **mbpp);
 void smb_rq_wstart(struct smb_rq *rqp);
@@ -213,6 +217,7 @@ void smb_rq_wend(struct smb_rq *rqp);
 void smb_rq_bstart(struct smb_rq *rqp);
 void smb_rq_bend(struct smb_rq *rqp);
 int  smb_rq_reply(struct smb_rq *rqp);
+int  smb_rq_enqueue(struct smb_rq *rqp);
 int  smb_rq_simple(struct smb_rq *rqp);
 int  smb_rq_simple_timed(struct smb_rq *rqp, int timo);
 
@@ -73,7 +73,7 @@ smb2_rq_alloc(struct smb_connobj *obj, u_char cmd, uint32_t *rq_len,
     /* 
      * This function allocates smb_rq and creates the SMB 2/3 header
      */
-	MALLOC(rqp, struct smb_rq *, sizeof(*rqp), M_SMBRQ, M_WAITOK);
+	rqp = smb_rq_cache_alloc();
 	if (rqp == NULL)
 		return ENOMEM;
     
@@ -260,6 +260,16 @@ struct smb2_query_info_rq {
 	uint32_t ret_buffer_len;
 };
 
+/* One element of a SMB 2/3 Lock request */
+struct smb2_lock_element {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t flags;
+};
+
+/* Keeps a Lock request well under one credit */
+#define SMB2_LOCK_MAX_ELEMENTS 64
+
 /* smb2_rw_rq flags */
 typedef enum _SMB2_RW_RQ_FLAGS
 {
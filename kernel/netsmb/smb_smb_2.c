@@ -46,6 +46,7 @@
 #define kMAX_WRITE_BLOCKS 2
 
 #include <sys/sysctl.h>
+#include <uuid/uuid.h>
 
 
 static uint32_t smb_maxwrite = 512 * 1024;	/* Default max write size */
@@ -274,6 +275,10 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
             else {
                 /* New lease, so lways want Read and Handle lease */
                 lease_state = SMB2_LEASE_READ_CACHING | SMB2_LEASE_HANDLE_CACHING;
+                if (dur_handlep->flags & SMB2_LEASE_REQUEST_WRITE) {
+                    /* Byte range locks can be cached under a write lease */
+                    lease_state |= SMB2_LEASE_WRITE_CACHING;
+                }
             }
 
             if (next_context_ptr != NULL) {
@@ -301,7 +306,41 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
             mb_put_uint64le(mbp, 0);        /* Lease Duration */
         }
         
-        if (createp->flags & SMB2_CREATE_DUR_HANDLE) {
+        if ((createp->flags & SMB2_CREATE_DUR_HANDLE) &&
+            (dur_handlep->flags & SMB2_DURABLE_HANDLE_V2)) {
+            /*
+             * Add Durable Handle Request V2
+             */
+            if (next_context_ptr != NULL) {
+                /* Set prev context next ptr */
+                *next_context_ptr = htolel(prev_content_size);
+            }
+            
+            context_len += 56;
+            prev_content_size = 56;
+            
+            next_context_ptr = mb_reserve(mbp, sizeof(uint32_t));   /* Next */
+            *next_context_ptr = htolel(0);  /* Assume we are last context */
+            mb_put_uint16le(mbp, 16);       /* Name Offset */
+            mb_put_uint16le(mbp, 4);        /* Name Length */
+            mb_put_uint16le(mbp, 0);        /* Reserved */
+            mb_put_uint16le(mbp, 24);       /* Data Offset */
+            mb_put_uint32le(mbp, 32);       /* Data Length */
+            /* Name is a string constant and thus its not byte swapped uint32 */
+            mb_put_uint32be(mbp, SMB2_CREATE_DURABLE_HANDLE_REQUEST_V2);
+            mb_put_uint32le(mbp, 0);        /* Pad to 8 byte boundary */
+            mb_put_uint32le(mbp, 0);        /* Timeout, let server pick */
+            if (dur_handlep->flags & SMB2_PERSISTENT_HANDLE) {
+                mb_put_uint32le(mbp, SMB2_DHANDLE_FLAG_PERSISTENT); /* Flags */
+            }
+            else {
+                mb_put_uint32le(mbp, 0);    /* Flags */
+            }
+            mb_put_uint64le(mbp, 0);        /* Reserved */
+            mb_put_mem(mbp, (caddr_t) dur_handlep->create_guid,
+                       sizeof(dur_handlep->create_guid), MB_MSYSTEM); /* CreateGuid */
+        }
+        else if (createp->flags & SMB2_CREATE_DUR_HANDLE) {
             /*
              * Add Durable Handle Request
              */
@@ -343,21 +382,48 @@ smb2_smb_add_create_contexts(struct smb_share *share, struct smb2_create_rq *cre
                 *next_context_ptr = htolel(prev_content_size);
             }
             
-            context_len += 40;
-            /* prev_content_size = 40; */   /* Last context so not needed */
-
-            next_context_ptr = mb_reserve(mbp, sizeof(uint32_t));   /* Next */
-            *next_context_ptr = htolel(0);  /* Assume we are last context */
-            mb_put_uint16le(mbp, 16);       /* Name Offset */
-            mb_put_uint16le(mbp, 4);        /* Name Length */
-            mb_put_uint16le(mbp, 0);        /* Reserved */
-            mb_put_uint16le(mbp, 24);       /* Data Offset */
-            mb_put_uint32le(mbp, 16);       /* Data Length */
-            /* Name is a string constant and thus its not byte swapped uint32 */
-            mb_put_uint32be(mbp, SMB2_CREATE_DURABLE_HANDLE_RECONNECT);
-            mb_put_uint32le(mbp, 0);        /* Pad to 8 byte boundary */
-            mb_put_uint64le(mbp, smb2_fid.fid_persistent); /* FID */
-            mb_put_uint64le(mbp, smb2_fid.fid_volatile);   /* FID */
+            if (dur_handlep->flags & SMB2_DURABLE_HANDLE_V2) {
+                context_len += 60;
+                /* prev_content_size = 60; */   /* Last context so not needed */
+                
+                next_context_ptr = mb_reserve(mbp, sizeof(uint32_t));   /* Next */
+                *next_context_ptr = htolel(0);  /* Assume we are last context */
+                mb_put_uint16le(mbp, 16);       /* Name Offset */
+                mb_put_uint16le(mbp, 4);        /* Name Length */
+                mb_put_uint16le(mbp, 0);        /* Reserved */
+                mb_put_uint16le(mbp, 24);       /* Data Offset */
+                mb_put_uint32le(mbp, 36);       /* Data Length */
+                /* Name is a string constant and thus its not byte swapped uint32 */
+                mb_put_uint32be(mbp, SMB2_CREATE_DURABLE_HANDLE_RECONNECT_V2);
+                mb_put_uint32le(mbp, 0);        /* Pad to 8 byte boundary */
+                mb_put_uint64le(mbp, smb2_fid.fid_persistent); /* FID */
+                mb_put_uint64le(mbp, smb2_fid.fid_volatile);   /* FID */
+                mb_put_mem(mbp, (caddr_t) dur_handlep->create_guid,
+                           sizeof(dur_handlep->create_guid), MB_MSYSTEM); /* CreateGuid */
+                if (dur_handlep->flags & SMB2_PERSISTENT_HANDLE_GRANTED) {
+                    mb_put_uint32le(mbp, SMB2_DHANDLE_FLAG_PERSISTENT); /* Flags */
+                }
+                else {
+                    mb_put_uint32le(mbp, 0);    /* Flags */
+                }
+            }
+            else {
+                context_len += 40;
+                /* prev_content_size = 40; */   /* Last context so not needed */
+                
+                next_context_ptr = mb_reserve(mbp, sizeof(uint32_t));   /* Next */
+                *next_context_ptr = htolel(0);  /* Assume we are last context */
+                mb_put_uint16le(mbp, 16);       /* Name Offset */
+                mb_put_uint16le(mbp, 4);        /* Name Length */
+                mb_put_uint16le(mbp, 0);        /* Reserved */
+                mb_put_uint16le(mbp, 24);       /* Data Offset */
+                mb_put_uint32le(mbp, 16);       /* Data Length */
+                /* Name is a string constant and thus its not byte swapped uint32 */
+                mb_put_uint32be(mbp, SMB2_CREATE_DURABLE_HANDLE_RECONNECT);
+                mb_put_uint32le(mbp, 0);        /* Pad to 8 byte boundary */
+                mb_put_uint64le(mbp, smb2_fid.fid_persistent); /* FID */
+                mb_put_uint64le(mbp, smb2_fid.fid_volatile);   /* FID */
+            }
         }
 
         /* Set the Context Length */
@@ -787,6 +853,21 @@ smb2_smb_dur_handle_init(struct smb_share *share, struct smbnode *np,
         dur_handle->lease_key_low = smbfs_hash(share, np->n_ino,
                                                np->n_name, np->n_nmlen);
         lck_rw_unlock_shared(&np->n_name_rwlock);
+        
+        /*
+         * SMB 3.x can use the V2 durable handle which is tied to a CreateGuid
+         * instead of just the file id. On a continuously available share, ask
+         * for a persistent handle so the open survives a server failover too.
+         */
+        if (SMBV_SMB30_OR_LATER(vcp)) {
+            dur_handle->flags |= SMB2_DURABLE_HANDLE_V2;
+            uuid_generate_random(dur_handle->create_guid);
+            
+            if ((vcp->vc_sopt.sv_capabilities & SMB2_GLOBAL_CAP_PERSISTENT_HANDLES) &&
+                (share->ss_share_caps & SMB2_SHARE_CAP_CONTINUOUS_AVAILABILITY)) {
+                dur_handle->flags |= SMB2_PERSISTENT_HANDLE;
+            }
+        }
         error = 0;
     }
     
@@ -1713,32 +1794,55 @@ int
 smb2_smb_lock(struct smb_share *share, int op, SMBFID fid,
               off_t offset, uint64_t length, vfs_context_t context)
 {
-    int error;
-    struct smb_rq *rqp = NULL;
-    struct mbchain *mbp;
-    struct mdchain *mdp;
-    SMB2FID smb2_fid;
-    uint32_t flags = SMB2_LOCKFLAG_FAIL_IMMEDIATELY; /* %%% Correct ??? */
-    uint16_t len, reserved_uint16;
+    struct smb2_lock_element element;
+    
+    element.offset = offset;
+    element.length = length;
+    element.flags = SMB2_LOCKFLAG_FAIL_IMMEDIATELY; /* %%% Correct ??? */
     
     switch (op) {
         case SMB_LOCK_EXCL:
-            flags |= SMB2_LOCKFLAG_EXCLUSIVE_LOCK;
+            element.flags |= SMB2_LOCKFLAG_EXCLUSIVE_LOCK;
             break;
             
         case SMB_LOCK_SHARED:
-            flags |= SMB2_LOCKFLAG_SHARED_LOCK;
+            element.flags |= SMB2_LOCKFLAG_SHARED_LOCK;
             break;
             
         case SMB_LOCK_RELEASE:
-            flags = 0;  /* cant have any other flags set with unlock */
-            flags |= SMB2_LOCKFLAG_UNLOCK;
+            /* cant have any other flags set with unlock */
+            element.flags = SMB2_LOCKFLAG_UNLOCK;
             break;
 
         default:
             SMBERROR("Unknown lock type %d\n", op);
-            error = EINVAL;
-            goto bad;
+            return EINVAL;
+    }
+    
+    return (smb2_smb_lock_elements(share, fid, &element, 1, context));
+}
+
+/*
+ * Send one Lock request with several lock elements. The server processes the
+ * elements in order and undoes any locks it already took if one of them
+ * fails. The elements must all be locks or all be unlocks.
+ */
+int
+smb2_smb_lock_elements(struct smb_share *share, SMBFID fid,
+                       struct smb2_lock_element *elements, uint32_t count,
+                       vfs_context_t context)
+{
+    int error;
+    struct smb_rq *rqp = NULL;
+    struct mbchain *mbp;
+    struct mdchain *mdp;
+    SMB2FID smb2_fid;
+    uint16_t len, reserved_uint16;
+    uint32_t i;
+    
+    if ((count == 0) || (count > SMB2_LOCK_MAX_ELEMENTS)) {
+        SMBERROR("Bad lock element count %u\n", count);
+        return EINVAL;
     }
 
 resend:
@@ -1754,7 +1858,7 @@ resend:
      * Build the SMB 2/3 Lock Request
      */
     mb_put_uint16le(mbp, 48);       /* Struct size */
-    mb_put_uint16le(mbp, 1);        /* LockCount */
+    mb_put_uint16le(mbp, count);    /* LockCount */
     mb_put_uint32le(mbp, 0);        /* LockSequence %%% Should this be something unique??? */
     
     /* map fid to SMB 2/3 fid */
@@ -1765,10 +1869,12 @@ resend:
     mb_put_uint64le(mbp, smb2_fid.fid_persistent);      /* FID */
     mb_put_uint64le(mbp, smb2_fid.fid_volatile);        /* FID */
     
-    mb_put_uint64le(mbp, offset);                       /* Offset */
-    mb_put_uint64le(mbp, length);                       /* Length */
-    mb_put_uint32le(mbp, flags);                        /* Flags */
-    mb_put_uint32le(mbp, 0);                            /* Reserved */
+    for (i = 0; i < count; i++) {
+        mb_put_uint64le(mbp, elements[i].offset);       /* Offset */
+        mb_put_uint64le(mbp, elements[i].length);       /* Length */
+        mb_put_uint32le(mbp, elements[i].flags);        /* Flags */
+        mb_put_uint32le(mbp, 0);                        /* Reserved */
+    }
 
     error = smb_rq_simple(rqp);
     if (error) {
@@ -1796,7 +1902,7 @@ resend:
         goto bad;
     }
     if (len != 4) {
-        SMBERROR("Bad struct size: %u\n", (uint32_t)length);
+        SMBERROR("Bad struct size: %u\n", (uint32_t)len);
         error = EBADRPC;
         goto bad;
     }
@@ -2126,14 +2232,17 @@ smb_smb_negotiate(struct smb_vc *vcp, vfs_context_t user_context,
 }
 
 int
-smb2_smb_parse_change_notify(struct smb_rq *rqp, uint32_t *events)
+smb2_smb_parse_change_notify(struct smb_rq *rqp, uint32_t *events,
+                             smb2_notify_entry_fn entry_fn, void *entry_arg)
 {
 	int error;
 	uint16_t length;
     uint16_t output_buffer_offset;
     uint32_t output_buffer_len;
 	struct mdchain *mdp;
-    uint32_t next_entry_offset, action;
+    uint32_t next_entry_offset, action, name_len;
+    int last_entry;
+    char *namep;
     
     *events = 0;
     
@@ -2198,6 +2307,9 @@ smb2_smb_parse_change_notify(struct smb_rq *rqp, uint32_t *events)
 	 */
 	if (output_buffer_len && (md_get_uint32le(mdp, &next_entry_offset) == 0)) {
 		do {
+            /* A next offset of zero means this is the last entry */
+            last_entry = (next_entry_offset == 0);
+            
 			/* since we already moved pass next offset don't count it */
 			if (next_entry_offset >= sizeof(uint32_t)) {
 				next_entry_offset -= (uint32_t) sizeof(uint32_t);
@@ -2213,9 +2325,44 @@ smb2_smb_parse_change_notify(struct smb_rq *rqp, uint32_t *events)
 				next_entry_offset -= (uint32_t)sizeof(uint32_t);
             }
             
-            /* Ignore the FileNameLength and FileName1 */
-			if (next_entry_offset) {
-				error = md_get_mem(mdp, NULL, next_entry_offset, MB_MSYSTEM);
+            if (entry_fn != NULL) {
+                /* They want the names, so get FileNameLength and FileName1 */
+                error = md_get_uint32le(mdp, &name_len);
+                if (error) {
+                    break;
+                }
+                
+                if ((name_len == 0) || (name_len > output_buffer_len) ||
+                    (!last_entry && (next_entry_offset < name_len + sizeof(uint32_t)))) {
+                    error = EBADRPC;
+                    break;
+                }
+                
+                SMB_MALLOC(namep, char *, name_len, M_SMBTEMP, M_WAITOK);
+                if (namep == NULL) {
+                    error = ENOMEM;
+                    break;
+                }
+                
+                error = md_get_mem(mdp, namep, name_len, MB_MSYSTEM);
+                if (!error) {
+                    entry_fn(entry_arg, action, namep, name_len);
+                }
+                SMB_FREE(namep, M_SMBTEMP);
+                if (error) {
+                    break;
+                }
+                
+                if (!last_entry) {
+                    next_entry_offset -= name_len + (uint32_t)sizeof(uint32_t);
+                }
+            }
+            
+            if (!last_entry) {
+                /* Skip the rest of this entry and get the next offset */
+                if (next_entry_offset) {
+                    error = md_get_mem(mdp, NULL, next_entry_offset, MB_MSYSTEM);
+                }
 				if (!error) {
 					error = md_get_uint32le(mdp, &next_entry_offset);
                 }
@@ -2248,7 +2395,7 @@ smb2_smb_parse_change_notify(struct smb_rq *rqp, uint32_t *events)
 					error = ENOTSUP;
 					break;
 			}
-		} while (next_entry_offset);
+		} while (!last_entry);
     }
 	
 	if (error || (*events == 0)) {
@@ -2405,6 +2552,7 @@ smb2_smb_parse_create(struct smb_share *share, struct mdchain *mdp,
 	uint32_t ret_context_length;
     SMB2FID smb2_fid;
     struct smb_vc *vcp = SSTOVC(share);
+    struct smb2_durable_handle *dur_handlep = NULL;
 
     /*
      * Parse SMB 2/3 Create Response 
@@ -2535,6 +2683,18 @@ smb2_smb_parse_create(struct smb_share *share, struct mdchain *mdp,
         vcp->vc_misc_flags |= SMBV_OTHER_SERVER;
     }
 
+    /*
+     * A successful DH2C does not get a DH2Q reply context like DHnC does, so
+     * the handle is still durable with the same CreateGuid.
+     */
+    dur_handlep = createp->create_contextp;
+    if ((createp->flags & SMB2_CREATE_DUR_HANDLE_RECONNECT) &&
+        (dur_handlep != NULL)) {
+        if (dur_handlep->flags & SMB2_DURABLE_HANDLE_V2) {
+            dur_handlep->flags |= SMB2_DURABLE_HANDLE_GRANTED;
+        }
+    }
+
     /* Only create user fid if the create worked */
     if (error == 0) {
         error = smb_fid_get_user_fid(share, smb2_fid, &createp->ret_fid);
@@ -2569,6 +2729,7 @@ smb2_smb_parse_create_contexts(struct smb_share *share, struct mdchain *mdp,
     struct mdchain md_context_shadow;
     uint64_t lease_key_hi;
     uint64_t lease_key_low = 0;
+    uint32_t dh2_flags = 0;
 
     /* Read in any pad bytes */
     *ret_context_offset -= SMB2_HDRLEN;
@@ -2772,7 +2933,46 @@ smb2_smb_parse_create_contexts(struct smb_share *share, struct mdchain *mdp,
                 dur_handlep->flags &= ~SMB2_DURABLE_HANDLE_REQUEST;
                 break;
 
+            case SMB2_CREATE_DURABLE_HANDLE_REQUEST_V2:    /* DH2Q */
+                dur_handlep = createp->create_contextp;
+                if (dur_handlep == NULL) {
+                    SMBERROR("dur_handlep is NULL \n");
+                    error = EBADRPC;
+                    goto bad;
+                }
+                
+                if (rsp_context_data_len != 8) {
+                    SMBERROR("Illegal DH2Q data len: %u\n",
+                             rsp_context_data_len);
+                    error = EBADRPC;
+                    goto bad;
+                }
+                
+                /* Get Timeout */
+                error = md_get_uint32le(&md_context_shadow, &dur_handlep->timeout);
+                if (error) {
+                    goto bad;
+                }
+                
+                /* Get Flags */
+                error = md_get_uint32le(&md_context_shadow, &dh2_flags);
+                if (error) {
+                    goto bad;
+                }
+                
+                if (dh2_flags & SMB2_DHANDLE_FLAG_PERSISTENT) {
+                    dur_handlep->flags |= SMB2_PERSISTENT_HANDLE_GRANTED;
+                }
+                else {
+                    dur_handlep->flags &= ~SMB2_PERSISTENT_HANDLE_GRANTED;
+                }
+                
+                dur_handlep->flags |= SMB2_DURABLE_HANDLE_GRANTED;
+                dur_handlep->flags &= ~SMB2_DURABLE_HANDLE_REQUEST;
+                break;
+                
             case SMB2_CREATE_DURABLE_HANDLE_RECONNECT:    /* DHnC */
+            case SMB2_CREATE_DURABLE_HANDLE_RECONNECT_V2:    /* DH2C */
                 /* The response to a DHnC seems to be a RqLs and DHnQ reply */
                 break;
 
@@ -4496,7 +4696,7 @@ smb2_smb_parse_lease_break(struct smbiod *iod, mbuf_t m)
 
     /* Try to find the vnode and upates its lease state */
     error = smbfs_handle_lease_break(smp, lease_key_hi, lease_key_low,
-                                     new_lease_state);
+                                     new_lease_state, iod->iod_context);
     if (error) {
         goto bad;
     }
@@ -6610,6 +6810,105 @@ bad:
     return (error);
 }
 
+/*
+ * Build a single SMB 2/3 Read or Write for the whole of rwp->auio and hand it
+ * to the iod without waiting for the reply. The callback gets called from the
+ * iod thread, with the request short term lock held, once the reply arrives
+ * or the request gets errored out (reconnect, unmount), so it should only
+ * queue up the real work. That work then calls smb2_smb_rw_async_reply to
+ * parse the reply and free the request.
+ *
+ * *out_rqp is filled in before the request is queued, since the callback can
+ * fire before we return. Returns ENOBUFS if we could not get enough credits
+ * to do it in one request, the caller should just do it synchronously.
+ *
+ * The calling routine must hold a reference on the share
+ */
+int
+smb2_smb_rw_async(struct smb_share *share, struct smb2_rw_rq *rwp,
+                  uint32_t do_read, void (*callback)(void *),
+                  void *callback_args, struct smb_rq **out_rqp)
+{
+    struct smb_rq *rqp = NULL;
+    user_ssize_t len, want, resid = 0;
+    int error;
+    
+    want = len = uio_resid(rwp->auio);
+    
+    /* Passing in a rqp just builds the request */
+    if (do_read) {
+        error = smb2_smb_read_one(share, rwp, &len, &resid, &rqp, NULL);
+    }
+    else {
+        error = smb2_smb_write_one(share, rwp, &len, &resid, &rqp, NULL);
+    }
+    if (error) {
+        return (error);
+    }
+    
+    if (len != want) {
+        /* Low on credits, not worth splitting it up here */
+        smb_rq_done(rqp);
+        return (ENOBUFS);
+    }
+    rwp->io_len = len;
+    
+    /* In this situation, its not a compound request */
+    rqp->sr_flags &= ~SMBR_COMPOUND_RQ;
+    rqp->sr_timo = (do_read) ? rqp->sr_vc->vc_timo : SMBWRTTIMO;
+    rqp->sr_state = SMBRQ_NOTSENT;
+    
+    /*
+     * Not SMBR_ASYNC, that is for requests that can be pending on the server
+     * forever and skips the timeout and reconnect checks. This is an ordinary
+     * request that just completes through the callback.
+     */
+    rqp->sr_flags |= SMBR_CALLBACK;
+    rqp->sr_callback = callback;
+    rqp->sr_callback_args = callback_args;
+    
+    *out_rqp = rqp;
+    error = smb_iod_rq_enqueue(rqp);
+    if (error) {
+        /* failed to enqueue, so manually clean up */
+        *out_rqp = NULL;
+        smb_rq_done(rqp);
+    }
+    
+    return (error);
+}
+
+/*
+ * Finish a request started by smb2_smb_rw_async. Parses the reply into
+ * rwp->auio for reads, sets *rresid to the amount read or written and frees
+ * the request.
+ */
+int
+smb2_smb_rw_async_reply(struct smb_rq *rqp, struct smb2_rw_rq *rwp,
+                        uint32_t do_read, user_ssize_t *rresid)
+{
+    struct mdchain *mdp;
+    int error;
+    
+    *rresid = 0;
+    error = smb_rq_reply(rqp);
+    rwp->ret_ntstatus = rqp->sr_ntstatus;
+    if (!error) {
+        /* Now get pointer to response data */
+        smb_rq_getreply(rqp, &mdp);
+        
+        if (do_read) {
+            error = smb2_smb_parse_read_one(mdp, rresid, rwp);
+        }
+        else {
+            error = smb2_smb_parse_write_one(mdp, rresid, rwp);
+        }
+    }
+    smb_rq_done(rqp);
+    
+    return (error);
+}
+
 /*
  * The calling routine must hold a reference on the share
  */
@@ -51,6 +51,8 @@
 #define	SMBTP_TIMEOUT	3		/* RW - struct timespec */
 #define	SMBTP_SELECTID	4		/* RW - (void *) */
 #define SMBTP_UPCALL	5		/* RW - (* void)(void *) */
+#define SMBTP_CORK		6		/* RW - int, hold sends until cleared */
+#define SMBTP_RCVREADY	7		/* R  - int, a whole PDU is already read ahead */
 
 struct smb_tran_ops;
 
@@ -74,6 +74,35 @@ SYSCTL_DECL(_net_smb_fs);
 SYSCTL_INT(_net_smb_fs, OID_AUTO, tcpsndbuf, CTLFLAG_RW, &smb_tcpsndbuf, 0, "");
 SYSCTL_INT(_net_smb_fs, OID_AUTO, tcprcvbuf, CTLFLAG_RW, &smb_tcprcvbuf, 0, "");
 
+/*
+ * Unless nsmb.conf sets the socket buffer sizes, we start with the sizes above
+ * and grow them to twice the bandwidth delay product we measure, up to
+ * smb_tcpmaxbuf.
+ */
+static uint32_t smb_tcpmaxbuf = 16 * 1024 * 1024;
+static int smb_tcpautotune = 1;
+
+SYSCTL_UINT(_net_smb_fs, OID_AUTO, tcpmaxbuf, CTLFLAG_RW, &smb_tcpmaxbuf, 0, "");
+SYSCTL_INT(_net_smb_fs, OID_AUTO, tcpautotune, CTLFLAG_RW, &smb_tcpautotune, 0, "");
+
+/*
+ * The receive path reads everything the socket has, up to nbp_rcvchunk, into
+ * nbp_rcvq and then splits the PDUs out of it. Counts the PDUs that needed no
+ * socket call at all.
+ */
+static uint64_t smb_rcvq_pdus = 0;
+
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, rcvq_pdus, CTLFLAG_RD, &smb_rcvq_pdus, "");
+
+/*
+ * While the iod has the transport corked, sends are queued and written out
+ * together once this many bytes are waiting or the iod uncorks. Zero turns
+ * coalescing off.
+ */
+static int smb_tcpcoalesce = 64 * 1024;
+
+SYSCTL_INT(_net_smb_fs, OID_AUTO, tcpcoalesce, CTLFLAG_RW, &smb_tcpcoalesce, 0, "");
+
 static int nbssn_recv(struct nbpcb *nbp, mbuf_t *mpp, int *lenp, uint8_t *rpcodep, 
 					  struct timespec *wait_time);
 static int  smb_nbst_disconnect(struct smb_vc *vcp);
@@ -84,6 +113,117 @@ nb_setsockopt_int(socket_t so, int level, int name, int val)
 	return (sock_setsockopt(so, level, name, &val, (int)sizeof(val)));
 }
 
+/*
+ * Try to grow the socket buffer to *sizep, backing off 64K at a time if the
+ * socket won't take it. The default size can vary depending on system
+ * pressure, so we never shrink it. Returns the size we ended up with.
+ */
+static int
+nb_set_sockbuf(socket_t so, int name, uint32_t *sizep)
+{
+	uint32_t bufsize = 0, want = *sizep;
+	int optlen = sizeof(bufsize);
+	int error;
+
+	error = sock_getsockopt(so, SOL_SOCKET, name, &bufsize, &optlen);
+	if (error) {
+		return (error);
+	}
+	while (bufsize < want) {
+		if (sock_setsockopt(so, SOL_SOCKET, name, &want, (int)sizeof(want)) == 0) {
+			optlen = sizeof(bufsize);
+			error = sock_getsockopt(so, SOL_SOCKET, name, &bufsize, &optlen);
+			break;
+		}
+		if (want < (NB_SOCKBUF_MIN + 0x10000)) {
+			break;
+		}
+		want -= 0x10000;
+	}
+	*sizep = bufsize;
+	return (error);
+}
+
+static void
+nb_update_rtt(struct nbpcb *nbp)
+{
+#ifdef TCP_CONNECTION_INFO
+	struct tcp_connection_info info;
+	int optlen = sizeof(info);
+
+	if ((sock_getsockopt(nbp->nbp_tso, IPPROTO_TCP, TCP_CONNECTION_INFO, 
+						 &info, &optlen) == 0) && info.tcpi_srtt) {
+		/* tcpi_srtt is in milliseconds */
+		nbp->nbp_rtt_usecs = (uint64_t)info.tcpi_srtt * 1000;
+	}
+#endif
+	nbp->nbp_vc->vc_tcp_rtt_usecs = nbp->nbp_rtt_usecs;
+}
+
+/*
+ * Account for len bytes sent or received. About once a second, see if the
+ * socket buffer is smaller than two bandwidth delay products and grow it.
+ * Only called from the iod thread.
+ */
+static void
+nb_autotune(struct nbpcb *nbp, int name, size_t len)
+{
+	struct timespec *tune_time;
+	struct timespec now, elapsed;
+	uint64_t *bytes;
+	uint32_t *bufp, bufsize;
+	uint64_t usecs, want;
+
+	if (name == SO_SNDBUF) {
+		if (!(nbp->nbp_flags & NBF_SNDAUTOTUNE)) {
+			return;
+		}
+		tune_time = &nbp->nbp_snd_tune_time;
+		bytes = &nbp->nbp_snd_bytes;
+		bufp = &nbp->nbp_sndbuf;
+	} else {
+		if (!(nbp->nbp_flags & NBF_RCVAUTOTUNE)) {
+			return;
+		}
+		tune_time = &nbp->nbp_rcv_tune_time;
+		bytes = &nbp->nbp_rcv_bytes;
+		bufp = &nbp->nbp_rcvbuf;
+	}
+	
+	*bytes += len;
+	nanouptime(&now);
+	elapsed = now;
+	timespecsub(&elapsed, tune_time);
+	if (elapsed.tv_sec < 1) {
+		return;
+	}
+	usecs = ((uint64_t)elapsed.tv_sec * USEC_PER_SEC) + (elapsed.tv_nsec / NSEC_PER_USEC);
+	
+	if (smb_tcpautotune && (*bufp < smb_tcpmaxbuf) && (nbp->nbp_tso != NULL)) {
+		nb_update_rtt(nbp);
+		want = 2 * ((*bytes * nbp->nbp_rtt_usecs) / usecs);
+		if (want > *bufp) {
+			/* At least double it, so we don't keep doing this */
+			bufsize = (uint32_t)MIN(MAX(want, 2 * (uint64_t)*bufp), smb_tcpmaxbuf);
+			if ((nb_set_sockbuf(nbp->nbp_tso, name, &bufsize) == 0) && 
+				(bufsize > *bufp)) {
+				SMB_LOG_IO("%s grown from %u to %u, rtt %llu usecs\n",
+						   (name == SO_SNDBUF) ? "SO_SNDBUF" : "SO_RCVBUF",
+						   *bufp, bufsize, nbp->nbp_rtt_usecs);
+				*bufp = bufsize;
+				if (name == SO_SNDBUF) {
+					nbp->nbp_vc->vc_tcp_cur_sndbuf = bufsize;
+				} else {
+					nbp->nbp_rcvchunk = MAX(bufsize / 2, NB_SORECEIVE_CHUNK);
+					nbp->nbp_vc->vc_tcp_cur_rcvbuf = bufsize;
+				}
+			}
+		}
+	}
+	*tune_time = now;
+	*bytes = 0;
+}
+
 static void
 nb_upcall(socket_t so, void *arg, int waitflag)
 {
@@ -159,8 +299,7 @@ static int tcp_connect(struct nbpcb *nbp, struct sockaddr *to)
 	socket_t so;
 	int error;
 	struct timeval  tv;
-	int optlen;
-	uint32_t bufsize, default_size;
+	uint32_t wanted;
 	
 	error = sock_socket(to->sa_family, SOCK_STREAM, IPPROTO_TCP, nb_upcall, nbp, &so);
 	if (error)
@@ -177,56 +316,40 @@ static int tcp_connect(struct nbpcb *nbp, struct sockaddr *to)
 	if (error)
 		goto bad;
 	
-	sock_getsockopt(so, SOL_SOCKET, SO_RCVBUF, &nbp->nbp_rcvchunk, &optlen);
+	/*
+	 * The window scale gets picked at connect time based on the receive
+	 * buffer size, so both buffers have to be sized before we connect or we
+	 * can never grow the window past 64K on a high latency link.
+	 */
+	wanted = nbp->nbp_sndbuf;
+	error = nb_set_sockbuf(so, SO_SNDBUF, &nbp->nbp_sndbuf);
 	if (error) {
+		/* Not sure what else we can do here, should never happen */
+        SMBERROR("sock_getsockopt failed %d\n", error);
 		goto bad;
 	}
-		/* Max size we want to read off the buffer at a time, always half the socket size */
-	nbp->nbp_rcvchunk /= 2;
-		/* Never let it go below 8K */
-	if (nbp->nbp_rcvchunk < NB_SORECEIVE_CHUNK) {
-		nbp->nbp_rcvchunk = NB_SORECEIVE_CHUNK;
+	if (nbp->nbp_sndbuf < wanted) {
+		SMBWARNING("wanted nbp_sndbuf = %d got %d\n", wanted, nbp->nbp_sndbuf);
 	}
 	
-	/*
-	 * The default socket buffer size can vary depending on system pressure. 
-     * Set SO_SNDBUF as large as we can get.
-	 */
-	bufsize = nbp->nbp_sndbuf;
-	optlen = sizeof(bufsize);
-	error = sock_getsockopt(so, SOL_SOCKET, SO_SNDBUF, &bufsize, &optlen);
+	wanted = nbp->nbp_rcvbuf;
+	error = nb_set_sockbuf(so, SO_RCVBUF, &nbp->nbp_rcvbuf);
 	if (error) {
-		/* Not sure what else we can do here, should never happen */
         SMBERROR("sock_getsockopt failed %d\n", error);
 		goto bad;
 	}
-    default_size = bufsize;
-
-	if (bufsize < nbp->nbp_sndbuf) {
-        do {
-            /* Not big enough, try to make it bigger */
-            bufsize = nbp->nbp_sndbuf;
-            optlen = sizeof(bufsize);
-            error = sock_setsockopt(so, SOL_SOCKET, SO_SNDBUF, &bufsize, optlen);
-            if ((error == 0) && (bufsize > 0x100000)) {
-				/* Currently, 1 MB seems to work fine */
-				break;
-			} else {
-				/* Reduce by 64K and try again */
-				nbp->nbp_sndbuf -= 0x10000;
-			}
-        } while (nbp->nbp_sndbuf >= 0x100000);
+	if (nbp->nbp_rcvbuf < wanted) {
+		SMBWARNING("wanted nbp_rcvbuf = %d got %d\n", wanted, nbp->nbp_rcvbuf);
 	}
-    if (error) {
-        nbp->nbp_sndbuf = default_size;
-    }
-    else {
-        nbp->nbp_sndbuf = bufsize;
-    }
-   
-	if (nbp->nbp_sndbuf < smb_tcpsndbuf) {
-		SMBWARNING("nbp_rcvbuf = %d nbp_sndbuf = %d\n", nbp->nbp_rcvbuf, nbp->nbp_sndbuf);
+	
+		/* Max size we want to read off the buffer at a time, always half the socket size */
+	nbp->nbp_rcvchunk = nbp->nbp_rcvbuf / 2;
+		/* Never let it go below 8K */
+	if (nbp->nbp_rcvchunk < NB_SORECEIVE_CHUNK) {
+		nbp->nbp_rcvchunk = NB_SORECEIVE_CHUNK;
 	}
+	nbp->nbp_vc->vc_tcp_cur_sndbuf = nbp->nbp_sndbuf;
+	nbp->nbp_vc->vc_tcp_cur_rcvbuf = nbp->nbp_rcvbuf;
     
 	error = nb_setsockopt_int(so, SOL_SOCKET, SO_KEEPALIVE, 1);
 	if (error)
@@ -340,6 +463,103 @@ nbssn_rq_request(struct nbpcb *nbp)
 	return (error);
 }
 
+/*
+ * Read whatever the socket has waiting, without blocking, onto the end of
+ * the read ahead queue.
+ */
+static int
+nbssn_recv_ahead(struct nbpcb *nbp)
+{
+	mbuf_t m = NULL;
+	size_t recvdlen;
+	int error;
+
+	if (nbp->nbp_rcvq_len >= nbp->nbp_rcvchunk) {
+		return (0);
+	}
+	recvdlen = nbp->nbp_rcvchunk - nbp->nbp_rcvq_len;
+	error = sock_receivembuf(nbp->nbp_tso, NULL, &m, MSG_DONTWAIT, &recvdlen);
+	if ((error == 0) && (m != NULL) && (recvdlen != 0)) {
+		if (nbp->nbp_rcvq == NULL) {
+			nbp->nbp_rcvq = m;
+		} else {
+			mbuf_cat_internal(nbp->nbp_rcvq, m);
+		}
+		nbp->nbp_rcvq_len += recvdlen;
+		m_fixhdr(nbp->nbp_rcvq); /* Work around <15114764> */
+		return (0);
+	}
+	/* EOF and real errors get found by the blocking path */
+	if (m) {
+		mbuf_freem(m);
+	}
+	return (error);
+}
+
+/*
+ * Remove the first len bytes from the read ahead queue, returning them in
+ * *mp if mp isn't NULL.
+ */
+static int
+nbssn_rcvq_take(struct nbpcb *nbp, size_t len, mbuf_t *mp)
+{
+	mbuf_t rest = NULL;
+	int error;
+
+	DBG_ASSERT(len <= nbp->nbp_rcvq_len);
+	if (mp == NULL) {
+		mbuf_adj(nbp->nbp_rcvq, (int)len);
+		nbp->nbp_rcvq_len -= len;
+		if (nbp->nbp_rcvq_len == 0) {
+			mbuf_freem(nbp->nbp_rcvq);
+			nbp->nbp_rcvq = NULL;
+		}
+		return (0);
+	}
+	if (len < nbp->nbp_rcvq_len) {
+		error = mbuf_split(nbp->nbp_rcvq, len, MBUF_WAITOK, &rest);
+		if (error) {
+			return (error);
+		}
+	}
+	*mp = nbp->nbp_rcvq;
+	nbp->nbp_rcvq = rest;
+	nbp->nbp_rcvq_len -= len;
+	return (0);
+}
+
+/*
+ * Does the read ahead queue hold at least one whole PDU? Nothing will upcall
+ * us for those, the data is already off the socket.
+ */
+static int
+nbssn_rcvq_ready(struct nbpcb *nbp)
+{
+	uint32_t len;
+
+	if (nbp->nbp_rcvq_len < sizeof(len)) {
+		return (0);
+	}
+	mbuf_copydata(nbp->nbp_rcvq, 0, sizeof(len), &len);
+	len = ntohl(len);
+	if (nbp->nbp_flags & NBF_NETBIOS) {
+		len &= SMB_MAXPKTLEN;
+	} else {
+		len &= SMB_LARGE_MAXPKTLEN;
+	}
+	return (nbp->nbp_rcvq_len >= (sizeof(len) + len));
+}
+
+static void
+nbssn_rcvq_flush(struct nbpcb *nbp)
+{
+	if (nbp->nbp_rcvq) {
+		mbuf_freem(nbp->nbp_rcvq);
+		nbp->nbp_rcvq = NULL;
+	}
+	nbp->nbp_rcvq_len = 0;
+}
+
 static int nbssn_recvhdr(struct nbpcb *nbp, uint32_t *lenp, uint8_t *rpcodep, 
 						 struct timespec *wait_time)
 {
@@ -354,6 +574,25 @@ static int nbssn_recvhdr(struct nbpcb *nbp, uint32_t *lenp, uint8_t *rpcodep,
 
 	resid = sizeof(len);
 	bytep = (uint8_t *)&len;
+	
+	/* Pull in everything that has arrived so we can split it up without going back to the socket */
+	if (nbp->nbp_rcvq_len < resid) {
+		error = nbssn_recv_ahead(nbp);
+		if ((error == EWOULDBLOCK) && (wait_time == NULL) && (nbp->nbp_rcvq_len == 0)) {
+			/* Nothing there and no one wants to wait */
+			return (error);
+		}
+	}
+	if (nbp->nbp_rcvq_len) {
+		recvdlen = MIN(resid, nbp->nbp_rcvq_len);
+		mbuf_copydata(nbp->nbp_rcvq, 0, recvdlen, bytep);
+		nbssn_rcvq_take(nbp, recvdlen, NULL);
+		resid -= recvdlen;
+		bytep += recvdlen;
+		/* Got part of the header, only wait 5 seconds to get the rest */
+		flags = MSG_WAITALL;
+	}
+	
 	while (resid != 0) {
 		aio.iov_base = bytep;
 		aio.iov_len = resid;
@@ -499,6 +738,23 @@ static int nbssn_recv(struct nbpcb *nbp, mbuf_t *mpp, int *lenp, uint8_t *rpcode
 		 * the TCP code at the completion of each call.
 		 */
 		resid = len;
+		if (resid && nbp->nbp_rcvq_len) {
+			/* Take what we can from the read ahead data */
+			recvdlen = MIN(resid, nbp->nbp_rcvq_len);
+			error = nbssn_rcvq_take(nbp, recvdlen, &tm);
+			if (error)
+				goto out;
+			if (!m) {
+				m = tm;
+			} else {
+				mbuf_cat_internal(m, tm);
+			}
+			m_fixhdr(m); /* Work around <15114764> */
+			resid -= recvdlen;
+			if (resid == 0) {
+				OSAddAtomic64(1, (SInt64 *) &smb_rcvq_pdus);
+			}
+		}
 		while (resid != 0) {
 			struct timespec tstart, tend;
 			tm = NULL;
@@ -628,6 +884,9 @@ out:
 			mbuf_freem(m);
 		return (error);
 	}
+	if (nbp->nbp_state == NBST_SESSION) {
+		nb_autotune(nbp, SO_RCVBUF, len);
+	}
 	if (mpp)
 		*mpp = m;
 	else
@@ -650,8 +909,18 @@ smb_nbst_create(struct smb_vc *vcp)
 	nbp->nbp_timo.tv_sec = SMB_NBTIMO;
 	nbp->nbp_state = NBST_CLOSED;
 	nbp->nbp_vc = vcp;
-	nbp->nbp_sndbuf = smb_tcpsndbuf;
-	nbp->nbp_rcvbuf = smb_tcprcvbuf;
+	if (vcp->vc_tcp_sndbuf) {
+		nbp->nbp_sndbuf = vcp->vc_tcp_sndbuf;
+	} else {
+		nbp->nbp_sndbuf = smb_tcpsndbuf;
+		nbp->nbp_flags |= NBF_SNDAUTOTUNE;
+	}
+	if (vcp->vc_tcp_rcvbuf) {
+		nbp->nbp_rcvbuf = vcp->vc_tcp_rcvbuf;
+	} else {
+		nbp->nbp_rcvbuf = smb_tcprcvbuf;
+		nbp->nbp_flags |= NBF_RCVAUTOTUNE;
+	}
 	lck_mtx_init(&nbp->nbp_lock, nbp_lck_group, nbp_lck_attr);
 	vcp->vc_tdata = nbp;
 	return (0);
@@ -756,6 +1025,12 @@ smb_nbst_connect(struct smb_vc *vcp, struct sockaddr *sap)
 		return (error);
 	nanouptime(&ts2);
 	timespecsub(&ts2, &ts1);
+	/* Our first rtt estimate, until TCP has a better one */
+	nbp->nbp_rtt_usecs = ((uint64_t)ts2.tv_sec * USEC_PER_SEC) + (ts2.tv_nsec / NSEC_PER_USEC);
+	nbp->nbp_vc->vc_tcp_rtt_usecs = nbp->nbp_rtt_usecs;
+	nanouptime(&nbp->nbp_snd_tune_time);
+	nbp->nbp_rcv_tune_time = nbp->nbp_snd_tune_time;
+	nbp->nbp_snd_bytes = nbp->nbp_rcv_bytes = 0;
 	timespecadd(&ts2, &ts2);
 	timespecadd(&ts2, &ts2);	/*  * 4 */
 	if (timespeccmp(&ts2, &nbp->nbp_timo, >))
@@ -788,16 +1063,53 @@ smb_nbst_disconnect(struct smb_vc *vcp)
 		sock_shutdown(so, 2);
 		sock_close(so);
 	}
+	/* Anything we read ahead or held back belongs to the old connection */
+	nbssn_rcvq_flush(nbp);
+	if (nbp->nbp_sndq) {
+		mbuf_freem(nbp->nbp_sndq);
+		nbp->nbp_sndq = NULL;
+	}
+	nbp->nbp_sndq_len = 0;
 	if (nbp->nbp_state != NBST_RETARGET) {
 		nbp->nbp_state = NBST_CLOSED;
 	}
 	return (0);
 }
 
+/*
+ * Write out everything queued while we were corked. The requests in the
+ * queue are already marked as sent and a partial write leaves the stream out
+ * of sync, so any failure is returned as ENOTCONN and the caller reconnects.
+ */
+static int
+nb_sndq_flush(struct nbpcb *nbp)
+{
+	mbuf_t m = nbp->nbp_sndq;
+	size_t len = nbp->nbp_sndq_len;
+	int error;
+
+	if (m == NULL)
+		return (0);
+	nbp->nbp_sndq = NULL;
+	nbp->nbp_sndq_len = 0;
+	if ((nbp->nbp_tso == NULL) || (nbp->nbp_state != NBST_SESSION)) {
+		mbuf_freem(m);
+		return (ENOTCONN);
+	}
+	error = sock_sendmbuf(nbp->nbp_tso, NULL, m, 0, NULL);
+	if (error) {
+		SMBERROR("Sending %ld coalesced bytes failed with %d\n", (long)len, error);
+		return (ENOTCONN);
+	}
+	nb_autotune(nbp, SO_SNDBUF, len);
+	return (0);
+}
+
 static int
 smb_nbst_send(struct smb_vc *vcp, mbuf_t m0)
 {
 	struct nbpcb *nbp = vcp->vc_tdata;
+	size_t len;
 	int error;
 
 	/* Should never happen, but just in case */
@@ -810,8 +1122,24 @@ smb_nbst_send(struct smb_vc *vcp, mbuf_t m0)
     /* Add in the NetBIOS 4 byte header */
 	if (mbuf_prepend(&m0, 4, MBUF_WAITOK))
 		return (ENOBUFS);
-	nb_sethdr(nbp, m0, NB_SSN_MESSAGE, (uint32_t)(m_fixhdr(m0) - 4));
+	len = m_fixhdr(m0);
+	nb_sethdr(nbp, m0, NB_SSN_MESSAGE, (uint32_t)(len - 4));
+	if ((nbp->nbp_flags & NBF_SNDCORK) && (smb_tcpcoalesce > 0)) {
+		if (nbp->nbp_sndq == NULL) {
+			nbp->nbp_sndq = m0;
+		} else {
+			nbp->nbp_sndq = mbuf_concatenate(nbp->nbp_sndq, m0);
+			m_fixhdr(nbp->nbp_sndq);
+		}
+		nbp->nbp_sndq_len += len;
+		if (nbp->nbp_sndq_len < (size_t)smb_tcpcoalesce)
+			return (0);
+		return (nb_sndq_flush(nbp));
+	}
 	error = sock_sendmbuf(nbp->nbp_tso, NULL, (mbuf_t)m0, 0, NULL);
+	if (!error) {
+		nb_autotune(nbp, SO_SNDBUF, len);
+	}
 	return (error);
 abort:
 	if (m0)
@@ -898,6 +1226,12 @@ smb_nbst_getparam(struct smb_vc *vcp, int param, void *data)
 	    case SMBTP_UPCALL:
 		*(void **)data = nbp->nbp_upcall;
 		break;
+	    case SMBTP_CORK:
+		*(int *)data = (nbp->nbp_flags & NBF_SNDCORK) ? 1 : 0;
+		break;
+	    case SMBTP_RCVREADY:
+		*(int *)data = nbssn_rcvq_ready(nbp);
+		break;
 	    default:
 		return (EINVAL);
 	}
@@ -920,6 +1254,17 @@ smb_nbst_setparam(struct smb_vc *vcp, int param, void *data)
 	    case SMBTP_UPCALL:
 		nbp->nbp_upcall = data;
 		break;
+	    case SMBTP_CORK:
+		lck_mtx_lock(&nbp->nbp_lock);
+		if (*(int *)data) {
+			nbp->nbp_flags |= NBF_SNDCORK;
+		} else {
+			nbp->nbp_flags &= ~NBF_SNDCORK;
+		}
+		lck_mtx_unlock(&nbp->nbp_lock);
+		if (!(nbp->nbp_flags & NBF_SNDCORK))
+			return (nb_sndq_flush(nbp));
+		break;
 	    default:
 		return (EINVAL);
 	}
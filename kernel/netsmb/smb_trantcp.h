@@ -58,6 +58,9 @@ enum nbstate {
 #define	NBF_RECVLOCK	0x0004
 #define	NBF_UPCALLED	0x0010
 #define	NBF_NETBIOS		0x0020	
+#define	NBF_SNDAUTOTUNE	0x0040	/* grow SO_SNDBUF to match the link */
+#define	NBF_RCVAUTOTUNE	0x0080	/* grow SO_RCVBUF to match the link */
+#define	NBF_SNDCORK		0x0100	/* queue sends in nbp_sndq */
 
 
 /*
@@ -75,6 +78,15 @@ struct nbpcb {
 	uint32_t		nbp_sndbuf;
 	uint32_t		nbp_rcvbuf;
 	uint32_t		nbp_rcvchunk;
+	uint64_t		nbp_rtt_usecs;		/* connect time, then TCP's smoothed rtt */
+	struct timespec	nbp_snd_tune_time;	/* start of the current send tuning period */
+	uint64_t		nbp_snd_bytes;		/* bytes sent this period */
+	struct timespec	nbp_rcv_tune_time;	/* start of the current receive tuning period */
+	uint64_t		nbp_rcv_bytes;		/* bytes received this period */
+	mbuf_t			nbp_rcvq;			/* read ahead data not yet returned */
+	size_t			nbp_rcvq_len;
+	mbuf_t			nbp_sndq;			/* framed PDUs waiting for the cork to come out */
+	size_t			nbp_sndq_len;
 	void *		nbp_selectid;
 	void		(* nbp_upcall)(void *);
 	lck_mtx_t	nbp_lock;
@@ -89,6 +101,7 @@ struct nbpcb {
  * buffer size.  See nbssn_recv().
  */
 #define NB_SORECEIVE_CHUNK	(8 * 1024)
+#define NB_SOCKBUF_MIN		(1024 * 1024)	/* Don't back off a socket buffer below this */
 
 extern lck_grp_attr_t *nbp_grp_attr;
 extern lck_grp_t *nbp_lck_group;
@@ -218,7 +218,8 @@ struct smbfs_notify_change;
  * SM_MAX_STATFSTIME is the maximum time to cache statfs data. Since this
  * should be a fast call on the server, the time the data cached is short.
  * That lets the cache handle bursts of statfs() requests without generating
- * lots of network traffic.
+ * lots of network traffic. Once we have statfs data, a stale cache is
+ * returned as is and refreshed in the background by sm_statfs_call.
  */
 #define SM_MAX_STATFSTIME 2
 
@@ -229,6 +230,7 @@ struct smbfs_notify_change;
 #define SM_STATUS_DEAD		0x00000010 /* connection gone - unmount this */
 #define SM_STATUS_REMOUNT	0x00000020 /* remount inprogress */
 #define SM_STATUS_UPDATED	0x00000040 /* Remounted with new server/share */
+#define SM_STATUS_STATFS_DIRTY	0x00000080 /* statfs data changed since the refresh started */
 /* 
  * Some servers do not support all the info levels on Trans2 calls. Most systems do not care if you
  * use a file descriptor or a path name to do a get or set info call. Seems NetApp requires an file descriptor when 
@@ -245,6 +247,34 @@ struct smbfs_notify_change;
 #define SVRMSG_RCVD_GOING_DOWN	0x0000000000000001
 #define SVRMSG_RCVD_SHUTDOWN_CANCEL	0x0000000000000002
 
+/*
+ * Hash chains plus one LRU list for the small bounded caches we keep per
+ * mount. Every entry starts with a struct smb_bcache_link, when the cache is
+ * full the least recently used entry goes no matter which chain it is on.
+ */
+#define SMB_BCACHE_HASHSIZE	64
+
+struct smb_bcache_link {
+	LIST_ENTRY(smb_bcache_link)	bl_hash;
+	TAILQ_ENTRY(smb_bcache_link)	bl_lru;
+};
+
+LIST_HEAD(smb_bcache_head, smb_bcache_link);
+
+struct smb_bcache {
+	struct smb_bcache_head	bc_hash[SMB_BCACHE_HASHSIZE];
+	TAILQ_HEAD(smb_bcache_lru, smb_bcache_link)	bc_lru;	/* most recently used first */
+	uint32_t		bc_cnt;
+	uint32_t		bc_max;
+};
+
+#define SMB_BCACHE_CHAIN(bc, hash)	(&(bc)->bc_hash[(hash) % SMB_BCACHE_HASHSIZE])
+
+/* Number of hash chains in the per mount shared security descriptor table */
+#define SMB_SECDESC_HASHSIZE	256
+
+LIST_HEAD(smb_secdesc_head, smb_secdesc);
+
 struct smbmount {
 	uint64_t		ntwrk_uid;
 	uint64_t		ntwrk_gid;
@@ -266,12 +296,28 @@ struct smbmount {
 	time_t			sm_statfstime; /* sm_statfsbuf cache time */
 	lck_mtx_t		sm_statfslock; /* sm_statsbuf lock */
 	struct vfsstatfs	sm_statfsbuf; /* cached statfs data */
+	thread_call_t		sm_statfs_call; /* refreshes sm_statfsbuf in the background */
 	lck_mtx_t		sm_reclaim_lock; /* mount reclaim lock */
 	void			*notify_thread;	/* pointer to the notify thread structure */
 	int32_t			tooManyNotifies;
 	lck_mtx_t		sm_svrmsg_lock;		/* protects svrmsg fields */
 	uint64_t		sm_svrmsg_pending;	/* svrmsg replies pending (bits defined above) */
 	uint32_t		sm_svrmsg_shutdown_delay;  /* valid when SVRMSG_GOING_DOWN is set */
+	uint32_t		sm_reconnect_cnt;	/* number of reconnects recovered */
+	int32_t			sm_reopen_cnt;		/* files reopened by the last reconnect */
+	int32_t			sm_revoke_cnt;		/* files revoked by the last reconnect */
+	int32_t			sm_notify_reopen_cnt;	/* notifications restarted by the last reconnect */
+	uint64_t		sm_recovery_usecs;	/* how long the last reconnect recovery took */
+	lck_mtx_t		sm_sidcache_lock;	/* protects the sid cache fields */
+	struct smb_bcache	sm_sidcache;
+	uint64_t		sm_sidcache_hits;
+	uint64_t		sm_sidcache_misses;
+	lck_mtx_t		sm_secdesc_lock;	/* protects the shared security descriptors */
+	struct smb_secdesc_head	sm_secdesc[SMB_SECDESC_HASHSIZE];
+	uint32_t		sm_secdesc_cnt;
+	uint64_t		sm_secdesc_shared;	/* times a fetched descriptor was already known */
+	lck_mtx_t		sm_symcache_lock;	/* protects the symlink target cache */
+	struct smb_bcache	sm_symcache;
 };
 
 #define VFSTOSMBFS(mp)		((struct smbmount *)(vfs_fsprivate(mp)))
@@ -302,6 +348,9 @@ int smbfs_update_cache(struct smb_share *share, vnode_t vp,
 		       struct vnode_attr *vap, vfs_context_t context);
 int smbfs_fsync(struct smb_share *share, vnode_t vp, int waitfor, int ubc_flags, 
 		vfs_context_t context);
+void smbfs_strategy_init(void);
+void smbfs_strategy_uninit(void);
+void smbfs_statfs_changed(struct smbmount *smp, int64_t delta);
 
 /*
  * Notify change routines
@@ -316,6 +365,7 @@ int smbfs_stop_change_notify(struct smb_share *share, struct smbnode *np,
 int smbfs_stop_svrmsg_notify(struct smbmount *smp);
 void smbfs_restart_change_notify(struct smb_share *share, struct smbnode *np, 
 				 vfs_context_t context);
+void smbfs_notify_change_wakeup(struct smbmount *smp);
 
 #define SMB_IOMIN (1024 * 1024)
 #define SMB_IOMAXCACHE (SMB_IOMIN * 4)
@@ -374,6 +374,27 @@ smbnode_lock(struct smbnode *np, enum smbfslocktype locktype)
 	return (0);
 }
 
+/*
+ * Lock a node only if we can get it without waiting, returns EBUSY if not.
+ */
+int 
+smbnode_trylock(struct smbnode *np, enum smbfslocktype locktype)
+{
+	if (!lck_rw_try_lock(&np->n_rwlock, (locktype == SMBFS_SHARED_LOCK) ? 
+						 LCK_RW_TYPE_SHARED : LCK_RW_TYPE_EXCLUSIVE))
+		return (EBUSY);
+
+	np->n_lockState = locktype;
+	
+#if 1	
+	/* For Debugging... */
+	if (locktype != SMBFS_SHARED_LOCK) {
+		np->n_activation = (void *) current_thread();
+	}
+#endif
+	return (0);
+}
+
 
 /*
  * Lock a pair of smbnodes
@@ -1782,6 +1803,7 @@ smbfs_attr_cacheenter(struct smb_share *share, vnode_t vp, struct smbfattr *fap,
 	if (node_vtype_changed(vp, node_vtype, fap)) {
 		np->attribute_cache_timer = 0;
 		np->n_symlink_cache_timer = 0;
+		smbfs_symcache_remove(np->n_mount, np->n_ino);
 		cache_purge(vp);
 		smb_vhashrem(np);
 		monitorHint |= VNODE_EVENT_RENAME | VNODE_EVENT_ATTRIB;
@@ -2246,7 +2268,7 @@ smbfs_setsize(vnode_t vp, off_t size)
 	 */
 	nanouptime(&np->n_sizetime);
 	/* Resetting the size, blow away statfs cache */
-	VTOSMBFS(vp)->sm_statfstime = 0;
+	smbfs_statfs_changed(VTOSMBFS(vp), 0);
 }
 
 /*
@@ -2565,6 +2587,7 @@ AddRemoveByteRangeLockEntry(struct fileRefEntry *fndEntry, int64_t offset,
 		new->offset = offset;
 		new->length = length;
 		new->lck_pid = lck_pid;
+		new->flags = 0;
 		new->next = NULL;
 
 		curr = fndEntry->lockList;
@@ -2611,6 +2634,259 @@ AddRemoveByteRangeLockEntry(struct fileRefEntry *fndEntry, int64_t offset,
 	}
 }
 
+/*
+ * smbfs_cached_byterange_lock
+ *
+ * While the fork holds a write lease nobody else can have the file open, so a
+ * byte range lock only needs to be checked against the locks on this client.
+ * Take or release the lock locally in that case. The lease break pushes any
+ * cached locks out to the server before it gets acknowledged.
+ *
+ * Return Values
+ *	0		The lock was taken or released locally
+ *	ENOTSUP	Send the request to the server
+ *	EAGAIN	We already hold this exact lock
+ *	EACCES	The range overlaps another lock on this client
+ */
+int
+smbfs_cached_byterange_lock(struct smbnode *np, struct fileRefEntry *fndEntry,
+							int64_t offset, int64_t length, int8_t unLock,
+							uint32_t lck_pid)
+{
+	struct fileRefEntry *entry;
+	struct ByteRangeLockEntry *curr;
+	struct ByteRangeLockEntry *prev = NULL;
+	struct ByteRangeLockEntry *new = NULL;
+	int error = ENOTSUP;
+
+	/* Allocate it now so we don't block holding the list lock */
+	if (!unLock) {
+		SMB_MALLOC(new, struct ByteRangeLockEntry *, sizeof(struct ByteRangeLockEntry), 
+				   M_TEMP, M_WAITOK);
+		if (new == NULL) {
+			return (ENOTSUP);
+		}
+	}
+
+	lck_mtx_lock(&np->f_openDenyListLock);
+	if (unLock) {
+again:
+		prev = NULL;
+		for (curr = fndEntry->lockList; curr; prev = curr, curr = curr->next) {
+			if ((curr->offset == offset) && (curr->length == length)) {
+				break;
+			}
+		}
+		/* 
+		 * A lease break is still sending this lock to the server, the unlock
+		 * has to get there after it does.
+		 */
+		if (curr && (curr->flags & kBRLPushing)) {
+			msleep(&fndEntry->lockList, &np->f_openDenyListLock, PWAIT, 
+				   "smbfs_brlpush", NULL);
+			goto again;
+		}
+		/* If the server has it then the server has to release it */
+		if (curr && (curr->flags & kBRLCached)) {
+			if (prev) {
+				prev->next = curr->next;
+			} else {
+				fndEntry->lockList = curr->next;
+			}
+			SMB_FREE(curr, M_TEMP);
+			error = 0;
+		}
+		goto done;
+	}
+
+	if (!(fndEntry->dur_handle.flags & SMB2_LEASE_GRANTED) ||
+		!(fndEntry->dur_handle.lease_state & SMB2_LEASE_WRITE_CACHING)) {
+		goto done;
+	}
+
+	/* Zero length locks never conflict */
+	for (entry = np->f_openDenyList; entry && length; entry = entry->next) {
+		for (curr = entry->lockList; curr; curr = curr->next) {
+			if ((curr->length == 0) || (offset >= (curr->offset + curr->length)) ||
+				(curr->offset >= (offset + length))) {
+				continue;
+			}
+			if ((entry == fndEntry) && (curr->offset == offset) &&
+				(curr->length == length) && (curr->lck_pid == lck_pid)) {
+				error = EAGAIN;
+			} else {
+				error = EACCES;
+			}
+			goto done;
+		}
+	}
+
+	new->offset = offset;
+	new->length = length;
+	new->lck_pid = lck_pid;
+	new->flags = kBRLCached;
+	new->next = fndEntry->lockList;
+	fndEntry->lockList = new;
+	new = NULL;
+	error = 0;
+
+done:
+	lck_mtx_unlock(&np->f_openDenyListLock);
+	if (new) {
+		SMB_FREE(new, M_TEMP);
+	}
+	return (error);
+}
+
+/*
+ * Build the lock elements for all the locks on this entry that are only held
+ * locally and mark them as being pushed to the server. The caller holds
+ * f_openDenyListLock if it can, frees the returned elements and calls
+ * smbfs_pushed_cached_byterange_locks once they have been sent. Returns NULL
+ * with a zero count if there are none, or NULL with the count if we couldn't
+ * allocate them.
+ */
+static struct smb2_lock_element *
+smbfs_take_cached_byterange_locks(struct fileRefEntry *entry, uint32_t *countp)
+{
+	struct ByteRangeLockEntry *curr;
+	struct smb2_lock_element *elements = NULL;
+	uint32_t count = 0;
+
+	for (curr = entry->lockList; curr; curr = curr->next) {
+		if (curr->flags & kBRLCached) {
+			count++;
+		}
+	}
+	*countp = count;
+	if (count == 0) {
+		return (NULL);
+	}
+	SMB_MALLOC(elements, struct smb2_lock_element *,
+			   count * sizeof(struct smb2_lock_element), M_TEMP, M_WAITOK);
+	if (elements == NULL) {
+		return (NULL);
+	}
+	count = 0;
+	for (curr = entry->lockList; curr; curr = curr->next) {
+		if (curr->flags & kBRLCached) {
+			elements[count].offset = curr->offset;
+			elements[count].length = curr->length;
+			elements[count].flags = SMB2_LOCKFLAG_EXCLUSIVE_LOCK | 
+									SMB2_LOCKFLAG_FAIL_IMMEDIATELY;
+			curr->flags &= ~kBRLCached;
+			curr->flags |= kBRLPushing;
+			count++;
+		}
+	}
+	*countp = count;
+	return (elements);
+}
+
+/*
+ * The server has the locks now, or never will, either way any unlock waiting
+ * in smbfs_cached_byterange_lock can go to the server.
+ */
+static void
+smbfs_pushed_cached_byterange_locks(struct smbnode *np, struct fileRefEntry *entry)
+{
+	struct ByteRangeLockEntry *curr;
+
+	lck_mtx_lock(&np->f_openDenyListLock);
+	for (curr = entry->lockList; curr; curr = curr->next) {
+		curr->flags &= ~kBRLPushing;
+	}
+	lck_mtx_unlock(&np->f_openDenyListLock);
+	wakeup(&entry->lockList);
+}
+
+/*
+ * Take out the locks from smbfs_take_cached_byterange_locks on the server, in
+ * as few lock requests as we can. If this fails the application thinks it
+ * holds locks the server doesn't know about, so the file gets revoked.
+ */
+static int
+smbfs_send_cached_byterange_locks(struct smb_share *share, struct smbnode *np,
+								  SMBFID fid, struct smb2_lock_element *elements,
+								  uint32_t count, vfs_context_t context)
+{
+	uint32_t sent, this_count;
+	int error = 0;
+
+	if (elements == NULL) {
+		error = ENOMEM;
+	}
+	for (sent = 0; (error == 0) && (sent < count); sent += this_count) {
+		this_count = MIN(count - sent, SMB2_LOCK_MAX_ELEMENTS);
+		error = smb2_smb_lock_elements(share, fid, &elements[sent], this_count,
+									   context);
+	}
+	if (error) {
+		lck_rw_lock_shared(&np->n_name_rwlock);
+		SMBERROR("%s: failed to push %u cached locks, error %d, revoking\n",
+				 np->n_name, count, error);
+		lck_rw_unlock_shared(&np->n_name_rwlock);
+		lck_mtx_lock(&np->f_openStateLock);
+		np->f_openState |= kNeedRevoke;
+		lck_mtx_unlock(&np->f_openStateLock);
+	}
+	return (error);
+}
+
+/*
+ * Called on a lease break, with the lease state the server is breaking us to.
+ * If we are losing the write lease then take out all the locks we have been
+ * holding locally. This runs on the iod thread, so we can't take the node
+ * lock.
+ */
+static void
+smbfs_flush_cached_byterange_locks(struct smb_share *share, vnode_t vp,
+								   uint64_t lease_key_hi, uint64_t lease_key_low,
+								   uint32_t new_lease_state, vfs_context_t context)
+{
+	struct smbnode *np = VTOSMB(vp);
+	struct fileRefEntry *entry;
+	struct smb2_lock_element *elements = NULL;
+	uint32_t count = 0;
+	SMBFID fid = 0;
+
+	lck_mtx_lock(&np->f_openDenyListLock);
+	for (entry = np->f_openDenyList; entry; entry = entry->next) {
+		if ((entry->dur_handle.lease_key_hi == lease_key_hi) &&
+			(entry->dur_handle.lease_key_low == lease_key_low)) {
+			break;
+		}
+	}
+	if (entry == NULL) {
+		lck_mtx_unlock(&np->f_openDenyListLock);
+		SMBERROR("No fileRefEntry found for lease break \n");
+		return;
+	}
+
+	/* 
+	 * Once the write caching is gone no new locks get cached. Any unlock for
+	 * a lock we are pushing waits until the push is done, so the server
+	 * always sees the lock before the unlock, however many batches it takes.
+	 */
+	if ((entry->dur_handle.lease_state & SMB2_LEASE_WRITE_CACHING) &&
+		!(new_lease_state & SMB2_LEASE_WRITE_CACHING)) {
+		elements = smbfs_take_cached_byterange_locks(entry, &count);
+		fid = entry->fid;
+	}
+	entry->dur_handle.lease_state = new_lease_state;
+	lck_mtx_unlock(&np->f_openDenyListLock);
+
+	if (count) {
+		(void)smbfs_send_cached_byterange_locks(share, np, fid, elements, count,
+												context);
+		smbfs_pushed_cached_byterange_locks(np, entry);
+	}
+
+	if (elements) {
+		SMB_FREE(elements, M_TEMP);
+	}
+}
+
 /*
  * AddFileRef
  *
@@ -3074,6 +3350,18 @@ out:
 	lck_mtx_unlock(&np->f_openDenyListLock);
 }
 
+/*
+ * Max number of files reopened per pass in smb2fs_reconnect. This is also the
+ * max number of durable handle reconnects we will have in flight at once.
+ */
+#define SMB2_REOPEN_BATCH_MAX 32
+
+struct smb2fs_reopen_batch {
+    struct smbnode *nodes[SMB2_REOPEN_BATCH_MAX];
+    int errors[SMB2_REOPEN_BATCH_MAX];
+    struct smb2fs_reopen_entry entries[SMB2_REOPEN_BATCH_MAX];
+};
+
 static void
 smb1fs_reconnect(struct smbmount *smp)
 {
@@ -3157,6 +3445,338 @@ smb1fs_reconnect(struct smbmount *smp)
     smbfs_hash_unlock(smp);
 }
 
+/*
+ * Reopen a batch of files after a reconnect. The share lock is held on entry
+ * and exit, but is dropped around the network calls.
+ *
+ * 1. Reconnect the durable handles on every f_openDenyList for the whole
+ *    batch at once, up to batch_max requests in flight.
+ * 2. Then reopen the shared fork for each file. Do this AFTER doing the
+ *    f_openDenyList so we dont break any Handle leases.
+ */
+static void
+smb2fs_reconnect_reopen_batch(struct smbmount *smp,
+                              struct smb2fs_reopen_batch *batchp,
+                              uint32_t node_cnt, uint32_t batch_max)
+{
+    struct smb_share *share = smp->sm_share;
+    struct smb_vc *vcp = SSTOVC(share);
+    struct smbnode *np;
+    struct fileRefEntry *current;
+    struct smb2fs_reopen_entry *entryp;
+    uint32_t i, j, entry_cnt = 0;
+    int error;
+    SMB2FID temp_fid;
+    
+    /*
+     * For all network calls, use iod_context so we can tell this is
+     * from reconnect and thus it wont get blocked waiting for credits.
+     *
+     * Share was locked from smb_iod_reconnect, so have to
+     * unlock it otherwise we can deadlock in iod code when
+     * the share lock is attempted to be locked again.
+     */
+    lck_mtx_unlock(&share->ss_shlock);
+
+    for (i = 0; i < node_cnt; i++) {
+        np = batchp->nodes[i];
+        batchp->errors[i] = 0;
+        
+        /*
+         * Reopen any fids on the f_openDenyList
+         *
+         * We should lock f_openDenyListLock but can not because we will
+         * deadlock
+         */
+        for (current = np->f_openDenyList; current != NULL; current = current->next) {
+            if (!(current->dur_handle.flags & SMB2_DURABLE_HANDLE_GRANTED)) {
+                /*
+                 * Failed to get a durable handle when this file
+                 * was opened, so can not reopen this file
+                 */
+                SMBERROR_LOCK(np, "Missing durable handle %s \n", np->n_name);
+                batchp->errors[i] = EBADF;
+                break;
+            }
+        }
+        
+        if (batchp->errors[i]) {
+            continue;
+        }
+        
+        for (current = np->f_openDenyList; current != NULL; current = current->next) {
+            current->dur_handle.flags |= SMB2_DURABLE_HANDLE_RECONNECT;
+            current->dur_handle.flags &= ~(SMB2_DURABLE_HANDLE_GRANTED |
+                                           SMB2_LEASE_GRANTED);
+            current->dur_handle.fid = current->fid;
+            
+            entryp = &batchp->entries[entry_cnt++];
+            entryp->np = np;
+            entryp->fref = current;
+            entryp->node_index = i;
+            entryp->error = 0;
+            
+            if (entry_cnt < batch_max) {
+                continue;
+            }
+            
+            /* Window is full, send these and collect the replies */
+            smb2fs_smb_reopen_handles(share, batchp->entries, entry_cnt,
+                                      vcp->vc_iod->iod_context);
+            for (j = 0; j < entry_cnt; j++) {
+                entryp = &batchp->entries[j];
+                if (entryp->error && (batchp->errors[entryp->node_index] == 0)) {
+                    SMBERROR_LOCK(entryp->np, "Warning: Could not reopen %s \n",
+                                  entryp->np->n_name);
+                    batchp->errors[entryp->node_index] = entryp->error;
+                }
+            }
+            entry_cnt = 0;
+        }
+    }
+    
+    if (entry_cnt > 0) {
+        smb2fs_smb_reopen_handles(share, batchp->entries, entry_cnt,
+                                  vcp->vc_iod->iod_context);
+        for (j = 0; j < entry_cnt; j++) {
+            entryp = &batchp->entries[j];
+            if (entryp->error && (batchp->errors[entryp->node_index] == 0)) {
+                SMBERROR_LOCK(entryp->np, "Warning: Could not reopen %s \n",
+                              entryp->np->n_name);
+                batchp->errors[entryp->node_index] = entryp->error;
+            }
+        }
+    }
+    
+    for (i = 0; i < node_cnt; i++) {
+        np = batchp->nodes[i];
+        error = batchp->errors[i];
+        
+        if (np->f_openDenyList) {
+            if (error) {
+                /*
+                 * Remove any fids that did not get reopened from the fid
+                 * table. Successful reconnects get their durable handle
+                 * granted again.
+                 */
+                for (current = np->f_openDenyList; current != NULL; current = current->next) {
+                    if (!(current->dur_handle.flags & SMB2_DURABLE_HANDLE_GRANTED)) {
+                        smb_fid_get_kernel_fid(share, current->fid,
+                                               1, &temp_fid);
+                    }
+                }
+            }
+            
+            if (error == 0) {
+                /*
+                 * The server never saw the locks we were holding locally
+                 * under a write lease, take them out now. On failure the
+                 * file gets revoked.
+                 */
+                for (current = np->f_openDenyList; current != NULL; current = current->next) {
+                    struct smb2_lock_element *elements;
+                    uint32_t count;
+                    
+                    elements = smbfs_take_cached_byterange_locks(current, &count);
+                    if (count == 0) {
+                        continue;
+                    }
+                    error = smbfs_send_cached_byterange_locks(share, np, current->fid,
+                                                              elements, count,
+                                                              vcp->vc_iod->iod_context);
+                    smbfs_pushed_cached_byterange_locks(np, current);
+                    if (elements) {
+                        SMB_FREE(elements, M_TEMP);
+                    }
+                    if (error) {
+                        break;
+                    }
+                }
+            }
+            
+            lck_mtx_lock(&np->f_openStateLock);
+            
+            if (error) {
+                /* Mark the file as revoked */
+                np->f_openState |= kNeedRevoke;
+            } else if (np->f_fid == 0) {
+                /* No shared forks to open, we can clear kInReopen now */
+                np->f_openState &= ~kInReopen;
+            }
+            
+            lck_mtx_unlock(&np->f_openStateLock);
+        }
+        
+        /* Reopen shared fork if one is present */
+        if (np->f_fid != 0) {
+            /* Only reopen if no error from open deny list opens */
+            if (error == 0) {
+                error = smbfs_smb_reopen_file(share, np,
+                                              vcp->vc_iod->iod_context);
+                /* 
+                 * smbfs_smb_reopen_file() sets the correct f_openState
+                 * for us 
+                 */
+            }
+            
+            if (error) {
+                /*
+                 * On failure, file is marked for revoke so we are done
+                 * Remove the open fid from the fid table
+                 */
+                smb_fid_get_kernel_fid(share, np->f_fid,
+                                       1, &temp_fid);
+            }
+        }
+        
+        /* 
+         * Paranoid check - its possible that we get reconnected while
+         * we are trying to reopen and that would reset the kInReopen
+         * which could keep us looping forever. For now, we will only
+         * try once to reopen a file and thats it. May have to rethink
+         * this if it becomes a problem.
+         */
+        lck_mtx_lock(&np->f_openStateLock);
+        
+        if (np->f_openState & kNeedReopen) {
+            SMBERROR_LOCK(np, "Only one attempt to reopen %s \n", np->n_name);
+            np->f_openState &= ~kNeedReopen;
+            
+            /* Mark the file as revoked */
+            np->f_openState |= kNeedRevoke;
+        }
+        
+        if (np->f_openState & kNeedRevoke) {
+            OSAddAtomic(1, &smp->sm_revoke_cnt);
+        }
+        else {
+            OSAddAtomic(1, &smp->sm_reopen_cnt);
+        }
+        
+        lck_mtx_unlock(&np->f_openStateLock);
+    }
+    
+    lck_mtx_lock(&share->ss_shlock);
+}
+
+/*
+ * The share needs to be locked before calling this routine!
+ *
+ * Reopen the monitored directories that smb2fs_reconnect marked with
+ * d_needReopen, batch_max at a time, so their change notifications can be
+ * restarted as soon as the reconnect is done instead of waiting on the next
+ * sync. Any directory we skip here is still left for
+ * smbfs_restart_change_notify to reopen.
+ *
+ * We can not wait on the node lock while in reconnect, so only directories
+ * whose node lock we can get right away are done here. Each hash bucket is
+ * only looked at once, so directories that fail to reopen do not get retried.
+ * Once a batch is reopened the notify thread is woken up to resend the
+ * notifications for it.
+ */
+static void
+smb2fs_reconnect_notify_dirs(struct smbmount *smp,
+                             struct smb2fs_reopen_batch *batchp,
+                             uint32_t batch_max)
+{
+    struct smb_share *share = smp->sm_share;
+    struct smb_vc *vcp = SSTOVC(share);
+    struct smbnode *np;
+    struct smb2fs_reopen_entry *entryp;
+    uint32_t ii = 0, jj, bucket_start, node_cnt, reopened;
+    
+    while (ii < (smp->sm_hashlen + 1)) {
+        node_cnt = 0;
+        
+        smbfs_hash_lock(smp);
+        
+        for (; ii < (smp->sm_hashlen + 1); ii++) {
+            bucket_start = node_cnt;
+            
+            for (np = (&smp->sm_hash[ii])->lh_first; np; np = np->n_hash.le_next) {
+                if (ISSET(np->n_flag, NALLOC) || ISSET(np->n_flag, NTRANSIT))
+                    continue;
+                
+                if (!(np->n_dosattr & SMB_EFA_DIRECTORY) || !np->d_needReopen)
+                    continue;
+                
+                if (node_cnt == batch_max)
+                    break;
+                
+                if (smbnode_trylock(np, SMBFS_EXCLUSIVE_LOCK) != 0)
+                    continue;
+                
+                np->n_lastvop = smb2fs_reconnect_notify_dirs;
+                
+                batchp->nodes[node_cnt++] = np;
+            }
+            
+            if (np == NULL) {
+                /* Got all of this bucket */
+                continue;
+            }
+            
+            if (bucket_start != 0) {
+                /* Bucket does not fit, put it back and do it next time */
+                for (jj = bucket_start; jj < node_cnt; jj++) {
+                    smbnode_unlock(batchp->nodes[jj]);
+                }
+                node_cnt = bucket_start;
+            }
+            else {
+                /* Bucket alone is too big, leave the rest for later */
+                ii++;
+            }
+            break;
+        }
+        
+        smbfs_hash_unlock(smp);
+        
+        if (node_cnt == 0) {
+            break;
+        }
+        
+        /* Send the whole batch and then collect the replies */
+        lck_mtx_unlock(&share->ss_shlock);
+        
+        for (jj = 0; jj < node_cnt; jj++) {
+            entryp = &batchp->entries[jj];
+            entryp->np = batchp->nodes[jj];
+            entryp->fref = NULL;
+            entryp->node_index = jj;
+            entryp->error = 0;
+        }
+        
+        smb2fs_smb_reopen_handles(share, batchp->entries, node_cnt,
+                                  vcp->vc_iod->iod_context);
+        
+        reopened = 0;
+        for (jj = 0; jj < node_cnt; jj++) {
+            entryp = &batchp->entries[jj];
+            np = entryp->np;
+            
+            if (entryp->error) {
+                SMBWARNING_LOCK(np, "Attempting to reopen %s failed %d\n",
+                                np->n_name, entryp->error);
+            }
+            else {
+                np->d_needReopen = FALSE;
+                OSAddAtomic(1, &smp->sm_notify_reopen_cnt);
+                reopened++;
+            }
+            
+            smbnode_unlock(np);
+        }
+        
+        /* Same as smbfs_restart_change_notify does after its reopen */
+        if (reopened) {
+            smbfs_notify_change_wakeup(smp);
+        }
+        
+        lck_mtx_lock(&share->ss_shlock);
+    }
+}
+
 static void
 smb2fs_reconnect(struct smbmount *smp)
 {
@@ -3164,10 +3784,11 @@ smb2fs_reconnect(struct smbmount *smp)
     uint32_t ii;
     struct smbfattr *fap = NULL;
     struct smb_vc *vcp;
-	struct fileRefEntry *current = NULL;
-    int error;
     SMB2FID temp_fid;
-    uint32_t need_reopen = 0, done;
+    uint32_t need_reopen = 0, need_notify = 0, done;
+    struct smb2fs_reopen_batch *batchp = NULL;
+    uint32_t node_cnt, batch_max;
+    int32_t credits;
 
     vcp = SSTOVC(smp->sm_share);
 
@@ -3244,6 +3865,7 @@ smb2fs_reconnect(struct smbmount *smp)
                 /* Do we need to reopen this item */
                 if ((np->n_dosattr & SMB_EFA_DIRECTORY) && (np->d_fid != 0)) {
                     np->d_needReopen = TRUE;
+                    need_notify = 1;
                     
                     /* Remove the open fid from the fid table */
                     smb_fid_get_kernel_fid(smp->sm_share, np->d_fid,
@@ -3300,23 +3922,59 @@ smb2fs_reconnect(struct smbmount *smp)
     /* Free the hash lock */
     smbfs_hash_unlock(smp);
         
-    if (need_reopen == 0) {
-        /* No files need to be reopened, so leave */
+    if ((need_reopen == 0) && (need_notify == 0)) {
+        /* No files or directories need to be reopened, so leave */
         goto exit;
     }
 
     /*
      * <13934847> We can not hold the hash lock while we reopen files as
      * we end up dead locked. Now go through the list again holding the hash
-     * lock and if a vnode needs to be reopened, drop the hash lock, clear the
-     * kNeedReopen, attempt to reopen the vnode, then start at begining of
-     * loop again until there are no more vnodes that need to be reopened.
+     * lock and collect a batch of vnodes that need to be reopened, clearing
+     * kNeedReopen on each. Drop the hash lock, reopen the whole batch, then
+     * start at begining of the hash table again until there are no more
+     * vnodes that need to be reopened.
+     *
+     * The durable handle reconnects for a batch are all sent before waiting
+     * on any of the replies. Since reconnect requests do not go through the
+     * crediting code, keep the batch within the credits the server gave us.
      */
-    done = 0;
+    SMB_MALLOC(batchp,
+               struct smb2fs_reopen_batch *,
+               sizeof(struct smb2fs_reopen_batch),
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    if (batchp == NULL) {
+        /* Can not reopen anything, the files will get revoked */
+        SMBERROR("SMB_MALLOC failed\n");
+        smbfs_hash_lock(smp);
+        for (ii = 0; ii < (smp->sm_hashlen + 1); ii++) {
+            for (np = (&smp->sm_hash[ii])->lh_first; np; np = np->n_hash.le_next) {
+                if (ISSET(np->n_flag, NALLOC) || ISSET(np->n_flag, NTRANSIT))
+                    continue;
+                
+                lck_mtx_lock(&np->f_openStateLock);
+                if (np->f_openState & kNeedReopen) {
+                    np->f_openState &= ~kNeedReopen;
+                    np->f_openState |= kNeedRevoke;
+                }
+                lck_mtx_unlock(&np->f_openStateLock);
+            }
+        }
+        smbfs_hash_unlock(smp);
+        goto exit;
+    }
+
+    batch_max = SMB2_REOPEN_BATCH_MAX;
+    credits = OSAddAtomic(0, &vcp->vc_credits_granted) - kCREDIT_LOW_WATER;
+    if (credits < (int32_t) batch_max) {
+        batch_max = (credits > 0) ? credits : 1;
+    }
+
+    done = (need_reopen == 0);
     
     while (done == 0) {
-        /* Assume there are no files to be reopened */
-        done = 1;
+        node_cnt = 0;
         
         /* Get the hash lock */
         smbfs_hash_lock(smp);
@@ -3355,157 +4013,39 @@ smb2fs_reconnect(struct smbmount *smp)
                     continue;
                 }
                 
-                /* 
-                 * Free the hash lock - this is why we have to redo entire 
-                 * while loop as the hash table may now change.
-                 */
-                done = 0;
-                smbfs_hash_unlock(smp);
-
-                /*
-                 * For all network calls, use iod_context so we can tell this is
-                 * from reconnect and thus it wont get blocked waiting for credits.
-                 *
-                 * Share was locked from smb_iod_reconnect, so have to
-                 * unlock it otherwise we can deadlock in iod code when
-                 * the share lock is attempted to be locked again.
-                 */
-                
-                /*
-                 * Always check f_openDenyList too in case we need to remove all
-                 * those fids too.
-                 */
-                
-                error = 0;
-                
-                /*
-                 * Reopen any fids on the f_openDenyList
-                 *
-                 * We should lock f_openDenyListLock but can not because we will
-                 * deadlock
-                 */
-                if (np->f_openDenyList) {
-                    current = np->f_openDenyList;
-                    
-                    do {
-                        /*
-                         * Any previous error will cause us to skip attempting to
-                         * reopen rest of the fids and just close the fids instead.
-                         */
-                        if (error == 0) {
-                            if (current->dur_handle.flags & SMB2_DURABLE_HANDLE_GRANTED) {
-                                current->dur_handle.flags |= SMB2_DURABLE_HANDLE_RECONNECT;
-                                current->dur_handle.flags &= ~(SMB2_DURABLE_HANDLE_GRANTED |
-                                                               SMB2_LEASE_GRANTED);
-                                current->dur_handle.fid = current->fid;
-                                
-                                lck_mtx_unlock(&smp->sm_share->ss_shlock);
-                                error = smbfs_smb_ntcreatex(smp->sm_share, np,
-                                                            0, 0, VREG,
-                                                            &current->fid, NULL, 0,
-                                                            0, FALSE, fap,
-                                                            FALSE, &current->dur_handle, vcp->vc_iod->iod_context);
-                                lck_mtx_lock(&smp->sm_share->ss_shlock);
-                                if (error) {
-                                    SMBERROR_LOCK(np, "Warning: Could not reopen %s \n", np->n_name);
-                                }
-                            }
-                            else {
-                                /*
-                                 * Failed to get a durable handle when this file
-                                 * was opened, so can not reopen this file
-                                 */
-                                SMBERROR_LOCK(np, "Missing durable handle %s \n", np->n_name);
-                                error = EBADF;
-                            }
-                        }
-                        
-                        if (error) {
-                            /* Remove the open fid from the fid table */
-                            smb_fid_get_kernel_fid(smp->sm_share, current->fid,
-                                                   1, &temp_fid);
-                        }
-                        
-                        /* On to next fid */
-                        current = current->next;
-                    } while (current != NULL);
-                    
-                    lck_mtx_lock(&np->f_openStateLock);
-                    
-                    if (error) {
-                        /* Mark the file as revoked */
-                        np->f_openState |= kNeedRevoke;
-                    } else if (np->f_fid == 0) {
-                        /* No shared forks to open, we can clear kInReopen now */
-                        np->f_openState &= ~kInReopen;
-                    }
-                    
-                    lck_mtx_unlock(&np->f_openStateLock);
-                }
-                
-                /*
-                 * Reopen shared fork if one is present. Do this AFTER doing the
-                 * f_openDenyList so we dont break any Handle leases
-                 */
-                if (np->f_fid != 0) {
-                    /* Only reopen if no error from open deny list opens */
-                    if (error == 0) {
-                        lck_mtx_unlock(&smp->sm_share->ss_shlock);
-                        error = smbfs_smb_reopen_file(smp->sm_share, np,
-                                                      vcp->vc_iod->iod_context);
-                        /* 
-                         * smbfs_smb_reopen_file() sets the correct f_openState
-                         * for us 
-                         */
-                        lck_mtx_lock(&smp->sm_share->ss_shlock);
-                    }
-                    
-                    if (error) {
-                        /*
-                         * On failure, file is marked for revoke so we are done
-                         * Remove the open fid from the fid table
-                         */
-                        smb_fid_get_kernel_fid(smp->sm_share, np->f_fid,
-                                               1, &temp_fid);
-                    }
+                batchp->nodes[node_cnt++] = np;
+                if (node_cnt == batch_max) {
+                    goto batch_full; /* skip out of np and ii loops */
                 }
-                
-                /* 
-                 * Paranoid check - its possible that we get reconnected while
-                 * we are trying to reopen and that would reset the kInReopen
-                 * which could keep us looping forever. For now, we will only
-                 * try once to reopen a file and thats it. May have to rethink
-                 * this if it becomes a problem.
-                 */
-                lck_mtx_lock(&np->f_openStateLock);
-                
-                if (np->f_openState & kNeedReopen) {
-                    SMBERROR_LOCK(np, "Only one attempt to reopen %s \n", np->n_name);
-                    np->f_openState &= ~kNeedReopen;
-                    
-                    /* Mark the file as revoked */
-                    np->f_openState |= kNeedRevoke;
-                }
-                
-                lck_mtx_unlock(&np->f_openStateLock);
-                
-                /* 
-                 * Since we dropped the hash lock, have to start the while 
-                 * loop again to search entire hash table from beginning.
-                 */
-                goto loop_again; /* skip out of np and ii loops */
-                
             } /* for np loop */
         } /* for ii loop */
         
-loop_again:
-        
-        if (done == 1) {
+batch_full:
+        /* 
+         * Free the hash lock - this is why we have to redo entire 
+         * while loop as the hash table may now change.
+         */
+        smbfs_hash_unlock(smp);
+
+        if (node_cnt == 0) {
             /* if we get here, then must not have found any files to reopen */
-            smbfs_hash_unlock(smp);
+            done = 1;
+            break;
         }
+        
+        smb2fs_reconnect_reopen_batch(smp, batchp, node_cnt, batch_max);
+    }
+    
+    /*
+     * Files are done, now restart the change notifications. This is done
+     * last so the files that applications are blocked on come back first.
+     */
+    if (need_notify) {
+        smb2fs_reconnect_notify_dirs(smp, batchp, batch_max);
     }
     
+    SMB_FREE(batchp, M_SMBTEMP);
+    
 exit:
     if (fap) {
         SMB_FREE(fap, M_SMBTEMP);
@@ -3523,18 +4063,43 @@ void
 smbfs_reconnect(struct smbmount *smp)
 {
    	struct smb_vc *vcp;
+    struct timespec start, end, lost;
     
 	KASSERT(smb != NULL, ("smp is null"));
     
     vcp = SSTOVC(smp->sm_share);
 	KASSERT(vcp != NULL, ("vcp is null"));
 
+    smp->sm_reopen_cnt = 0;
+    smp->sm_revoke_cnt = 0;
+    smp->sm_notify_reopen_cnt = 0;
+    nanouptime(&start);
+    
     if (vcp->vc_flags & SMBV_SMB2) {
         smb2fs_reconnect(smp);
     }
     else {
         smb1fs_reconnect(smp);
     }
+    
+    /*
+     * Keep track of how long it took to get the open files and the change
+     * notifications back, and how long since we first lost the connection.
+     */
+    nanouptime(&end);
+    lost = end;
+    timespecsub(&end, &start);
+    timespecsub(&lost, &vcp->vc_iod->reconnectStartTime);
+    
+    smp->sm_reconnect_cnt++;
+    smp->sm_recovery_usecs = (end.tv_sec * 1000000LL) + (end.tv_nsec / 1000);
+    
+    SMBWARNING("%s recovered in %lld ms (%lld ms since disconnect), %d files reopened, %d revoked, %d notifications restarted\n",
+               (smp->sm_args.volume_name) ? smp->sm_args.volume_name : "",
+               smp->sm_recovery_usecs / 1000,
+               (lost.tv_sec * 1000LL) + (lost.tv_nsec / 1000000),
+               smp->sm_reopen_cnt, smp->sm_revoke_cnt,
+               smp->sm_notify_reopen_cnt);
 }
 
 /*
@@ -3661,7 +4226,8 @@ smbfs_ClearChildren(struct smbmount *smp, struct smbnode *parent)
 
 int
 smbfs_handle_lease_break(struct smbmount *smp, uint64_t lease_key_hi,
-                         uint64_t lease_key_low, uint32_t new_lease_state)
+                         uint64_t lease_key_low, uint32_t new_lease_state,
+                         vfs_context_t context)
 {
     int error = 0;
     uint32_t tree_id = 0;
@@ -3719,15 +4285,17 @@ loop:
         /* See if this vnode has the file ref entry that matches lease key */
         if (FindFileEntryByLeaseKey(vp, lease_key_hi, lease_key_low, &entry) == TRUE) {
             /*
-             * At this time, we do nothing with the lease, its just used for
-             * getting durable handles. Later when we actually use the leases for
-             * local caching, the lease break handling code should be moved to the
-             * change notify thread instead of using the iod thread.
+             * The lease is used for getting durable handles and for caching
+             * byte range locks. Push out any cached locks before the break
+             * gets acknowledged. Drop the hash lock, the lock requests have
+             * to wait on the server.
              */
-            entry->dur_handle.lease_state = new_lease_state;
-            error = 0;
+            smbfs_hash_unlock(smp);
+            smbfs_flush_cached_byterange_locks(smp->sm_share, vp,
+                                               lease_key_hi, lease_key_low,
+                                               new_lease_state, context);
             vnode_put(vp);
-            break;
+            return (0);
         }
         else {
             SMBERROR("No fileRefEntry found for lease break \n");
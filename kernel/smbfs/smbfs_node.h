@@ -101,9 +101,14 @@ struct ByteRangeLockEntry {
 	int64_t		offset;
 	int64_t		length;
 	uint32_t	lck_pid;
+	uint32_t	flags;
 	struct ByteRangeLockEntry *next;
 };
 
+/* ByteRangeLockEntry flags */
+#define kBRLCached	0x0001	/* Only held locally under a write lease, not on the server */
+#define kBRLPushing	0x0002	/* Being sent to the server after losing the write lease */
+
 /* Used for Open Deny */
 struct fileRefEntry {
     uint32_t        refcnt;     /* open file reference count */
@@ -118,6 +123,19 @@ struct fileRefEntry {
     struct fileRefEntry	*next;
 };
 
+/*
+ * One handle to reopen after a reconnect, either a durable handle to reclaim
+ * or, when fref is NULL, a monitored directory to reopen for change notify.
+ */
+struct smb2fs_reopen_entry {
+    struct smbnode          *np;
+    struct fileRefEntry     *fref;
+    uint32_t                node_index; /* which node in the reopen batch */
+    int                     error;
+    struct smb_rq           *rqp;       /* used by smb2fs_smb_reopen_handles */
+    struct smb2_create_rq   *createp;
+};
+
 struct smb_open_dir {
 	uint32_t		refcnt;
 	uint32_t		kq_refcnt;
@@ -129,6 +147,7 @@ struct smb_open_dir {
 	off_t			offset;			/* last ff offset */
 	uint32_t		needReopen;		/* Need to reopen the notification */
 	uint32_t		needsUpdate;
+	void			*watchItem;		/* Notify watch item, uses the watch list lock */
     u_int32_t       dirchangecnt;	/* changes each insert/delete. used by readdirattr */
 };
 
@@ -226,6 +245,7 @@ struct smbnode {
 #define d_needReopen open_type.dir.needReopen
 #define d_fid open_type.dir.fid
 #define d_needsUpdate open_type.dir.needsUpdate
+#define d_watchItem open_type.dir.watchItem
 #define d_changecnt open_type.dir.dirchangecnt
 
 /* File items */
@@ -292,6 +312,7 @@ extern lck_grp_t *smbfs_rwlock_group;
 struct smbfattr;
 
 int smbnode_lock(struct smbnode *np, enum smbfslocktype);
+int smbnode_trylock(struct smbnode *np, enum smbfslocktype);
 int smbnode_lockpair(struct smbnode *np1, struct smbnode *np2, enum smbfslocktype);
 void smbnode_unlock(struct smbnode *np);
 void smbnode_unlockpair(struct smbnode *np1, struct smbnode *np2);
@@ -330,6 +351,9 @@ int FindByteRangeLockEntry(struct fileRefEntry *fndEntry, int64_t offset,
 						int64_t length, uint32_t lck_pid);
 void AddRemoveByteRangeLockEntry(struct fileRefEntry *fndEntry, int64_t offset, 
 							  int64_t length, int8_t unLock, uint32_t lck_pid);
+int smbfs_cached_byterange_lock(struct smbnode *np, struct fileRefEntry *fndEntry,
+								int64_t offset, int64_t length, int8_t unLock,
+								uint32_t lck_pid);
 void AddFileRef(vnode_t vp, struct proc *p, uint16_t accessMode, uint32_t rights,
                 SMBFID fid, struct smb2_durable_handle dur_handle, struct fileRefEntry **fndEntry);
 int32_t FindFileEntryByFID(vnode_t vp, SMBFID fid, struct fileRefEntry **fndEntry);
@@ -357,7 +381,8 @@ void smbfs_reconnect(struct smbmount *smp);
 int32_t smbfs_IObusy(struct smbmount *smp);
 void smbfs_ClearChildren(struct smbmount *smp, struct smbnode * parent);
 int smbfs_handle_lease_break(struct smbmount *smp, uint64_t lease_key_hi,
-                             uint64_t lease_key_low, uint32_t new_lease_state);
+                             uint64_t lease_key_low, uint32_t new_lease_state,
+                             vfs_context_t context);
 
 #define smb_ubc_getsize(v) (vnode_vtype(v) == VREG ? ubc_getsize(v) : (off_t)0)
 
@@ -23,6 +23,7 @@
 
 #include <sys/param.h>
 #include <sys/kauth.h>
+#include <sys/sysctl.h>
 #include <libkern/OSAtomic.h>
 
 #include <sys/smb_apple.h>
@@ -33,6 +34,7 @@
 #include <netsmb/smb_rq_2.h>
 #include <netsmb/smb_conn.h>
 #include <netsmb/smb_conn_2.h>
+#include <netsmb/smb_converter.h>
 #include <smbfs/smbfs.h>
 #include <smbfs/smbfs_node.h>
 #include <smbfs/smbfs_subr.h>
@@ -44,9 +46,26 @@ extern lck_grp_t *smbfs_mutex_group;
 
 #define NOTIFY_CHANGE_SLEEP_TIMO	15
 #define NOTIFY_THROTTLE_SLEEP_TIMO	5
+#define NOTIFY_RECONNECT_SLEEP_TIMO	1
+#define NOTIFY_DEBOUNCE_MSECS		100
 #define SMBFS_MAX_RCVD_NOTIFY		4
 #define SMBFS_MAX_RCVD_NOTIFY_TIME	1
 
+/*
+ * How long to hold events for a directory so a burst of changes gets
+ * delivered as one update. Zero delivers every event as it arrives.
+ */
+static int smbfs_notify_debounce = NOTIFY_DEBOUNCE_MSECS;
+static uint64_t smbfs_notify_events_rcvd = 0;
+static uint64_t smbfs_notify_events_coalesced = 0;
+static uint64_t smbfs_notify_events_delivered = 0;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_INT(_net_smb_fs, OID_AUTO, notify_debounce, CTLFLAG_RW, &smbfs_notify_debounce, 0, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, notify_events_rcvd, CTLFLAG_RD, &smbfs_notify_events_rcvd, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, notify_events_coalesced, CTLFLAG_RD, &smbfs_notify_events_coalesced, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, notify_events_delivered, CTLFLAG_RD, &smbfs_notify_events_delivered, "");
+
 
 /* For now just notify on these item, may want to watch on more in the future */
 #define SMBFS_NOTIFY_CHANGE_FILTERS	FILE_NOTIFY_CHANGE_FILE_NAME | \
@@ -83,8 +102,14 @@ extern lck_grp_t *smbfs_mutex_group;
 static void 
 notify_wakeup(struct smbfs_notify_change * notify)
 {
+	/* 
+	 * The notify thread can sleep with no timeout, so hold the state lock 
+	 * to make sure it can't miss this wakeup.
+	 */
+	lck_mtx_lock(&notify->notify_statelock);
 	notify->haveMoreWork = TRUE;		/* we have work to do */
 	wakeup(&(notify)->notify_state);
+	lck_mtx_unlock(&notify->notify_statelock);
 }
 
 /*
@@ -213,6 +238,92 @@ done:
     SMB_LOG_KTRACE(SMB_DBG_SMBFS_NOTIFY | DBG_FUNC_END, 0, 0, 0, 0, 0);
 }
 
+/*
+ * notify_post_events
+ *
+ * Queue up events for a watch item. Events that come in within the debounce
+ * window get merged, so the node only gets one cache update and one
+ * vnode_notify for the whole burst. The notify thread delivers them once the
+ * window is up, see notify_flush_events.
+ *
+ * The calling routine must hold the watch list lock.
+ */
+static void
+notify_post_events(struct watch_item *watchItem, uint32_t events, 
+				   int throttleBack, vfs_context_t context)
+{
+	int debounce = smbfs_notify_debounce;
+	
+	OSAddAtomic64(1, (SInt64 *) &smbfs_notify_events_rcvd);
+	
+	if (throttleBack || (debounce <= 0)) {
+		/* Throttling only marks the node, nothing to hold on to */
+		smbfs_notified_vnode(watchItem->np, throttleBack, events, context);
+		if (!throttleBack)
+			OSAddAtomic64(1, (SInt64 *) &smbfs_notify_events_delivered);
+		return;
+	}
+	
+	if (watchItem->pendingEvents) {
+		OSAddAtomic64(1, (SInt64 *) &smbfs_notify_events_coalesced);
+	} else {
+		nanouptime(&watchItem->deliver_time);
+		watchItem->deliver_time.tv_sec += debounce / 1000;
+		watchItem->deliver_time.tv_nsec += (debounce % 1000) * 1000000;
+		if (watchItem->deliver_time.tv_nsec >= 1000000000) {
+			watchItem->deliver_time.tv_sec++;
+			watchItem->deliver_time.tv_nsec -= 1000000000;
+		}
+	}
+	watchItem->pendingEvents |= events;
+}
+
+/*
+ * notify_flush_events
+ *
+ * Deliver the events for any watch item whose debounce window is up. Returns
+ * TRUE if some are still waiting, with waitp set to how long until the next
+ * one is due.
+ *
+ * The calling routine must hold the watch list lock.
+ */
+static int
+notify_flush_events(struct smbfs_notify_change *notify, struct timespec *waitp,
+					vfs_context_t context)
+{
+	struct watch_item *watchItem;
+	struct timespec now, wait;
+	int pending = FALSE;
+	
+	nanouptime(&now);
+	STAILQ_FOREACH(watchItem, &notify->watch_list, entries) {
+		if (watchItem->pendingEvents == 0)
+			continue;
+		
+		if ((watchItem->state == kCancelNotify) || 
+			(watchItem->state == kWaitingForRemoval)) {
+			/* Going away, no one left to tell */
+			watchItem->pendingEvents = 0;
+			continue;
+		}
+		
+		if (timespeccmp(&now, &watchItem->deliver_time, <)) {
+			wait = watchItem->deliver_time;
+			timespecsub(&wait, &now);
+			if (!pending || timespeccmp(&wait, waitp, <))
+				*waitp = wait;
+			pending = TRUE;
+			continue;
+		}
+		
+		smbfs_notified_vnode(watchItem->np, FALSE, watchItem->pendingEvents, 
+							 context);
+		watchItem->pendingEvents = 0;
+		OSAddAtomic64(1, (SInt64 *) &smbfs_notify_events_delivered);
+	}
+	return pending;
+}
+
 /*
  * process_notify_change
  *
@@ -304,6 +415,294 @@ process_notify_change(struct smb_ntrq *ntp)
 	return events;
 }
 
+/*
+ * notify_tree_active
+ *
+ * Is this item's outstanding notify a watch tree that covers its descendants.
+ */
+static int
+notify_tree_active(struct watch_item *watchItem)
+{
+	if (!watchItem->treeSent)
+		return FALSE;
+	
+	switch (watchItem->state) {
+		case kSendNotify:
+		case kReceivedNotify:
+		case kWaitingOnNotify:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/*
+ * notify_tree_update
+ *
+ * Find the watch tree item that covers each watch item. An item is covered by
+ * its top most watched ancestor that is using notifications, so one watch tree
+ * request on that ancestor replaces the requests for every watched directory
+ * below it.
+ *
+ * The calling routine must hold the watch list lock.
+ */
+static void
+notify_tree_update(struct smbfs_notify_change *notify, int useWatchTree)
+{
+	struct smbmount *smp = notify->smp;
+	struct watch_item *watchItem, *parentItem;
+	struct smbnode *np, *parent;
+	
+	notify->watchCoveredCnt = 0;
+	STAILQ_FOREACH(watchItem, &notify->watch_list, entries) {
+		watchItem->coverItem = NULL;
+		watchItem->coveredCnt = 0;
+		if (watchItem->state == kCoveredByTree)
+			notify->watchCoveredCnt++;
+	}
+	
+	if (!useWatchTree)
+		return;
+	
+	/* Protect the n_parent fields, see smbfs_build_path */
+	lck_mtx_lock(&smp->sm_reclaim_lock);
+	STAILQ_FOREACH(watchItem, &notify->watch_list, entries) {
+		if ((watchItem->state == kCancelNotify) || 
+			(watchItem->state == kWaitingForRemoval))
+			continue;
+		
+		np = watchItem->np;
+		lck_rw_lock_shared(&np->n_parent_rwlock);
+		parent = np->n_parent;
+		lck_rw_unlock_shared(&np->n_parent_rwlock);
+		
+		while (parent) {
+			parentItem = parent->d_watchItem;
+			if (parentItem && (parentItem->np == parent) &&
+				(parentItem->state != kUsePollingToNotify) &&
+				(parentItem->state != kCoveredByTree) &&
+				(parentItem->state != kCancelNotify) &&
+				(parentItem->state != kWaitingForRemoval)) {
+				/* Keep going, we want the top most one */
+				watchItem->coverItem = parentItem;
+			}
+			lck_rw_lock_shared(&parent->n_parent_rwlock);
+			np = parent;
+			parent = parent->n_parent;
+			lck_rw_unlock_shared(&np->n_parent_rwlock);
+		}
+		if (watchItem->coverItem)
+			watchItem->coverItem->coveredCnt++;
+	}
+	lck_mtx_unlock(&smp->sm_reclaim_lock);
+}
+
+/*
+ * notify_action_to_events
+ */
+static uint32_t
+notify_action_to_events(uint32_t action)
+{
+	switch (action) {
+		case FILE_ACTION_ADDED:
+			return VNODE_EVENT_FILE_CREATED | VNODE_EVENT_DIR_CREATED;
+		case FILE_ACTION_REMOVED:
+			return VNODE_EVENT_FILE_REMOVED | VNODE_EVENT_DIR_REMOVED;
+		case FILE_ACTION_RENAMED_OLD_NAME:
+		case FILE_ACTION_RENAMED_NEW_NAME:
+			return VNODE_EVENT_RENAME;
+		default:
+			return VNODE_EVENT_ATTRIB;
+	}
+}
+
+/*
+ * notify_tree_match
+ *
+ * Does the path, relative to headnp, name the directory np. Walk up from np
+ * matching one component at a time from the end of the path.
+ */
+static int
+notify_tree_match(struct smbnode *np, struct smbnode *headnp, 
+				  const char *path, size_t path_len)
+{
+	struct smbnode *parent;
+	size_t end = path_len;
+	int match = TRUE;
+	
+	while (np != headnp) {
+		if (np == NULL)
+			return FALSE;
+		
+		lck_rw_lock_shared(&np->n_name_rwlock);
+		if ((end < np->n_nmlen) ||
+			(strncasecmp(&path[end - np->n_nmlen], np->n_name, np->n_nmlen) != 0)) {
+			match = FALSE;
+		} else {
+			end -= np->n_nmlen;
+		}
+		lck_rw_unlock_shared(&np->n_name_rwlock);
+		if (!match)
+			return FALSE;
+		
+		lck_rw_lock_shared(&np->n_parent_rwlock);
+		parent = np->n_parent;
+		lck_rw_unlock_shared(&np->n_parent_rwlock);
+		
+		if (parent != headnp) {
+			/* Need a delimiter before the next component */
+			if ((end == 0) || (path[end - 1] != '/'))
+				return FALSE;
+			end--;
+		}
+		np = parent;
+	}
+	return (end == 0);
+}
+
+struct notify_tree_ctx {
+	struct smbfs_notify_change *notify;
+	struct watch_item	*headItem;
+	char				*path;			/* Work buffer, MAXPATHLEN */
+	char				*last_path;		/* Last directory we looked up */
+	size_t				last_len;
+	struct watch_item	*lastItem;		/* Item that last_path matched */
+	uint32_t			headEvents;		/* Events for the head item itself */
+	int					routeAll;		/* Couldn't route, notify everyone */
+};
+
+/*
+ * notify_tree_entry
+ *
+ * Called for each entry in a watch tree reply. Route the event to the
+ * directory that holds the changed item, which is either the head item
+ * itself or one of the items it covers.
+ */
+static void
+notify_tree_entry(void *arg, uint32_t action, char *name, uint32_t name_len)
+{
+	struct notify_tree_ctx *ctx = arg;
+	struct smbmount *smp = ctx->notify->smp;
+	struct watch_item *headItem = ctx->headItem;
+	struct watch_item *watchItem;
+	size_t path_len = MAXPATHLEN - 1;
+	size_t dir_len;
+	uint32_t events = notify_action_to_events(action);
+	
+	if (smb_convert_network_to_path(name, name_len, ctx->path, &path_len, 
+									'\\', UTF_SFM_CONVERSIONS, TRUE)) {
+		ctx->routeAll = TRUE;
+		return;
+	}
+	
+	/* Find the directory part of the name */
+	for (dir_len = path_len; dir_len > 0; dir_len--) {
+		if (ctx->path[dir_len - 1] == '/')
+			break;
+	}
+	if (dir_len == 0) {
+		/* The item is right in the head directory */
+		ctx->headEvents |= events;
+		return;
+	}
+	dir_len--;	/* Don't include the delimiter */
+	
+	/* Bulk changes tend to hit the same directory over and over */
+	if ((ctx->last_len == dir_len) && 
+		(bcmp(ctx->last_path, ctx->path, dir_len) == 0)) {
+		if (ctx->lastItem)
+			ctx->lastItem->treeEvents |= events;
+		return;
+	}
+	
+	ctx->lastItem = NULL;
+	/* Protect the n_parent fields, see smbfs_build_path */
+	lck_mtx_lock(&smp->sm_reclaim_lock);
+	STAILQ_FOREACH(watchItem, &ctx->notify->watch_list, entries) {
+		if ((watchItem->coverItem != headItem) || 
+			(watchItem->state != kCoveredByTree))
+			continue;
+		
+		if (notify_tree_match(watchItem->np, headItem->np, ctx->path, dir_len)) {
+			watchItem->treeEvents |= events;
+			ctx->lastItem = watchItem;
+			break;
+		}
+	}
+	lck_mtx_unlock(&smp->sm_reclaim_lock);
+	bcopy(ctx->path, ctx->last_path, dir_len);
+	ctx->last_len = dir_len;
+}
+
+/*
+ * rcvd_notify_tree
+ *
+ * Parse a watch tree reply and hand the events out to the covered items.
+ * Returns the events for the head item itself.
+ */
+static int
+rcvd_notify_tree(struct watch_item *watchItem, uint32_t *events)
+{
+	struct smbfs_notify_change *notify = watchItem->notify;
+	struct notify_tree_ctx ctx;
+	struct watch_item *item;
+	int error;
+	
+	bzero(&ctx, sizeof(ctx));
+	ctx.notify = notify;
+	ctx.headItem = watchItem;
+	SMB_MALLOC(ctx.path, char *, MAXPATHLEN * 2, M_TEMP, M_WAITOK | M_ZERO);
+	if (ctx.path == NULL) {
+		/* Can't route them, so just parse it and tell everyone */
+		error = smb2_smb_parse_change_notify(watchItem->rqp, events, NULL, NULL);
+		ctx.routeAll = TRUE;
+	} else {
+		ctx.last_path = ctx.path + MAXPATHLEN;
+		ctx.last_len = MAXPATHLEN;	/* Nothing looked up yet */
+		error = smb2_smb_parse_change_notify(watchItem->rqp, events, 
+											 notify_tree_entry, &ctx);
+		SMB_FREE(ctx.path, M_TEMP);
+		if (error == 0) {
+			/* No data means too many changes, have everyone update */
+			if ((ctx.headEvents == 0) && (ctx.lastItem == NULL) && 
+				(ctx.last_len == MAXPATHLEN))
+				ctx.routeAll = TRUE;
+			else if (!ctx.routeAll)
+				*events = ctx.headEvents;
+		}
+	}
+	
+	STAILQ_FOREACH(item, &notify->watch_list, entries) {
+		if ((item->coverItem != watchItem) || (item->state != kCoveredByTree))
+			continue;
+		if (error || ctx.routeAll)
+			item->treeEvents |= VNODE_EVENT_ATTRIB | VNODE_EVENT_WRITE;
+	}
+	return error;
+}
+
+/*
+ * notify_tree_deliver
+ *
+ * Tell the items covered by this watch tree about their events.
+ */
+static void
+notify_tree_deliver(struct watch_item *watchItem, vfs_context_t context)
+{
+	struct smbfs_notify_change *notify = watchItem->notify;
+	struct watch_item *item;
+	
+	STAILQ_FOREACH(item, &notify->watch_list, entries) {
+		if ((item->coverItem != watchItem) || (item->treeEvents == 0))
+			continue;
+		if (item->state == kCoveredByTree) {
+			notify_post_events(item, item->treeEvents, 
+							   watchItem->throttleBack, context);
+		}
+		item->treeEvents = 0;
+	}
+}
+
 /* 
  * Proces a change notify message from the server
  */
@@ -320,8 +719,12 @@ rcvd_notify_change(struct watch_item *watchItem, vfs_context_t context)
         /* Using SMB 2/3 */
         rqp = watchItem->rqp;
 
-        if (rqp) {
-            error = smb2_smb_parse_change_notify(rqp, &events);
+        if (rqp && watchItem->treeSent && watchItem->coveredCnt) {
+            /* Watch tree covering other items, route the events */
+            error = rcvd_notify_tree(watchItem, &events);
+        }
+        else if (rqp) {
+            error = smb2_smb_parse_change_notify(rqp, &events, NULL, NULL);
         }
     }
     else {
@@ -382,7 +785,10 @@ rcvd_notify_change(struct watch_item *watchItem, vfs_context_t context)
 	}
     
 	/* Notify them that something changed */
-	smbfs_notified_vnode(np, watchItem->throttleBack, events, context);
+	if (events)
+		notify_post_events(watchItem, events, watchItem->throttleBack, context);
+	/* Now any items our watch tree covers */
+	notify_tree_deliver(watchItem, context);
 
 done:
 	reset_notify_change(watchItem, FALSE);
@@ -489,7 +895,7 @@ send_notify_change(struct watch_item *watchItem, vfs_context_t context)
 		 * Something could have happen while we were throttle so just say 
 		 * something changed 
 		 */
-		smbfs_notified_vnode(np, watchItem->throttleBack, events, context);
+		notify_post_events(watchItem, events, watchItem->throttleBack, context);
 		nanouptime(&watchItem->last_notify_time);
 		watchItem->last_notify_time.tv_sec += SMBFS_MAX_RCVD_NOTIFY_TIME;
 	}
@@ -733,10 +1139,21 @@ process_notify_items(struct smbfs_notify_change *notify, vfs_context_t context)
 	int	 updatePollingNodes = FALSE;
 	int moveToPollCnt = 0, moveFromPollCnt = 0;
 	int workingCnt;
+	int useWatchTree = FALSE;
+	int needTimer = FALSE;
+	struct timespec debounceWait = {0, 0};
+	struct smb_share *share;
+	
+	/* Watch tree coalescing is only done with SMB 2/3 */
+	share = smb_get_share_with_reference(smp);
+	if (SSTOVC(share)->vc_flags & SMBV_SMB2)
+		useWatchTree = TRUE;
+	smb_share_rele(share, context);
 	
 	lck_mtx_lock(&notify->watch_list_lock);
+	notify_tree_update(notify, (useWatchTree && !notify->pollOnly));
 	/* How many outstanding notification do we have */ 
-	workingCnt = notify->watchCnt - notify->watchPollCnt;
+	workingCnt = notify->watchCnt - notify->watchPollCnt - notify->watchCoveredCnt;
 	/* Calculate how many need to be move to the polling state */
 	if (workingCnt > maxWorkingCnt) {
 		moveToPollCnt = workingCnt - maxWorkingCnt;
@@ -798,6 +1215,7 @@ process_notify_items(struct smbfs_notify_change *notify, vfs_context_t context)
 					if (watchItem->throttleBack) {
 						SMBDEBUG_LOCK(watchItem->np, "Throttling back %s\n", watchItem->np->n_name);
 						notify->sleeptimespec.tv_sec = NOTIFY_THROTTLE_SLEEP_TIMO;
+						needTimer = TRUE;
 						break;	/* Pull back sending notification, until next time */					
 					}
 				}
@@ -805,13 +1223,34 @@ process_notify_items(struct smbfs_notify_change *notify, vfs_context_t context)
 			case kSendNotify:
 			{
 				int sendError;
+				
+				if (watchItem->coverItem && notify_tree_active(watchItem->coverItem)) {
+					/* An ancestor's watch tree covers us, no need to send */
+					SMBDEBUG_LOCK(watchItem->np, "%s covered by a watch tree\n", watchItem->np->n_name);
+					watchItem->state = kCoveredByTree;
+					watchItem->treeSent = FALSE;
+					break;
+				}
+				/* Watch the whole tree if we can cover any other items */
+				if (watchItem->coveredCnt) {
+					watchItem->watchTree = TRUE;
+				} else if (!watchItem->isRoot) {
+					watchItem->watchTree = FALSE;
+				}
 				sendError = send_notify_change(watchItem, context);
 				if (sendError == EAGAIN) {
-					/* Must be in reconnect, try to send agian later */
+					/* 
+					 * Must be in reconnect, try to send agian later. Reconnect
+					 * reopens the directories for us, so check back soon
+					 * instead of waiting out the full idle timeout.
+					 */
+					notify->sleeptimespec.tv_sec = NOTIFY_RECONNECT_SLEEP_TIMO;
+					needTimer = TRUE;
 					break;
 				} 
 				if (!sendError) {
 					watchItem->state = kWaitingOnNotify;
+					watchItem->treeSent = (useWatchTree && watchItem->watchTree);
 					break;
 				}
 				if (!watchItem->isRoot && moveToPollCnt) {
@@ -822,10 +1261,28 @@ process_notify_items(struct smbfs_notify_change *notify, vfs_context_t context)
 				} else {
 					/* If an error then keep trying */
 					watchItem->state = kSendNotify;
+					needTimer = TRUE;
 				}
 				break;
 			}
+			case kCoveredByTree:
+				if (watchItem->coverItem && notify_tree_active(watchItem->coverItem)) {
+					/* Nothing to do here, the watch tree does the work */
+					break;
+				}
+				/* The watch tree went away, go back to sending our own */
+				SMBDEBUG_LOCK(watchItem->np, "%s no longer covered by a watch tree\n", watchItem->np->n_name);
+				watchItem->state = kSendNotify;
+				notify->haveMoreWork = TRUE; /* Force us to resend these items */
+				break;
 			case kUsePollingToNotify:
+				if (watchItem->coverItem && notify_tree_active(watchItem->coverItem)) {
+					/* A watch tree covers us now, no need to poll */
+					watchItem->state = kCoveredByTree;
+					notify->watchPollCnt--;
+					SMBDEBUG_LOCK(watchItem->np, "Moving %s from polling to watch tree\n", watchItem->np->n_name);
+					break;
+				}
 				/* We can move some back to notify and turn off polling */
 				if ((!notify->pollOnly) && 
                     moveFromPollCnt &&
@@ -838,7 +1295,7 @@ process_notify_items(struct smbfs_notify_change *notify, vfs_context_t context)
 					SMBDEBUG_LOCK(watchItem->np, "Moving %s from polling to send state\n", watchItem->np->n_name);
 				} else if (updatePollingNodes) {
 					uint32_t events = VNODE_EVENT_ATTRIB | VNODE_EVENT_WRITE;
-					smbfs_notified_vnode(watchItem->np, FALSE, events, context);
+					notify_post_events(watchItem, events, FALSE, context);
                     SMBDEBUG_LOCK(watchItem->np, "Updating %s using polling\n", watchItem->np->n_name);
 				}
 				break;
@@ -850,6 +1307,24 @@ process_notify_items(struct smbfs_notify_change *notify, vfs_context_t context)
 				break;
 		}
 	}	
+	/*
+	 * Only need to wake up on a timer if something needs to be retried or we
+	 * are polling. Otherwise the replies and new watch items wake us up.
+	 */
+	if (notify->watchPollCnt || moveToPollCnt)
+		needTimer = TRUE;
+	if (notify->svrmsg_item && (notify->svrmsg_item->state == kSendNotify))
+		needTimer = TRUE;
+	/* Deliver the events that are due, wake up in time for the rest */
+	if (notify_flush_events(notify, &debounceWait, context)) {
+		if (!needTimer || timespeccmp(&debounceWait, &notify->sleeptimespec, <))
+			notify->sleeptimespec = debounceWait;
+		needTimer = TRUE;
+	}
+	if (!needTimer) {
+		notify->sleeptimespec.tv_sec = 0;
+		notify->sleeptimespec.tv_nsec = 0;
+	}
 	lck_mtx_unlock(&notify->watch_list_lock);
 	/* 
 	 * Keep track of how many are we over the limit So we can kick them off
@@ -883,11 +1358,19 @@ notify_main(void *arg)
 
 	while (notify->notify_state == kNotifyThreadRunning) {
 		notify->sleeptimespec.tv_sec = NOTIFY_CHANGE_SLEEP_TIMO;
+		notify->sleeptimespec.tv_nsec = 0;
 		notify->haveMoreWork = FALSE;
 		process_notify_items(notify, context);
-		if (!notify->haveMoreWork)
-			msleep(&notify->notify_state, 0, PWAIT, "notify change idle", 
-				   &notify->sleeptimespec);	
+		lck_mtx_lock(&notify->notify_statelock);
+		if (!notify->haveMoreWork && (notify->notify_state == kNotifyThreadRunning)) {
+			/* No timeout means we only need to wake up for new work */
+			msleep(&notify->notify_state, &notify->notify_statelock, PWAIT | PDROP, 
+				   "notify change idle", 
+				   (notify->sleeptimespec.tv_sec || notify->sleeptimespec.tv_nsec) ? 
+				   &notify->sleeptimespec : NULL);
+		} else {
+			lck_mtx_unlock(&notify->notify_statelock);
+		}
 	}
 	/* Shouldn't have anything in the queue at this point */
 	DBG_ASSERT(STAILQ_EMPTY(&notify->watch_list))		
@@ -949,8 +1432,10 @@ smbfs_notify_change_destroy_thread(struct smbmount *smp)
 	if (smp->notify_thread == NULL)
 		return;
 	smp->notify_thread = NULL;
+	lck_mtx_lock(&notify->notify_statelock);
 	notify->notify_state = kNotifyThreadStopping;
 	wakeup(&notify->notify_state);
+	lck_mtx_unlock(&notify->notify_statelock);
 	
 	for (;;) {
 		lck_mtx_lock(&notify->notify_statelock);
@@ -995,6 +1480,7 @@ enqueue_notify_change_request(struct smbfs_notify_change *notify,
 	watchItem->last_notify_time.tv_sec += SMBFS_MAX_RCVD_NOTIFY_TIME;
 	lck_mtx_lock(&notify->watch_list_lock);
 	notify->watchCnt++;
+	np->d_watchItem = watchItem;
 
     SMBDEBUG_LOCK(np, "Enqueue %s count = %d poll count = %d\n", np->n_name,
                   notify->watchCnt, notify->watchPollCnt);
@@ -1069,6 +1555,8 @@ dequeue_notify_change_request(struct smbfs_notify_change *notify,
 			msleep(watchItem, &notify->watch_list_lock, PWAIT, 
 				   "notify watchItem cancel", NULL);
 			STAILQ_REMOVE(&notify->watch_list, watchItem, watch_item, entries);
+			if (np->d_watchItem == watchItem)
+				np->d_watchItem = NULL;
 			SMB_FREE(watchItem, M_TEMP);
 			watchItem = NULL;
 			break;
@@ -1325,3 +1813,17 @@ smbfs_restart_change_notify(struct smb_share *share, struct smbnode *np,
 	np->d_needReopen = FALSE; 
 	notify_wakeup(smp->notify_thread);
 }
+
+/*
+ * smbfs_notify_change_wakeup
+ *
+ * Directories were reopened without going through smbfs_restart_change_notify,
+ * wake up the notify queue so it resends their notifications.
+ */
+void 
+smbfs_notify_change_wakeup(struct smbmount *smp)
+{
+	if (smp->notify_thread != NULL) {
+		notify_wakeup(smp->notify_thread);
+	}
+}
@@ -35,8 +35,8 @@ enum  {
 	kUsePollingToNotify = 3,
 	kWaitingOnNotify = 4,
 	kWaitingForRemoval = 5,
-	kCancelNotify = 6
-	
+	kCancelNotify = 6,
+	kCoveredByTree = 7		/* An ancestor's watch tree notify covers this item */
 };
 
 struct watch_item {
@@ -53,6 +53,12 @@ struct watch_item {
     int             isServerMsg;
 	struct timespec	last_notify_time;
 	uint32_t		rcvd_notify_count;
+	struct watch_item *coverItem;	/* Watch tree item that covers this item */
+	uint32_t		coveredCnt;		/* Number of items this item could cover */
+	uint32_t		treeSent;		/* Outstanding notify has watch tree set */
+	uint32_t		treeEvents;		/* Events routed to us from a watch tree */
+	uint32_t		pendingEvents;	/* Events waiting out the debounce window */
+	struct timespec	deliver_time;	/* When to deliver the pending events */
 	STAILQ_ENTRY(watch_item) entries;
 };
 
@@ -65,6 +71,7 @@ struct smbfs_notify_change {
 	int					pollOnly;		/* Server doesn't support notifications */
 	int					watchCnt;		/* Count of all items on the list */
 	int					watchPollCnt;	/* Count of all polling items on the list */
+	int					watchCoveredCnt; /* Count of all covered items on the list */
 	lck_mtx_t			notify_statelock;
 	lck_mtx_t			watch_list_lock;
 	STAILQ_HEAD(, watch_item) watch_list;
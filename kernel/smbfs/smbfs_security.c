@@ -24,6 +24,8 @@
 #include <sys/mount.h>
 #include <sys/kauth.h>
 #include <sys/syslog.h>
+#include <sys/sysctl.h>
+#include <libkern/OSAtomic.h>
 
 #include <sys/smb_byte_order.h>
 #include <sys/smb_apple.h>
@@ -44,6 +46,57 @@
 #define MAX_SID_PRINTBUFFER	256	/* Used to print out the sid in case of an error */
 #define DEBUG_ACLS 0
 
+#define SMB_SIDCACHE_MAX		1024	/* Most sid translations cached per mount */
+#define SMB_SIDCACHE_TIMO		300		/* How long a translation is good for */
+#define SMB_SIDCACHE_NEG_TIMO	30		/* How long a failed or temporary one is good for */
+
+/* Bit definitions for the sm_flags field of the smb_sidmap structure */
+#define SIDMAP_GUID		0x0001	/* sm_guid, sm_guid_error are valid */
+#define SIDMAP_UID		0x0002	/* sm_uid, sm_uid_error are valid */
+#define SIDMAP_GID		0x0004	/* sm_gid, sm_gid_error are valid */
+
+/*
+ * Cached translations of a sid. Each kauth_cred_ntsid2* call can end up 
+ * going to the identity resolver, so we remember the answer, including the 
+ * errors, for every sid we see in an ACL.
+ */
+struct smb_sidmap {
+	struct smb_bcache_link	sm_link;	/* must be first */
+	ntsid_t					sm_sid;
+	uint32_t				sm_flags;
+	time_t					sm_expire;
+	guid_t					sm_guid;
+	uid_t					sm_uid;
+	gid_t					sm_gid;
+	int						sm_guid_error;
+	int						sm_uid_error;
+	int						sm_gid_error;
+};
+
+/*
+ * Security descriptors as returned by the server, shared by every node on the
+ * mount that has the same one. Files that inherit their ACL from a parent 
+ * all get identical descriptors, so there is no need to keep a copy per node.
+ * The node's acl_cache_data points at the descriptor, just past the header.
+ */
+struct smb_secdesc {
+	LIST_ENTRY(smb_secdesc)	sd_link;
+	uint32_t				sd_hash;
+	int32_t					sd_refcnt;
+	size_t					sd_len;
+	/* The descriptor itself follows */
+};
+
+#define SECDESC_DATA(sdp)		((void *)((sdp) + 1))
+#define SECDESC_FROM_DATA(data)	((struct smb_secdesc *)(data) - 1)
+
+static uint64_t smbfs_sidcache_hits = 0;
+static uint64_t smbfs_sidcache_misses = 0;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, sidcache_hits, CTLFLAG_RD, &smbfs_sidcache_hits, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, sidcache_misses, CTLFLAG_RD, &smbfs_sidcache_misses, "");
+
 /*
  * Directory Service generates these UUIDs for SIDs that are unknown. These UUIDs 
  * are used so we can round trip a translation from SID-->UUID-->SID. The first 
@@ -61,6 +114,7 @@ static const ntsid_t unix_groups_domsid =
 { 1, 1, {0, 0, 0, 0, 0, 22}, {2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0} };
 
 static void * smb_sdoffset(struct ntsecdesc *w_secp, size_t w_seclen, int sd_type);
+static void smbfs_secdesc_release(struct smbmount *smp, void *data);
 
 #define sdowner(s, s_len) (struct ntsid *)smb_sdoffset(s, s_len, OWNER_SECURITY_INFORMATION)
 #define sdgroup(s, s_len) (struct ntsid *)smb_sdoffset(s, s_len, GROUP_SECURITY_INFORMATION)
@@ -288,9 +342,7 @@ void
 smbfs_clear_acl_cache(struct smbnode *np)
 {
 	lck_mtx_lock(&np->f_ACLCacheLock);
-    if (np->acl_cache_data) {
-        SMB_FREE(np->acl_cache_data, M_TEMP);
-    }
+	smbfs_secdesc_release(np->n_mount, np->acl_cache_data);
 	np->acl_cache_data = NULL;
 	np->acl_cache_timer = 0;
 	np->acl_error = 0;
@@ -601,6 +653,348 @@ smb_sid_endianize(struct ntsid *sidptr, size_t len)
 	}
 }
 
+void
+smbfs_sidcache_init(struct smbmount *smp)
+{
+	lck_mtx_init(&smp->sm_sidcache_lock, smbfs_mutex_group, smbfs_lock_attr);
+	smb_bcache_init(&smp->sm_sidcache, SMB_SIDCACHE_MAX);
+	smp->sm_sidcache_hits = 0;
+	smp->sm_sidcache_misses = 0;
+}
+
+void
+smbfs_sidcache_destroy(struct smbmount *smp)
+{
+	struct smb_sidmap *entry;
+	
+	/* Only called on unmount, no one else can be using the cache */
+	while ((entry = (struct smb_sidmap *)smb_bcache_first(&smp->sm_sidcache)) != NULL) {
+		smb_bcache_remove(&smp->sm_sidcache, &entry->sm_link);
+		SMB_FREE(entry, M_TEMP);
+	}
+	SMBDEBUG("sid cache hits %llu misses %llu\n", smp->sm_sidcache_hits, 
+			 smp->sm_sidcache_misses);
+	lck_mtx_destroy(&smp->sm_sidcache_lock, smbfs_mutex_group);
+}
+
+void
+smbfs_secdesc_init(struct smbmount *smp)
+{
+	int ii;
+	
+	lck_mtx_init(&smp->sm_secdesc_lock, smbfs_mutex_group, smbfs_lock_attr);
+	for (ii = 0; ii < SMB_SECDESC_HASHSIZE; ii++) {
+		LIST_INIT(&smp->sm_secdesc[ii]);
+	}
+	smp->sm_secdesc_cnt = 0;
+	smp->sm_secdesc_shared = 0;
+}
+
+void
+smbfs_secdesc_destroy(struct smbmount *smp)
+{
+	struct smb_secdesc *sdp;
+	int ii;
+	
+	/* Only called on unmount, all the nodes are gone by now */
+	for (ii = 0; ii < SMB_SECDESC_HASHSIZE; ii++) {
+		while ((sdp = LIST_FIRST(&smp->sm_secdesc[ii])) != NULL) {
+			SMBWARNING("security descriptor %p still has %d references\n", 
+					   sdp, sdp->sd_refcnt);
+			LIST_REMOVE(sdp, sd_link);
+			SMB_FREE(sdp, M_TEMP);
+		}
+	}
+	smp->sm_secdesc_cnt = 0;
+	SMBDEBUG("security descriptors shared %llu times\n", smp->sm_secdesc_shared);
+	lck_mtx_destroy(&smp->sm_secdesc_lock, smbfs_mutex_group);
+}
+
+/*
+ * Replace a security descriptor we just got from the server with the shared
+ * copy, adding one if this is the first time we have seen it. Always consumes
+ * w_sec. Returns NULL if we are out of memory.
+ */
+static void *
+smbfs_secdesc_intern(struct smbmount *smp, struct ntsecdesc *w_sec, size_t seclen)
+{
+	struct smb_secdesc *sdp, *new_sdp = NULL;
+	struct smb_secdesc_head *head;
+	uint32_t hash = 2166136261U;
+	size_t ii;
+	
+	/* FNV-1a */
+	for (ii = 0; ii < seclen; ii++) {
+		hash ^= ((uint8_t *)w_sec)[ii];
+		hash *= 16777619;
+	}
+	head = &smp->sm_secdesc[hash % SMB_SECDESC_HASHSIZE];
+	
+	lck_mtx_lock(&smp->sm_secdesc_lock);
+	LIST_FOREACH(sdp, head, sd_link) {
+		if ((sdp->sd_hash == hash) && (sdp->sd_len == seclen) && 
+			(bcmp(SECDESC_DATA(sdp), w_sec, seclen) == 0)) {
+			sdp->sd_refcnt++;
+			smp->sm_secdesc_shared++;
+			break;
+		}
+	}
+	lck_mtx_unlock(&smp->sm_secdesc_lock);
+	
+	if (sdp == NULL) {
+		SMB_MALLOC(new_sdp, struct smb_secdesc *, 
+				   sizeof(*new_sdp) + seclen, M_TEMP, M_WAITOK);
+		if (new_sdp) {
+			new_sdp->sd_hash = hash;
+			new_sdp->sd_refcnt = 1;
+			new_sdp->sd_len = seclen;
+			bcopy(w_sec, SECDESC_DATA(new_sdp), seclen);
+			
+			lck_mtx_lock(&smp->sm_secdesc_lock);
+			/* Someone may have added it while we were allocating */
+			LIST_FOREACH(sdp, head, sd_link) {
+				if ((sdp->sd_hash == hash) && (sdp->sd_len == seclen) && 
+					(bcmp(SECDESC_DATA(sdp), w_sec, seclen) == 0)) {
+					sdp->sd_refcnt++;
+					smp->sm_secdesc_shared++;
+					break;
+				}
+			}
+			if (sdp == NULL) {
+				LIST_INSERT_HEAD(head, new_sdp, sd_link);
+				smp->sm_secdesc_cnt++;
+				sdp = new_sdp;
+				new_sdp = NULL;
+			}
+			lck_mtx_unlock(&smp->sm_secdesc_lock);
+		}
+	}
+	
+	SMB_FREE(w_sec, M_TEMP);
+	if (new_sdp) {
+		SMB_FREE(new_sdp, M_TEMP);
+	}
+	return (sdp) ? SECDESC_DATA(sdp) : NULL;
+}
+
+static void
+smbfs_secdesc_retain(struct smbmount *smp, void *data)
+{
+	lck_mtx_lock(&smp->sm_secdesc_lock);
+	SECDESC_FROM_DATA(data)->sd_refcnt++;
+	lck_mtx_unlock(&smp->sm_secdesc_lock);
+}
+
+static void
+smbfs_secdesc_release(struct smbmount *smp, void *data)
+{
+	struct smb_secdesc *sdp;
+	
+	if (data == NULL) {
+		return;
+	}
+	sdp = SECDESC_FROM_DATA(data);
+	
+	lck_mtx_lock(&smp->sm_secdesc_lock);
+	if (--sdp->sd_refcnt == 0) {
+		LIST_REMOVE(sdp, sd_link);
+		smp->sm_secdesc_cnt--;
+	} else {
+		sdp = NULL;
+	}
+	lck_mtx_unlock(&smp->sm_secdesc_lock);
+	
+	if (sdp) {
+		SMB_FREE(sdp, M_TEMP);
+	}
+}
+
+static uint32_t
+smbfs_sidcache_hash(const ntsid_t *sid)
+{
+	uint32_t hash = sid->sid_authcount;
+	int ii;
+	
+	for (ii = 0; (ii < sid->sid_authcount) && (ii < KAUTH_NTSID_MAX_AUTHORITIES); ii++) {
+		hash = (hash * 31) + sid->sid_authorities[ii];
+	}
+	return hash;
+}
+
+/*
+ * Find the cache entry for this sid, tossing it if it has expired.
+ *
+ * The calling routine must hold the sm_sidcache_lock.
+ */
+static struct smb_sidmap *
+smbfs_sidcache_find(struct smbmount *smp, const ntsid_t *sid, time_t now)
+{
+	struct smb_bcache_link *link;
+	struct smb_sidmap *entry;
+	
+	LIST_FOREACH(link, SMB_BCACHE_CHAIN(&smp->sm_sidcache, smbfs_sidcache_hash(sid)), bl_hash) {
+		entry = (struct smb_sidmap *)link;
+		if (!smb_sid_is_equal(&entry->sm_sid, sid)) {
+			continue;
+		}
+		if (entry->sm_expire <= now) {
+			smb_bcache_remove(&smp->sm_sidcache, link);
+			SMB_FREE(entry, M_TEMP);
+			return NULL;
+		}
+		return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Remember the result of a sid translation. Failures and temporary UUIDs are
+ * only held on to for a short time, since the identity resolver may learn
+ * about the sid later. A failure stores the null guid or KAUTH_UID_NONE, the
+ * caller's value is never copied out for those.
+ */
+static void
+smbfs_sidcache_enter(struct smbmount *smp, const ntsid_t *sid, uint32_t which, 
+					 int error, const guid_t *guidp, uid_t id)
+{
+	struct smb_sidmap *entry, *new_entry = NULL, *victim = NULL;
+	struct timespec ts;
+	time_t expire;
+	
+	nanouptime(&ts);
+	if (error || ((which == SIDMAP_GUID) && is_memberd_tempuuid(guidp))) {
+		expire = ts.tv_sec + SMB_SIDCACHE_NEG_TIMO;
+	} else {
+		expire = ts.tv_sec + SMB_SIDCACHE_TIMO;
+	}
+	
+	/* Allocate before taking the lock, we may not need it */
+	SMB_MALLOC(new_entry, struct smb_sidmap *, sizeof(*new_entry), M_TEMP, 
+			   M_WAITOK | M_ZERO);
+	
+	lck_mtx_lock(&smp->sm_sidcache_lock);
+	entry = smbfs_sidcache_find(smp, sid, ts.tv_sec);
+	if (entry == NULL) {
+		if (new_entry == NULL) {
+			goto done;
+		}
+		entry = new_entry;
+		new_entry = NULL;
+		entry->sm_sid = *sid;
+		entry->sm_expire = expire;
+		/* If full this hands back the least recently used entry */
+		victim = (struct smb_sidmap *)smb_bcache_insert(&smp->sm_sidcache, 
+								smbfs_sidcache_hash(sid), &entry->sm_link);
+	} else if (expire < entry->sm_expire) {
+		entry->sm_expire = expire;
+	}
+	
+	entry->sm_flags |= which;
+	switch (which) {
+		case SIDMAP_GUID:
+			entry->sm_guid = (error) ? kauth_null_guid : *guidp;
+			entry->sm_guid_error = error;
+			break;
+		case SIDMAP_UID:
+			entry->sm_uid = (error) ? KAUTH_UID_NONE : id;
+			entry->sm_uid_error = error;
+			break;
+		case SIDMAP_GID:
+			entry->sm_gid = (error) ? KAUTH_GID_NONE : id;
+			entry->sm_gid_error = error;
+			break;
+	}
+	
+done:
+	lck_mtx_unlock(&smp->sm_sidcache_lock);
+	if (new_entry) {
+		SMB_FREE(new_entry, M_TEMP);
+	}
+	if (victim) {
+		SMB_FREE(victim, M_TEMP);
+	}
+}
+
+/*
+ * Look in the cache for a translation of this sid. Returns TRUE with the 
+ * cached result if found. Like kauth, a cached failure leaves the caller's
+ * guid or id alone.
+ */
+static int
+smbfs_sidcache_lookup(struct smbmount *smp, const ntsid_t *sid, uint32_t which, 
+					  guid_t *guidp, uid_t *idp, int *error)
+{
+	struct smb_sidmap *entry;
+	struct timespec ts;
+	int found = FALSE;
+	
+	nanouptime(&ts);
+	lck_mtx_lock(&smp->sm_sidcache_lock);
+	entry = smbfs_sidcache_find(smp, sid, ts.tv_sec);
+	if (entry && (entry->sm_flags & which)) {
+		switch (which) {
+			case SIDMAP_GUID:
+				*error = entry->sm_guid_error;
+				if (*error == 0)
+					*guidp = entry->sm_guid;
+				break;
+			case SIDMAP_UID:
+				*error = entry->sm_uid_error;
+				if (*error == 0)
+					*idp = entry->sm_uid;
+				break;
+			case SIDMAP_GID:
+				*error = entry->sm_gid_error;
+				if (*error == 0)
+					*idp = entry->sm_gid;
+				break;
+		}
+		smb_bcache_touch(&smp->sm_sidcache, &entry->sm_link);
+		found = TRUE;
+		smp->sm_sidcache_hits++;
+	} else {
+		smp->sm_sidcache_misses++;
+	}
+	lck_mtx_unlock(&smp->sm_sidcache_lock);
+	
+	OSAddAtomic64(1, (found) ? (SInt64 *) &smbfs_sidcache_hits : 
+							   (SInt64 *) &smbfs_sidcache_misses);
+	return found;
+}
+
+/*
+ * Cached versions of kauth_cred_ntsid2guid and kauth_cred_ntsid2uid/gid.
+ */
+static int
+smbfs_sidcache_ntsid2guid(struct smbmount *smp, ntsid_t *sid, guid_t *guidp)
+{
+	int error;
+	
+	if (smbfs_sidcache_lookup(smp, sid, SIDMAP_GUID, guidp, NULL, &error)) {
+		return error;
+	}
+	error = kauth_cred_ntsid2guid(sid, guidp);
+	smbfs_sidcache_enter(smp, sid, SIDMAP_GUID, error, guidp, 0);
+	return error;
+}
+
+static int
+smbfs_sidcache_ntsid2id(struct smbmount *smp, ntsid_t *sid, uid_t *idp, int owner)
+{
+	uint32_t which = (owner) ? SIDMAP_UID : SIDMAP_GID;
+	int error;
+	
+	if (smbfs_sidcache_lookup(smp, sid, which, NULL, idp, &error)) {
+		return error;
+	}
+	if (owner)
+		error = kauth_cred_ntsid2uid(sid, idp);
+	else
+		error = kauth_cred_ntsid2gid(sid, idp);
+	smbfs_sidcache_enter(smp, sid, which, error, NULL, *idp);
+	return error;
+}
+
 /*
  * This is the main routine that goes across the network to get our acl 
  * information. We now always ask for everything so we can make less calls. If 
@@ -692,6 +1086,22 @@ smbfs_update_acl_cache(struct smb_share *share, struct smbnode *np,
 			error = EBADRPC;
 	}
 	
+	if ((error == 0) && acl_cache_data) {
+		/* Share it with any other node that has the same descriptor */
+		acl_cache_data = smbfs_secdesc_intern(np->n_mount, acl_cache_data, 
+											  acl_cache_len);
+		if (acl_cache_data == NULL)
+			error = ENOMEM;
+	} else if (acl_cache_data) {
+		/* 
+		 * The parse can fail after allocating the reply buffer. It was never
+		 * interned, so it must not end up in the cache.
+		 */
+		SMB_FREE(acl_cache_data, M_TEMP);
+		acl_cache_data = NULL;
+		acl_cache_len = 0;
+	}
+	
 	/* Don't let anyone play with the acl cache until we are done */
 	lck_mtx_lock(&np->f_ACLCacheLock);
     
@@ -702,9 +1112,8 @@ smbfs_update_acl_cache(struct smb_share *share, struct smbnode *np,
         goto done;
     }
     
-	/* Free the old data no longer needed */
-	if (np->acl_cache_data)
-		SMB_FREE(np->acl_cache_data, M_TEMP);
+	/* Drop the old data no longer needed */
+	smbfs_secdesc_release(np->n_mount, np->acl_cache_data);
     
 	np->acl_cache_data = acl_cache_data;
 	np->acl_cache_len = acl_cache_len;
@@ -720,17 +1129,10 @@ done:
 		if (np->acl_error == 0)
 			np->acl_error =  EBADRPC; /* Should never happen, but just to be safe */
 	} else {
-		SMB_MALLOC(*w_sec, struct ntsecdesc *, np->acl_cache_len, M_TEMP, M_WAITOK);
-		if (*w_sec) {
-			*seclen = np->acl_cache_len;		
-			bcopy(np->acl_cache_data, *w_sec, np->acl_cache_len);
-		} else {
-			*w_sec = np->acl_cache_data;
-			*seclen = np->acl_cache_len;
-			np->acl_cache_data = NULL;
-			np->acl_cache_len = 0;
-			np->acl_cache_timer = 0;
-		}
+		/* Hand back a reference, the caller releases it with smbfs_secdesc_release */
+		smbfs_secdesc_retain(np->n_mount, np->acl_cache_data);
+		*w_sec = np->acl_cache_data;
+		*seclen = np->acl_cache_len;
 	}
 	error = np->acl_error;
 	lck_mtx_unlock(&np->f_ACLCacheLock);
@@ -777,7 +1179,7 @@ smbfs_set_node_identifier(struct smbnode *np, struct ntsecdesc *w_sec,
 		return; /* We are done */
 	}
 	
-	error = kauth_cred_ntsid2guid(&sid, unique_identifier);
+	error = smbfs_sidcache_ntsid2guid(smp, &sid, unique_identifier);
 	if (error) {
 		if (smbfs_loglevel == SMB_ACL_LOG_LEVEL) {
             lck_rw_lock_shared(&np->n_name_rwlock);
@@ -798,10 +1200,7 @@ smbfs_set_node_identifier(struct smbnode *np, struct ntsecdesc *w_sec,
 		return; /* We already have a real uid/gid from the server keep using it */
 	}
 	
-	if (owner)
-		error = kauth_cred_ntsid2uid(&sid, node_identifier);
-	else
-		error = kauth_cred_ntsid2gid(&sid, node_identifier);
+	error = smbfs_sidcache_ntsid2id(smp, &sid, node_identifier, owner);
 	if (error == 0)
 		return; /* We are done */
 	
@@ -859,8 +1258,7 @@ smbfs_getsecurity(struct smb_share *share, struct smbnode *np,
 	/* Check to make sure we have current acl information */
 	error = smbfs_update_acl_cache(share, np, context, &w_sec, &seclen);
 	if (error) {
-		if (w_sec)
-			SMB_FREE(w_sec, M_TEMP);
+		smbfs_secdesc_release(smp, w_sec);
 		w_sec = NULL;
 		/* 
 		 * When should we eat the error and when shouldn't we, that is the
@@ -962,7 +1360,8 @@ smbfs_getsecurity(struct smb_share *share, struct smbnode *np,
 				(bcmp(&smp->ntwrk_sids[0], &sid, sizeof(sid)) == 0)) {
 				res->acl_ace[res->acl_entrycount].ace_applicable = smp->sm_args.uuid;
 			} else {
-				warn_error = kauth_cred_ntsid2guid(&sid, &res->acl_ace[res->acl_entrycount].ace_applicable);
+				warn_error = smbfs_sidcache_ntsid2guid(smp, &sid, 
+								&res->acl_ace[res->acl_entrycount].ace_applicable);
 			}
 			if (warn_error) {
 				if (smbfs_loglevel == SMB_ACL_LOG_LEVEL) {
@@ -1068,8 +1467,7 @@ exit:
 	if (res)
 		kauth_acl_free(res);
 	
-	if (w_sec)
-		SMB_FREE(w_sec, M_TEMP);
+	smbfs_secdesc_release(smp, w_sec);
 	
     SMB_LOG_KTRACE(SMB_DBG_SMBFS_GET_SEC | DBG_FUNC_END, error, 0, 0, 0, 0);
 	return error;
@@ -22,6 +22,10 @@
  */
 
 int is_memberd_tempuuid(const guid_t *uuidp);
+void smbfs_sidcache_init(struct smbmount *smp);
+void smbfs_sidcache_destroy(struct smbmount *smp);
+void smbfs_secdesc_init(struct smbmount *smp);
+void smbfs_secdesc_destroy(struct smbmount *smp);
 void smbfs_clear_acl_cache(struct smbnode *np);
 int smbfs_getsecurity(struct smb_share	*share, struct smbnode *np, 
 					  struct vnode_attr *vap, vfs_context_t context);
@@ -43,6 +43,7 @@
 #include <sys/xattr.h>
 #include <sys/kpi_mbuf.h>
 #include <sys/mount.h>
+#include <sys/sysctl.h>
 
 #include <sys/kauth.h>
 
@@ -907,6 +908,207 @@ done:
 	
 }
 
+/*
+ * Symlink target cache
+ *
+ * The node only holds its target until the vnode gets reclaimed, and trees
+ * with lots of links churn through vnodes. So we also keep the targets per
+ * mount, keyed by the file id. A symlink's target can't change without its
+ * modify time changing, so an entry is good as long as the mtime we got back
+ * from the last lookup or enumeration still matches. Only used when the
+ * server gives us real file ids.
+ */
+#define SMB_SYMCACHE_MAX	4096	/* Most symlink targets cached per mount */
+
+struct smb_symcache {
+	struct smb_bcache_link	sc_link;	/* must be first */
+	uint64_t		sc_ino;
+	struct timespec	sc_mtime;
+	char			*sc_target;
+	size_t			sc_targetlen;
+};
+
+static uint64_t smbfs_symcache_hits = 0;
+static uint64_t smbfs_symcache_misses = 0;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, symcache_hits, CTLFLAG_RD, &smbfs_symcache_hits, "");
+SYSCTL_QUAD(_net_smb_fs, OID_AUTO, symcache_misses, CTLFLAG_RD, &smbfs_symcache_misses, "");
+
+#define SMB_SYMCACHE_HASH(ino)	((uint32_t)((ino) ^ ((ino) >> 32)))
+
+static int
+smbfs_symcache_enabled(struct smbmount *smp)
+{
+	return ((smp->sm_share != NULL) &&
+			(SSTOVC(smp->sm_share)->vc_misc_flags & SMBV_HAS_FILEIDS));
+}
+
+static void
+smbfs_symcache_free(struct smb_symcache *entry)
+{
+	if (entry->sc_target) {
+		SMB_FREE(entry->sc_target, M_TEMP);
+	}
+	SMB_FREE(entry, M_TEMP);
+}
+
+/*
+ * The calling routine must hold the sm_symcache_lock.
+ */
+static struct smb_symcache *
+smbfs_symcache_find(struct smbmount *smp, uint64_t ino)
+{
+	struct smb_bcache_link *link;
+	
+	LIST_FOREACH(link, SMB_BCACHE_CHAIN(&smp->sm_symcache, SMB_SYMCACHE_HASH(ino)), bl_hash) {
+		if (((struct smb_symcache *)link)->sc_ino == ino) {
+			return (struct smb_symcache *)link;
+		}
+	}
+	return NULL;
+}
+
+void
+smbfs_symcache_init(struct smbmount *smp)
+{
+	lck_mtx_init(&smp->sm_symcache_lock, smbfs_mutex_group, smbfs_lock_attr);
+	smb_bcache_init(&smp->sm_symcache, SMB_SYMCACHE_MAX);
+}
+
+void
+smbfs_symcache_destroy(struct smbmount *smp)
+{
+	struct smb_symcache *entry;
+	
+	/* Only called on unmount, no one else can be using the cache */
+	while ((entry = (struct smb_symcache *)smb_bcache_first(&smp->sm_symcache)) != NULL) {
+		smb_bcache_remove(&smp->sm_symcache, &entry->sc_link);
+		smbfs_symcache_free(entry);
+	}
+	lck_mtx_destroy(&smp->sm_symcache_lock, smbfs_mutex_group);
+}
+
+/*
+ * Remember the target of this symlink node.
+ */
+static void
+smbfs_symcache_enter(struct smbnode *np, char *target, size_t targetlen)
+{
+	struct smbmount *smp = np->n_mount;
+	struct smb_symcache *entry, *new_entry = NULL, *victim;
+	
+	if (!smbfs_symcache_enabled(smp)) {
+		return;
+	}
+	
+	/* Allocate before taking the lock */
+	SMB_MALLOC(new_entry, struct smb_symcache *, sizeof(*new_entry), M_TEMP, 
+			   M_WAITOK | M_ZERO);
+	if (new_entry == NULL) {
+		return;
+	}
+	new_entry->sc_target = smb_strndup(target, targetlen);
+	if (new_entry->sc_target == NULL) {
+		SMB_FREE(new_entry, M_TEMP);
+		return;
+	}
+	new_entry->sc_ino = np->n_ino;
+	new_entry->sc_mtime = np->n_mtime;
+	new_entry->sc_targetlen = targetlen;
+	
+	lck_mtx_lock(&smp->sm_symcache_lock);
+	entry = smbfs_symcache_find(smp, np->n_ino);
+	if (entry) {
+		smb_bcache_remove(&smp->sm_symcache, &entry->sc_link);
+	}
+	/* If full this hands back the least recently used entry */
+	victim = (struct smb_symcache *)smb_bcache_insert(&smp->sm_symcache, 
+							SMB_SYMCACHE_HASH(np->n_ino), &new_entry->sc_link);
+	lck_mtx_unlock(&smp->sm_symcache_lock);
+	
+	if (entry) {
+		smbfs_symcache_free(entry);
+	}
+	if (victim) {
+		smbfs_symcache_free(victim);
+	}
+}
+
+/*
+ * Fill in the node's symlink target from the mount's cache. Only trusted
+ * when the node's attributes are current, since that is what tells us the
+ * mtime still matches the server. Returns TRUE if the node now has its target.
+ *
+ * The calling routine must hold the node lock.
+ */
+int
+smbfs_symcache_lookup(struct smbnode *np)
+{
+	struct smbmount *smp = np->n_mount;
+	struct smb_symcache *entry;
+	struct timespec ts;
+	time_t attrtimeo;
+	char *target = NULL;
+	size_t targetlen = 0;
+	
+	if (!smbfs_symcache_enabled(smp)) {
+		return FALSE;
+	}
+	
+	SMB_CACHE_TIME(ts, np, attrtimeo);
+	if ((ts.tv_sec - np->attribute_cache_timer) > attrtimeo) {
+		return FALSE;
+	}
+	
+	lck_mtx_lock(&smp->sm_symcache_lock);
+	entry = smbfs_symcache_find(smp, np->n_ino);
+	if (entry && (timespeccmp(&entry->sc_mtime, &np->n_mtime, ==))) {
+		target = smb_strndup(entry->sc_target, entry->sc_targetlen);
+		targetlen = entry->sc_targetlen;
+		smb_bcache_touch(&smp->sm_symcache, &entry->sc_link);
+	} else if (entry) {
+		/* The link got changed on the server, toss it */
+		smb_bcache_remove(&smp->sm_symcache, &entry->sc_link);
+		smbfs_symcache_free(entry);
+	}
+	lck_mtx_unlock(&smp->sm_symcache_lock);
+	
+	if (target == NULL) {
+		OSAddAtomic64(1, (SInt64 *) &smbfs_symcache_misses);
+		return FALSE;
+	}
+	OSAddAtomic64(1, (SInt64 *) &smbfs_symcache_hits);
+	
+	if (np->n_symlink_target != NULL) {
+		SMB_FREE(np->n_symlink_target, M_TEMP);
+	}
+	np->n_symlink_target = target;
+	np->n_symlink_target_len = targetlen;
+	np->n_symlink_cache_timer = ts.tv_sec;
+	return TRUE;
+}
+
+/*
+ * The item is gone or isn't the same symlink any more.
+ */
+void
+smbfs_symcache_remove(struct smbmount *smp, uint64_t ino)
+{
+	struct smb_symcache *entry;
+	
+	lck_mtx_lock(&smp->sm_symcache_lock);
+	entry = smbfs_symcache_find(smp, ino);
+	if (entry) {
+		smb_bcache_remove(&smp->sm_symcache, &entry->sc_link);
+	}
+	lck_mtx_unlock(&smp->sm_symcache_lock);
+	
+	if (entry) {
+		smbfs_symcache_free(entry);
+	}
+}
+
 void 
 smbfs_update_symlink_cache(struct smbnode *np, char *target, size_t targetlen)
 {
@@ -920,6 +1122,7 @@ smbfs_update_symlink_cache(struct smbnode *np, char *target, size_t targetlen)
 		np->n_symlink_target_len = targetlen;
 		nanouptime(&ts);
 		np->n_symlink_cache_timer = ts.tv_sec;
+		smbfs_symcache_enter(np, np->n_symlink_target, targetlen);
 	}
 }
 
@@ -90,7 +90,7 @@ smb2fs_smb_qstreaminfo(struct smb_share *share, struct smbnode *np, enum vtype v
                        vfs_context_t context);
 static int
 smb2fs_smb_request_resume_key(struct smb_share *share, SMBFID fid, u_char *resume_key,
-                              vfs_context_t context);
+                              uint32_t *ntstatusp, vfs_context_t context);
 
 static int
 smb2fs_smb_set_eof(struct smb_share *share, SMBFID fid, uint64_t newsize,
@@ -4336,7 +4336,8 @@ smbfs_smb_close(struct smb_share *share, SMBFID fid, vfs_context_t context)
 static int
 smb2fs_smb_copychunks(struct smb_share *share, SMBFID src_fid,
                       SMBFID targ_fid, uint64_t src_file_len,
-                      int mac_to_mac, vfs_context_t context)
+                      int mac_to_mac, uint32_t *ntstatusp,
+                      vfs_context_t context)
 {
     struct smb2_ioctl_rq            *ioctlp = NULL;
     struct smb2_copychunk           *copychunk_hdr;
@@ -4366,7 +4367,8 @@ smb2fs_smb_copychunks(struct smb_share *share, SMBFID src_fid,
     }
     
     /* Begin by getting a resume key from the source */
-    error = smb2fs_smb_request_resume_key(share, src_fid, resume_key, context);
+    error = smb2fs_smb_request_resume_key(share, src_fid, resume_key,
+                                          ntstatusp, context);
     
     if (error) {
         SMBERROR("Failed to get resume key, error: %d\n", error);
@@ -4529,6 +4531,10 @@ again:
         }
     }
 out:
+    if ((ntstatusp != NULL) && (ioctlp != NULL)) {
+        *ntstatusp = ioctlp->ret_ntstatus;
+    }
+    
     // clean house
     if (sendbuf != NULL) {
         SMB_FREE(sendbuf, M_SMBTEMP);
@@ -4545,6 +4551,328 @@ out:
     return (error);
 }
 
+/*
+ * Client side copy, used when the server can't do the copychunk for us. The
+ * data is read into a small pool of buffers and written back out using async
+ * SMB 2/3 reads and writes, so reads from the source overlap writes to the
+ * target instead of paying two round trips per buffer.
+ */
+#define SMB2_COPYDATA_BUFS      4
+#define SMB2_COPYDATA_MAX_IO    (1024 * 1024)
+
+enum {
+    kCopyBufFree = 0,
+    kCopyBufReading,
+    kCopyBufFilled,
+    kCopyBufWriting
+};
+
+struct smb2_copydata_buf {
+    struct smb2_copydata *cb_cdp;
+    struct smb_rq *cb_rqp;
+    struct smb2_rw_rq cb_rw;
+    uint8_t *cb_data;
+    uint64_t cb_offset;
+    user_ssize_t cb_len;
+    int cb_state;
+    int cb_done;                /* set by the callback */
+};
+
+struct smb2_copydata {
+    lck_mtx_t cd_lock;
+    struct smb2_copydata_buf cd_bufs[SMB2_COPYDATA_BUFS];
+};
+
+static void
+smb2fs_smb_copydata_done(void *arg)
+{
+    struct smb2_copydata_buf *cbp = arg;
+    struct smb2_copydata *cdp = cbp->cb_cdp;
+    
+    /* Called from the iod with the request lock held, so just flag it */
+    lck_mtx_lock(&cdp->cd_lock);
+    cbp->cb_done = 1;
+    lck_mtx_unlock(&cdp->cd_lock);
+    wakeup(cdp);
+}
+
+static int
+smb2fs_smb_copydata_start(struct smb_share *share, struct smb2_copydata_buf *cbp,
+                          SMBFID fid, uint32_t do_read, vfs_context_t context)
+{
+    int error;
+    
+    bzero(&cbp->cb_rw, sizeof(cbp->cb_rw));
+    cbp->cb_rw.fid = fid;
+    cbp->cb_rw.auio = uio_create(1, cbp->cb_offset, UIO_SYSSPACE,
+                                 (do_read) ? UIO_READ : UIO_WRITE);
+    if (cbp->cb_rw.auio == NULL) {
+        return (ENOMEM);
+    }
+    uio_addiov(cbp->cb_rw.auio, CAST_USER_ADDR_T(cbp->cb_data), cbp->cb_len);
+    
+    cbp->cb_done = 0;
+    error = smb2_smb_rw_async(share, &cbp->cb_rw, do_read,
+                              smb2fs_smb_copydata_done, cbp,
+                              &cbp->cb_rqp);
+    if (error == ENOBUFS) {
+        /* Not enough credits for an async one, do this one synchronously */
+        if (do_read) {
+            error = smb_smb_read(share, fid, cbp->cb_rw.auio, context);
+        }
+        else {
+            error = smb_smb_write(share, fid, cbp->cb_rw.auio, 0, context);
+        }
+        if (!error && uio_resid(cbp->cb_rw.auio)) {
+            error = EIO;
+        }
+        uio_free(cbp->cb_rw.auio);
+        cbp->cb_rw.auio = NULL;
+        cbp->cb_rqp = NULL;
+        if (!error) {
+            cbp->cb_state = (do_read) ? kCopyBufFilled : kCopyBufFree;
+        }
+        return (error);
+    }
+    if (error) {
+        uio_free(cbp->cb_rw.auio);
+        cbp->cb_rw.auio = NULL;
+        return (error);
+    }
+    cbp->cb_state = (do_read) ? kCopyBufReading : kCopyBufWriting;
+    return (0);
+}
+
+static int
+smb2fs_smb_copydata_finish(struct smb2_copydata_buf *cbp)
+{
+    user_ssize_t resid = 0;
+    uint32_t do_read = (cbp->cb_state == kCopyBufReading);
+    int error;
+    
+    error = smb2_smb_rw_async_reply(cbp->cb_rqp, &cbp->cb_rw, do_read, &resid);
+    cbp->cb_rqp = NULL;
+    uio_free(cbp->cb_rw.auio);
+    cbp->cb_rw.auio = NULL;
+    
+    if (!error && (resid != cbp->cb_len)) {
+        /* The source changed size on us or the server took a short write */
+        SMBDEBUG("short %s, expected %lld got %lld\n", (do_read) ? "read" : "write",
+                 (int64_t)cbp->cb_len, (int64_t)resid);
+        error = EIO;
+    }
+    cbp->cb_state = (do_read) ? kCopyBufFilled : kCopyBufFree;
+    return (error);
+}
+
+static int
+smb2fs_smb_copydata(struct smb_share *share, SMBFID src_fid,
+                    SMBFID targ_fid, uint64_t src_file_len,
+                    vfs_context_t context)
+{
+    struct smb2_copydata *cdp = NULL;
+    struct smb2_copydata_buf *cbp;
+    struct timespec ts, progress, now;
+    uint64_t next_offset = 0;
+    uint32_t io_size, timeout;
+    int busy, done, i;
+    int error = 0, this_error, cancel_error;
+    
+    if (src_file_len == 0) {
+        return (0);
+    }
+    
+    io_size = MIN(SSTOVC(share)->vc_rxmax, SSTOVC(share)->vc_wxmax);
+    io_size = MIN(io_size, SMB2_COPYDATA_MAX_IO);
+    
+    SMB_MALLOC(cdp,
+               struct smb2_copydata *,
+               sizeof(struct smb2_copydata),
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    if (cdp == NULL) {
+        SMBERROR("SMB_MALLOC failed\n");
+        return (ENOMEM);
+    }
+    lck_mtx_init(&cdp->cd_lock, srs_lck_group, srs_lck_attr);
+    
+    for (i = 0; i < SMB2_COPYDATA_BUFS; i++) {
+        cbp = &cdp->cd_bufs[i];
+        cbp->cb_cdp = cdp;
+        /* No point in more buffers than the file needs */
+        if ((uint64_t)i * io_size >= src_file_len) {
+            break;
+        }
+        SMB_MALLOC(cbp->cb_data, uint8_t *, io_size, M_SMBTEMP, M_WAITOK);
+        if (cbp->cb_data == NULL) {
+            if (i == 0) {
+                SMBERROR("SMB_MALLOC failed\n");
+                error = ENOMEM;
+                goto out;
+            }
+            /* Just go with the ones we got */
+            break;
+        }
+    }
+    
+    for (;;) {
+        /*
+         * Start writes for filled buffers and reads for free ones. Once we
+         * have an error we stop starting anything and just wait for what is
+         * already out on the wire.
+         */
+        busy = 0;
+        for (i = 0; i < SMB2_COPYDATA_BUFS; i++) {
+            cbp = &cdp->cd_bufs[i];
+            if (cbp->cb_data == NULL) {
+                continue;
+            }
+            if (!error && (cbp->cb_state == kCopyBufFilled)) {
+                error = smb2fs_smb_copydata_start(share, cbp, targ_fid,
+                                                  0, context);
+            }
+            if (!error && (cbp->cb_state == kCopyBufFree) &&
+                (next_offset < src_file_len)) {
+                cbp->cb_offset = next_offset;
+                cbp->cb_len = (user_ssize_t)MIN(io_size, src_file_len - next_offset);
+                next_offset += cbp->cb_len;
+                error = smb2fs_smb_copydata_start(share, cbp, src_fid,
+                                                  1, context);
+            }
+            if ((cbp->cb_state == kCopyBufReading) ||
+                (cbp->cb_state == kCopyBufWriting)) {
+                busy++;
+            }
+            else if (!error && (cbp->cb_state == kCopyBufFilled)) {
+                /* Filled synchronously, come back around for the write */
+                busy++;
+            }
+        }
+        if (busy == 0) {
+            break;
+        }
+        
+        /*
+         * Wait for something to complete. The iod times out requests to a
+         * server that stops answering, but don't count on it. Give up on
+         * the outstanding requests if we get a signal or nothing completes
+         * within the soft mount time out, or the iod's own time out.
+         */
+        timeout = (share->ss_soft_timer) ? share->ss_soft_timer : SMB_SEND_WAIT_TIMO;
+        nanouptime(&progress);
+        cancel_error = 0;
+        lck_mtx_lock(&cdp->cd_lock);
+        for (;;) {
+            done = 0;
+            for (i = 0; i < SMB2_COPYDATA_BUFS; i++) {
+                cbp = &cdp->cd_bufs[i];
+                if ((!error && (cbp->cb_state == kCopyBufFilled)) ||
+                    (((cbp->cb_state == kCopyBufReading) ||
+                      (cbp->cb_state == kCopyBufWriting)) && cbp->cb_done)) {
+                    done++;
+                }
+            }
+            if (done) {
+                break;
+            }
+            if (cancel_error) {
+                /* Already errored them out, the callbacks are on the way */
+                ts.tv_sec = 1;
+                ts.tv_nsec = 0;
+                msleep(cdp, &cdp->cd_lock, PWAIT, "smbcopy", &ts);
+                continue;
+            }
+            ts.tv_sec = 5;
+            ts.tv_nsec = 0;
+            this_error = msleep(cdp, &cdp->cd_lock, PWAIT | PCATCH, "smbcopy", &ts);
+            if ((this_error == EINTR) || (this_error == ERESTART)) {
+                cancel_error = EINTR;
+            }
+            else {
+                nanouptime(&now);
+                if (now.tv_sec > (progress.tv_sec + (time_t)timeout)) {
+                    cancel_error = ETIMEDOUT;
+                }
+            }
+            if (cancel_error) {
+                /* The callback takes cd_lock, so drop it while we error them out */
+                lck_mtx_unlock(&cdp->cd_lock);
+                SMBDEBUG("giving up on the outstanding requests, error %d\n",
+                         cancel_error);
+                for (i = 0; i < SMB2_COPYDATA_BUFS; i++) {
+                    cbp = &cdp->cd_bufs[i];
+                    if ((cbp->cb_state == kCopyBufReading) ||
+                        (cbp->cb_state == kCopyBufWriting)) {
+                        smb_iod_errorout_request(cbp->cb_rqp, cancel_error);
+                    }
+                }
+                if (!error) {
+                    error = cancel_error;
+                }
+                lck_mtx_lock(&cdp->cd_lock);
+            }
+        }
+        lck_mtx_unlock(&cdp->cd_lock);
+        
+        for (i = 0; i < SMB2_COPYDATA_BUFS; i++) {
+            cbp = &cdp->cd_bufs[i];
+            if (((cbp->cb_state != kCopyBufReading) &&
+                 (cbp->cb_state != kCopyBufWriting)) || !cbp->cb_done) {
+                continue;
+            }
+            this_error = smb2fs_smb_copydata_finish(cbp);
+            if (this_error && !error) {
+                error = this_error;
+            }
+        }
+    }
+    
+out:
+    for (i = 0; i < SMB2_COPYDATA_BUFS; i++) {
+        cbp = &cdp->cd_bufs[i];
+        if (cbp->cb_data != NULL) {
+            SMB_FREE(cbp->cb_data, M_SMBTEMP);
+        }
+    }
+    lck_mtx_destroy(&cdp->cd_lock, srs_lck_group);
+    SMB_FREE(cdp, M_SMBTEMP);
+    
+    return (error);
+}
+
+/*
+ * Copy the data using copychunk if the server supports it, otherwise do it
+ * ourselves. Once a server says it doesn't do copychunk we don't bother
+ * asking again until the next reconnect.
+ */
+static int
+smb2fs_smb_copydata_fid(struct smb_share *share, SMBFID src_fid,
+                        SMBFID targ_fid, uint64_t src_file_len,
+                        vfs_context_t context)
+{
+    uint32_t ntstatus = 0;
+    int error;
+    
+    if (!(share->ss_flags & SMBS_NO_COPYCHUNK)) {
+        error = smb2fs_smb_copychunks(share, src_fid,
+                                      targ_fid, src_file_len,
+                                      FALSE, &ntstatus, context);
+        /* STATUS_INVALID_DEVICE_REQUEST maps to EINVAL, so check the ntstatus */
+        if ((error != ENOTSUP) &&
+            (ntstatus != STATUS_NOT_SUPPORTED) &&
+            (ntstatus != STATUS_INVALID_DEVICE_REQUEST)) {
+            return (error);
+        }
+        SMBDEBUG("copychunk not supported (%d), copying it ourselves\n", error);
+        lck_mtx_lock(&share->ss_stlock);
+        share->ss_flags |= SMBS_NO_COPYCHUNK;
+        lck_mtx_unlock(&share->ss_stlock);
+    }
+    
+    return (smb2fs_smb_copydata(share, src_fid, targ_fid,
+                                src_file_len, context));
+}
+
 int
 smb2fs_smb_copyfile(struct smb_share *share, struct smbnode *src_np,
                     struct smbnode *tdnp, const char *tnamep,
@@ -4667,12 +4995,12 @@ smb2fs_smb_copyfile(struct smb_share *share, struct smbnode *src_np,
     /*************************************/
     /* Now initiate the server-side copy */
     /*************************************/
-    error = smb2fs_smb_copychunks(share, src_fid,
-                                  targ_fid, src_file_len,
-                                  FALSE, context);
+    error = smb2fs_smb_copydata_fid(share, src_fid,
+                                    targ_fid, src_file_len,
+                                    context);
     
     if (error) {
-        SMBDEBUG("smb2fs_smb_copychunks failed (file data) %d\n", error);
+        SMBDEBUG("smb2fs_smb_copydata_fid failed (file data) %d\n", error);
         goto out;
     }
     
@@ -4771,12 +5099,12 @@ smb2fs_smb_copyfile(struct smb_share *share, struct smbnode *src_np,
         /*************************************/
         /* Now initiate the server-side copy */
         /*************************************/
-        error = smb2fs_smb_copychunks(share, src_xattr_fid,
-                                      targ_xattr_fid, src_file_len,
-                                      FALSE, context);
+        error = smb2fs_smb_copydata_fid(share, src_xattr_fid,
+                                        targ_xattr_fid, src_file_len,
+                                        context);
         
         if (error) {
-            SMBDEBUG("smb2fs_smb_copychunks failed (xattr), error: %d\n", error);
+            SMBDEBUG("smb2fs_smb_copydata_fid failed (xattr), error: %d\n", error);
             goto out;
         }
         
@@ -4959,7 +5287,7 @@ smb2fs_smb_copyfile_mac(struct smb_share *share, struct smbnode *src_np,
     /*************************************/
     error = smb2fs_smb_copychunks(share, src_fid,
                                   targ_fid, 0,
-                                  TRUE, context);
+                                  TRUE, NULL, context);
     
     if (error) {
         SMBDEBUG("smb2fs_smb_copychunks_mac failed (file data) %d\n", error);
@@ -5836,6 +6164,11 @@ smb2fs_smb_ntcreatex(struct smb_share *share, struct smbnode *np,
     
     /* Building a compound requests */
     if (in_createp != NULL) {
+        /* Stream name has already been put into the request */
+        if (snamep) {
+            createp->strm_namep = NULL;
+            SMB_FREE(snamep, M_SMBSTR);
+        }
         *in_createp = createp;
         return (0);
     }
@@ -6741,9 +7074,129 @@ smbfs_smb_reparse_read_symlink(struct smb_share *share, struct smbnode *np,
 
 }
 
+/*
+ * Reopen a batch of handles after a reconnect. All of the Create requests are
+ * sent before we wait on any of the replies, so the whole batch costs about
+ * one round trip instead of one round trip per handle. The result for each
+ * handle is returned in its entry's error field.
+ *
+ * An entry with a fref is a durable handle reconnect and its dur_handle must
+ * already be set up for a reconnect. An entry without a fref is a monitored
+ * directory that gets a new open for change notify, returned in d_fid. Only
+ * used from reconnect with the iod_context.
+ *
+ * The calling routine must hold a reference on the share
+ */
+int
+smb2fs_smb_reopen_handles(struct smb_share *share,
+                          struct smb2fs_reopen_entry *entries,
+                          uint32_t count, vfs_context_t context)
+{
+    struct smb2fs_reopen_entry *entryp;
+    struct smbfattr *fap = NULL;
+    struct mdchain *mdp;
+    SMBFID *fidp;
+    uint32_t i;
+    
+    SMB_MALLOC(fap,
+               struct smbfattr *,
+               sizeof(struct smbfattr),
+               M_SMBTEMP,
+               M_WAITOK | M_ZERO);
+    if (fap == NULL) {
+        SMBERROR("SMB_MALLOC failed\n");
+        for (i = 0; i < count; i++) {
+            entries[i].error = ENOMEM;
+        }
+        return (ENOMEM);
+    }
+    
+    /*
+     * Build and send all the Create requests. Build them as compound
+     * requests so smb2fs_smb_ntcreatex() hands them back to us without
+     * waiting on the reply, then send each one on its own.
+     */
+    for (i = 0; i < count; i++) {
+        entryp = &entries[i];
+        entryp->rqp = NULL;
+        entryp->createp = NULL;
+        
+        if (entryp->fref != NULL) {
+            entryp->error = smb2fs_smb_ntcreatex(share, entryp->np,
+                                                 NULL, 0,
+                                                 NULL, 0,
+                                                 0, VREG,
+                                                 0, 0,
+                                                 SMB2_CREATE_DUR_HANDLE_RECONNECT, 0,
+                                                 &entryp->fref->fid, fap,
+                                                 &entryp->rqp, &entryp->createp,
+                                                 &entryp->fref->dur_handle, context);
+        }
+        else {
+            /* Same open that smbfs_restart_change_notify does */
+            entryp->error = smb2fs_smb_ntcreatex(share, entryp->np,
+                                                 NULL, 0,
+                                                 NULL, 0,
+                                                 SMB2_FILE_READ_DATA | SMB2_SYNCHRONIZE, VDIR,
+                                                 NTCREATEX_SHARE_ACCESS_ALL, FILE_OPEN,
+                                                 SMB2_CREATE_GET_MAX_ACCESS, 0,
+                                                 &entryp->np->d_fid, fap,
+                                                 &entryp->rqp, &entryp->createp,
+                                                 NULL, context);
+        }
+        if (entryp->error) {
+            SMBERROR("smb2fs_smb_ntcreatex failed %d\n", entryp->error);
+            continue;
+        }
+        
+        /* In this situation, its not a compound request */
+        entryp->rqp->sr_flags &= ~SMBR_COMPOUND_RQ;
+        
+        entryp->error = smb_rq_enqueue(entryp->rqp);
+    }
+    
+    /* Now collect the replies */
+    for (i = 0; i < count; i++) {
+        entryp = &entries[i];
+        
+        if (entryp->error == 0) {
+            entryp->error = smb_rq_reply(entryp->rqp);
+            entryp->createp->ret_ntstatus = entryp->rqp->sr_ntstatus;
+        }
+        
+        if (entryp->error == 0) {
+            smb_rq_getreply(entryp->rqp, &mdp);
+            entryp->error = smb2_smb_parse_create(share, mdp, entryp->createp);
+        }
+        
+        if (entryp->error == 0) {
+            fidp = (entryp->fref != NULL) ? &entryp->fref->fid : &entryp->np->d_fid;
+            *fidp = entryp->createp->ret_fid;
+            
+            bzero(fap, sizeof(*fap));
+            nanouptime(&fap->fa_reqtime);
+            entryp->error = smb2fs_smb_parse_ntcreatex(share, entryp->np,
+                                                       entryp->createp,
+                                                       fidp, fap, context);
+        }
+        
+        if (entryp->rqp != NULL) {
+            smb_rq_done(entryp->rqp);
+            entryp->rqp = NULL;
+        }
+        
+        if (entryp->createp != NULL) {
+            SMB_FREE(entryp->createp, M_SMBTEMP);
+        }
+    }
+    
+    SMB_FREE(fap, M_SMBTEMP);
+    return (0);
+}
+
 static int
 smb2fs_smb_request_resume_key(struct smb_share *share, SMBFID fid, u_char *resume_key,
-                              vfs_context_t context)
+                              uint32_t *ntstatusp, vfs_context_t context)
 {
     struct smb2_ioctl_rq *ioctlp = NULL;
     int error = 0;
@@ -6772,6 +7225,9 @@ smb2fs_smb_request_resume_key(struct smb_share *share, SMBFID fid, u_char *resum
 	ioctlp->rcv_output_len = 0x20;
     
     error = smb2_smb_ioctl(share, ioctlp, NULL, context);
+    if (ntstatusp) {
+        *ntstatusp = ioctlp->ret_ntstatus;
+    }
     
     if (!error) {
         memcpy(resume_key, ioctlp->rcv_output_buffer, SMB2_RESUME_KEY_LEN);
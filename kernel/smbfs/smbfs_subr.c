@@ -437,3 +437,67 @@ smb_get_share_with_reference(struct smbmount *smp)
 	lck_rw_unlock_shared(&smp->sm_rw_sharelock);
 	return share;
 }
+
+/*
+ * Bounded cache helpers, the caller provides the locking. 
+ */
+void
+smb_bcache_init(struct smb_bcache *bc, uint32_t max)
+{
+	int ii;
+	
+	for (ii = 0; ii < SMB_BCACHE_HASHSIZE; ii++) {
+		LIST_INIT(&bc->bc_hash[ii]);
+	}
+	TAILQ_INIT(&bc->bc_lru);
+	bc->bc_cnt = 0;
+	bc->bc_max = max;
+}
+
+/*
+ * Add the entry to the cache. If the cache was full the least recently used
+ * entry is taken out and returned, the calling routine needs to free it.
+ */
+struct smb_bcache_link *
+smb_bcache_insert(struct smb_bcache *bc, uint32_t hash, 
+				  struct smb_bcache_link *link)
+{
+	struct smb_bcache_link *victim = NULL;
+	
+	if (bc->bc_cnt >= bc->bc_max) {
+		victim = TAILQ_LAST(&bc->bc_lru, smb_bcache_lru);
+		if (victim != NULL) {
+			smb_bcache_remove(bc, victim);
+		}
+	}
+	LIST_INSERT_HEAD(SMB_BCACHE_CHAIN(bc, hash), link, bl_hash);
+	TAILQ_INSERT_HEAD(&bc->bc_lru, link, bl_lru);
+	bc->bc_cnt++;
+	return victim;
+}
+
+void
+smb_bcache_remove(struct smb_bcache *bc, struct smb_bcache_link *link)
+{
+	LIST_REMOVE(link, bl_hash);
+	TAILQ_REMOVE(&bc->bc_lru, link, bl_lru);
+	bc->bc_cnt--;
+}
+
+/*
+ * Mark the entry as just used.
+ */
+void
+smb_bcache_touch(struct smb_bcache *bc, struct smb_bcache_link *link)
+{
+	if (TAILQ_FIRST(&bc->bc_lru) != link) {
+		TAILQ_REMOVE(&bc->bc_lru, link, bl_lru);
+		TAILQ_INSERT_HEAD(&bc->bc_lru, link, bl_lru);
+	}
+}
+
+struct smb_bcache_link *
+smb_bcache_first(struct smb_bcache *bc)
+{
+	return TAILQ_FIRST(&bc->bc_lru);
+}
@@ -165,6 +165,10 @@ int smb1fs_smb_create_reparse_symlink(struct smb_share *share, struct smbnode *d
                                       size_t targetlen, struct smbfattr *fap,
                                       vfs_context_t context);
 void smbfs_update_symlink_cache(struct smbnode *np, char *target, size_t targetlen);
+void smbfs_symcache_init(struct smbmount *smp);
+void smbfs_symcache_destroy(struct smbmount *smp);
+int smbfs_symcache_lookup(struct smbnode *np);
+void smbfs_symcache_remove(struct smbmount *smp, uint64_t ino);
 int smbfs_smb_get_reparse_tag(struct smb_share *share, SMBFID fid,
                               uint32_t *reparseTag, char **outTarget, 
                               size_t *outTargetlen, vfs_context_t context);
@@ -298,6 +302,12 @@ int smbfs_fullpath_stream(struct mbchain *mbp, struct smbnode *dnp,
                           size_t *lenp, size_t strm_name_len, int name_flags,
                           int usingUnicode, uint8_t sep);
 struct smb_share *smb_get_share_with_reference(struct smbmount *smp);
+void smb_bcache_init(struct smb_bcache *bc, uint32_t max);
+struct smb_bcache_link *smb_bcache_insert(struct smb_bcache *bc, uint32_t hash, 
+										  struct smb_bcache_link *link);
+void smb_bcache_remove(struct smb_bcache *bc, struct smb_bcache_link *link);
+void smb_bcache_touch(struct smb_bcache *bc, struct smb_bcache_link *link);
+struct smb_bcache_link *smb_bcache_first(struct smb_bcache *bc);
 int smb1fs_smb_ntcreatex(struct smb_share *share, struct smbnode *dnp_or_np, 
                          uint32_t rights, uint32_t shareMode, 
                          enum vtype vt, SMBFID *fidp, const char *name, 
@@ -127,6 +127,9 @@ int smbfs_smb_query_info(struct smb_share *share, struct smbnode *dnp, enum vtyp
 int smbfs_smb_rename(struct smb_share *share, struct smbnode *src, 
                      struct smbnode *tdnp, const char *tname, size_t tnmlen, 
                      vfs_context_t context);
+int smb2fs_smb_reopen_handles(struct smb_share *share,
+                              struct smb2fs_reopen_entry *entries,
+                              uint32_t count, vfs_context_t context);
 int smbfs_smb_reparse_read_symlink(struct smb_share *share, struct smbnode *np,
                                    struct uio *uiop, vfs_context_t context);
 int smbfs_smb_rmdir(struct smb_share *share, struct smbnode *np,
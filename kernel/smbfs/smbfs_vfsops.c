@@ -172,10 +172,28 @@ extern struct sysctl_oid sysctl__net_smb_fs_kern_hard_deadtimer;
 extern struct sysctl_oid sysctl__net_smb_fs_kern_soft_deadtimer;
 extern struct sysctl_oid sysctl__net_smb_fs_tcpsndbuf;
 extern struct sysctl_oid sysctl__net_smb_fs_tcprcvbuf;
+extern struct sysctl_oid sysctl__net_smb_fs_tcpmaxbuf;
+extern struct sysctl_oid sysctl__net_smb_fs_tcpautotune;
+extern struct sysctl_oid sysctl__net_smb_fs_rcvq_pdus;
+extern struct sysctl_oid sysctl__net_smb_fs_tcpcoalesce;
 extern struct sysctl_oid sysctl__net_smb_fs_maxwrite;
 extern struct sysctl_oid sysctl__net_smb_fs_maxread;
 extern struct sysctl_oid sysctl__net_smb_fs_maxsegreadsize;
 extern struct sysctl_oid sysctl__net_smb_fs_maxsegwritesize;
+extern struct sysctl_oid sysctl__net_smb_fs_notify_debounce;
+extern struct sysctl_oid sysctl__net_smb_fs_notify_events_rcvd;
+extern struct sysctl_oid sysctl__net_smb_fs_notify_events_coalesced;
+extern struct sysctl_oid sysctl__net_smb_fs_notify_events_delivered;
+extern struct sysctl_oid sysctl__net_smb_fs_sidcache_hits;
+extern struct sysctl_oid sysctl__net_smb_fs_sidcache_misses;
+extern struct sysctl_oid sysctl__net_smb_fs_async_strategy;
+extern struct sysctl_oid sysctl__net_smb_fs_rq_cache_max;
+extern struct sysctl_oid sysctl__net_smb_fs_rq_cache_hits;
+extern struct sysctl_oid sysctl__net_smb_fs_rq_cache_misses;
+extern struct sysctl_oid sysctl__net_smb_fs_rq_cache_highwater;
+extern struct sysctl_oid sysctl__net_smb_fs_brl_cache;
+extern struct sysctl_oid sysctl__net_smb_fs_symcache_hits;
+extern struct sysctl_oid sysctl__net_smb_fs_symcache_misses;
 
 
 MALLOC_DEFINE(M_SMBFSHASH, "SMBFS hash", "SMBFS hash table");
@@ -644,6 +662,77 @@ smbfs_remount(int32_t dev, struct mount *mp, struct smbmount *smp,
 	return 0;
 }
 
+/*
+ * Refresh the cached statfs data. Scheduled by smbfs_vfs_getattr when the
+ * cache is stale, so statfs callers never have to wait on the server.
+ */
+static void
+smbfs_statfs_thread_call(thread_call_param_t param0, thread_call_param_t param1)
+{
+#pragma unused(param1)
+	struct smbmount *smp = (struct smbmount *)param0;
+	struct smb_share *share;
+	struct vfsstatfs cachedstatfs;
+	struct timespec ts;
+	vfs_context_t context;
+	int error;
+
+	context = vfs_context_create((vfs_context_t)0);
+	share = smb_get_share_with_reference(smp);
+
+	lck_mtx_lock(&smp->sm_statfslock);
+	cachedstatfs = smp->sm_statfsbuf;
+	smp->sm_status &= ~SM_STATUS_STATFS_DIRTY;
+	lck_mtx_unlock(&smp->sm_statfslock);
+
+	error = smbfs_smb_statfs(smp, &cachedstatfs, context);
+	smb_share_rele(share, context);
+
+	lck_mtx_lock(&smp->sm_statfslock);
+	if (error == 0) {
+		smp->sm_statfsbuf = cachedstatfs;
+		/* Something changed while we were waiting, refresh again next time */
+		if (smp->sm_status & SM_STATUS_STATFS_DIRTY) {
+			smp->sm_statfstime = 0;
+		} else {
+			nanouptime(&ts);
+			smp->sm_statfstime = ts.tv_sec;
+		}
+	}
+	smp->sm_status &= ~SM_STATUS_STATFS;
+	lck_mtx_unlock(&smp->sm_statfslock);
+
+	vfs_context_rele(context);
+}
+
+/*
+ * Something changed the space used on the volume. Mark the statfs cache
+ * stale and, until the next refresh, adjust the free blocks by delta bytes.
+ */
+void
+smbfs_statfs_changed(struct smbmount *smp, int64_t delta)
+{
+	uint64_t blocks;
+
+	lck_mtx_lock(&smp->sm_statfslock);
+	smp->sm_statfstime = 0;
+	smp->sm_status |= SM_STATUS_STATFS_DIRTY;
+	if (delta && smp->sm_statfsbuf.f_bsize) {
+		if (delta > 0) {
+			blocks = howmany((uint64_t)delta, smp->sm_statfsbuf.f_bsize);
+			smp->sm_statfsbuf.f_bfree -= MIN(blocks, smp->sm_statfsbuf.f_bfree);
+			smp->sm_statfsbuf.f_bavail -= MIN(blocks, smp->sm_statfsbuf.f_bavail);
+		} else {
+			blocks = (uint64_t)(-delta) / smp->sm_statfsbuf.f_bsize;
+			smp->sm_statfsbuf.f_bfree = MIN(smp->sm_statfsbuf.f_bfree + blocks,
+											smp->sm_statfsbuf.f_blocks);
+			smp->sm_statfsbuf.f_bavail = MIN(smp->sm_statfsbuf.f_bavail + blocks,
+											 smp->sm_statfsbuf.f_blocks);
+		}
+	}
+	lck_mtx_unlock(&smp->sm_statfslock);
+}
+
 static int
 smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t context)
 {
@@ -728,8 +817,12 @@ smbfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t con
 
 	lck_rw_init(&smp->sm_rw_sharelock, smbfs_rwlock_group, smbfs_lock_attr);
 	lck_mtx_init(&smp->sm_statfslock, smbfs_mutex_group, smbfs_lock_attr);		
+	smp->sm_statfs_call = thread_call_allocate(smbfs_statfs_thread_call, smp);
 	lck_mtx_init(&smp->sm_reclaim_lock, smbfs_mutex_group, smbfs_lock_attr);
     lck_mtx_init(&smp->sm_svrmsg_lock, smbfs_mutex_group, smbfs_lock_attr);
+	smbfs_sidcache_init(smp);
+	smbfs_secdesc_init(smp);
+	smbfs_symcache_init(smp);
 
 	lck_rw_lock_exclusive(&smp->sm_rw_sharelock);
 	smp->sm_share = share;
@@ -1115,10 +1208,16 @@ bad:
 			SMB_FREE(smp->sm_hash, M_SMBFSHASH);
 		lck_mtx_free(smp->sm_hashlock, hash_lck_grp);
 
+		if (smp->sm_statfs_call) {
+			thread_call_free(smp->sm_statfs_call);
+		}
 		lck_mtx_destroy(&smp->sm_statfslock, smbfs_mutex_group);
 		lck_mtx_destroy(&smp->sm_reclaim_lock, smbfs_mutex_group);
 		lck_rw_destroy(&smp->sm_rw_sharelock, smbfs_rwlock_group);
         lck_mtx_destroy(&smp->sm_svrmsg_lock, smbfs_mutex_group);
+		smbfs_sidcache_destroy(smp);
+		smbfs_secdesc_destroy(smp);
+		smbfs_symcache_destroy(smp);
 		SMB_FREE(smp->sm_args.volume_name, M_SMBSTR);	
 		SMB_FREE(smp->sm_args.path, M_SMBFSDATA);
 		SMB_FREE(smp->sm_args.unique_id, M_SMBFSDATA);
@@ -1139,6 +1238,7 @@ smbfs_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 	struct smbmount *smp = VFSTOSMBFS(mp);
     struct smb_share *share = smp->sm_share;
 	vnode_t vp;
+	thread_call_t statfs_call;
 	int error = 0;
 
     SMB_LOG_KTRACE(SMB_DBG_UNMOUNT | DBG_FUNC_START, mntflags, 0, 0, 0, 0);
@@ -1183,6 +1283,16 @@ smbfs_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 	/* We are done with this share shutdown all outstanding I/O requests. */
 	smb_iod_errorout_share_request(share, ENXIO);
 	
+	/* Wait for any background statfs refresh, no new ones can start */
+	lck_mtx_lock(&smp->sm_statfslock);
+	statfs_call = smp->sm_statfs_call;
+	smp->sm_statfs_call = NULL;
+	lck_mtx_unlock(&smp->sm_statfslock);
+	if (statfs_call) {
+		thread_call_cancel_wait(statfs_call);
+		thread_call_free(statfs_call);
+	}
+	
 	OSAddAtomic(-1, &SSTOVC(share)->vc_volume_cnt);
 	smbfs_notify_change_destroy_thread(smp);
 
@@ -1215,6 +1325,9 @@ smbfs_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 	lck_mtx_destroy(&smp->sm_reclaim_lock, smbfs_mutex_group);
     lck_mtx_destroy(&smp->sm_svrmsg_lock, smbfs_mutex_group);
 	lck_rw_destroy(&smp->sm_rw_sharelock, smbfs_rwlock_group);
+	smbfs_sidcache_destroy(smp);
+	smbfs_secdesc_destroy(smp);
+	smbfs_symcache_destroy(smp);
     
     if (smp->sm_args.volume_name) {
         SMB_FREE(smp->sm_args.volume_name, M_SMBSTR);	
@@ -1366,6 +1479,7 @@ smbfs_init(struct vfsconf *vfsp)
 		return (0);
 	done = 1;
 	smbfs_lock_init();
+	smbfs_strategy_init();
 
 	return 0;
 }
@@ -1394,36 +1508,35 @@ smbfs_vfs_getattr(struct mount *mp, struct vfs_attr *fsap, vfs_context_t context
     vcp = SSTOVC(share);
 
 	lck_mtx_lock(&smp->sm_statfslock);
-	cachedstatfs = smp->sm_statfsbuf;
-	if (smp->sm_status & SM_STATUS_STATFS)
-		lck_mtx_unlock(&smp->sm_statfslock);
-	else {
+	if ((smp->sm_statfsbuf.f_bsize == 0) && !(smp->sm_status & SM_STATUS_STATFS)) {
+		/* We have nothing to return yet, so this time we wait on the server */
 		smp->sm_status |= SM_STATUS_STATFS;
+		smp->sm_status &= ~SM_STATUS_STATFS_DIRTY;
+		cachedstatfs = smp->sm_statfsbuf;
 		lck_mtx_unlock(&smp->sm_statfslock);
+		error = smbfs_smb_statfs(smp, &cachedstatfs, context);
+		lck_mtx_lock(&smp->sm_statfslock);
+		if (error == 0) {
+			nanouptime(&ts);
+			smp->sm_statfstime = ts.tv_sec;
+			smp->sm_statfsbuf = cachedstatfs;
+		}
+		error = 0;
+		smp->sm_status &= ~SM_STATUS_STATFS;
+	} else if (!(smp->sm_status & SM_STATUS_STATFS) && smp->sm_statfs_call &&
+			   (VFSATTR_IS_ACTIVE(fsap, f_bsize) || VFSATTR_IS_ACTIVE(fsap, f_blocks) ||
+				VFSATTR_IS_ACTIVE(fsap, f_bfree) || VFSATTR_IS_ACTIVE(fsap, f_bavail) ||
+				VFSATTR_IS_ACTIVE(fsap, f_files) || VFSATTR_IS_ACTIVE(fsap, f_ffree))) {
+		/* Return what we have and refresh it in the background if its stale */
 		nanouptime(&ts);
-		/* We always check the first time otherwise only if the cache is stale. */
 		if ((smp->sm_statfstime == 0) ||
-			(((ts.tv_sec - smp->sm_statfstime) > SM_MAX_STATFSTIME) &&
-			(VFSATTR_IS_ACTIVE(fsap, f_bsize) || VFSATTR_IS_ACTIVE(fsap, f_blocks) ||
-			 VFSATTR_IS_ACTIVE(fsap, f_bfree) || VFSATTR_IS_ACTIVE(fsap, f_bavail) ||
-			 VFSATTR_IS_ACTIVE(fsap, f_files) || VFSATTR_IS_ACTIVE(fsap, f_ffree)))) {
-			/* update cached from-the-server data */
-			error = smbfs_smb_statfs(smp, &cachedstatfs, context);
-			if (error == 0) {
-				nanouptime(&ts);
-				smp->sm_statfstime = ts.tv_sec;
-				lck_mtx_lock(&smp->sm_statfslock);
-				smp->sm_statfsbuf = cachedstatfs;
-				lck_mtx_unlock(&smp->sm_statfslock);
-			}
-            else {
-				error = 0;
-			}
+			((ts.tv_sec - smp->sm_statfstime) > SM_MAX_STATFSTIME)) {
+			smp->sm_status |= SM_STATUS_STATFS;
+			thread_call_enter(smp->sm_statfs_call);
 		}
-		lck_mtx_lock(&smp->sm_statfslock);
-		smp->sm_status &= ~SM_STATUS_STATFS;
-		lck_mtx_unlock(&smp->sm_statfslock);
 	}
+	cachedstatfs = smp->sm_statfsbuf;
+	lck_mtx_unlock(&smp->sm_statfslock);
 
 	/*
 	 * Not sure what to do about these items, seems we get call for them and
@@ -2618,6 +2731,7 @@ int smbfs_module_start(kmod_info_t *ki, void *data)
 		goto out;
 
 	smbnet_lock_init();	/* Initialize the network locks */
+	smb_rq_cache_init();
 	
 	/* This just calls nsmb_dev_load */
 	SEND_EVENT(dev_netsmb, MOD_LOAD);
@@ -2634,6 +2748,10 @@ int smbfs_module_start(kmod_info_t *ki, void *data)
 
 	sysctl_register_oid(&sysctl__net_smb_fs_tcpsndbuf);
 	sysctl_register_oid(&sysctl__net_smb_fs_tcprcvbuf);
+	sysctl_register_oid(&sysctl__net_smb_fs_tcpmaxbuf);
+	sysctl_register_oid(&sysctl__net_smb_fs_tcpautotune);
+	sysctl_register_oid(&sysctl__net_smb_fs_rcvq_pdus);
+	sysctl_register_oid(&sysctl__net_smb_fs_tcpcoalesce);
 
 	sysctl_register_oid(&sysctl__net_smb_fs_maxwrite);
 	sysctl_register_oid(&sysctl__net_smb_fs_maxread);
@@ -2641,6 +2759,21 @@ int smbfs_module_start(kmod_info_t *ki, void *data)
 	sysctl_register_oid(&sysctl__net_smb_fs_maxsegreadsize);
 	sysctl_register_oid(&sysctl__net_smb_fs_maxsegwritesize);
 
+	sysctl_register_oid(&sysctl__net_smb_fs_notify_debounce);
+	sysctl_register_oid(&sysctl__net_smb_fs_notify_events_rcvd);
+	sysctl_register_oid(&sysctl__net_smb_fs_notify_events_coalesced);
+	sysctl_register_oid(&sysctl__net_smb_fs_notify_events_delivered);
+	sysctl_register_oid(&sysctl__net_smb_fs_sidcache_hits);
+	sysctl_register_oid(&sysctl__net_smb_fs_sidcache_misses);
+	sysctl_register_oid(&sysctl__net_smb_fs_async_strategy);
+	sysctl_register_oid(&sysctl__net_smb_fs_rq_cache_max);
+	sysctl_register_oid(&sysctl__net_smb_fs_rq_cache_hits);
+	sysctl_register_oid(&sysctl__net_smb_fs_rq_cache_misses);
+	sysctl_register_oid(&sysctl__net_smb_fs_rq_cache_highwater);
+	sysctl_register_oid(&sysctl__net_smb_fs_brl_cache);
+	sysctl_register_oid(&sysctl__net_smb_fs_symcache_hits);
+	sysctl_register_oid(&sysctl__net_smb_fs_symcache_misses);
+
 	smbfs_install_sleep_wake_notifier();
 
 out:
@@ -2679,11 +2812,30 @@ int smbfs_module_stop(kmod_info_t *ki, void *data)
 	sysctl_unregister_oid(&sysctl__net_smb_fs_maxsegreadsize);
 	sysctl_unregister_oid(&sysctl__net_smb_fs_maxsegwritesize);
 
+	sysctl_unregister_oid(&sysctl__net_smb_fs_notify_debounce);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_notify_events_rcvd);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_notify_events_coalesced);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_notify_events_delivered);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_sidcache_hits);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_sidcache_misses);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_async_strategy);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_rq_cache_max);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_rq_cache_hits);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_rq_cache_misses);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_rq_cache_highwater);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_brl_cache);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_symcache_hits);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_symcache_misses);
+
 	sysctl_unregister_oid(&sysctl__net_smb_fs_maxwrite);
 	sysctl_unregister_oid(&sysctl__net_smb_fs_maxread);
 
 	sysctl_unregister_oid(&sysctl__net_smb_fs_tcpsndbuf);
 	sysctl_unregister_oid(&sysctl__net_smb_fs_tcprcvbuf);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_tcpmaxbuf);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_tcpautotune);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_rcvq_pdus);
+	sysctl_unregister_oid(&sysctl__net_smb_fs_tcpcoalesce);
 	
 	sysctl_unregister_oid(&sysctl__net_smb_fs_kern_deadtimer);
 	sysctl_unregister_oid(&sysctl__net_smb_fs_kern_hard_deadtimer);
@@ -2701,7 +2853,9 @@ int smbfs_module_stop(kmod_info_t *ki, void *data)
 	smbfs_remove_sleep_wake_notifier();
 
 	lck_rw_free(dev_rw_lck, dev_lck_grp);
+	smbfs_strategy_uninit();
 	smbfs_lock_uninit();	/* Free up the file system locks */
+	smb_rq_cache_uninit();
 	smbnet_lock_uninit();	/* Free up the network locks */
 	
 out:	
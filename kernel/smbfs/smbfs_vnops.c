@@ -49,6 +49,7 @@
 #include <libkern/OSAtomic.h>
 #include <sys/attr.h>
 #include <sys/kauth.h>
+#include <sys/sysctl.h>
 #include <sys/syslog.h>
 
 #include <sys/smb_apple.h>
@@ -864,7 +865,7 @@ smbfs_create_open(struct smb_share *share, vnode_t dvp, struct componentname *cn
 		}
 		
 		/* blow away statfs cache */
-		smp->sm_statfstime = 0;
+		smbfs_statfs_changed(smp, 0);
 	}
 	/* smbfs_nget returns a locked node, unlock it */
 	smbnode_unlock(VTOSMB(vp));		/* Release the smbnode lock */
@@ -2598,6 +2599,9 @@ smbfs_setattr(struct smb_share *share, vnode_t vp, struct vnode_attr *vap,
 			goto out;
 		} else {
 			smbfs_setsize(vp, (off_t)vap->va_data_size);
+			/* We extended or truncated it, adjust the free space until the next statfs */
+			smbfs_statfs_changed(VTOSMBFS(vp),
+								 (int64_t)vap->va_data_size - (int64_t)tsize);
 		}
         SMB_LOG_KTRACE(SMB_DBG_SMBFS_SETATTR | DBG_FUNC_NONE,
                        0xabc004, error, 0, 0, 0);
@@ -2909,14 +2913,376 @@ smbfs_vnop_blockmap(struct vnop_blockmap_args *ap)
 }
 
 /*
- * smbfs_vnop_strategy
+ * Async strategy support
  *
- *	struct buf *a_bp;
+ * Cluster read-ahead and pageouts hand us bufs marked B_ASYNC. On SMB 2/3 we
+ * send those as a single Read/Write and return right away, so the UBC can keep
+ * many clusters in flight. The iod calls smbfs_strategy_rq_done with the
+ * request lock held, so that just queues the io and the buf gets finished by
+ * smbfs_strategy_complete from a thread call. Anything that goes wrong,
+ * reconnects included, falls back to the synchronous path since it knows how
+ * to reopen the file. Dropping the last iocount can run VNOP_INACTIVE, which
+ * talks to the server, so the vnode_put is left to a second thread call
+ * rather than holding up the bufs queued behind it.
  */
-static int 
-smbfs_vnop_strategy(struct vnop_strategy_args *ap)
+static int smbfs_async_strategy = 1;
+
+SYSCTL_DECL(_net_smb_fs);
+SYSCTL_INT(_net_smb_fs, OID_AUTO, async_strategy, CTLFLAG_RW, &smbfs_async_strategy, 0, "");
+
+struct smbfs_strategy_io {
+	TAILQ_ENTRY(smbfs_strategy_io) sio_link;
+	struct buf			*sio_bp;
+	vnode_t				sio_vp;			/* holds an iocount */
+	struct smb_share	*sio_share;		/* holds a reference */
+	struct smb_rq		*sio_rqp;
+	struct smb2_rw_rq	sio_rw;
+	caddr_t				sio_addr;		/* mapped buf */
+	off_t				sio_offset;
+	user_ssize_t		sio_len;		/* amount sent to the server */
+};
+
+static TAILQ_HEAD(, smbfs_strategy_io) smbfs_strategy_queue =
+	TAILQ_HEAD_INITIALIZER(smbfs_strategy_queue);
+static lck_mtx_t *smbfs_strategy_lock = NULL;
+static thread_call_t smbfs_strategy_call = NULL;
+static TAILQ_HEAD(, smbfs_strategy_io) smbfs_strategy_rele_queue =
+	TAILQ_HEAD_INITIALIZER(smbfs_strategy_rele_queue);
+static thread_call_t smbfs_strategy_rele_call = NULL;
+
+static int smbfs_strategy(struct buf *bp, int allow_async);
+
+/*
+ * Called from the iod when the reply arrives or the request is errored out.
+ */
+static void
+smbfs_strategy_rq_done(void *arg)
+{
+	struct smbfs_strategy_io *sio = arg;
+
+	lck_mtx_lock(smbfs_strategy_lock);
+	TAILQ_INSERT_TAIL(&smbfs_strategy_queue, sio, sio_link);
+	lck_mtx_unlock(smbfs_strategy_lock);
+	thread_call_enter(smbfs_strategy_call);
+}
+
+static void
+smbfs_strategy_io_free(struct smbfs_strategy_io *sio)
+{
+	int error;
+
+	if (sio->sio_rw.auio != NULL) {
+		uio_free(sio->sio_rw.auio);
+	}
+	if (sio->sio_addr && (error = buf_unmap(sio->sio_bp))) {
+		panic("smbfs_strategy_io_free: buf_unmap() failed with (%d)", error);
+	}
+	if (sio->sio_share != NULL) {
+		smb_share_rele(sio->sio_share, NULL);
+	}
+	if (sio->sio_vp != NULL) {
+		vnode_put(sio->sio_vp);
+	}
+	SMB_FREE(sio, M_SMBTEMP);
+}
+
+/*
+ * Same as smbfs_strategy_io_free, but the vnode_put and the free happen on
+ * smbfs_strategy_rele_call.
+ */
+static void
+smbfs_strategy_io_rele(struct smbfs_strategy_io *sio)
+{
+	if (sio->sio_share != NULL) {
+		smb_share_rele(sio->sio_share, NULL);
+		sio->sio_share = NULL;
+	}
+	lck_mtx_lock(smbfs_strategy_lock);
+	TAILQ_INSERT_TAIL(&smbfs_strategy_rele_queue, sio, sio_link);
+	lck_mtx_unlock(smbfs_strategy_lock);
+	thread_call_enter(smbfs_strategy_rele_call);
+}
+
+/*
+ * Try to start the I/O for this buf without waiting for it. Returns zero if
+ * the buf will be finished by smbfs_strategy_complete, otherwise the caller
+ * needs to do the I/O synchronously.
+ */
+static int
+smbfs_strategy_async(struct buf *bp)
+{
+	vnode_t vp = buf_vnode(bp);
+	struct smbnode *np = VTOSMB(vp);
+	int32_t bflags = buf_flags(bp);
+	struct smbfs_strategy_io *sio = NULL;
+	struct smb_share *share;
+	off_t offset = ((off_t)buf_blkno(bp)) * PAGE_SIZE;
+	user_ssize_t len = buf_count(bp);
+	uint32_t maxio;
+	SMBFID fid = 0;
+	int error;
+
+	if (!smbfs_async_strategy || (smbfs_strategy_call == NULL)) {
+		return ENOTSUP;
+	}
+	/* Let the synchronous path deal with reopens */
+	if (np->f_openState & (kNeedRevoke | kNeedReopen | kInReopen)) {
+		return EBADF;
+	}
+	if (bflags & B_READ) {
+		/* Reading past the eof is just zero filling */
+		if (offset >= (off_t)np->n_size) {
+			return EINVAL;
+		}
+		len = MIN(len, (off_t)np->n_size - offset);
+	} else if (offset > (off_t)np->n_size) {
+		/* Hole in the file, smbfs_dowrite needs to zero extend it first */
+		return EINVAL;
+	}
+
+	share = smb_get_share_with_reference(VTOSMBFS(vp));
+	maxio = (bflags & B_READ) ? SSTOVC(share)->vc_rxmax : SSTOVC(share)->vc_wxmax;
+	if (!(SSTOVC(share)->vc_flags & SMBV_SMB2) || (len > maxio)) {
+		smb_share_rele(share, NULL);
+		return ENOTSUP;
+	}
+
+	SMB_MALLOC(sio,
+			   struct smbfs_strategy_io *,
+			   sizeof(struct smbfs_strategy_io),
+			   M_SMBTEMP,
+			   M_WAITOK | M_ZERO);
+	if (sio == NULL) {
+		smb_share_rele(share, NULL);
+		return ENOMEM;
+	}
+	sio->sio_bp = bp;
+	sio->sio_share = share;
+	sio->sio_offset = offset;
+	sio->sio_len = len;
+
+	/* The completion can happen after our caller drops its iocount */
+	error = vnode_get(vp);
+	if (error) {
+		goto bad;
+	}
+	sio->sio_vp = vp;
+
+	error = buf_map(bp, &sio->sio_addr);
+	if (error) {
+		sio->sio_addr = 0;
+		goto bad;
+	}
+
+	sio->sio_rw.auio = uio_create(1, offset, UIO_SYSSPACE,
+								  (bflags & B_READ) ? UIO_READ : UIO_WRITE);
+	if (sio->sio_rw.auio == NULL) {
+		error = ENOMEM;
+		goto bad;
+	}
+	uio_addiov(sio->sio_rw.auio, CAST_USER_ADDR_T(sio->sio_addr), len);
+
+	/* See smbfs_strategy on why we go looking for a file ref */
+	if (FindFileRef(vp, buf_proc(bp), (bflags & B_READ) ? kAccessRead : kAccessWrite,
+					kCheckDenyOrLocks, offset, len, NULL, &fid)) {
+		fid = np->f_fid;
+	}
+	sio->sio_rw.fid = fid;
+
+	lck_rw_lock_shared(&np->n_name_rwlock);
+	SMB_LOG_IO("%s: async %s offset %lld, size %lld, bflags 0x%x\n",
+			   np->n_name, (bflags & B_READ) ? "Read":"Write", offset,
+			   (int64_t)len, bflags);
+	lck_rw_unlock_shared(&np->n_name_rwlock);
+
+	error = smb2_smb_rw_async(share, &sio->sio_rw, (bflags & B_READ) ? 1 : 0,
+							  smbfs_strategy_rq_done, sio, &sio->sio_rqp);
+	if (error) {
+		goto bad;
+	}
+	/* The sio belongs to smbfs_strategy_complete now */
+	return 0;
+
+bad:
+	smbfs_strategy_io_free(sio);
+	return error;
+}
+
+/*
+ * Redo a failed async buf synchronously. This can block for as long as a
+ * reconnect takes, so it gets its own short lived thread rather than holding
+ * up the completions queued behind it.
+ */
+static void
+smbfs_strategy_retry_thread(void *arg)
+{
+	struct smbfs_strategy_io *sio = arg;
+
+	(void)smbfs_strategy(sio->sio_bp, FALSE);
+	smbfs_strategy_io_free(sio);
+}
+
+/*
+ * Finish a buf started by smbfs_strategy_async.
+ */
+static void
+smbfs_strategy_complete(struct smbfs_strategy_io *sio)
+{
+	struct buf *bp = sio->sio_bp;
+	vnode_t vp = sio->sio_vp;
+	struct smbnode *np = VTOSMB(vp);
+	int32_t bflags = buf_flags(bp);
+	user_ssize_t resid = 0;
+	thread_t thread;
+	int error;
+
+	error = smb2_smb_rw_async_reply(sio->sio_rqp, &sio->sio_rw,
+									(bflags & B_READ) ? 1 : 0, &resid);
+	sio->sio_rqp = NULL;
+
+	if (bflags & B_READ) {
+		if (error == ENODATA) {
+			/* ntstatus holds the EOF error */
+			error = 0;
+			resid = 0;
+		}
+		if ((error == 0) && (resid < buf_count(bp))) {
+			/* Short read or read at the eof, zero out the rest of the buf */
+			bzero((caddr_t)(sio->sio_addr + resid), (size_t)(buf_count(bp) - resid));
+		}
+	} else if ((error == 0) && (resid != sio->sio_len)) {
+		/* Short write, have the synchronous path redo it */
+		error = EIO;
+	}
+
+	if (error) {
+		lck_rw_lock_shared(&np->n_name_rwlock);
+		SMB_LOG_IO("%s: async %s failed with %d, retrying synchronously\n",
+				   np->n_name, (bflags & B_READ) ? "READ" : "WRITE", error);
+		lck_rw_unlock_shared(&np->n_name_rwlock);
+
+		/* Unmap it before the synchronous path maps it again */
+		uio_free(sio->sio_rw.auio);
+		sio->sio_rw.auio = NULL;
+		if ((error = buf_unmap(bp))) {
+			panic("smbfs_strategy_complete: buf_unmap() failed with (%d)", error);
+		}
+		sio->sio_addr = 0;
+
+		if (kernel_thread_start((thread_continue_t)smbfs_strategy_retry_thread,
+								sio, &thread) == KERN_SUCCESS) {
+			thread_deallocate(thread);
+			return;
+		}
+		/* No thread, just do it here */
+		smbfs_strategy_retry_thread(sio);
+		return;
+	}
+
+	if (!(bflags & B_READ)) {
+		/* Save last time we wrote data */
+		nanouptime(&np->n_last_write_time);
+
+		lck_mtx_lock(&np->f_clusterWriteLock);
+		if ((u_quad_t)(sio->sio_offset + sio->sio_len) >= np->n_size) {
+			/* We finished writing past the eof reset the flag */
+			nanouptime(&np->n_sizetime);
+			np->waitOnClusterWrite = FALSE;
+		}
+		lck_mtx_unlock(&np->f_clusterWriteLock);
+	}
+
+	buf_seterror(bp, 0);
+	buf_setresid(bp, 0);
+
+	uio_free(sio->sio_rw.auio);
+	sio->sio_rw.auio = NULL;
+	if ((error = buf_unmap(bp))) {
+		panic("smbfs_strategy_complete: buf_unmap() failed with (%d)", error);
+	}
+	sio->sio_addr = 0;
+
+	buf_biodone(bp);
+	smbfs_strategy_io_rele(sio);
+}
+
+static void
+smbfs_strategy_thread_call(thread_call_param_t param0, thread_call_param_t param1)
+{
+#pragma unused(param0, param1)
+	struct smbfs_strategy_io *sio;
+
+	for (;;) {
+		lck_mtx_lock(smbfs_strategy_lock);
+		sio = TAILQ_FIRST(&smbfs_strategy_queue);
+		if (sio != NULL) {
+			TAILQ_REMOVE(&smbfs_strategy_queue, sio, sio_link);
+		}
+		lck_mtx_unlock(smbfs_strategy_lock);
+		if (sio == NULL) {
+			break;
+		}
+		smbfs_strategy_complete(sio);
+	}
+}
+
+static void
+smbfs_strategy_rele_thread_call(thread_call_param_t param0, thread_call_param_t param1)
+{
+#pragma unused(param0, param1)
+	struct smbfs_strategy_io *sio;
+
+	for (;;) {
+		lck_mtx_lock(smbfs_strategy_lock);
+		sio = TAILQ_FIRST(&smbfs_strategy_rele_queue);
+		if (sio != NULL) {
+			TAILQ_REMOVE(&smbfs_strategy_rele_queue, sio, sio_link);
+		}
+		lck_mtx_unlock(smbfs_strategy_lock);
+		if (sio == NULL) {
+			break;
+		}
+		smbfs_strategy_io_free(sio);
+	}
+}
+
+void
+smbfs_strategy_init(void)
+{
+	smbfs_strategy_lock = lck_mtx_alloc_init(smbfs_mutex_group, smbfs_lock_attr);
+	smbfs_strategy_call = thread_call_allocate(smbfs_strategy_thread_call, NULL);
+	smbfs_strategy_rele_call = thread_call_allocate(smbfs_strategy_rele_thread_call, NULL);
+}
+
+void
+smbfs_strategy_uninit(void)
+{
+	/* No mounts left, so nothing can still be queued */
+	if (smbfs_strategy_call != NULL) {
+		thread_call_cancel_wait(smbfs_strategy_call);
+		thread_call_free(smbfs_strategy_call);
+		smbfs_strategy_call = NULL;
+	}
+	if (smbfs_strategy_rele_call != NULL) {
+		thread_call_cancel_wait(smbfs_strategy_rele_call);
+		thread_call_free(smbfs_strategy_rele_call);
+		smbfs_strategy_rele_call = NULL;
+	}
+	if (smbfs_strategy_lock != NULL) {
+		lck_mtx_free(smbfs_strategy_lock, smbfs_mutex_group);
+		smbfs_strategy_lock = NULL;
+	}
+}
+
+/*
+ * smbfs_strategy
+ *
+ * Do the I/O for the buf. If allow_async is set and the buf is B_ASYNC we try
+ * to start it without waiting, otherwise we do it on this thread.
+ */
+static int
+smbfs_strategy(struct buf *bp, int allow_async)
 {
-	struct buf *bp = ap->a_bp;
 	vnode_t vp = buf_vnode(bp);
 	int32_t bflags = buf_flags(bp);
 	struct smbnode *np = VTOSMB(vp);
@@ -2956,6 +3322,12 @@ smbfs_vnop_strategy(struct vnop_strategy_args *ap)
         goto exit;
     }
 
+	if (allow_async && (bflags & B_ASYNC) && (smbfs_strategy_async(bp) == 0)) {
+		/* smbfs_strategy_complete will finish the buf */
+		SMB_LOG_KTRACE(SMB_DBG_STRATEGY | DBG_FUNC_END, 0, 0, 0, 0, 0);
+		return (0);
+	}
+
     SMB_MALLOC(fap,
                struct smbfattr *,
                sizeof(struct smbfattr),
@@ -3162,6 +3534,17 @@ exit:
     return (error);
 }
 
+/*
+ * smbfs_vnop_strategy
+ *
+ *	struct buf *a_bp;
+ */
+static int
+smbfs_vnop_strategy(struct vnop_strategy_args *ap)
+{
+	return (smbfs_strategy(ap->a_bp, TRUE));
+}
+
 /*
  * smbfs_vnop_read
  *
@@ -3641,6 +4024,8 @@ exit:
 		}
         
 		smbfs_setsize(vp, uio_offset(uio));
+		/* We extended it, adjust the free space until the next statfs */
+		smbfs_statfs_changed(VTOSMBFS(vp), (int64_t)uio_offset(uio) - (int64_t)originalEOF);
         
         lck_rw_lock_shared(&np->n_name_rwlock);
 		SMB_LOG_IO("%s: Calling smbfs_setsize, old eof = %lld  new eof = %lld time %ld:%ld\n",
@@ -4004,7 +4389,7 @@ smbfs_create(struct smb_share *share, struct vnop_create_args *ap, char *target,
 bad:
 	/* if success, blow away statfs cache */
 	if (!error)
-		smp->sm_statfstime = 0;
+		smbfs_statfs_changed(smp, 0);
 
     SMB_LOG_KTRACE(SMB_DBG_SMBFS_CREATE | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
@@ -4182,10 +4567,13 @@ out:
 	}
     
 	if (!error) {
+		if (vnode_vtype(vp) == VLNK) {
+			smbfs_symcache_remove(smp, np->n_ino);
+		}
 		/* Not sure why we do this here. Leave it for now. */
 		(void) vnode_recycle(vp);
 		/* if success, blow away statfs cache */
-		smp->sm_statfstime = 0;
+		smbfs_statfs_changed(smp, 0);
 	}
 
 done:
@@ -4314,7 +4702,7 @@ smbfs_rmdir(struct smb_share *share, vnode_t dvp, vnode_t vp,
 bad:
 	/* if success, blow away statfs cache */
 	if (!error) {
-		smp->sm_statfstime = 0;
+		smbfs_statfs_changed(smp, 0);
 		(void) vnode_recycle(vp);
 	}
 	return (error);
@@ -4862,7 +5250,7 @@ smbfs_vnop_rename(struct vnop_rename_args *ap)
 		smbfs_attr_touchdir(tdnp, (share->ss_fstype == SMB_FS_FAT));
 	/* if success, blow away statfs cache */
 	if (!error) {
-		smp->sm_statfstime = 0;
+		smbfs_statfs_changed(smp, 0);
         
         /* Invalidate negative cache entries in destination dir */
 		if (tdnp->n_flag & NNEGNCENTRIES) {
@@ -5011,6 +5399,9 @@ smbfs_vnop_readlink(struct vnop_readlink_args *ap)
         (use_cached_data || ((ts.tv_sec - np->n_symlink_cache_timer) <= attrtimeo))) {
         /* Cached data is still valid */
 		error = uiomove(np->n_symlink_target, (int)np->n_symlink_target_len, ap->a_uio);
+	} else if (smbfs_symcache_lookup(np)) {
+		/* Another node for this link already read it */
+		error = uiomove(np->n_symlink_target, (int)np->n_symlink_target_len, ap->a_uio);
 	} else if ((np->n_dosattr & SMB_EFA_REPARSE_POINT) &&
                (np->n_reparse_tag == IO_REPARSE_TAG_SYMLINK)) {
         error = smbfs_smb_reparse_read_symlink(share, np, ap->a_uio, ap->a_context);
@@ -5134,7 +5525,7 @@ bad:
 		SMB_FREE(name, M_SMBNODENAME);
 	}
 	/* if success, blow away statfs cache */
-	smp->sm_statfstime = 0;
+	smbfs_statfs_changed(smp, 0);
 exit:
 	smb_share_rele(share, ap->a_context);
 	smbnode_unlock(dnp);
@@ -5224,7 +5615,7 @@ smbfs_fsync(struct smb_share *share, vnode_t vp, int waitfor, int ubc_flags,
 	}
 	error = smbfs_smb_fsync(share, VTOSMB(vp), context);
 	if (!error)
-		VTOSMBFS(vp)->sm_statfstime = 0;
+		smbfs_statfs_changed(VTOSMBFS(vp), 0);
 
 	SMB_LOG_KTRACE(SMB_DBG_SMBFS_FSYNC | DBG_FUNC_END, error, 0, 0, 0, 0);
     return (error);
@@ -5402,6 +5793,14 @@ static int smbfs_vnop_pathconf(struct vnop_pathconf_args *ap)
     return (error);
 }
 
+/*
+ * Forks opened for byte range locks ask for a write lease. While we hold it
+ * the locks are only kept on this client, see smbfs_cached_byterange_lock.
+ */
+static int smbfs_brl_cache = 1;
+
+SYSCTL_INT(_net_smb_fs, OID_AUTO, brl_cache, CTLFLAG_RW, &smbfs_brl_cache, 0, "");
+
 /*
  * smbfs_vnop_ioctl - smbfs vnodeop entry point
  *	vnode_t a_vp;
@@ -5648,6 +6047,10 @@ static int32_t smbfs_vnop_ioctl(struct vnop_ioctl_args *ap)
             dptr = NULL;
             error = smb2_smb_dur_handle_init(share, np, &dur_handle);
             if (!error) {
+                if (smbfs_brl_cache) {
+                    /* A write lease lets us cache the byte range locks */
+                    dur_handle.flags |= SMB2_LEASE_REQUEST_WRITE;
+                }
                 dptr = &dur_handle;
             }
             
@@ -5703,12 +6106,28 @@ static int32_t smbfs_vnop_ioctl(struct vnop_ioctl_args *ap)
 		 */
 		timo = 0;
 
+		/* Under a write lease the lock may not need to go to the server */
+		if (SSTOVC(share)->vc_flags & SMBV_SMB2) {
+			error = smbfs_cached_byterange_lock(np, fndEntry, pb->offset, 
+												pb->length, pb->unLockFlag, 
+												lck_pid);
+			if (error == 0) {
+				pb->retRangeStart = pb->offset;
+				break;
+			}
+			if (error != ENOTSUP) {
+				goto exit;
+			}
+		}
+
 		error = smbfs_smb_lock(share, flags, fid, lck_pid, pb->offset, 
 							   pb->length, timo, ap->a_context);
 		if (error == 0) {
 			/* Save/remove lock info for use in read/write to determine what fork to use */
+			lck_mtx_lock(&np->f_openDenyListLock);
 			AddRemoveByteRangeLockEntry (fndEntry, pb->offset, pb->length,
 										 pb->unLockFlag, lck_pid);
+			lck_mtx_unlock(&np->f_openDenyListLock);
 			/* return the offset to the first byte of the lock */
 			pb->retRangeStart = pb->offset;
 		} else if ((!pb->unLockFlag) && (error == EACCES)) {
@@ -5716,8 +6135,10 @@ static int32_t smbfs_vnop_ioctl(struct vnop_ioctl_args *ap)
 			 * Need to see if we are locking against ourself, so we can return 
 			 * the correct error.
 			 */
+			lck_mtx_lock(&np->f_openDenyListLock);
 			if (FindByteRangeLockEntry(fndEntry, pb->offset, pb->length, lck_pid))
 				error = EAGAIN;
+			lck_mtx_unlock(&np->f_openDenyListLock);
 		}
 	}
 	break;
@@ -5863,7 +6284,14 @@ smbfs_vnop_advlock(struct vnop_advlock_args *ap)
 	 * use the same value.
 	 */
 	lck_pid = 1;
-	/* Remember that we are always using the share open file at this point */
+	/* 
+	 * Remember that we are always using the share open file at this point.
+	 * These locks don't go through smbfs_cached_byterange_lock. The shared
+	 * fork never asks for a write lease, and a flock is a single whole file
+	 * lock, so there is nothing to batch. POSIX fcntl locks only get here on
+	 * servers with the UNIX fcntl lock capability. Everywhere else we don't
+	 * advertise VOL_CAP_INT_ADVLOCK and the VFS keeps those locks locally.
+	 */
 	switch(ap->a_op) {
 	case F_SETLK:
 		if (! np->f_smbflock) {
@@ -6587,7 +7015,7 @@ smbfs_vnop_copyfile(struct vnop_copyfile_args *ap)
 	smbfs_attr_touchdir(tdnp, (share->ss_fstype == SMB_FS_FAT));
     
 	/* blow away statfs cache */
-    smp->sm_statfstime = 0;
+    smbfs_statfs_changed(smp, 0);
     
     /* Invalidate negative cache entries in destination dir */
     if (tdnp->n_flag & NNEGNCENTRIES) {
@@ -7246,6 +7674,7 @@ smbfs_vnop_getxattr(struct vnop_getxattr_args *ap)
     uint64_t strmsize = 0;
     uint64_t strm_alloc_size = 0;
     size_t afpsize = 0;
+	int rfrk_expired = FALSE;
     uint8_t	afpinfo[60];
     enum vtype vnode_type = VREG; /* Streams are always files */
 
@@ -7339,6 +7768,24 @@ smbfs_vnop_getxattr(struct vnop_getxattr_args *ap)
 
         /* Check to see if the cache has timed out */
 		SMB_CACHE_TIME(ts, np, attrtimeo);
+		
+		/*
+		 * If the resource fork size has expired as well, refresh both with a
+		 * single stream information query. It updates the resource fork size
+		 * and, when the file has no AFP_AfpInfo stream, negative caches the
+		 * Finder info so we don't have to open a stream that isn't there.
+		 */
+		if (((ts.tv_sec - np->finfo_cache_timer) > attrtimeo) &&
+			!use_cached_data && vnode_isreg(vp)) {
+			lck_mtx_lock(&np->rfrkMetaLock);
+			rfrk_expired = ((ts.tv_sec - np->rfrk_cache_timer) > attrtimeo);
+			lck_mtx_unlock(&np->rfrkMetaLock);
+			
+			if (rfrk_expired) {
+				(void)smb_get_rsrcfrk_size(share, vp, ap->a_context);
+			}
+		}
+		
 		if (((ts.tv_sec - np->finfo_cache_timer) > attrtimeo) &&
             !use_cached_data) {
             /* Cache has expired go get the finder information. */
@@ -7552,6 +7999,7 @@ smbfs_vnop_getnamedstream(struct vnop_getnamedstream_args* ap)
     uint32_t stream_flags = 0;
 	int use_cached_data = 0;
     enum vtype vnode_type = VREG;
+	int have_rfrk_size = FALSE;
 
 	/* Lock the parent while we look for the stream */
 	if ((error = smbnode_lock(VTOSMB(vp), SMBFS_EXCLUSIVE_LOCK)))
@@ -7652,14 +8100,36 @@ smbfs_vnop_getnamedstream(struct vnop_getnamedstream_args* ap)
 	 * If smbfs_smb_qstreaminfo returns no error and we do not have the stream 
 	 * node in our hash table then create the stream node, using the data node 
 	 * to fill in all information except the size.
+	 *
+	 * The data node's resource size comes from the same stream list, so if we 
+	 * do not have the stream node yet and that size was fetched recently 
+	 * (readdirattr, getxattr or an earlier lookup) just use it. A zero size 
+	 * could also mean there is no resource stream, so ask the server then.
 	 */
-    error = smbfs_smb_qstreaminfo(share, np, vnode_type,
-                                  NULL, 0,
-                                  sname,
-                                  NULL, NULL,
-                                  &strmsize, &strm_alloc_size,
-                                  &stream_flags, NULL,
-                                  ap->a_context);
+	if (*svpp == NULL) {
+		SMB_CACHE_TIME(ts, np, attrtimeo);
+		lck_mtx_lock(&np->rfrkMetaLock);
+		if ((np->rfrk_cache_timer != 0) && (np->rfrk_size != 0) &&
+			((ts.tv_sec - np->rfrk_cache_timer) <= attrtimeo)) {
+			strmsize = np->rfrk_size;
+			strm_alloc_size = np->rfrk_alloc_size;
+			have_rfrk_size = TRUE;
+		}
+		lck_mtx_unlock(&np->rfrkMetaLock);
+	}
+	
+	if (have_rfrk_size) {
+		error = 0;
+	}
+	else {
+		error = smbfs_smb_qstreaminfo(share, np, vnode_type,
+									  NULL, 0,
+									  sname,
+									  NULL, NULL,
+									  &strmsize, &strm_alloc_size,
+									  &stream_flags, NULL,
+									  ap->a_context);
+	}
 	if (error && (*svpp == NULL)) {
 		error = ENOATTR;
 		goto exit;		
@@ -27,9 +27,15 @@
 
 #include <algorithm>
 #include <vector>
+#include <list>
+#include <map>
+#include <new>
 #include <cstdlib>
 #include <assert.h>
 #include <string>
+#include <pthread.h>
+#include <time.h>
+#include <dispatch/dispatch.h>
 
 
 #include "LsarLookup.h"
@@ -41,6 +47,462 @@ extern "C" {
 #include <dce/dcethread.h>
 }
 
+/* How long an unused policy handle stays open, in seconds */
+#define LSA_POLICY_IDLE_TIMEOUT		60
+/* Most unused policy handles we keep open */
+#define LSA_POLICY_MAX_IDLE			4
+/* How often we look for policy handles that have been idle too long, in seconds */
+#define LSA_POLICY_REAP_INTERVAL	30
+/* How long a lookup result is good for, in seconds */
+#define LSA_CACHE_TTL				600
+#define LSA_CACHE_MAX_ENTRIES		1024
+/* Most names or sids we put in a single lookup request */
+#define LSA_LOOKUP_MAX_BATCH		1000
+
+/*
+ * An open binding to a server's lsarpc pipe along with a policy handle that
+ * allows lookups. Opening these costs several round trips, so once a lookup
+ * is done we keep them around for a little while.
+ */
+struct lsa_connection
+{
+	std::string server;
+	WCHAR * UTF16ServerName;
+	rpc_binding binding;
+	LSAPR_HANDLE PolicyHandle;
+	time_t last_used;
+};
+
+static pthread_mutex_t lsa_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::list<lsa_connection *> lsa_idle_pool;
+static dispatch_source_t lsa_pool_timer = NULL;
+
+/*
+ * Cache of lookup results, keyed by server and either the account name or
+ * the sid. Most recently used entries are kept at the front of the list.
+ */
+struct lsa_cache_entry
+{
+	std::string key;
+	ntsid_t sid;
+	std::string name;
+	uint32_t use;
+	time_t expires;
+};
+
+typedef std::list<lsa_cache_entry> lsa_cache_list;
+
+static pthread_mutex_t lsa_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static lsa_cache_list lsa_cache;
+static std::map<std::string, lsa_cache_list::iterator> lsa_cache_index;
+
+/*
+ * Swap in a memory pool for the RPC stubs to allocate out of and put the
+ * old allocator back when we are done. Everything the stubs returned is
+ * freed along with the pool.
+ */
+struct lsa_rpc_allocator
+{
+	lsa_rpc_allocator() : mempool(rpc_mempool::allocate(0)) {
+		memset(&allocator, 0, sizeof(allocator));
+		memset(&old_allocator, 0, sizeof(old_allocator));
+		if (mempool) {
+			allocator.p_allocate = rpc_pool_allocate;
+			allocator.p_free = rpc_pool_free;
+			allocator.p_context = (idl_void_p_t)mempool;
+			rpc_ss_swap_client_alloc_free_ex(&allocator, &old_allocator);
+		}
+	}
+	
+	~lsa_rpc_allocator() {
+		if (mempool) {
+			rpc_ss_swap_client_alloc_free_ex(&old_allocator, &allocator);
+			rpc_mempool::destroy(mempool);
+		}
+	}
+	
+	rpc_mempool * mempool;
+	rpc_ss_allocator_t allocator;
+	rpc_ss_allocator_t old_allocator;
+	
+private:
+	lsa_rpc_allocator(const lsa_rpc_allocator&);
+	lsa_rpc_allocator& operator=(const lsa_rpc_allocator&);
+};
+
+static std::string LsaLowerCase(const char *str)
+{
+	std::string lower(str ? str : "");
+	
+	/* The server compares names case insensitively, so should we */
+	for (std::string::iterator it = lower.begin(); it != lower.end(); ++it) {
+		if ((*it >= 'A') && (*it <= 'Z')) {
+			*it = *it - 'A' + 'a';
+		}
+	}
+	return lower;
+}
+
+static std::string NameCacheKey(const std::string &server, const char *name)
+{
+	return "N:" + LsaLowerCase(server.c_str()) + ":" + LsaLowerCase(name);
+}
+
+static std::string SidCacheKey(const std::string &server, const ntsid_t *sid)
+{
+	char buf[32];
+	uint64_t auth = 0;
+	std::string key("S:" + LsaLowerCase(server.c_str()) + ":S-");
+	int ii;
+	
+	for (ii = 0; ii < 6; ii++) {
+		auth = (auth << 8) | sid->sid_authority[ii];
+	}
+	snprintf(buf, sizeof(buf), "%u-%llu", sid->sid_kind, (unsigned long long)auth);
+	key += buf;
+	for (ii = 0; (ii < sid->sid_authcount) && (ii < KAUTH_NTSID_MAX_AUTHORITIES); ii++) {
+		snprintf(buf, sizeof(buf), "-%u", sid->sid_authorities[ii]);
+		key += buf;
+	}
+	return key;
+}
+
+static bool LsaCacheLookup(const std::string &key, lsa_cache_entry &entry)
+{
+	std::map<std::string, lsa_cache_list::iterator>::iterator which;
+	bool found = false;
+	
+	pthread_mutex_lock(&lsa_cache_lock);
+	which = lsa_cache_index.find(key);
+	if (which != lsa_cache_index.end()) {
+		lsa_cache_list::iterator it = which->second;
+		
+		if (it->expires <= time(NULL)) {
+			/* Stale, toss it */
+			lsa_cache.erase(it);
+			lsa_cache_index.erase(which);
+		} else {
+			/* Move it to the front of the line */
+			lsa_cache.splice(lsa_cache.begin(), lsa_cache, it);
+			entry = *it;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&lsa_cache_lock);
+	return found;
+}
+
+static void LsaCacheEnter(const std::string &key, const ntsid_t *sid, 
+						  const std::string &name, uint32_t use)
+{
+	std::map<std::string, lsa_cache_list::iterator>::iterator which;
+	lsa_cache_entry entry;
+	
+	entry.key = key;
+	entry.sid = *sid;
+	entry.name = name;
+	entry.use = use;
+	entry.expires = time(NULL) + LSA_CACHE_TTL;
+	
+	pthread_mutex_lock(&lsa_cache_lock);
+	which = lsa_cache_index.find(key);
+	if (which != lsa_cache_index.end()) {
+		lsa_cache.erase(which->second);
+		lsa_cache_index.erase(which);
+	}
+	lsa_cache.push_front(entry);
+	lsa_cache_index[key] = lsa_cache.begin();
+	
+	/* Drop the least recently used entries */
+	while (lsa_cache.size() > LSA_CACHE_MAX_ENTRIES) {
+		lsa_cache_index.erase(lsa_cache.back().key);
+		lsa_cache.pop_back();
+	}
+	pthread_mutex_unlock(&lsa_cache_lock);
+}
+
+void FlushNetworkAccountCache(void)
+{
+	pthread_mutex_lock(&lsa_cache_lock);
+	lsa_cache_index.clear();
+	lsa_cache.clear();
+	pthread_mutex_unlock(&lsa_cache_lock);
+}
+
+static void CloseLsaConnection(lsa_connection *conn)
+{
+    error_status_t rpc_status = rpc_s_ok;
+	
+	/* Ignore any errors, nothing we could do about them anyways */
+	if (conn->PolicyHandle) {
+		DCETHREAD_TRY
+			(void)LsarClose(conn->binding.get(), &conn->PolicyHandle, &rpc_status);
+		DCETHREAD_CATCH_ALL(exc)
+			rpc_status = rpc_exception_status(exc);
+		DCETHREAD_ENDTRY
+	}
+	if (conn->UTF16ServerName) {
+		free(conn->UTF16ServerName);
+	}
+	delete conn;
+}
+
+static lsa_connection * OpenLsaConnection(const char *ServerName, NTSTATUS *status)
+{
+	LSAPR_OBJECT_ATTRIBUTES ObjectAttributes;
+	SECURITY_QUALITY_OF_SERVICE SecurityQualityOfService;
+	ACCESS_MASK DesiredAccess = 0x00000800;
+    NTSTATUS nt_status = STATUS_SUCCESS;
+    error_status_t rpc_status = rpc_s_ok;
+	lsa_connection *conn;
+	
+	conn = new (std::nothrow) lsa_connection;
+	if (!conn) {
+		*status = STATUS_NO_MEMORY;
+		return NULL;
+	}
+	conn->server = ServerName ? ServerName : "";
+	conn->PolicyHandle = NULL;
+	conn->last_used = 0;
+	conn->UTF16ServerName = SMBConvertFromUTF8ToUTF16(ServerName, 1024, 0);
+	if (!conn->UTF16ServerName) {
+		CloseLsaConnection(conn);
+		*status = STATUS_NO_MEMORY;
+		return NULL;
+	}
+	
+	rpc_binding binding = make_rpc_binding(ServerName, "lsarpc");
+	conn->binding.swap(binding);
+	if (conn->binding.get() == NULL) {
+        SMBLogInfo("make_rpc_binding failed", ASL_LEVEL_DEBUG);
+		CloseLsaConnection(conn);
+		*status = STATUS_UNSUCCESSFUL;
+		return NULL;
+	}
+	
+	memset(&ObjectAttributes, 0, sizeof(ObjectAttributes));
+	/*
+	 * We could just leave ObjectAttributes zeroed out since that works. Notice
+	 * that windows fills in the SecurityQualityOfService so lets do the same
+	 * for now.
+	 */
+	SecurityQualityOfService.Length = 12; /* Size of SecurityQualityOfService */
+	SecurityQualityOfService.ImpersonationLevel = SecurityImpersonation;
+	SecurityQualityOfService.ContextTrackingMode = 1;
+	SecurityQualityOfService.EffectiveOnly = 0;
+	ObjectAttributes.Length = 24;	 /* Size of ObjectAttributes */
+	ObjectAttributes.SecurityQualityOfService = &SecurityQualityOfService;
+	
+	DCETHREAD_TRY
+		/* 
+		 * The second parameter in LsarOpenPolicy2 is the SystemName, window always
+		 * puts the server name in here, it helps with tracing so we will also. Since
+		 * the docs say the following it should hurt:
+		 * SystemName: This parameter does not have any effect on message processing 
+		 *			    in any environment. It MUST be ignored on receipt.
+		*/
+		nt_status = LsarOpenPolicy2(conn->binding.get(), conn->UTF16ServerName, 
+									&ObjectAttributes, DesiredAccess, 
+									&conn->PolicyHandle, &rpc_status);
+	DCETHREAD_CATCH_ALL(exc)
+		/* Catch any exceptions */
+		rpc_status = rpc_exception_status(exc);
+	DCETHREAD_ENDTRY
+	
+	if (rpc_status != rpc_s_ok) {
+        SMBLogInfo("RPC to lsarpc gave rpc status of %#08x", ASL_LEVEL_DEBUG, rpc_status);
+		nt_status = STATUS_UNSUCCESSFUL;
+	} else if (!NT_SUCCESS(nt_status)) {
+        SMBLogInfo("RPC to lsarpc gave nt status of %#08x", ASL_LEVEL_DEBUG, nt_status);
+	}
+	if (!NT_SUCCESS(nt_status)) {
+		conn->PolicyHandle = NULL;
+		CloseLsaConnection(conn);
+		*status = nt_status;
+		return NULL;
+	}
+	*status = STATUS_SUCCESS;
+	return conn;
+}
+
+/*
+ * Move the connections that have been idle too long out of the pool. Called
+ * with the pool lock held, the caller closes them once the lock is dropped
+ * since that goes over the wire.
+ */
+static void ExpireLsaConnections(std::list<lsa_connection *> &expired)
+{
+	std::list<lsa_connection *>::iterator it;
+	time_t now = time(NULL);
+	
+	for (it = lsa_idle_pool.begin(); it != lsa_idle_pool.end(); ) {
+		if ((now - (*it)->last_used) > LSA_POLICY_IDLE_TIMEOUT) {
+			expired.push_back(*it);
+			it = lsa_idle_pool.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+static void CloseLsaConnections(std::list<lsa_connection *> &expired)
+{
+	std::list<lsa_connection *>::iterator it;
+	
+	for (it = expired.begin(); it != expired.end(); ++it) {
+		CloseLsaConnection(*it);
+	}
+	expired.clear();
+}
+
+/*
+ * Timer handler, closes the connections that have been idle too long. Once
+ * the pool is empty the timer goes away until the next release.
+ */
+static void ReapLsaConnections(void *context __unused)
+{
+	std::list<lsa_connection *> expired;
+	
+	pthread_mutex_lock(&lsa_pool_lock);
+	ExpireLsaConnections(expired);
+	if (lsa_idle_pool.empty() && lsa_pool_timer) {
+		dispatch_source_cancel(lsa_pool_timer);
+		dispatch_release(lsa_pool_timer);
+		lsa_pool_timer = NULL;
+	}
+	pthread_mutex_unlock(&lsa_pool_lock);
+	
+	CloseLsaConnections(expired);
+}
+
+/* Called with the pool lock held */
+static void StartLsaPoolTimer(void)
+{
+	if (lsa_pool_timer) {
+		return;
+	}
+	lsa_pool_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+											dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+	if (lsa_pool_timer == NULL) {
+		return;
+	}
+	dispatch_source_set_timer(lsa_pool_timer,
+							  dispatch_time(DISPATCH_TIME_NOW, LSA_POLICY_REAP_INTERVAL * NSEC_PER_SEC),
+							  LSA_POLICY_REAP_INTERVAL * NSEC_PER_SEC, NSEC_PER_SEC);
+	dispatch_source_set_event_handler_f(lsa_pool_timer, ReapLsaConnections);
+	dispatch_resume(lsa_pool_timer);
+}
+
+/*
+ * Get a connection with an open policy handle to the server, reusing an idle
+ * one if we have it.
+ */
+static lsa_connection * AcquireLsaConnection(const char *ServerName, NTSTATUS *status)
+{
+	std::list<lsa_connection *> expired;
+	std::list<lsa_connection *>::iterator it;
+	lsa_connection *conn = NULL;
+	
+	pthread_mutex_lock(&lsa_pool_lock);
+	ExpireLsaConnections(expired);
+	for (it = lsa_idle_pool.begin(); ServerName && (it != lsa_idle_pool.end()); ++it) {
+		if (strcasecmp((*it)->server.c_str(), ServerName) == 0) {
+			conn = *it;
+			lsa_idle_pool.erase(it);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lsa_pool_lock);
+	
+	CloseLsaConnections(expired);
+	
+	if (conn) {
+		*status = STATUS_SUCCESS;
+		return conn;
+	}
+	return OpenLsaConnection(ServerName, status);
+}
+
+/*
+ * Done with the connection. If nothing went wrong at the RPC level hang on to
+ * it for the next lookup, otherwise the binding may be dead so close it. The
+ * pool timer closes it if nobody picks it up within LSA_POLICY_IDLE_TIMEOUT.
+ */
+static void ReleaseLsaConnection(lsa_connection *conn, bool reuse)
+{
+	if (reuse) {
+		pthread_mutex_lock(&lsa_pool_lock);
+		if (lsa_idle_pool.size() < LSA_POLICY_MAX_IDLE) {
+			conn->last_used = time(NULL);
+			lsa_idle_pool.push_front(conn);
+			conn = NULL;
+			StartLsaPoolTimer();
+		}
+		pthread_mutex_unlock(&lsa_pool_lock);
+	}
+	if (conn) {
+		CloseLsaConnection(conn);
+	}
+}
+
+/*
+ * Build a ntsid_t from the domain sid and a relative id. Returns false if the
+ * domain sid has no room for the relative id.
+ */
+static bool MakeNetworkSid(PRPC_SID DomainSid, uint32_t RelativeId, ntsid_t *sid)
+{
+	int ii;
+	
+	/* Need room for the RID */
+	if (DomainSid->SubAuthorityCount >= KAUTH_NTSID_MAX_AUTHORITIES) {
+		return false;
+	}
+	memset(sid, 0, sizeof(*sid));
+	
+	sid->sid_kind = DomainSid->Revision;
+	sid->sid_authcount = DomainSid->SubAuthorityCount;	
+	memcpy(sid->sid_authority, DomainSid->IdentifierAuthority.Value, 
+		   sizeof(sid->sid_authority));
+	
+	for (ii = 0; ii < sid->sid_authcount; ii++)
+		sid->sid_authorities[ii] = DomainSid->SubAuthority[ii];
+	/* Now add the RID */
+	sid->sid_authorities[sid->sid_authcount++] = RelativeId;
+	return true;
+}
+
+static PRPC_SID GetReferencedDomainSid(PLSAPR_REFERENCED_DOMAIN_LIST ReferencedDomains, 
+									   int32_t DomainIndex)
+{
+	if (!ReferencedDomains || !ReferencedDomains->Domains || (DomainIndex < 0) || 
+		((uint32_t)DomainIndex >= ReferencedDomains->Entries)) {
+		return NULL;
+	}
+	return ReferencedDomains->Domains[DomainIndex].Sid;
+}
+
+/* The kinds of accounts we hand back sids for */
+static bool IsAccountSidType(uint32_t use)
+{
+	return ((use == SidTypeUser) || (use == SidTypeGroup) || 
+			(use == SidTypeAlias) || (use == SidTypeWellKnownGroup));
+}
+
+static char * CreateUTF8StringFromCFString(CFStringRef str)
+{
+	CFIndex maxLen;
+	char *utf8;
+	
+	maxLen = CFStringGetMaximumSizeForEncoding(CFStringGetLength(str), 
+											   kCFStringEncodingUTF8) + 1;
+	utf8 = (char *)malloc(maxLen);
+	if (utf8 && !CFStringGetCString(str, utf8, maxLen, kCFStringEncodingUTF8)) {
+		free(utf8);
+		utf8 = NULL;
+	}
+	return utf8;
+}
+
 /* 
  * Create a CFString that contains a fully qualified account names based on 
  * either DNS or NetBIOS names. For example: example.example.com\user_name or 
@@ -119,11 +581,215 @@ done:
 	return FullyQualifiedRef;
 }	
 
+/*
+ * Look up a batch of names in a single LsarLookupNames request. The entries in
+ * which index into names, sids and uses. Every name that maps gets its sid
+ * filled in and cached; the rest are left alone. rpc_failed gets set if the
+ * connection should not be used again.
+ */
+static NTSTATUS LookupNamesBatch(lsa_connection *conn, const char * const *names, 
+								 const uint32_t *which, uint32_t count, 
+								 ntsid_t **sids, uint32_t *uses, 
+								 uint32_t *mapped, bool *rpc_failed)
+{
+	std::vector<RPC_UNICODE_STRING> Names(count);
+	std::vector<uint16_t *> buffers(count, (uint16_t *)NULL);
+    NTSTATUS nt_status = STATUS_SUCCESS;
+    error_status_t rpc_status = rpc_s_ok;
+	LSAPR_TRANSLATED_SIDS TranslatedSids;
+	idl_ulong_int MappedCount = 0;
+	PLSAPR_REFERENCED_DOMAIN_LIST ReferencedDomains = NULL;
+	uint32_t ii;
+	
+	for (ii = 0; ii < count; ii++) {
+		size_t len = 0;
+		
+		buffers[ii] = SMBConvertFromUTF8ToUTF16(names[which[ii]], 1024, 0);
+		if (!buffers[ii]) {
+			nt_status = STATUS_NO_MEMORY;
+			goto done;
+		}
+		while (buffers[ii][len]) {
+			len++;
+		}
+		Names[ii].Length = len * sizeof(uint16_t);
+		Names[ii].MaximumLength = Names[ii].Length;
+		Names[ii].Buffer = (WCHAR *)buffers[ii];
+	}
+	
+ 	memset(&TranslatedSids, 0, sizeof(TranslatedSids));
+	
+	DCETHREAD_TRY
+		nt_status = LsarLookupNames(conn->binding.get(), conn->PolicyHandle, count, 
+									&Names[0], &ReferencedDomains, &TranslatedSids, 
+									LsapLookupWksta, &MappedCount, &rpc_status);
+	DCETHREAD_CATCH_ALL(exc)
+		/* Catch any exceptions */
+		rpc_status = rpc_exception_status(exc);
+	DCETHREAD_ENDTRY
+	
+	if (rpc_status != rpc_s_ok) {
+        SMBLogInfo("RPC to lsarpc gave rpc status of %#08x", ASL_LEVEL_DEBUG, rpc_status);
+		*rpc_failed = true;
+		/* Need a routine that converts rpc status to nt status */
+		nt_status = STATUS_UNSUCCESSFUL;
+		goto done;
+    } else if (!NT_SUCCESS(nt_status)) {		
+        SMBLogInfo("RPC to lsarpc gave nt status of %#08x", ASL_LEVEL_DEBUG, nt_status);
+		goto done;
+	}
+	
+	for (ii = 0; (ii < count) && (ii < TranslatedSids.Entries) && TranslatedSids.Sids; ii++) {
+		PRPC_SID DomainSid;
+		ntsid_t *sid;
+		
+		if (!IsAccountSidType(TranslatedSids.Sids[ii].Use)) {
+			continue;
+		}
+		DomainSid = GetReferencedDomainSid(ReferencedDomains, 
+										   TranslatedSids.Sids[ii].DomainIndex);
+		if (!DomainSid) {
+			SMBLogInfo("No domain sid?", ASL_LEVEL_DEBUG);
+			continue;
+		}
+		sid = (ntsid_t *)malloc(sizeof(ntsid_t));
+		if (sid == NULL) {
+			nt_status = STATUS_NO_MEMORY;
+			goto done;
+		}
+		if (!MakeNetworkSid(DomainSid, TranslatedSids.Sids[ii].RelativeId, sid)) {
+			SMBLogInfo("Invalid domain sid?", ASL_LEVEL_DEBUG);
+			free(sid);
+			continue;
+		}
+		LsaCacheEnter(NameCacheKey(conn->server, names[which[ii]]), sid, 
+					  names[which[ii]], TranslatedSids.Sids[ii].Use);
+		sids[which[ii]] = sid;
+		if (uses) {
+			uses[which[ii]] = TranslatedSids.Sids[ii].Use;
+		}
+		(*mapped)++;
+	}
+	nt_status = STATUS_SUCCESS;
+	
+done:
+	for (ii = 0; ii < count; ii++) {
+		if (buffers[ii]) {
+			free(buffers[ii]);
+		}
+	}
+	return nt_status;
+}
+
+/*
+ * Look up a batch of sids in a single LsarLookupSids request, see 
+ * LookupNamesBatch. Names come back as domain\account.
+ */
+static NTSTATUS LookupSidsBatch(lsa_connection *conn, const ntsid_t * const *sids, 
+								const uint32_t *which, uint32_t count, 
+								char **names, uint32_t *mapped, bool *rpc_failed)
+{
+	std::vector<LSAPR_SID_INFORMATION> SidInfo(count);
+	std::vector<PRPC_SID> RpcSids(count, (PRPC_SID)NULL);
+	LSAPR_SID_ENUM_BUFFER SidEnumBuffer;
+	LSAPR_TRANSLATED_NAMES TranslatedNames;
+    NTSTATUS nt_status = STATUS_SUCCESS;
+    error_status_t rpc_status = rpc_s_ok;
+	idl_ulong_int MappedCount = 0;
+	PLSAPR_REFERENCED_DOMAIN_LIST ReferencedDomains = NULL;
+	uint32_t ii;
+	int jj;
+	
+	for (ii = 0; ii < count; ii++) {
+		const ntsid_t *sid = sids[which[ii]];
+		
+		/* SubAuthority is a conformant array, make room for all of them */
+		RpcSids[ii] = (PRPC_SID)calloc(1, sizeof(RPC_SID) + 
+							KAUTH_NTSID_MAX_AUTHORITIES * sizeof(RpcSids[ii]->SubAuthority[0]));
+		if (!RpcSids[ii]) {
+			nt_status = STATUS_NO_MEMORY;
+			goto done;
+		}
+		RpcSids[ii]->Revision = sid->sid_kind;
+		RpcSids[ii]->SubAuthorityCount = std::min<int>(sid->sid_authcount, 
+													   KAUTH_NTSID_MAX_AUTHORITIES);
+		memcpy(RpcSids[ii]->IdentifierAuthority.Value, sid->sid_authority, 
+			   sizeof(sid->sid_authority));
+		for (jj = 0; jj < RpcSids[ii]->SubAuthorityCount; jj++) {
+			RpcSids[ii]->SubAuthority[jj] = sid->sid_authorities[jj];
+		}
+		SidInfo[ii].Sid = RpcSids[ii];
+	}
+	SidEnumBuffer.Entries = count;
+	SidEnumBuffer.SidInfo = &SidInfo[0];
+ 	memset(&TranslatedNames, 0, sizeof(TranslatedNames));
+	
+	DCETHREAD_TRY
+		nt_status = LsarLookupSids(conn->binding.get(), conn->PolicyHandle, 
+								   &SidEnumBuffer, &ReferencedDomains, 
+								   &TranslatedNames, LsapLookupWksta, 
+								   &MappedCount, &rpc_status);
+	DCETHREAD_CATCH_ALL(exc)
+		/* Catch any exceptions */
+		rpc_status = rpc_exception_status(exc);
+	DCETHREAD_ENDTRY
+	
+	if (rpc_status != rpc_s_ok) {
+        SMBLogInfo("RPC to lsarpc gave rpc status of %#08x", ASL_LEVEL_DEBUG, rpc_status);
+		*rpc_failed = true;
+		nt_status = STATUS_UNSUCCESSFUL;
+		goto done;
+    } else if (!NT_SUCCESS(nt_status)) {		
+        SMBLogInfo("RPC to lsarpc gave nt status of %#08x", ASL_LEVEL_DEBUG, nt_status);
+		goto done;
+	}
+	
+	for (ii = 0; (ii < count) && (ii < TranslatedNames.Entries) && TranslatedNames.Names; ii++) {
+		PRPC_UNICODE_STRING AccountName = &TranslatedNames.Names[ii].Name;
+		int32_t DomainIndex = TranslatedNames.Names[ii].DomainIndex;
+		CFStringRef FullyQualifiedRef = NULL;
+		char *name = NULL;
+		
+		if ((TranslatedNames.Names[ii].Use == SidTypeUnknown) || 
+			(TranslatedNames.Names[ii].Use == SidTypeInvalid) || 
+			!AccountName->Buffer || !AccountName->Length) {
+			continue;
+		}
+		if (ReferencedDomains && ReferencedDomains->Domains && (DomainIndex >= 0) && 
+			((uint32_t)DomainIndex < ReferencedDomains->Entries)) {
+			FullyQualifiedRef = CreateFullyQualifiedAccountName(AccountName, 
+									&ReferencedDomains->Domains[DomainIndex].Name);
+		}
+		if (FullyQualifiedRef) {
+			name = CreateUTF8StringFromCFString(FullyQualifiedRef);
+			CFRelease(FullyQualifiedRef);
+		} else {
+			name = SMBConvertFromUTF16ToUTF8((const uint16_t *)AccountName->Buffer, 
+											 AccountName->Length, 0);
+		}
+		if (!name) {
+			nt_status = STATUS_NO_MEMORY;
+			goto done;
+		}
+		LsaCacheEnter(SidCacheKey(conn->server, sids[which[ii]]), sids[which[ii]], 
+					  name, TranslatedNames.Names[ii].Use);
+		names[which[ii]] = name;
+		(*mapped)++;
+	}
+	nt_status = STATUS_SUCCESS;
+	
+done:
+	for (ii = 0; ii < count; ii++) {
+		if (RpcSids[ii]) {
+			free(RpcSids[ii]);
+		}
+	}
+	return nt_status;
+}
+
 /* 
- * Given a server and a name obtain the sid. We only support looking up one name
- * at a time currently with this routine.
+ * Given a name obtain the sid. Only user accounts are accepted here.
  * 
- * ServerName	-	The UTF16 name of the server.
  * AccountName	-	Contains the security principal names to translate. The 
  *					RPC_UNICODE_STRING structure is defined in [MS-DTYP] section 
  *					2.3.5. 
@@ -142,116 +808,176 @@ done:
  * 
  */
 static 
-NTSTATUS GetAccountNameSID(WCHAR * ServerName, PRPC_UNICODE_STRING AccountName, 
-						   ntsid_t **ntsid, rpc_binding *binding)
+NTSTATUS GetAccountNameSID(lsa_connection *conn, PRPC_UNICODE_STRING AccountName, 
+						   ntsid_t **ntsid, bool *rpc_failed)
 {
-	LSAPR_OBJECT_ATTRIBUTES ObjectAttributes;
-	LSAPR_HANDLE PolicyHandle = NULL;
-	ACCESS_MASK DesiredAccess = 0x00000800;
     NTSTATUS nt_status = STATUS_SUCCESS;
-    error_status_t rpc_status = rpc_s_ok;
-	LSAPR_TRANSLATED_SIDS TranslatedSids;
-	idl_ulong_int RequestCount, MappedCount = 0;
-	PLSAPR_REFERENCED_DOMAIN_LIST ReferencedDomains = NULL;
-	SECURITY_QUALITY_OF_SERVICE SecurityQualityOfService;
-	PRPC_SID DomainSid = NULL;
-	ntsid_t *sid;
-	int ii;
-
-	RequestCount = 1; /* We only request one name at a time */
-	memset(&ObjectAttributes, 0, sizeof(ObjectAttributes));
-	/*
-	 * We could just leave ObjectAttributes zeroed out since that works. Notice
-	 * that windows fills in the SecurityQualityOfService so lets do the same
-	 * for now.
-	 */
-	SecurityQualityOfService.Length = 12; /* Size of SecurityQualityOfService */
-	SecurityQualityOfService.ImpersonationLevel = SecurityImpersonation;
-	SecurityQualityOfService.ContextTrackingMode = 1;
-	SecurityQualityOfService.EffectiveOnly = 0;
-	ObjectAttributes.Length = 24;	 /* Size of ObjectAttributes */
-	ObjectAttributes.SecurityQualityOfService = &SecurityQualityOfService;
-
- 	memset(&TranslatedSids, 0, sizeof(TranslatedSids));
+	lsa_cache_entry entry;
+	ntsid_t *sid = NULL;
+	uint32_t use = SidTypeUnknown;
+	uint32_t which = 0, mapped = 0;
+	char *name;
 	
-	DCETHREAD_TRY
-		/* 
-		 * The second parameter in LsarOpenPolicy2 is the SystemName, window always
-		 * puts the server name in here, it helps with tracing so we will also. Since
-		 * the docs say the following it should hurt:
-		 * SystemName: This parameter does not have any effect on message processing 
-		 *			    in any environment. It MUST be ignored on receipt.
-		*/
-		nt_status = LsarOpenPolicy2(binding->get(), ServerName, &ObjectAttributes,
-							   DesiredAccess, &PolicyHandle, &rpc_status);
-		if ((NT_SUCCESS(nt_status)) && (rpc_status == rpc_s_ok)) {
-			nt_status = LsarLookupNames(binding->get(), PolicyHandle, RequestCount, 
-										AccountName, &ReferencedDomains, &TranslatedSids, 
-										LsapLookupWksta, &MappedCount, &rpc_status);
-		}
-		/* 
-		 * Close the handle if we have one. Ignore any any errors, since I am 
-		 * not sure what I would do about them anyways
-		 */
-		if (PolicyHandle) {
-			(void)LsarClose(binding->get(), &PolicyHandle, &rpc_status);
+	name = SMBConvertFromUTF16ToUTF8((const uint16_t *)AccountName->Buffer, 
+									 AccountName->Length, 0);
+	if (!name) {
+		return STATUS_NO_MEMORY;
+	}
+	
+	if (LsaCacheLookup(NameCacheKey(conn->server, name), entry)) {
+		use = entry.use;
+		sid = (ntsid_t *)malloc(sizeof(ntsid_t));
+		if (sid) {
+			*sid = entry.sid;
+		} else {
+			nt_status = STATUS_NO_MEMORY;
 		}
-	DCETHREAD_CATCH_ALL(exc)
-		/* Catch any exceptions */
-		rpc_status = rpc_exception_status(exc);
-	DCETHREAD_ENDTRY
+	} else {
+		nt_status = LookupNamesBatch(conn, &name, &which, 1, &sid, &use, 
+									 &mapped, rpc_failed);
+	}
+	free(name);
 	
-	if (rpc_status != rpc_s_ok) {
-        SMBLogInfo("RPC to lsarpc gave rpc status of %#08x", ASL_LEVEL_DEBUG, rpc_status);
-		/* Need a routine that converts rpc status to nt status */
-		return (STATUS_UNSUCCESSFUL);
-    } else if (!NT_SUCCESS(nt_status)) {		
-        SMBLogInfo("RPC to lsarpc gave nt status of %#08x", ASL_LEVEL_DEBUG, nt_status);
+	if (!NT_SUCCESS(nt_status)) {
 		return nt_status;
 	}
-	/* Make sure they returned the users RID */
-	if ((TranslatedSids.Entries == 0) || 
-		(TranslatedSids.Sids == NULL) || 
-		(TranslatedSids.Sids->Use != SidTypeUser)) {
-        SMBLogInfo("No Relative Id (RID)?", ASL_LEVEL_DEBUG);
+	/* Make sure they returned a user */
+	if (!sid || (use != SidTypeUser)) {
+        SMBLogInfo("No user sid?", ASL_LEVEL_DEBUG);
+		if (sid) {
+			free(sid);
+		}
 		return STATUS_NO_SUCH_USER;
 	}
-	/* Now get the domain sid */
-	if (ReferencedDomains && ReferencedDomains->Entries && ReferencedDomains->Domains) {
-		DomainSid = ReferencedDomains->Domains->Sid;
+	*ntsid = sid;
+	return 0;
+}
+
+/*
+ * Given a server and a list of names obtain their sids. Cached results are
+ * used when we have them, the rest are looked up in as few requests as
+ * possible. Names that do not map get a NULL sid, the others must be freed
+ * by the caller.
+ */
+NTSTATUS LookupNetworkAccountSIDs(const char *ServerName, uint32_t count, 
+								  const char * const *names, ntsid_t **sids)
+{
+	std::vector<uint32_t> misses;
+	lsa_cache_entry entry;
+    NTSTATUS nt_status = STATUS_SUCCESS;
+	uint32_t ii, mapped = 0;
+	
+	for (ii = 0; ii < count; ii++) {
+		sids[ii] = NULL;
+		if (!names[ii]) {
+			continue;
+		}
+		if (LsaCacheLookup(NameCacheKey(ServerName ? ServerName : "", names[ii]), entry)) {
+			sids[ii] = (ntsid_t *)malloc(sizeof(ntsid_t));
+			if (!sids[ii]) {
+				nt_status = STATUS_NO_MEMORY;
+				break;
+			}
+			*sids[ii] = entry.sid;
+			mapped++;
+		} else {
+			misses.push_back(ii);
+		}
 	}
-	/* No domain sid returned, error out */
-	if (!DomainSid) {
-        SMBLogInfo("No domain sid?", ASL_LEVEL_DEBUG);
-		return (STATUS_NO_SUCH_DOMAIN);
+	
+	if (NT_SUCCESS(nt_status) && !misses.empty()) {
+		lsa_rpc_allocator allocator;
+		lsa_connection *conn = NULL;
+		bool rpc_failed = false;
+		
+		if (!allocator.mempool) {
+			nt_status = STATUS_NO_MEMORY;
+		} else {
+			conn = AcquireLsaConnection(ServerName, &nt_status);
+		}
+		for (ii = 0; conn && (ii < misses.size()); ii += LSA_LOOKUP_MAX_BATCH) {
+			uint32_t batch = std::min<uint32_t>(misses.size() - ii, LSA_LOOKUP_MAX_BATCH);
+			
+			nt_status = LookupNamesBatch(conn, names, &misses[ii], batch, sids, 
+										 NULL, &mapped, &rpc_failed);
+			if (rpc_failed || (nt_status == STATUS_NO_MEMORY)) {
+				break;
+			}
+		}
+		if (conn) {
+			ReleaseLsaConnection(conn, !rpc_failed);
+		}
 	}
-	/* Need room for the users RID */
-	if (DomainSid->SubAuthorityCount >= KAUTH_NTSID_MAX_AUTHORITIES) {
-        SMBLogInfo("Invalid domain sid?", ASL_LEVEL_DEBUG);
-		return (STATUS_INVALID_SID);
+	
+	if (mapped == count) {
+		return STATUS_SUCCESS;
 	}
-
-	sid = (ntsid_t *)malloc(sizeof(ntsid_t));
-	if (sid == NULL) {
-        SMBLogInfo("Couldn't allocate ntsid", ASL_LEVEL_DEBUG);
-		return (STATUS_NO_MEMORY);
+	if (mapped) {
+		return STATUS_SOME_NOT_MAPPED;
 	}
+	return NT_SUCCESS(nt_status) ? STATUS_NONE_MAPPED : nt_status;
+}
 
-	memset(sid, 0, sizeof(*sid));
-
-	sid->sid_kind = DomainSid->Revision;
-	sid->sid_authcount = DomainSid->SubAuthorityCount;	
-	memcpy(sid->sid_authority, DomainSid->IdentifierAuthority.Value, 
-		   sizeof(sid->sid_authority));
+/*
+ * Given a server and a list of sids obtain their domain\account names, see
+ * LookupNetworkAccountSIDs. The returned names must be freed by the caller.
+ */
+NTSTATUS LookupNetworkAccountNames(const char *ServerName, uint32_t count, 
+								   const ntsid_t * const *sids, char **names)
+{
+	std::vector<uint32_t> misses;
+	lsa_cache_entry entry;
+    NTSTATUS nt_status = STATUS_SUCCESS;
+	uint32_t ii, mapped = 0;
 	
-	for (ii = 0; ii < sid->sid_authcount; ii++)
-		sid->sid_authorities[ii] = DomainSid->SubAuthority[ii];
-	/* Now add the users RID */
-	sid->sid_authorities[sid->sid_authcount++] = TranslatedSids.Sids->RelativeId;
+	for (ii = 0; ii < count; ii++) {
+		names[ii] = NULL;
+		if (!sids[ii]) {
+			continue;
+		}
+		if (LsaCacheLookup(SidCacheKey(ServerName ? ServerName : "", sids[ii]), entry)) {
+			names[ii] = strdup(entry.name.c_str());
+			if (!names[ii]) {
+				nt_status = STATUS_NO_MEMORY;
+				break;
+			}
+			mapped++;
+		} else {
+			misses.push_back(ii);
+		}
+	}
 	
-	*ntsid = sid;
-	return 0;
+	if (NT_SUCCESS(nt_status) && !misses.empty()) {
+		lsa_rpc_allocator allocator;
+		lsa_connection *conn = NULL;
+		bool rpc_failed = false;
+		
+		if (!allocator.mempool) {
+			nt_status = STATUS_NO_MEMORY;
+		} else {
+			conn = AcquireLsaConnection(ServerName, &nt_status);
+		}
+		for (ii = 0; conn && (ii < misses.size()); ii += LSA_LOOKUP_MAX_BATCH) {
+			uint32_t batch = std::min<uint32_t>(misses.size() - ii, LSA_LOOKUP_MAX_BATCH);
+			
+			nt_status = LookupSidsBatch(conn, sids, &misses[ii], batch, names, 
+										&mapped, &rpc_failed);
+			if (rpc_failed || (nt_status == STATUS_NO_MEMORY)) {
+				break;
+			}
+		}
+		if (conn) {
+			ReleaseLsaConnection(conn, !rpc_failed);
+		}
+	}
 	
+	if (mapped == count) {
+		return STATUS_SUCCESS;
+	}
+	if (mapped) {
+		return STATUS_SOME_NOT_MAPPED;
+	}
+	return NT_SUCCESS(nt_status) ? STATUS_NONE_MAPPED : nt_status;
 }
 
 static 
@@ -289,33 +1015,29 @@ NTSTATUS GetNetworkAccountSID(const char *ServerName, char **account, char **dom
 	PRPC_UNICODE_STRING AccountName = NULL;
 	PRPC_UNICODE_STRING DomainName = NULL;
     NTSTATUS nt_status = STATUS_SUCCESS;
-	WCHAR * UTF16ServerName = SMBConvertFromUTF8ToUTF16(ServerName, 1024, 0);
-    rpc_ss_allocator_t  allocator;
-    
-    rpc_mempool * mempool(rpc_mempool::allocate(0));
+	lsa_rpc_allocator allocator;
+	lsa_connection *conn = NULL;
+	bool rpc_failed = false;
 	
-    rpc_binding binding = make_rpc_binding(ServerName, "lsarpc");
-    if (binding.get() == NULL) {
-        SMBLogInfo("make_rpc_binding failed", ASL_LEVEL_DEBUG);
-		nt_status = STATUS_UNSUCCESSFUL; 
-		errno = EINVAL;
-		goto done;
-    }
-    
-	if (!UTF16ServerName) {
+	if (!allocator.mempool) {
 		nt_status = STATUS_NO_MEMORY; 
 		errno = ENOMEM;
 		goto done;
 	}
-	/* Setup the memory allocator */
-	memset(&allocator, 0, sizeof(allocator));
-    allocator.p_allocate = rpc_pool_allocate;
-    allocator.p_free = rpc_pool_free;
-    allocator.p_context = (idl_void_p_t)mempool;
 	
-    rpc_ss_swap_client_alloc_free_ex(&allocator, &allocator);
+	conn = AcquireLsaConnection(ServerName, &nt_status);
+	if (!conn) {
+        SMBLogInfo("Couldn't open the lsarpc policy: %d", ASL_LEVEL_DEBUG, nt_status);
+		errno = (nt_status == STATUS_NO_MEMORY) ? ENOMEM : EINVAL;
+		goto done;
+	}
 	
-	nt_status = GetAccountName(UTF16ServerName, &AccountName, &DomainName, &binding);
+	nt_status = GetAccountName(conn->UTF16ServerName, &AccountName, &DomainName, 
+							   &conn->binding);
+	if (nt_status == STATUS_UNSUCCESSFUL) {
+		/* Failed at the RPC level, don't reuse the binding */
+		rpc_failed = true;
+	}
 	/* Some servers will return success, but they won't return the user name.  */
 	if (!AccountName && (NT_SUCCESS(nt_status))) {
         SMBLogInfo("Server return a NULL account name", ASL_LEVEL_DEBUG);
@@ -340,7 +1062,7 @@ NTSTATUS GetNetworkAccountSID(const char *ServerName, char **account, char **dom
 		/* Remember that CFStringGetCharactersPtr can fail */
 		FullyQualified.Buffer = (WCHAR *)CFStringGetCharactersPtr(FullyQualifiedRef);
 		if (FullyQualified.Buffer) {
-			nt_status = GetAccountNameSID(UTF16ServerName, &FullyQualified, ntsid, &binding);
+			nt_status = GetAccountNameSID(conn, &FullyQualified, ntsid, &rpc_failed);
 		} else {
 			nt_status = STATUS_NO_MEMORY; 
 		}
@@ -349,9 +1071,9 @@ NTSTATUS GetNetworkAccountSID(const char *ServerName, char **account, char **dom
 		nt_status = STATUS_UNSUCCESSFUL;
 	}
 	/* The fully qualified account name failed, try just the account name */
-	if (!NT_SUCCESS(nt_status)) {
+	if (!NT_SUCCESS(nt_status) && !rpc_failed) {
         SMBLogInfo("Failed to get the sid using the fully qualified account name", ASL_LEVEL_DEBUG);
-		nt_status = GetAccountNameSID(UTF16ServerName, AccountName, ntsid, &binding);
+		nt_status = GetAccountNameSID(conn, AccountName, ntsid, &rpc_failed);
 	}
 	if (!NT_SUCCESS(nt_status)) {
         SMBLogInfo("Couldn't get the account sid: %d", ASL_LEVEL_DEBUG, nt_status);
@@ -380,10 +1102,9 @@ NTSTATUS GetNetworkAccountSID(const char *ServerName, char **account, char **dom
 	}
 	
 done:
-	/* Need to free the memory allocator here */
-	if (UTF16ServerName) {
-		free(UTF16ServerName);
+	if (conn) {
+		ReleaseLsaConnection(conn, !rpc_failed);
 	}
-	rpc_mempool::destroy(mempool);
+	/* The memory allocator gets freed on the way out */
 	return nt_status;
 }
@@ -37,6 +37,18 @@ extern "C" {
 #endif
 	
 NTSTATUS GetNetworkAccountSID(const char *ServerName, char **account, char **domain, ntsid_t **ntsid);
+
+/*
+ * Batch lookups. Results are cached for a while and the lsarpc policy handle
+ * is kept open between calls. Entries that do not map come back NULL, the
+ * rest must be freed by the caller. Returns STATUS_SOME_NOT_MAPPED or
+ * STATUS_NONE_MAPPED if not everything mapped.
+ */
+NTSTATUS LookupNetworkAccountSIDs(const char *ServerName, uint32_t count, 
+								  const char * const *names, ntsid_t **sids);
+NTSTATUS LookupNetworkAccountNames(const char *ServerName, uint32_t count, 
+								   const ntsid_t * const *sids, char **names);
+void FlushNetworkAccountCache(void);
 	
 #ifdef __cplusplus
 } // extern "C"
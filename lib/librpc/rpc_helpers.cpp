@@ -27,7 +27,6 @@
 #include <smbclient/smbclient_internal.h>
 
 #include <algorithm>
-#include <vector>
 #include <cstdlib>
 #include <assert.h>
 #include <string>
@@ -38,16 +37,10 @@
 
 #define MEMPOOL_DEBUG 0
 
-struct free_function : public std::unary_function<void *, void>
-{
-    void operator()(void * ptr) const {
-#if MEMPOOL_DEBUG
-        SMBLogInfo("rpc_mempool(%llu): freeing ptr %p", ASL_LEVEL_DEBUG
-				  (unsigned long long)pthread_self(), ptr);
-#endif
-        std::free(ptr);
-    }
-};
+/* First chunk size, doubled for each new chunk up to the max */
+#define MEMPOOL_MIN_CHUNK   (4 * 1024)
+#define MEMPOOL_MAX_CHUNK   (256 * 1024)
+#define MEMPOOL_ALIGN       16
 
 #ifndef __clang_analyzer__
 /* <12135199> Clang static analyzer does not understand the below code */
@@ -76,12 +69,11 @@ rpc_mempool::destroy(
 }
 
 rpc_mempool::rpc_mempool()
-: ptrs(10)
+: chunks(NULL), next_size(MEMPOOL_MIN_CHUNK)
 {
 #if MEMPOOL_DEBUG
     SMBLogInfo("constructing rpc_mempool at %p", ASL_LEVEL_DEBUG, this);
 #endif
-    ptrs.resize(0);
 }
 
 rpc_mempool::~rpc_mempool()
@@ -89,16 +81,57 @@ rpc_mempool::~rpc_mempool()
 #if MEMPOOL_DEBUG
     SMBLogInfo("destroying rpc_mempool at %p", ASL_LEVEL_DEBUG, this);
 #endif
-    std::for_each(ptrs.begin(), ptrs.end(), free_function());
+    while (chunks) {
+        chunk * next = chunks->next;
+        std::free(chunks);
+        chunks = next;
+    }
+}
+
+void *
+rpc_mempool::alloc_chunk(
+						 size_t sz)
+{
+    chunk * c;
+    size_t csize = next_size;
+	
+    /* Oversized requests get a chunk of their own */
+    if (csize < sz) {
+        csize = sz;
+    }
+	
+    c = (chunk *)platform::allocate(NULL, chunk_header() + csize);
+    if (!c) {
+        return NULL;
+    }
+	
+    c->size = csize;
+    c->used = sz;
+    c->last = 0;
+    c->next = chunks;
+    chunks = c;
+	
+    if (next_size < MEMPOOL_MAX_CHUNK) {
+        next_size *= 2;
+    }
+	
+    return (uint8_t *)c + chunk_header();
 }
 
 void *
 rpc_mempool::alloc(
 				   size_t sz)
 {
-    void * ptr = platform::allocate(NULL, sz);
-    if (ptr) {
-        ptrs.push_back(ptr);
+    void * ptr;
+	
+    sz = roundup(sz ? sz : 1, MEMPOOL_ALIGN);
+	
+    if (chunks && (chunks->size - chunks->used) >= sz) {
+        ptr = (uint8_t *)chunks + chunk_header() + chunks->used;
+        chunks->last = chunks->used;
+        chunks->used += sz;
+    } else {
+        ptr = alloc_chunk(sz);
     }
 	
 #if MEMPOOL_DEBUG
@@ -112,17 +145,22 @@ void
 rpc_mempool::free(
 				  void * ptr)
 {
-    ptr_list_type::iterator which =
-	std::find(ptrs.begin(), ptrs.end(), ptr);
+    if (!ptr || !chunks) {
+        return;
+    }
 	
-    assert(which != ptrs.end());
-    ptrs.erase(which);
+    /*
+     * The stubs tend to free what they just allocated, so hand that back.
+     * Anything else stays put until the pool goes away.
+     */
+    if (ptr == (uint8_t *)chunks + chunk_header() + chunks->last) {
+        chunks->used = chunks->last;
+    }
 	
 #if MEMPOOL_DEBUG
     SMBLogInfo("rpc_mempool(%llu): freed ptr %p", ASL_LEVEL_DEBUG,
 			  (unsigned long long)pthread_self(), ptr);
 #endif
-    free_function f; f(ptr);
 }
 
 idl_void_p_t
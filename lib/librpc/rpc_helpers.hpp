@@ -30,10 +30,13 @@ extern "C" {
 #include <dce/dcethread.h>
 }
 
+// Arena allocator for the RPC stubs. Allocations are carved out of chunks
+// that grow geometrically, so unmarshalling a reply with thousands of strings
+// costs a handful of mallocs. Individual frees are O(1) and only give memory
+// back when they release the most recent allocation; everything else goes
+// away in one pass when the pool is destroyed.
 struct rpc_mempool
 {
-    typedef std::vector<void *> ptr_list_type;
-	
     rpc_mempool();
     ~rpc_mempool();
 	
@@ -48,7 +51,26 @@ struct rpc_mempool
     static void destroy(rpc_mempool *);
 	
 private:
-    ptr_list_type ptrs;
+    struct chunk
+    {
+        chunk *     next;
+        size_t      size;   // usable bytes following the header
+        size_t      used;
+        size_t      last;   // offset of the most recent allocation
+    };
+	
+    static inline size_t chunk_header() {
+        return roundup(sizeof(struct chunk), 16);
+    }
+	
+    void * alloc_chunk(size_t sz);
+	
+    chunk *     chunks;     // most recent chunk first
+    size_t      next_size;
+	
+    // Not copyable.
+    rpc_mempool(const rpc_mempool&);
+    rpc_mempool& operator=(const rpc_mempool&);
 };
 
 template <typename T>
@@ -803,6 +803,10 @@ static int smb_negotiate(struct smb_ctx *ctx, struct sockaddr *raddr,
     /* Pass in the max_resp_timeout */
     rq.ioc_max_resp_timeout = ctx->prefs.max_resp_timeout;
     
+    /* Pass in the socket buffer sizes */
+    rq.ioc_tcp_sndbuf = ctx->prefs.tcp_sndbuf;
+    rq.ioc_tcp_rcvbuf = ctx->prefs.tcp_rcvbuf;
+    
     rq.ioc_negotiate_token_len = SMB_IOC_SPI_INIT_SIZE;
 
     /* Need Client Guid for SMB 2/3 Neg request */
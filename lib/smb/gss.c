@@ -267,6 +267,28 @@ smb_gss_principal_from_cred(void *smb_cred)
 	return (principal);
 }
 
+/*
+ * Return the principal of the default Kerberos credential, the one an
+ * authenticated connect without a user name would use. Caller frees it.
+ */
+char *
+smb_gss_default_principal(void)
+{
+	gss_OID_set_desc mechs = { 1, GSS_KRB5_MECHANISM };
+	gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
+	char *principal;
+	uint32_t M, m;
+
+	M = gss_acquire_cred(&m, GSS_C_NO_NAME, GSS_C_INDEFINITE, &mechs,
+						 GSS_C_INITIATE, &cred, NULL, NULL);
+	if (M != GSS_S_COMPLETE)
+		return (NULL);
+	principal = smb_gss_principal_from_cred(cred);
+	(void) gss_release_cred(&m, &cred);
+
+	return (principal);
+}
+
 static void
 smb_gss_add_cred(struct smb_gss_cred_list *list, gss_OID oid, gss_cred_id_t cred)
 {
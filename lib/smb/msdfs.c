@@ -212,6 +212,8 @@
 #include <NetFS/NetFSPrivate.h>
 #include <NetFS/NetFSUtilPrivate.h>
 #include <netsmb/smb_lib.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #define MAX_DFS_REFFERAL_SIZE 56 * 1024
 #define REFERRAL_ENTRY_HEADER_SIZE	8
@@ -246,8 +248,9 @@ enum {
 
 #define MAX_LOOP_CNT		30
 
-/* The only defined ReferralEntryFlag */
+/* ReferralEntryFlags */
 #define NAME_LIST_REFERRAL	0x0002
+#define TARGET_SET_BOUNDARY	0x0004	/* Version 4 only, starts a new priority tier */
 
 // DFS Version Levels
 #define DFS_REFERRAL_V1		0x0001
@@ -258,7 +261,7 @@ enum {
 #define kReferralList			CFSTR("ReferralList")
 /* See [MS-DFSC] 2.2.2 REQ_GET_DFS_REFERRAL NOTE: In our case UTF8 */
 #define kRequestFileName		CFSTR("RequestFileName")
-#define kReferralRequestTime	CFSTR("RequestTime")            /* future use */
+#define kReferralRequestTime	CFSTR("RequestTime")
 
 /* 
  * GET_DFS_REFERRAL reply header 
@@ -278,7 +281,7 @@ enum {
 #define kShareName				kNetworkAddress
 /* Proximity is only in Version 2 */
 #define	kProximity				CFSTR("Proximity")              /* unused */
-#define	kTimeToLive				CFSTR("TimeToLive")             /* unused */
+#define	kTimeToLive				CFSTR("TimeToLive")
 
 /* kDFSPath shows exactly what was consumed by the server */
 #define	kDFSPathOffset			CFSTR("DFSPathOffset")          /* unused */
@@ -763,9 +766,8 @@ static int addDfsStringToDictionary(struct smb_ctx *inConn, mdchain_t mdp,
  *
  * [APPLE]
  * The C56 code places some of this information into a CFDictionary, which it
- * would use for caching. Not sure we need to cache this info now? For now lets
- * parse everything and put it in the dictionary, we can always change this in
- * the future.
+ * would use for caching. We parse everything and put it in the dictionary,
+ * processDfsReferralDictionary hands the result to the referral cache.
  */
 int decodeDfsReferral(struct smb_ctx *inConn, mdchain_t mdp,
                       char *rcv_buffer, uint32_t rcv_buffer_len,
@@ -1116,7 +1118,12 @@ int decodeDfsReferral(struct smb_ctx *inConn, mdchain_t mdp,
 		}
         else {
             /* Only keep the referral_entry_flags flags we support */
-			referral_entry_flags &= NAME_LIST_REFERRAL;
+			if (version_number == DFS_REFERRAL_V4) {
+				referral_entry_flags &= (NAME_LIST_REFERRAL | TARGET_SET_BOUNDARY);
+			}
+			else {
+				referral_entry_flags &= NAME_LIST_REFERRAL;
+			}
 		}
 		
         /*
@@ -1793,18 +1800,55 @@ int testGettingDfsReferralDict(struct smb_ctx * inConn, const char *referral)
 #endif // SMB_DEBUG
 
 /*
- * connectToReferral
+ * createReferralOpenOptions
+ *
+ * Create and set the default open options, these are used by the server
+ * info and open session. The clone ctx will up date these options for
+ * the authentication method being used.
+ */
+static CFMutableDictionaryRef createReferralOpenOptions(struct smb_ctx * inConn)
+{
+	CFMutableDictionaryRef openOptions;
+	
+	openOptions = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, 
+											&kCFTypeDictionaryKeyCallBacks, 
+											&kCFTypeDictionaryValueCallBacks);
+	if (!openOptions) {
+		smb_log_info("%s creating openOptions failed, syserr = %s",
+                     ASL_LEVEL_ERR, __FUNCTION__, strerror(ENOMEM));
+		return NULL;
+	}
+	
+	if (inConn->ct_setup.ioc_userflags & SMBV_HOME_ACCESS_OK) {
+		CFDictionarySetValue(openOptions, kNetFSNoUserPreferencesKey,
+                             kCFBooleanFalse);
+	}
+    else {
+		CFDictionarySetValue(openOptions, kNetFSNoUserPreferencesKey,
+                             kCFBooleanTrue);
+	}
+    
+	/* 
+	 * If they have a loopback in the referral we always allow it, no way for
+	 * us to decided what is correct at this point.
+	 */
+	CFDictionarySetValue(openOptions, kNetFSAllowLoopbackKey, kCFBooleanTrue);
+	return openOptions;
+}
+
+/*
+ * getReferralServerInfo
  * 
- * Take the connection handle passed in and clone it for any security or local
- * info needed. Now convert the referral into a URL and make a connect to that
- * URL.
+ * Convert the referral into a URL, create a new connection handle for it and
+ * do a get server info call. This resolves the server name, connects to it
+ * and negotiates, but does not use anything from the original connection
+ * handle, so it is safe to run on several referrals at once.
  */
-static int connectToReferral(struct smb_ctx * inConn, struct smb_ctx ** outConn, 
-							 CFStringRef referralStr, CFURLRef referralURL)
+static int getReferralServerInfo(struct smb_ctx ** outConn, CFStringRef referralStr,
+								 CFURLRef referralURL, CFDictionaryRef openOptions)
 {
 	CFDictionaryRef serverParams = NULL;
 	struct smb_ctx * newConn = NULL;
-	CFMutableDictionaryRef openOptions = NULL;
 	CFURLRef url = NULL;
 	int error = ENOMEM;
 		
@@ -1827,35 +1871,6 @@ static int connectToReferral(struct smb_ctx * inConn, struct smb_ctx ** outConn,
 		goto done;
 	}
     
-	/*
-	 * Create and set the default open options, these are used by the server
-	 * info and open session. The clone ctx will up date these options for
-	 * the authentication method being used.
-	 */
-	openOptions = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, 
-											&kCFTypeDictionaryKeyCallBacks, 
-											&kCFTypeDictionaryValueCallBacks);
-	if (!openOptions) {
-		smb_log_info("%s creating openOptions failed, syserr = %s",
-                     ASL_LEVEL_ERR, __FUNCTION__, strerror(error));
-		goto done;
-	}
-	
-	if (inConn->ct_setup.ioc_userflags & SMBV_HOME_ACCESS_OK) {
-		CFDictionarySetValue(openOptions, kNetFSNoUserPreferencesKey,
-                             kCFBooleanFalse);
-	}
-    else {
-		CFDictionarySetValue(openOptions, kNetFSNoUserPreferencesKey,
-                             kCFBooleanTrue);
-	}
-    
-	/* 
-	 * If they have a loopback in the referral we always allow it, no way for
-	 * us to decided what is correct at this point.
-	 */
-	CFDictionarySetValue(openOptions, kNetFSAllowLoopbackKey, kCFBooleanTrue);
-	
 	/*
 	 * Do a get server info call here, this will make sure we have a server
 	 * name and address. We need this information before cloning the ctx.
@@ -1872,6 +1887,37 @@ static int connectToReferral(struct smb_ctx * inConn, struct smb_ctx ** outConn,
 		CFRelease(serverParams);
 	}
 
+done:
+	if (error) {
+		smb_ctx_done(newConn);	
+	}
+    else {
+		*outConn = newConn;
+	}
+    
+	if (url) {
+		CFRelease(url);
+	}
+    
+	return error;
+}
+
+/*
+ * openReferralSession
+ * 
+ * Take the connection handle passed in and clone it for any security or local
+ * info needed, then open the session on the referral connection.
+ */
+static int openReferralSession(struct smb_ctx * inConn, struct smb_ctx * newConn)
+{
+	CFMutableDictionaryRef openOptions = NULL;
+	int error = ENOMEM;
+	
+	openOptions = createReferralOpenOptions(inConn);
+	if (!openOptions) {
+		goto done;
+	}
+	
 	error = smb_ctx_clone(newConn, inConn, openOptions);
 	if (error) {
 		smb_log_info("%s clone failed, syserr = %s", ASL_LEVEL_ERR, 
@@ -1887,6 +1933,40 @@ static int connectToReferral(struct smb_ctx * inConn, struct smb_ctx ** outConn,
 		goto done;
 	}
 	
+done:
+	if (openOptions) {
+		CFRelease(openOptions);
+	}
+    
+	return error;
+}
+
+/*
+ * connectToReferral
+ * 
+ * Take the connection handle passed in and clone it for any security or local
+ * info needed. Now convert the referral into a URL and make a connect to that
+ * URL.
+ */
+static int connectToReferral(struct smb_ctx * inConn, struct smb_ctx ** outConn, 
+							 CFStringRef referralStr, CFURLRef referralURL)
+{
+	struct smb_ctx * newConn = NULL;
+	CFMutableDictionaryRef openOptions = NULL;
+	int error = ENOMEM;
+	
+	openOptions = createReferralOpenOptions(inConn);
+	if (!openOptions) {
+		goto done;
+	}
+	
+	error = getReferralServerInfo(&newConn, referralStr, referralURL, openOptions);
+	if (error) {
+		goto done;
+	}
+	
+	error = openReferralSession(inConn, newConn);
+	
 done:
 	if (error) {
 		smb_ctx_done(newConn);	
@@ -1895,10 +1975,6 @@ done:
 		*outConn = newConn;
 	}
     
-	if (url) {
-		CFRelease(url);
-	}
-    
 	if (openOptions) {
 		CFRelease(openOptions);
 	}
@@ -1906,6 +1982,904 @@ done:
 	return error;
 }
 
+/*
+ * [APPLE]
+ * Process wide DFS referral cache.
+ *
+ * [MS-DFSC] 3.1.1 lets the client keep the referrals it gets back so that it
+ * does not have to walk the whole namespace again on every mount. Each entry
+ * is keyed by the part of the request path the server consumed (the DFS root
+ * or link) and is good for the TimeToLive the server handed back. A lookup
+ * finds the longest cached prefix that ends on a path component boundary and
+ * builds a referral dictionary for the remaining path from it, so any path
+ * under a link that was already resolved skips the GET_DFS_REFERRAL round
+ * trips. Targets are kept in the order the server returned them (which is
+ * already sorted by site cost), along with their referral entry flags so the
+ * version 4 target set boundaries survive, except that the last target we
+ * successfully connected to is tried first.
+ *
+ * Version 1 referrals have no TimeToLive and NAME_LIST_REFERRAL entries are
+ * domain controller lists, neither of those are cached.
+ */
+#define DFS_CACHE_MAX_ENTRIES	256
+
+struct dfs_cache_entry {
+	struct dfs_cache_entry *next;
+	CFStringRef prefix;			/* consumed path, no trailing slash */
+	CFArrayRef targets;			/* network addresses in server order */
+	uint16_t *entryFlags;		/* referral entry flags, same order as targets */
+	uint16_t versionNumber;
+	uint32_t headerFlags;
+	CFIndex hint;				/* last target that worked */
+	time_t expires;
+};
+
+static pthread_mutex_t dfs_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dfs_cache_entry *dfs_cache_list = NULL;
+static int dfs_cache_cnt = 0;
+
+static void dfsCacheFreeEntry(struct dfs_cache_entry *entry)
+{
+	if (entry->prefix) {
+		CFRelease(entry->prefix);
+	}
+	if (entry->targets) {
+		CFRelease(entry->targets);
+	}
+	if (entry->entryFlags) {
+		free(entry->entryFlags);
+	}
+	free(entry);
+}
+
+/*
+ * Return the part of the request path that the referral covers. The
+ * unconsumed path is always the tail of the request path.
+ */
+static CFStringRef dfsCacheCreatePrefix(CFDictionaryRef referralDict)
+{
+	CFStringRef requestStr, unconsumedStr = NULL;
+	CFArrayRef referralList;
+	CFDictionaryRef referralInfo;
+	CFIndex len;
+	
+	requestStr = CFDictionaryGetValue(referralDict, kRequestFileName);
+	referralList = CFDictionaryGetValue(referralDict, kReferralList);
+	if ((requestStr == NULL) || (referralList == NULL) ||
+		(CFArrayGetCount(referralList) == 0)) {
+		return NULL;
+	}
+	
+	referralInfo = CFArrayGetValueAtIndex(referralList, 0);
+	if (referralInfo) {
+		unconsumedStr = CFDictionaryGetValue(referralInfo, kUnconsumedPath);
+	}
+	
+	len = CFStringGetLength(requestStr);
+	if (unconsumedStr) {
+		if (!CFStringHasSuffix(requestStr, unconsumedStr)) {
+			return NULL;
+		}
+		len -= CFStringGetLength(unconsumedStr);
+	}
+	
+	/* Strip any trailing slash */
+	while ((len > 1) && (CFStringGetCharacterAtIndex(requestStr, len - 1) == '/')) {
+		len--;
+	}
+	if (len <= 1) {
+		return NULL;
+	}
+	
+	return CFStringCreateWithSubstring(NULL, requestStr, CFRangeMake(0, len));
+}
+
+/*
+ * Does the prefix cover the path? Must match up to a path component boundary.
+ */
+static int dfsCachePrefixMatch(CFStringRef prefix, CFStringRef path)
+{
+	CFIndex prefixLen = CFStringGetLength(prefix);
+	CFIndex pathLen = CFStringGetLength(path);
+	UniChar ch;
+	
+	if (pathLen < prefixLen) {
+		return FALSE;
+	}
+	if (CFStringCompareWithOptions(path, prefix, CFRangeMake(0, prefixLen),
+								   kCFCompareCaseInsensitive) != kCFCompareEqualTo) {
+		return FALSE;
+	}
+	if (pathLen == prefixLen) {
+		return TRUE;
+	}
+	ch = CFStringGetCharacterAtIndex(path, prefixLen);
+	return ((ch == '/') || (ch == '\\'));
+}
+
+/*
+ * Called with the cache lock held. Frees any expired entries and returns the
+ * entry whose prefix matches exactly, if one exists.
+ */
+static struct dfs_cache_entry **dfsCachePurge(CFStringRef prefix, time_t now)
+{
+	struct dfs_cache_entry **entryp = &dfs_cache_list;
+	struct dfs_cache_entry **found = NULL;
+	struct dfs_cache_entry *entry;
+	
+	while ((entry = *entryp) != NULL) {
+		if (entry->expires <= now) {
+			*entryp = entry->next;
+			dfsCacheFreeEntry(entry);
+			dfs_cache_cnt--;
+			continue;
+		}
+		if (prefix && (CFStringCompare(entry->prefix, prefix,
+									   kCFCompareCaseInsensitive) == kCFCompareEqualTo)) {
+			found = entryp;
+		}
+		entryp = &entry->next;
+	}
+	return found;
+}
+
+/*
+ * Add the referrals returned by the server into the cache.
+ */
+static void dfsCacheEnter(CFDictionaryRef referralDict)
+{
+	struct dfs_cache_entry *entry, **entryp;
+	CFMutableArrayRef targets = NULL;
+	uint16_t *entryFlags = NULL;
+	CFStringRef prefix = NULL;
+	CFArrayRef referralList;
+	CFIndex ii, count;
+	uint32_t ttl = 0;
+	time_t now = time(NULL);
+	time_t requestTime = 0;
+	CFNumberRef num;
+	
+	referralList = CFDictionaryGetValue(referralDict, kReferralList);
+	if (referralList == NULL) {
+		return;
+	}
+	count = CFArrayGetCount(referralList);
+	if (count == 0) {
+		return;
+	}
+	
+	targets = CFArrayCreateMutable(kCFAllocatorSystemDefault, count,
+								   &kCFTypeArrayCallBacks);
+	entryFlags = malloc(count * sizeof(*entryFlags));
+	if ((targets == NULL) || (entryFlags == NULL)) {
+		goto done;
+	}
+	
+	for (ii = 0; ii < count; ii++) {
+		CFDictionaryRef referralInfo = CFArrayGetValueAtIndex(referralList, ii);
+		CFStringRef networkAddress;
+		
+		if ((referralInfo == NULL) ||
+			(uint16FromDictionary(referralInfo, kVersionNumber) < DFS_REFERRAL_V2) ||
+			(uint16FromDictionary(referralInfo, kReferralEntryFlags) & NAME_LIST_REFERRAL)) {
+			goto done;
+		}
+		networkAddress = CFDictionaryGetValue(referralInfo, kNetworkAddress);
+		if (networkAddress == NULL) {
+			goto done;
+		}
+		/* [MS-DFSC] All entries MUST have the same time to live */
+		if (ii == 0) {
+			ttl = uint32FromDictionary(referralInfo, kTimeToLive);
+		}
+		CFArrayAppendValue(targets, networkAddress);
+		entryFlags[ii] = uint16FromDictionary(referralInfo, kReferralEntryFlags);
+	}
+	
+	if (ttl == 0) {
+		goto done;
+	}
+	
+	prefix = dfsCacheCreatePrefix(referralDict);
+	if (prefix == NULL) {
+		goto done;
+	}
+	
+	/* The time to live starts from when we sent the request */
+	num = CFDictionaryGetValue(referralDict, kReferralRequestTime);
+	if ((num == NULL) || !CFNumberGetValue(num, kCFNumberLongType, &requestTime) ||
+		(requestTime > now)) {
+		requestTime = now;
+	}
+	if ((time_t)(requestTime + ttl) <= now) {
+		goto done;
+	}
+	
+	entry = malloc(sizeof(*entry));
+	if (entry == NULL) {
+		goto done;
+	}
+	entry->prefix = prefix;
+	entry->targets = targets;
+	entry->entryFlags = entryFlags;
+	entry->versionNumber = uint16FromDictionary(CFArrayGetValueAtIndex(referralList, 0),
+												kVersionNumber);
+	entry->headerFlags = uint32FromDictionary(referralDict, kReferralHeaderFlags);
+	entry->hint = 0;
+	entry->expires = requestTime + ttl;
+	prefix = NULL;
+	targets = NULL;
+	entryFlags = NULL;
+	
+	pthread_mutex_lock(&dfs_cache_lock);
+	entryp = dfsCachePurge(entry->prefix, now);
+	if (entryp) {
+		/* Replace the old entry */
+		struct dfs_cache_entry *old = *entryp;
+		
+		*entryp = old->next;
+		dfsCacheFreeEntry(old);
+		dfs_cache_cnt--;
+	}
+	
+	/* Full, drop the oldest entry which is always at the end of the list */
+	if (dfs_cache_cnt >= DFS_CACHE_MAX_ENTRIES) {
+		for (entryp = &dfs_cache_list; (*entryp)->next; entryp = &(*entryp)->next)
+			;
+		dfsCacheFreeEntry(*entryp);
+		*entryp = NULL;
+		dfs_cache_cnt--;
+	}
+	entry->next = dfs_cache_list;
+	dfs_cache_list = entry;
+	dfs_cache_cnt++;
+	pthread_mutex_unlock(&dfs_cache_lock);
+	
+done:
+	if (prefix) {
+		CFRelease(prefix);
+	}
+	if (targets) {
+		CFRelease(targets);
+	}
+	if (entryFlags) {
+		free(entryFlags);
+	}
+}
+
+/*
+ * Look up the referral string in the cache and if found build a referral
+ * dictionary, just like decodeDfsReferral would, for it.
+ */
+static CFMutableDictionaryRef dfsCacheCreateReferralDict(CFStringRef referralStr)
+{
+	struct dfs_cache_entry *entry, *best = NULL;
+	CFMutableDictionaryRef referralDict = NULL;
+	CFMutableArrayRef referralList = NULL;
+	CFStringRef unconsumedStr = NULL;
+	CFIndex ii, jj, count, start;
+	uint16_t numberOfReferrals;
+	uint16_t entryFlags;
+	time_t now = time(NULL);
+	
+	pthread_mutex_lock(&dfs_cache_lock);
+	(void)dfsCachePurge(NULL, now);
+	
+	/* Longest prefix wins */
+	for (entry = dfs_cache_list; entry; entry = entry->next) {
+		if (!dfsCachePrefixMatch(entry->prefix, referralStr)) {
+			continue;
+		}
+		if ((best == NULL) ||
+			(CFStringGetLength(entry->prefix) > CFStringGetLength(best->prefix))) {
+			best = entry;
+		}
+	}
+	if (best == NULL) {
+		goto done;
+	}
+	
+	referralDict = CFDictionaryCreateMutable(kCFAllocatorSystemDefault, 0,
+											 &kCFTypeDictionaryKeyCallBacks,
+											 &kCFTypeDictionaryValueCallBacks);
+	referralList = CFArrayCreateMutable(kCFAllocatorSystemDefault, 0,
+										&kCFTypeArrayCallBacks);
+	if ((referralDict == NULL) || (referralList == NULL)) {
+		if (referralDict) {
+			CFRelease(referralDict);
+			referralDict = NULL;
+		}
+		goto done;
+	}
+	
+	if (CFStringGetLength(referralStr) > CFStringGetLength(best->prefix)) {
+		unconsumedStr = CFStringCreateWithSubstring(NULL, referralStr,
+								CFRangeMake(CFStringGetLength(best->prefix),
+											CFStringGetLength(referralStr) - CFStringGetLength(best->prefix)));
+	}
+	
+	/* Start with the last target that worked, then the rest in server order */
+	count = CFArrayGetCount(best->targets);
+	start = (best->hint < count) ? best->hint : 0;
+	for (ii = 0; ii < count; ii++) {
+		CFStringRef networkAddress;
+		CFMutableDictionaryRef referralInfo;
+		CFMutableStringRef newReferralStr;
+		
+		if (ii == 0) {
+			jj = start;
+		} else {
+			jj = (ii <= start) ? ii - 1 : ii;
+		}
+		networkAddress = CFArrayGetValueAtIndex(best->targets, jj);
+		entryFlags = best->entryFlags[jj];
+		/*
+		 * The hint moved to the front, so if it started a target set the
+		 * target that followed it starts that set now. The old first target
+		 * stays in the first set.
+		 */
+		if ((start > 0) && (jj == 0)) {
+			entryFlags &= ~TARGET_SET_BOUNDARY;
+		}
+		if ((start > 0) && (ii > 0) && (jj == start + 1) &&
+			(best->entryFlags[start] & TARGET_SET_BOUNDARY)) {
+			entryFlags |= TARGET_SET_BOUNDARY;
+		}
+		
+		referralInfo = CFDictionaryCreateMutable(kCFAllocatorSystemDefault, 0,
+												 &kCFTypeDictionaryKeyCallBacks,
+												 &kCFTypeDictionaryValueCallBacks);
+		if (referralInfo == NULL) {
+			continue;
+		}
+		addNumberToDictionary(referralInfo, kVersionNumber,
+							  kCFNumberSInt16Type, &best->versionNumber);
+		addNumberToDictionary(referralInfo, kReferralEntryFlags,
+							  kCFNumberSInt16Type, &entryFlags);
+		CFDictionarySetValue(referralInfo, kNetworkAddress, networkAddress);
+		newReferralStr = CFStringCreateMutableCopy(NULL, 1024, networkAddress);
+		if (newReferralStr) {
+			if (unconsumedStr) {
+				CFStringAppend(newReferralStr, unconsumedStr);
+			}
+			CFDictionarySetValue(referralInfo, kNewReferral, newReferralStr);
+			CFRelease(newReferralStr);
+		}
+		if (unconsumedStr) {
+			CFDictionarySetValue(referralInfo, kUnconsumedPath, unconsumedStr);
+		}
+		CFArrayAppendValue(referralList, referralInfo);
+		CFRelease(referralInfo);
+	}
+	
+	numberOfReferrals = (uint16_t)CFArrayGetCount(referralList);
+	CFDictionarySetValue(referralDict, kRequestFileName, referralStr);
+	CFDictionarySetValue(referralDict, kReferralList, referralList);
+	addNumberToDictionary(referralDict, kNumberOfReferrals,
+						  kCFNumberSInt16Type, &numberOfReferrals);
+	addNumberToDictionary(referralDict, kReferralHeaderFlags,
+						  kCFNumberSInt32Type, &best->headerFlags);
+	addNumberToDictionary(referralDict, kReferralRequestTime,
+						  kCFNumberLongType, &now);
+	
+done:
+	pthread_mutex_unlock(&dfs_cache_lock);
+	if (referralList) {
+		CFRelease(referralList);
+	}
+	if (unconsumedStr) {
+		CFRelease(unconsumedStr);
+	}
+	return referralDict;
+}
+
+/*
+ * Remember which target of a referral worked, so it gets tried first the
+ * next time.
+ */
+static void dfsCacheSetHint(CFDictionaryRef referralDict, CFDictionaryRef referralInfo)
+{
+	struct dfs_cache_entry **entryp;
+	CFStringRef networkAddress;
+	CFStringRef prefix;
+	CFIndex ii;
+	
+	networkAddress = CFDictionaryGetValue(referralInfo, kNetworkAddress);
+	prefix = dfsCacheCreatePrefix(referralDict);
+	if ((networkAddress == NULL) || (prefix == NULL)) {
+		goto done;
+	}
+	
+	pthread_mutex_lock(&dfs_cache_lock);
+	entryp = dfsCachePurge(prefix, time(NULL));
+	if (entryp) {
+		struct dfs_cache_entry *entry = *entryp;
+		
+		ii = CFArrayGetFirstIndexOfValue(entry->targets,
+										 CFRangeMake(0, CFArrayGetCount(entry->targets)),
+										 networkAddress);
+		if (ii != kCFNotFound) {
+			entry->hint = ii;
+		}
+	}
+	pthread_mutex_unlock(&dfs_cache_lock);
+	
+done:
+	if (prefix) {
+		CFRelease(prefix);
+	}
+}
+
+/*
+ * None of the targets worked, throw the entry away so the next attempt asks
+ * the server again.
+ */
+static void dfsCacheRemove(CFDictionaryRef referralDict)
+{
+	struct dfs_cache_entry **entryp;
+	CFStringRef prefix;
+	
+	prefix = dfsCacheCreatePrefix(referralDict);
+	if (prefix == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&dfs_cache_lock);
+	entryp = dfsCachePurge(prefix, time(NULL));
+	if (entryp) {
+		struct dfs_cache_entry *entry = *entryp;
+		
+		*entryp = entry->next;
+		dfsCacheFreeEntry(entry);
+		dfs_cache_cnt--;
+	}
+	pthread_mutex_unlock(&dfs_cache_lock);
+	CFRelease(prefix);
+}
+
+/*
+ * [APPLE]
+ * DFS target selection.
+ *
+ * We remember how long it took to connect to each target server and when a
+ * target last failed. Within a priority tier (Version 4 TargetSetBoundary,
+ * otherwise all targets are one tier) targets that worked before are tried
+ * fastest first, then targets we know nothing about in server order, and
+ * targets that recently failed go last.
+ *
+ * For storage targets we also race the connects of every target in a tier,
+ * each in its own thread, and take the first one that gets through
+ * negotiate. Losers finish in the background and just record their time.
+ */
+#define DFS_TARGET_MAX_ENTRIES	256
+#define DFS_TARGET_FAIL_TIMO	60		/* Secs a failed target sorts last */
+#define DFS_RACE_MAX_TARGETS	8
+
+struct dfs_target_stats {
+	struct dfs_target_stats *next;
+	CFStringRef server;
+	uint32_t rtt;				/* smoothed connect time in ms */
+	time_t failed;				/* last time we could not reach it */
+};
+
+static struct dfs_target_stats *dfs_target_list = NULL;
+static int dfs_target_cnt = 0;
+
+struct dfs_target {
+	CFIndex index;				/* into the referral list */
+	int tier;
+	uint64_t rank;
+	int raced;
+	int error;					/* failed when raced */
+};
+
+struct dfs_race;
+
+struct dfs_race_target {
+	struct dfs_race *race;
+	CFIndex slot;				/* into the dfs_target array */
+	CFStringRef referralStr;
+	CFStringRef networkAddress;
+	CFMutableDictionaryRef openOptions;
+};
+
+struct dfs_race {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refcnt;
+	int pending;
+	CFIndex winner;
+	struct smb_ctx *conn;
+	CFIndex count;
+	struct dfs_race_target *targets;
+	int *errors;
+};
+
+/*
+ * Get the server name out of the network address, "\server\share\path".
+ */
+static CFStringRef dfsCreateTargetServer(CFStringRef networkAddress)
+{
+	CFIndex len = CFStringGetLength(networkAddress);
+	CFIndex start = 0, end;
+	UniChar ch;
+	
+	while (start < len) {
+		ch = CFStringGetCharacterAtIndex(networkAddress, start);
+		if ((ch != '\\') && (ch != '/')) {
+			break;
+		}
+		start++;
+	}
+	for (end = start; end < len; end++) {
+		ch = CFStringGetCharacterAtIndex(networkAddress, end);
+		if ((ch == '\\') || (ch == '/')) {
+			break;
+		}
+	}
+	if (end == start) {
+		return NULL;
+	}
+	return CFStringCreateWithSubstring(NULL, networkAddress,
+									   CFRangeMake(start, end - start));
+}
+
+/*
+ * Called with the cache lock held.
+ */
+static struct dfs_target_stats *dfsTargetFind(CFStringRef server)
+{
+	struct dfs_target_stats *stats;
+	
+	for (stats = dfs_target_list; stats; stats = stats->next) {
+		if (CFStringCompare(stats->server, server,
+							kCFCompareCaseInsensitive) == kCFCompareEqualTo) {
+			break;
+		}
+	}
+	return stats;
+}
+
+/*
+ * Record how the connect to this target went.
+ */
+static void dfsTargetUpdate(CFStringRef networkAddress, int error, uint32_t elapsed)
+{
+	struct dfs_target_stats *stats, **statsp;
+	CFStringRef server;
+	
+	server = (networkAddress) ? dfsCreateTargetServer(networkAddress) : NULL;
+	if (server == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&dfs_cache_lock);
+	stats = dfsTargetFind(server);
+	if (stats == NULL) {
+		if (dfs_target_cnt >= DFS_TARGET_MAX_ENTRIES) {
+			/* Full, drop the oldest entry which is always at the end */
+			for (statsp = &dfs_target_list; (*statsp)->next; statsp = &(*statsp)->next)
+				;
+			CFRelease((*statsp)->server);
+			free(*statsp);
+			*statsp = NULL;
+			dfs_target_cnt--;
+		}
+		stats = calloc(1, sizeof(*stats));
+		if (stats == NULL) {
+			goto done;
+		}
+		stats->server = server;
+		server = NULL;
+		stats->next = dfs_target_list;
+		dfs_target_list = stats;
+		dfs_target_cnt++;
+	}
+	
+	if (error) {
+		stats->failed = time(NULL);
+	}
+	else {
+		stats->failed = 0;
+		if (elapsed == 0) {
+			elapsed = 1;
+		}
+		/* Smooth it the same way TCP does, 1/8 of the new sample */
+		stats->rtt = (stats->rtt) ? ((stats->rtt * 7) + elapsed) / 8 : elapsed;
+	}
+	
+done:
+	pthread_mutex_unlock(&dfs_cache_lock);
+	if (server) {
+		CFRelease(server);
+	}
+}
+
+/*
+ * Called with the cache lock held. Lower ranks get tried first.
+ */
+static uint64_t dfsTargetRank(CFStringRef networkAddress, time_t now)
+{
+	struct dfs_target_stats *stats = NULL;
+	CFStringRef server;
+	
+	server = (networkAddress) ? dfsCreateTargetServer(networkAddress) : NULL;
+	if (server) {
+		stats = dfsTargetFind(server);
+		CFRelease(server);
+	}
+	if (stats == NULL) {
+		return (1ULL << 32);
+	}
+	if (stats->failed && ((stats->failed + DFS_TARGET_FAIL_TIMO) > now)) {
+		return (2ULL << 32);
+	}
+	if (stats->rtt == 0) {
+		return (1ULL << 32);
+	}
+	return stats->rtt;
+}
+
+static int dfsTargetCompare(const void *arg1, const void *arg2)
+{
+	const struct dfs_target *target1 = arg1;
+	const struct dfs_target *target2 = arg2;
+	
+	if (target1->tier != target2->tier) {
+		return (target1->tier < target2->tier) ? -1 : 1;
+	}
+	if (target1->rank != target2->rank) {
+		return (target1->rank < target2->rank) ? -1 : 1;
+	}
+	/* Keep the server order for everything else */
+	return (target1->index < target2->index) ? -1 : 1;
+}
+
+/*
+ * Return the order we should try the referral's targets in.
+ */
+static struct dfs_target *dfsCreateTargetOrder(CFArrayRef referralList, 
+											   uint16_t numberOfReferrals)
+{
+	struct dfs_target *targets;
+	time_t now = time(NULL);
+	int tier = 0;
+	CFIndex ii;
+	
+	targets = calloc(numberOfReferrals ? numberOfReferrals : 1, sizeof(*targets));
+	if (targets == NULL) {
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&dfs_cache_lock);
+	for (ii = 0; ii < numberOfReferrals; ii++) {
+		CFDictionaryRef referralInfo = CFArrayGetValueAtIndex(referralList, ii);
+		
+		if (referralInfo && (ii > 0) &&
+			(uint16FromDictionary(referralInfo, kReferralEntryFlags) & TARGET_SET_BOUNDARY)) {
+			tier++;
+		}
+		targets[ii].index = ii;
+		targets[ii].tier = tier;
+		targets[ii].rank = (referralInfo) ? 
+			dfsTargetRank(CFDictionaryGetValue(referralInfo, kNetworkAddress), now) : 
+			(2ULL << 32);
+	}
+	pthread_mutex_unlock(&dfs_cache_lock);
+	
+	qsort(targets, numberOfReferrals, sizeof(*targets), dfsTargetCompare);
+	return targets;
+}
+
+/*
+ * Get the new referral string, which has the new server address with any
+ * unconsumed path appended on.
+ */
+static CFStringRef dfsCreateTargetReferralString(CFDictionaryRef referralInfo, 
+												 CFStringRef unconsumedStr)
+{
+	CFStringRef referralStr;
+	CFMutableStringRef new_referral_str;
+	
+	referralStr = CFDictionaryGetValue(referralInfo, kNewReferral);
+	if (referralStr == NULL) {
+		return NULL;
+	}
+	if (unconsumedStr == NULL) {
+		return CFRetain(referralStr);
+	}
+	new_referral_str = CFStringCreateMutableCopy(NULL, 1024, referralStr);
+	if (new_referral_str == NULL) {
+		smb_log_info("%s: CFStringCreateMutableCopy failed",
+					 ASL_LEVEL_ERR, __FUNCTION__);
+		return CFRetain(referralStr);
+	}
+	CFStringAppend(new_referral_str, unconsumedStr);
+	return new_referral_str;
+}
+
+static void dfsRaceRelease(struct dfs_race *race)
+{
+	CFIndex ii;
+	int refcnt;
+	
+	pthread_mutex_lock(&race->lock);
+	refcnt = --race->refcnt;
+	pthread_mutex_unlock(&race->lock);
+	if (refcnt) {
+		return;
+	}
+	
+	for (ii = 0; ii < race->count; ii++) {
+		if (race->targets[ii].referralStr) {
+			CFRelease(race->targets[ii].referralStr);
+		}
+		if (race->targets[ii].networkAddress) {
+			CFRelease(race->targets[ii].networkAddress);
+		}
+		if (race->targets[ii].openOptions) {
+			CFRelease(race->targets[ii].openOptions);
+		}
+	}
+	pthread_cond_destroy(&race->cond);
+	pthread_mutex_destroy(&race->lock);
+	free(race->targets);
+	free(race->errors);
+	free(race);
+}
+
+static void *dfsRaceThread(void *arg)
+{
+	struct dfs_race_target *target = arg;
+	struct dfs_race *race = target->race;
+	struct smb_ctx *newConn = NULL;
+	struct timeval start, end;
+	uint32_t elapsed;
+	int error;
+	
+	gettimeofday(&start, NULL);
+	error = getReferralServerInfo(&newConn, target->referralStr, NULL, 
+								  target->openOptions);
+	gettimeofday(&end, NULL);
+	elapsed = (uint32_t)(((end.tv_sec - start.tv_sec) * 1000) +
+						 ((end.tv_usec - start.tv_usec) / 1000));
+	dfsTargetUpdate(target->networkAddress, error, elapsed);
+	
+	pthread_mutex_lock(&race->lock);
+	race->errors[target - race->targets] = error;
+	if ((error == 0) && (race->winner == -1)) {
+		race->winner = target->slot;
+		race->conn = newConn;
+		newConn = NULL;
+	}
+	race->pending--;
+	pthread_cond_signal(&race->cond);
+	pthread_mutex_unlock(&race->lock);
+	
+	/* Lost the race */
+	smb_ctx_done(newConn);
+	dfsRaceRelease(race);
+	return NULL;
+}
+
+/*
+ * Race the targets in the same tier as the target at slot, that we have not
+ * tried yet. On return the winner has been moved into slot and outConn has
+ * its negotiated connection, the session still needs to be opened. Targets
+ * that failed are marked so we do not try them again.
+ */
+static void dfsRaceTier(struct smb_ctx * inConn, CFArrayRef referralList,
+						CFStringRef unconsumedStr, struct dfs_target *targets,
+						CFIndex slot, uint16_t numberOfReferrals,
+						struct smb_ctx **outConn)
+{
+	struct dfs_race *race = NULL;
+	struct dfs_target winner;
+	CFIndex ii, count = 0, started = 0;
+	pthread_attr_t attr;
+	pthread_t thread;
+	
+	*outConn = NULL;
+	
+	for (ii = slot; (ii < numberOfReferrals) && (count < DFS_RACE_MAX_TARGETS) &&
+		 (targets[ii].tier == targets[slot].tier); ii++) {
+		targets[ii].raced = TRUE;
+		count++;
+	}
+	if (count < 2) {
+		/* Nothing to race */
+		return;
+	}
+	
+	race = calloc(1, sizeof(*race));
+	if (race == NULL) {
+		return;
+	}
+	race->targets = calloc(count, sizeof(*race->targets));
+	race->errors = calloc(count, sizeof(*race->errors));
+	if ((race->targets == NULL) || (race->errors == NULL)) {
+		free(race->targets);
+		free(race->errors);
+		free(race);
+		return;
+	}
+	pthread_mutex_init(&race->lock, NULL);
+	pthread_cond_init(&race->cond, NULL);
+	race->refcnt = 1;
+	race->winner = -1;
+	race->count = count;
+	
+	for (ii = 0; ii < count; ii++) {
+		struct dfs_race_target *target = &race->targets[ii];
+		CFDictionaryRef referralInfo;
+		
+		target->race = race;
+		target->slot = slot + ii;
+		/* Anything we can not start counts as failed */
+		race->errors[ii] = ENOMEM;
+		referralInfo = CFArrayGetValueAtIndex(referralList, targets[slot + ii].index);
+		if (referralInfo == NULL) {
+			race->errors[ii] = ENOENT;
+			continue;
+		}
+		target->networkAddress = CFDictionaryGetValue(referralInfo, kNetworkAddress);
+		if (target->networkAddress) {
+			CFRetain(target->networkAddress);
+		}
+		target->referralStr = dfsCreateTargetReferralString(referralInfo, unconsumedStr);
+		target->openOptions = createReferralOpenOptions(inConn);
+	}
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&race->lock);
+	for (ii = 0; ii < count; ii++) {
+		struct dfs_race_target *target = &race->targets[ii];
+		
+		if ((target->referralStr == NULL) || (target->openOptions == NULL)) {
+			continue;
+		}
+		race->refcnt++;
+		race->pending++;
+		race->errors[ii] = 0;
+		if (pthread_create(&thread, &attr, dfsRaceThread, target) != 0) {
+			race->refcnt--;
+			race->pending--;
+			race->errors[ii] = ENOMEM;
+			continue;
+		}
+		started++;
+	}
+	pthread_attr_destroy(&attr);
+	
+	/* Wait for the first one to get through or for all of them to fail */
+	while (started && race->pending && (race->winner == -1)) {
+		pthread_cond_wait(&race->cond, &race->lock);
+	}
+	
+	for (ii = 0; ii < count; ii++) {
+		if (race->errors[ii]) {
+			targets[slot + ii].error = race->errors[ii];
+		}
+	}
+	if (race->winner != -1) {
+		/* Move the winner to the front of the tier */
+		winner = targets[race->winner];
+		for (ii = race->winner; ii > slot; ii--) {
+			targets[ii] = targets[ii - 1];
+		}
+		targets[slot] = winner;
+		targets[slot].error = 0;
+		*outConn = race->conn;
+		race->conn = NULL;
+		smb_log_info("%s: Target %ld of %ld won", ASL_LEVEL_DEBUG, 
+					 __FUNCTION__, (long)(race->winner - slot), (long)count);
+	}
+	pthread_mutex_unlock(&race->lock);
+	
+	dfsRaceRelease(race);
+}
+
 /*
  * getDfsReferralDictFromReferral
  *
@@ -2028,13 +3002,17 @@ static int processDfsReferralDictionary(struct smb_ctx * inConn,
 										CFMutableArrayRef dfsReferralDictArray)
 {
 	CFMutableDictionaryRef referralDict = NULL;
-	uint32_t ii, referralHeaderFlags;
+	uint32_t ii, kk, referralHeaderFlags;
 	uint16_t numberOfReferrals;
 	CFArrayRef referralList;
 	int error = 0;
 	struct smb_ctx *tmpConn = NULL;
+	struct smb_ctx *referralConn;
+	struct smb_ctx *raceConn = NULL;
+	struct dfs_target *targets = NULL;
     CFMutableStringRef new_referral_str = NULL;
     int add_unconsumed = 0;
+    int from_cache = 0;
 	
     /* This is a recursive function, make sure we dont recurse too much */
 	if (*loopCnt > MAX_LOOP_CNT) {
@@ -2042,6 +3020,17 @@ static int processDfsReferralDictionary(struct smb_ctx * inConn,
     }
 	*loopCnt += 1;
 	
+    /*
+     * If we already have an unexpired referral that covers this path, then
+     * skip the GET_DFS_REFERRAL and go straight to its targets.
+     */
+    referralDict = dfsCacheCreateReferralDict(inReferralStr);
+    if (referralDict != NULL) {
+        from_cache = 1;
+        goto found_referral;
+    }
+
+fetch_referral:
     /* 
      * Send first GET_DFS_REFERRAL and get the reply results back in a 
      * dictionary.
@@ -2095,6 +3084,16 @@ static int processDfsReferralDictionary(struct smb_ctx * inConn,
 
 found_referral:
     
+    if (!from_cache) {
+        dfsCacheEnter(referralDict);
+    }
+
+    /*
+     * Targets are cloned from the connection the referral came from. A cached
+     * referral never made that connection, so use the one passed in.
+     */
+    referralConn = (tmpConn != NULL) ? tmpConn : inConn;
+
 	/* If we find no items then return the correct error */
 	error = ENOENT;
     
@@ -2119,8 +3118,15 @@ found_referral:
 		numberOfReferrals = (uint16_t)CFArrayGetCount(referralList);
     }
 	
+    /* Order the targets by priority tier and how well they worked before */
+	targets = dfsCreateTargetOrder(referralList, numberOfReferrals);
+	if (targets == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+	
     /* For each referral returned, try to connect to it */
-	for (ii = 0; ii < numberOfReferrals; ii++) {
+	for (kk = 0; kk < numberOfReferrals; kk++) {
 		CFDictionaryRef referralInfo;
 		CFStringRef referralStr;
 		CFStringRef unconsumedPathStr = NULL;
@@ -2131,6 +3137,22 @@ found_referral:
             new_referral_str = NULL;
         }
         
+        /*
+         * For storage servers, race all the targets in this tier and start
+         * with the one that answered first.
+         */
+        if ((referralHeaderFlags & kDFSStorageServer) && !targets[kk].raced) {
+            dfsRaceTier(referralConn, referralList,
+                        (add_unconsumed == 1) ? inUnConsumedStr : NULL,
+                        targets, kk, numberOfReferrals, &raceConn);
+        }
+        if (targets[kk].error) {
+            /* Already failed in the race, so try next referral */
+            error = targets[kk].error;
+            continue;
+        }
+        ii = (uint32_t)targets[kk].index;
+        
         /* Get the dictionary for this referral */
 		referralInfo = CFArrayGetValueAtIndex(referralList, ii);
 		if (referralInfo == NULL) {
@@ -2172,8 +3194,27 @@ found_referral:
 		if (referralHeaderFlags & kDFSStorageServer) {
 			struct smb_ctx *newConn = NULL;
 			
-			/* Connect to the server */
-			error = connectToReferral(tmpConn, &newConn, referralStr, NULL);
+			if (raceConn != NULL) {
+				/* Won the race, just need to open the session */
+				newConn = raceConn;
+				raceConn = NULL;
+				error = openReferralSession(referralConn, newConn);
+				if (error) {
+					smb_ctx_done(newConn);
+					newConn = NULL;
+				}
+			}
+			else {
+				struct timeval start, end;
+				
+				/* Connect to the server */
+				gettimeofday(&start, NULL);
+				error = connectToReferral(referralConn, &newConn, referralStr, NULL);
+				gettimeofday(&end, NULL);
+				dfsTargetUpdate(CFDictionaryGetValue(referralInfo, kNetworkAddress),
+								error, (uint32_t)(((end.tv_sec - start.tv_sec) * 1000) +
+												  ((end.tv_usec - start.tv_usec) / 1000)));
+			}
 			if (error) {
                 /* if cant connect to the server, try next referral */
 				continue;
@@ -2228,6 +3269,7 @@ found_referral:
 				*outConn = newConn;
 			}
             
+            dfsCacheSetHint(referralDict, referralInfo);
 			break;
 		}
         else {
@@ -2235,7 +3277,7 @@ found_referral:
              * No storage servers returned, so keep recursing to resolve using
              * the new referral string given to us.
              */
-			error = processDfsReferralDictionary(tmpConn, outConn,
+			error = processDfsReferralDictionary(referralConn, outConn,
                                                  referralStr, unconsumedPathStr,
                                                  loopCnt, dfsReferralDictArray);
             
@@ -2244,11 +3286,30 @@ found_referral:
                  * No error, so the out connection now contains a storage
                  * server, so we are done and can stop recursing.
                  */
+                dfsCacheSetHint(referralDict, referralInfo);
 				break;
             }
 		}
 	}
 	
+    if (error && from_cache) {
+        /*
+         * None of the cached targets worked, the namespace may have changed
+         * under us. Drop the entry and ask the server again.
+         */
+        dfsCacheRemove(referralDict);
+        CFRelease(referralDict);
+        referralDict = NULL;
+        from_cache = 0;
+        free(targets);
+        targets = NULL;
+        if (new_referral_str != NULL) {
+            CFRelease(new_referral_str);
+            new_referral_str = NULL;
+        }
+        goto fetch_referral;
+    }
+
 done:
 	if (referralDict) {
 		if (dfsReferralDictArray) {
@@ -2264,6 +3325,10 @@ done:
         new_referral_str = NULL;
     }
 
+	if (targets != NULL) {
+		free(targets);
+	}
+	smb_ctx_done(raceConn);
 	smb_ctx_done(tmpConn);
 	return error;
 }
@@ -110,6 +110,77 @@ int nb_ctx_resolve(struct nb_ctx *ctx, CFArrayRef WINSAddresses)
 	return error;
 }
 
+/*
+ * Used for resolving NetBIOS names when we want to ask every WINS server at
+ * once. Returns the IPv4 address of every WINS server we could resolve, the
+ * first one is also set as the name server in the context. With no WINS
+ * servers this is the same as nb_ctx_resolve.
+ */
+int nb_ctx_resolve_wins(struct nb_ctx *ctx, CFArrayRef WINSAddresses, 
+						struct sockaddr_in **outServers, int *outCount)
+{
+	struct sockaddr_in *servers = NULL;
+	CFIndex ii, jj, count;
+	int error = 0, nservers = 0;
+
+	*outServers = NULL;
+	*outCount = 0;
+	if (WINSAddresses == NULL) {
+		return nb_ctx_resolve(ctx, NULL);
+	}
+	
+	count = CFArrayGetCount(WINSAddresses);
+	servers = calloc(count ? count : 1, sizeof(*servers));
+	if (servers == NULL) {
+		return ENOMEM;
+	}
+	
+	error = ENOMEM;
+	for (ii = 0; ii < count; ii++) {
+		CFStringRef winsString = CFArrayGetValueAtIndex(WINSAddresses, ii);
+		CFMutableArrayRef addressArray = NULL;
+		CFMutableDataRef addressData;
+		struct connectAddress *conn = NULL;
+		char winsName[SMB_MAX_DNS_SRVNAMELEN+1];
+		
+		if (winsString == NULL) {
+			continue;		
+		}
+		
+		CFStringGetCString(winsString, winsName,  sizeof(winsName), kCFStringEncodingUTF8);
+		error = resolvehost(winsName, &addressArray, NULL, NBNS_UDP_PORT_137, TRUE, FALSE);
+		if (error) {
+			smb_log_info("can't resolve WINS[%d] %s, syserr = %s", ASL_LEVEL_DEBUG, 
+						 (int)ii, winsName, strerror(error));
+			continue;
+		}
+		
+		addressData = (CFMutableDataRef)CFArrayGetValueAtIndex(addressArray, 0);
+		if (addressData)
+			conn = (struct connectAddress *)((void *)CFDataGetMutableBytePtr(addressData));
+		if (conn && (conn->addr.sa_family == AF_INET)) {
+			/* Two names for the same server, only ask it once */
+			for (jj = 0; jj < nservers; jj++) {
+				if (servers[jj].sin_addr.s_addr == conn->in4.sin_addr.s_addr)
+					break;
+			}
+			if (jj == nservers)
+				memcpy(&servers[nservers++], &conn->in4, sizeof(servers[0]));
+		}
+		CFRelease(addressArray);
+	}
+	
+	if (nservers == 0) {
+		free(servers);
+		return (error) ? error : EHOSTUNREACH;
+	}
+	
+	memcpy(&ctx->nb_ns, &servers[0], sizeof(ctx->nb_ns));
+	*outServers = servers;
+	*outCount = nservers;
+	return 0;
+}
+
 /*
  * Convert NetBIOS name lookup errors to UNIX errors
  */
@@ -37,6 +37,8 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <ifaddrs.h>
@@ -493,24 +495,312 @@ static int nonBlockingSocket(int family)
 	return so;
 }
 
+/*
+ * Connection racing, loosely following RFC 8305 (Happy Eyeballs Version 2).
+ *
+ * Instead of firing off connects to every address at once, we sort the
+ * addresses and start them one at a time, a connection attempt delay apart.
+ * A new attempt starts right away when the previous one fails. We remember
+ * how long each address took to connect (and when it last failed) across
+ * calls, so addresses that worked before are tried fastest first, addresses
+ * we know nothing about are tried next alternating IPv6 and IPv4, and
+ * addresses that just failed are tried last. Port 445 is still preferred over
+ * port 139.
+ */
+#define kConnectAttemptDelay	250		/* msecs, RFC 8305 recommended default */
+#define kMinConnectAttemptDelay	100		/* msecs */
+#define kMaxConnectAttemptDelay	2000	/* msecs */
+#define kPort445GraceTime		1000	/* msecs to wait for 445 once 139 connected */
+#define kAddressDeadTime		60		/* secs a failed address is tried last */
+#define kAddressHistoryMax		128
+
+struct address_key {
+	sa_family_t family;
+	in_port_t port;
+	uint32_t scope;
+	uint8_t addr[16];
+};
+
+struct address_history {
+	struct address_history *next;
+	struct address_key key;
+	uint32_t rtt;				/* smoothed connect time in msecs */
+	time_t failed;				/* last time the connect failed */
+};
+
+static pthread_mutex_t address_history_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct address_history *address_history_list = NULL;
+static int address_history_cnt = 0;
+
+struct connect_attempt {
+	struct connectAddress *conn;
+	struct address_key key;
+	struct timeval start;
+	uint64_t rank;
+	CFIndex index;
+	int inflight;
+};
+
+static in_port_t getConnectAddressPort(struct connectAddress *conn)
+{
+	switch (conn->addr.sa_family) {
+		case AF_NETBIOS:
+			return ntohs(conn->nb.snb_addrin.sin_port);
+		case PF_INET6:
+			return ntohs(conn->in6.sin6_port);
+		default:
+			/* Must be IPv4 */
+			return ntohs(conn->in4.sin_port);
+	}
+}
+
+static void getAddressKey(struct connectAddress *conn, struct address_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->family = conn->addr.sa_family;
+	key->port = getConnectAddressPort(conn);
+	switch (conn->addr.sa_family) {
+		case AF_NETBIOS:
+			memcpy(key->addr, &conn->nb.snb_addrin.sin_addr, 
+				   sizeof(conn->nb.snb_addrin.sin_addr));
+			break;
+		case PF_INET6:
+			memcpy(key->addr, &conn->in6.sin6_addr, sizeof(conn->in6.sin6_addr));
+			key->scope = conn->in6.sin6_scope_id;
+			break;
+		default:
+			memcpy(key->addr, &conn->in4.sin_addr, sizeof(conn->in4.sin_addr));
+			break;
+	}
+}
+
+static uint32_t elapsedMSecs(struct timeval *start, struct timeval *end)
+{
+	int64_t msecs;
+	
+	msecs = ((int64_t)(end->tv_sec - start->tv_sec) * 1000) + 
+			((end->tv_usec - start->tv_usec) / 1000);
+	return (msecs > 0) ? (uint32_t)msecs : 0;
+}
+
+static void addMSecs(struct timeval *tv, uint32_t msecs)
+{
+	tv->tv_sec += msecs / 1000;
+	tv->tv_usec += (msecs % 1000) * 1000;
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+/*
+ * Called with the history lock held.
+ */
+static struct address_history *findAddressHistory(struct address_key *key)
+{
+	struct address_history *history;
+	
+	for (history = address_history_list; history; history = history->next) {
+		if (memcmp(&history->key, key, sizeof(*key)) == 0) {
+			break;
+		}
+	}
+	return history;
+}
+
+/*
+ * Record how the connect to this address went.
+ */
+static void updateAddressHistory(struct address_key *key, int error, uint32_t rtt)
+{
+	struct address_history *history, **historyp;
+	
+	pthread_mutex_lock(&address_history_lock);
+	
+	/* Pull it out of the list, we always put it back at the front */
+	for (historyp = &address_history_list; (history = *historyp) != NULL; 
+		 historyp = &history->next) {
+		if (memcmp(&history->key, key, sizeof(*key)) == 0) {
+			*historyp = history->next;
+			break;
+		}
+	}
+	
+	if (history == NULL) {
+		if (address_history_cnt >= kAddressHistoryMax) {
+			/* Full, drop the least recently used which is always at the end */
+			for (historyp = &address_history_list; (*historyp)->next; 
+				 historyp = &(*historyp)->next)
+				;
+			free(*historyp);
+			*historyp = NULL;
+			address_history_cnt--;
+		}
+		history = calloc(1, sizeof(*history));
+		if (history == NULL) {
+			goto done;
+		}
+		history->key = *key;
+		address_history_cnt++;
+	}
+	
+	if (error) {
+		history->failed = time(NULL);
+	}
+	else {
+		history->failed = 0;
+		if (rtt == 0) {
+			rtt = 1;
+		}
+		/* Smooth it the same way TCP does, 1/8 of the new sample */
+		history->rtt = (history->rtt) ? ((history->rtt * 7) + rtt) / 8 : rtt;
+	}
+	history->next = address_history_list;
+	address_history_list = history;
+	
+done:
+	pthread_mutex_unlock(&address_history_lock);
+}
+
+static int compareConnectAttempts(const void *arg1, const void *arg2)
+{
+	const struct connect_attempt *attempt1 = arg1;
+	const struct connect_attempt *attempt2 = arg2;
+	
+	if (attempt1->rank != attempt2->rank) {
+		return (attempt1->rank < attempt2->rank) ? -1 : 1;
+	}
+	return (attempt1->index < attempt2->index) ? -1 : 1;
+}
+
+/*
+ * Put the addresses in the order we want to try them. Lower ranks go first.
+ */
+static void sortConnectAttempts(struct connect_attempt *attempts, CFIndex count)
+{
+	struct address_history *history;
+	uint64_t inet_cnt = 0, inet6_cnt = 0;
+	time_t now = time(NULL);
+	CFIndex ii;
+	
+	pthread_mutex_lock(&address_history_lock);
+	for (ii = 0; ii < count; ii++) {
+		struct connect_attempt *attempt = &attempts[ii];
+		uint64_t port139 = (attempt->key.port == SMB_TCP_PORT_445) ? 0 : 1;
+		
+		history = findAddressHistory(&attempt->key);
+		if (history && history->failed && 
+			((history->failed + kAddressDeadTime) > now)) {
+			/* Failed recently, try it last */
+			attempt->rank = (2ULL << 32) + (port139 << 16) + ii;
+		}
+		else if (history && history->rtt) {
+			/* Worked before, fastest first */
+			attempt->rank = (port139 << 31) + history->rtt;
+		}
+		else if (attempt->key.family == PF_INET6) {
+			/* Never seen it, alternate families starting with IPv6 */
+			attempt->rank = (1ULL << 32) + (port139 << 16) + (inet6_cnt++ * 2);
+		}
+		else {
+			attempt->rank = (1ULL << 32) + (port139 << 16) + (inet_cnt++ * 2) + 1;
+		}
+	}
+	pthread_mutex_unlock(&address_history_lock);
+	
+	qsort(attempts, count, sizeof(*attempts), compareConnectAttempts);
+}
+
+/*
+ * How long to wait before starting the attempt after this one. If we have
+ * seen this address before use twice its connect time, otherwise use the
+ * default.
+ */
+static uint32_t getConnectAttemptDelay(struct connect_attempt *attempt)
+{
+	struct address_history *history;
+	uint32_t delay = kConnectAttemptDelay;
+	
+	pthread_mutex_lock(&address_history_lock);
+	history = findAddressHistory(&attempt->key);
+	if (history && history->rtt && !history->failed) {
+		delay = history->rtt * 2;
+		if (delay < kMinConnectAttemptDelay) {
+			delay = kMinConnectAttemptDelay;
+		}
+		else if (delay > kMaxConnectAttemptDelay) {
+			delay = kMaxConnectAttemptDelay;
+		}
+	}
+	pthread_mutex_unlock(&address_history_lock);
+	return delay;
+}
+
+/*
+ * Start a non blocking connect. Returns zero if the connect is in progress.
+ */
+static int startConnectAttempt(struct connect_attempt *attempt)
+{
+	struct connectAddress *conn = attempt->conn;
+	int error;
+	
+	if (conn->addr.sa_family == AF_NETBIOS)
+		conn->so = nonBlockingSocket(AF_INET);
+	else	
+		conn->so = nonBlockingSocket(conn->addr.sa_family);
+	
+	if (conn->so < 0) {
+		/* Socket called failed, so skip this address */
+		return EIO;
+	}
+	
+	gettimeofday(&attempt->start, NULL);
+	
+	/* Connect to the address */
+	if (conn->addr.sa_family == AF_NETBIOS) {
+		error = connect(conn->so, (struct sockaddr *)&conn->nb.snb_addrin, conn->nb.snb_addrin.sin_len);
+	}
+	else {
+		error = connect(conn->so, &conn->addr, conn->addr.sa_len);
+	}
+	
+	/* This is a non blocking, so we expect EINPROGRESS */
+	if ((error < 0) && (errno != EINPROGRESS)) {
+		error = errno;
+		smb_log_info("%s: Connection %ld failed, family = %d, syserr = %s", 
+					 ASL_LEVEL_DEBUG, __FUNCTION__, attempt->index, 
+					 conn->addr.sa_family, strerror(error));
+		close (conn->so);
+		conn->so = -1;
+		return error;
+	}
+	
+	attempt->inflight = TRUE;
+	return 0;
+}
+
 int findReachableAddress(CFMutableArrayRef addressArray, uint16_t *cancel, struct connectAddress **dest)
 {
-	struct timeval tv;
+	struct timeval tv, now, begin, next_start, port139_time;
 	int error = 0;
 	fd_set writefds;
-	int	nfds = 0;
-	CFIndex ii, numAddresses =  CFArrayGetCount(addressArray);
-	int32_t totalWaitTime = 0;
+	int	nfds;
+	CFIndex ii, next, count = 0, inflight = 0;
+	CFIndex numAddresses = CFArrayGetCount(addressArray);
 	CFMutableDataRef dataRef;
 	struct connectAddress *conn;
 	struct connectAddress *conn_port139 = NULL;
 	struct connectAddress *conn_port445 = NULL;
-    in_port_t port;
+	struct connect_attempt *attempts = NULL;
+	uint32_t wait, remaining;
 	
 	*dest = NULL;
-	FD_ZERO(&writefds);
 	
-	/* Attempt to connect to all addresses non blocking */
+	attempts = calloc(numAddresses ? numAddresses : 1, sizeof(*attempts));
+	if (attempts == NULL) {
+		return ENOMEM;
+	}
+	
 	for (ii = 0; ii < numAddresses; ii++) {
 		dataRef = (CFMutableDataRef)CFArrayGetValueAtIndex(addressArray, ii);
 		if (!dataRef)
@@ -519,231 +809,226 @@ int findReachableAddress(CFMutableArrayRef addressArray, uint16_t *cancel, struc
 		conn = (struct connectAddress *)((void *)CFDataGetMutableBytePtr(dataRef));
 		if (!conn)
 			continue;
-					
+		
+		conn->so = -1;
+		attempts[count].conn = conn;
+		attempts[count].index = ii;
+		getAddressKey(conn, &attempts[count].key);
+		count++;
+	}
+	sortConnectAttempts(attempts, count);
+	
+	gettimeofday(&begin, NULL);
+	next_start = begin;
+	port139_time = begin;
+	next = 0;
+	
+	for (;;) {
 		if ( (cancel) && (*cancel == TRUE) ) {
 			smb_log_info("%s: Connection cancelled", ASL_LEVEL_DEBUG, __FUNCTION__);
 			error = ECANCELED;
 			goto done;
 		}
 		
-		if (conn->addr.sa_family == AF_NETBIOS)
-			conn->so = nonBlockingSocket(AF_INET);
-		else	
-			conn->so = nonBlockingSocket(conn->addr.sa_family);
+		gettimeofday(&now, NULL);
 		
-		if (conn->so < 0) {
-			/* Socket called failed, so skip this address */
+		/* 
+		 * Start the next attempt when its time, or right away if nothing is 
+		 * in progress. Never start a new one once we waited too long.
+		 */
+		if ((next < count) && (elapsedMSecs(&begin, &now) < (kMaxTimeToWait * 1000)) &&
+			((inflight == 0) || !timercmp(&now, &next_start, <))) {
+			struct connect_attempt *attempt = &attempts[next++];
+			
+			error = startConnectAttempt(attempt);
+			if (error) {
+				updateAddressHistory(&attempt->key, error, 0);
+				/* Failed right away, so start the next one now */
+				next_start = now;
+			}
+			else {
+				inflight++;
+				next_start = now;
+				addMSecs(&next_start, getConnectAttemptDelay(attempt));
+			}
+			error = 0;
 			continue;
 		}
-        
-		/* Connect to the address */
-		if (conn->addr.sa_family == AF_NETBIOS) {
-			error = connect(conn->so, (struct sockaddr *)&conn->nb.snb_addrin, conn->nb.snb_addrin.sin_len);
-        }
-		else {
-			error = connect(conn->so, &conn->addr, conn->addr.sa_len);
-        }
-        
-		if (error < 0) {
-			/* This is a non blocking, so we expect EINPROGRESS */
-			if (errno == EINPROGRESS) {
-				FD_SET(conn->so, &writefds); /* add socket into set for the select call */
-				if (conn->so > nfds)		/* save max fd for select call */
-					nfds = conn->so;
-			} else {
-				/* Connection failed skip this address */
-				smb_log_info("%s: Connection %ld failed, family = %d, syserr = %s", 
-							 ASL_LEVEL_DEBUG, __FUNCTION__, ii, 
-							 conn->addr.sa_family, strerror(errno));
-				close (conn->so);
-				conn->so = -1;
+		
+		if (inflight == 0) {
+			/* Nothing left to try */
+			goto done;
+		}
+		
+		if (elapsedMSecs(&begin, &now) >= (kMaxTimeToWait * 1000)) {
+			/* Time limit expired */
+			goto done;
+		}
+		
+		if (conn_port139 != NULL) {
+			if (elapsedMSecs(&port139_time, &now) >= kPort445GraceTime) {
+				/* 
+				 * Found a port 139 connection, we waited a little longer to
+				 * see if a port 445 connection will be found and it was not
+				 * found so just use the 139 connection.
+				 */
+				goto done;
 			}
-			continue;
 		}
-	}
-	
-	/* Wait for one or more connects to complete */
-	while (nfds && (totalWaitTime < kMaxTimeToWait)) { 
-		tv.tv_sec = kPollSeconds; 
-		tv.tv_usec = 0; 
+		
+		/* Work out how long we can wait */
+		wait = kPollSeconds * 1000;
+		if ((next < count) && timercmp(&now, &next_start, <)) {
+			remaining = elapsedMSecs(&now, &next_start);
+			if (remaining < wait) {
+				wait = remaining ? remaining : 1;
+			}
+		}
+		if (conn_port139 != NULL) {
+			remaining = kPort445GraceTime - elapsedMSecs(&port139_time, &now);
+			if (remaining < wait) {
+				wait = remaining ? remaining : 1;
+			}
+		}
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		
+		/* Wait for one or more connects to complete */
+		FD_ZERO(&writefds);
+		nfds = 0;
+		for (ii = 0; ii < next; ii++) {
+			if (!attempts[ii].inflight)
+				continue;
+			FD_SET(attempts[ii].conn->so, &writefds);
+			if (attempts[ii].conn->so > nfds)	/* save max fd for select call */
+				nfds = attempts[ii].conn->so;
+		}
+		
 		error = select(nfds + 1, NULL, &writefds, NULL, &tv);
-        
 		if (error < 0) {
 			/* We treat EAGAIN or EINTR the same as a timeout */
 			if ((errno == EAGAIN) || (errno == EINTR)) {
 				error = 0;
-			} else {
-				/* Not sure what went wrong here just get out */
-				error = errno;
-				smb_log_info("%s: Select call failed, syserr = %s", 
-							 ASL_LEVEL_DEBUG, __FUNCTION__, strerror(error));
-				goto done;
+				continue;
 			}
+			/* Not sure what went wrong here just get out */
+			error = errno;
+			smb_log_info("%s: Select call failed, syserr = %s", 
+						 ASL_LEVEL_DEBUG, __FUNCTION__, strerror(error));
+			goto done;
 		}
-        
-		if (error > 0) {
-			/* One or more sockets finished */
-			nfds = 0;
-			error = 0;
-			for (ii = 0; ii < numAddresses; ii++) {
-				socklen_t dummy;
-
-				dataRef = (CFMutableDataRef)CFArrayGetValueAtIndex(addressArray, ii);
-				if (!dataRef)
-					continue;
-				
-				conn = (struct connectAddress *)((void *)CFDataGetMutableBytePtr(dataRef));
-				if (!conn)
-					continue;
-				
-				/* This socket already failed, so skip this connection */
-				if (conn->so < 0)
-					continue;
-				
-				if (FD_ISSET(conn->so, &writefds) == 0) {
-					/* Connection hasn't completed, so skip it */
-					FD_SET (conn->so, &writefds);
-					if (conn->so > nfds)
-						nfds = conn->so;
-					continue;
-				}
-				
-				/* 
-				 * See what error came back.  SO_ERROR gives us an exact error 
-				 * for why the connect failed 
-				 */
-				dummy = sizeof(int); 
-				if (getsockopt(conn->so, SOL_SOCKET, SO_ERROR, (void*)(&error), &dummy) < 0) {
-					error = errno;	/* Handle this below */
-					smb_log_info("%s: getsockopt failed, syserr = %s", 
-								 ASL_LEVEL_DEBUG, __FUNCTION__, strerror(errno));
-				}
-                
-				if (error) {
-					if (error != EINPROGRESS) {
-						smb_log_info("%s: Connection failed, syserr = %s", 
-									 ASL_LEVEL_DEBUG, __FUNCTION__, strerror(error));
-						/* We treat all other errors as a connection failure */
-						FD_CLR (conn->so, &writefds);
-						close (conn->so);
-						conn->so = -1;
-					} else {
-						FD_SET (conn->so, &writefds);
-						if (conn->so > nfds)		/* save max fd for select call */
-							nfds = conn->so;
-					}
-					error = 0;
-					continue;
-				}
-                
-				/* 
-                 * A connection completed. If its port 445, then we are done.
-                 * If its port 139, check the others and see if we have a port 
-                 * 445 completed yet. We prefer port 445 over 139.
-                 */
-                switch (conn->addr.sa_family) {
-                    case AF_NETBIOS:
-                        port = ntohs(conn->nb.snb_addrin.sin_port);
-                        break;
-                    case PF_INET6:
-                        port = ntohs(conn->in6.sin6_port);
-                        break;
-                        
-                    default:
-                        /* Must be IPv4 */
-                        port = ntohs(conn->in4.sin_port);
-                        break;
-                }
-                
-                if (port == SMB_TCP_PORT_445) {
-                    if (conn_port445 == NULL) {
-                        /* save the first one that connected */
-                        conn_port445 = conn;
-                    }
-                }
-                else {
-                    if (conn_port139 == NULL) {
-                        /* save the first one that connected */
-                        conn_port139 = conn;
-                    }
-                }
-
-                if (conn_port445 != NULL) {
-                    /* Found a port 445, so we are done */
-                    goto done;
-                }
+		if (error == 0) {
+			/* Time to start another attempt, or check the time limits */
+			continue;
+		}
+		
+		/* One or more sockets finished */
+		error = 0;
+		gettimeofday(&now, NULL);
+		for (ii = 0; ii < next; ii++) {
+			struct connect_attempt *attempt = &attempts[ii];
+			socklen_t dummy;
+			
+			conn = attempt->conn;
+			if (!attempt->inflight || (FD_ISSET(conn->so, &writefds) == 0)) {
+				/* Connection hasn't completed, so skip it */
+				continue;
 			}
-		} else {
-			/* time limit expired */
-			totalWaitTime += kPollSeconds;
 			
-			if ( (cancel) && (*cancel == TRUE) ) {
-				smb_log_info("%s: Connection cancelled", ASL_LEVEL_DEBUG, __FUNCTION__);
-				error = ECANCELED;
-				goto done;
+			/* 
+			 * See what error came back.  SO_ERROR gives us an exact error 
+			 * for why the connect failed 
+			 */
+			dummy = sizeof(int); 
+			if (getsockopt(conn->so, SOL_SOCKET, SO_ERROR, (void*)(&error), &dummy) < 0) {
+				error = errno;	/* Handle this below */
+				smb_log_info("%s: getsockopt failed, syserr = %s", 
+							 ASL_LEVEL_DEBUG, __FUNCTION__, strerror(errno));
 			}
 			
-            if ((conn_port139 != NULL) && (totalWaitTime > kPollSeconds)) {
-                /* 
-                 * Found a port 139 connection, we waited one more time to see
-                 * if port 445 connection will be found and it was not found
-                 * so just use the 139 connection. I dont think this can ever 
-                 * happen as port 445 always seems to be supported and found.
-                 */
-                goto done;
-            }
-
+			if (error == EINPROGRESS) {
+				error = 0;
+				continue;
+			}
+			
+			attempt->inflight = FALSE;
+			inflight--;
+			
+			if (error) {
+				smb_log_info("%s: Connection %ld failed, syserr = %s", 
+							 ASL_LEVEL_DEBUG, __FUNCTION__, attempt->index,
+							 strerror(error));
+				/* We treat all other errors as a connection failure */
+				updateAddressHistory(&attempt->key, error, 0);
+				close (conn->so);
+				conn->so = -1;
+				/* Start the next one now */
+				next_start = now;
+				error = 0;
+				continue;
+			}
+			
+			updateAddressHistory(&attempt->key, 0, 
+								 elapsedMSecs(&attempt->start, &now));
 			
-            /* we are going to do the select call again, so setup the FD list */
-			nfds = 0;
-			for (ii = 0; ii < numAddresses; ii++) {
-				dataRef = (CFMutableDataRef)CFArrayGetValueAtIndex(addressArray, ii);
-				if (!dataRef)
-					continue;
-				conn = (struct connectAddress *)((void *)CFDataGetMutableBytePtr(dataRef));
-				if (!conn)
-					continue;
-				
-				if (conn->so < 0)
-					continue;
-				
-				if (FD_ISSET(conn->so, &writefds) == 0) {
-					FD_SET (conn->so, &writefds);
-					if (conn->so > nfds)		/* save max fd for select call */
-						nfds = conn->so;
-				}
+			/* 
+			 * A connection completed. If its port 445, then we are done.
+			 * If its port 139, give port 445 a little longer. We prefer
+			 * port 445 over 139.
+			 */
+			if (attempt->key.port == SMB_TCP_PORT_445) {
+				conn_port445 = conn;
+				goto done;
+			}
+			if (conn_port139 == NULL) {
+				/* save the first one that connected */
+				conn_port139 = conn;
+				port139_time = now;
+			}
+		}
+		
+		if ((conn_port139 != NULL) && (inflight == 0)) {
+			/* Nothing left that could get us a port 445 connection */
+			for (ii = next; ii < count; ii++) {
+				if (attempts[ii].key.port == SMB_TCP_PORT_445)
+					break;
+			}
+			if (ii == count) {
+				goto done;
 			}
 		}
 	}
 	
 done:
-    if (conn_port445 != NULL) {
-        *dest = conn_port445;
-    }
-    else {
-        if (conn_port139 != NULL) {
-            smb_log_info("%s: Using port 139 family = %d",
-                         ASL_LEVEL_ERR, __FUNCTION__,
-                         (conn != NULL) ? conn->addr.sa_family : 0);
-            *dest = conn_port139;
-        }
-    }
+	if (conn_port445 != NULL) {
+		*dest = conn_port445;
+	}
+	else if (conn_port139 != NULL) {
+		smb_log_info("%s: Using port 139 family = %d",
+					 ASL_LEVEL_ERR, __FUNCTION__, conn_port139->addr.sa_family);
+		*dest = conn_port139;
+	}
+	else if (!error) {
+		/* Anything still going never made it, remember that */
+		for (ii = 0; ii < next; ii++) {
+			if (attempts[ii].inflight) {
+				updateAddressHistory(&attempts[ii].key, ETIMEDOUT, 0);
+			}
+		}
+	}
     
 	if (!error && (*dest == NULL))
 		error = ETIMEDOUT;
     
 	/* close all open sockets */
-	for (ii = 0; ii < numAddresses; ii++) {
-		dataRef = (CFMutableDataRef)CFArrayGetValueAtIndex(addressArray, ii);
-		if (!dataRef)
-			continue;
-		conn = (struct connectAddress *)((void *)CFDataGetMutableBytePtr(dataRef));
-		if (!conn)
-			continue;
-		
-		if (conn->so != -1)
+	for (ii = 0; ii < count; ii++) {
+		conn = attempts[ii].conn;
+		if (conn->so != -1) {
 			close (conn->so);
+			conn->so = -1;
+		}
 	}
+	free(attempts);
     
 	return error;
 }
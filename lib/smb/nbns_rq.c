@@ -33,6 +33,8 @@
  *
  * $Id: nbns_rq.c,v 1.13.140.1 2006/04/14 23:49:37 gcolley Exp $
  */
+#include <pthread.h>
+
 #include <netsmb/netbios.h>
 #include <sys/smb_byte_order.h>
 #include <netsmb/upi_mbuf.h>
@@ -70,6 +72,10 @@ struct nbns_rq {
 	int		nr_flags; /* endian-ness depends on host */
 	int		nr_fd;
 	int32_t	nr_timo;
+	struct sockaddr_in *nr_dests;	/* when querying several WINS servers */
+	int		nr_ndests;
+	int		nr_nreplies;
+	uint8_t	*nr_replied;	/* which of nr_dests have sent an error reply */
 };
 
 static struct nb_ifdesc *nb_iflist;
@@ -120,6 +126,8 @@ static void nbns_rq_done(struct nbns_rq *rqp)
 		close(rqp->nr_fd);
 	mb_done(&rqp->nr_rq);
 	md_done(&rqp->nr_rp);
+	if (rqp->nr_replied)
+		free(rqp->nr_replied);
 	free(rqp);
 }
 
@@ -167,6 +175,9 @@ static int nbns_rq_recv(struct nbns_rq *rqp)
 	FD_ZERO(&ex);
 	FD_SET(s, &rd);
 	
+	/* Parse any new reply from the start */
+	md_initm(mdp, mdp->md_top);
+	
 	tv.tv_sec = 0;
 	tv.tv_usec = 500000; /* We wait half a second for a response */
 	
@@ -215,11 +226,46 @@ static int nbns_rq_send(struct nbns_rq *rqp)
 {
 	mbchain_t mbp = &rqp->nr_rq;
 	int s = rqp->nr_fd;
+	int ii, sent = 0, error = 0;
 	
-	if (sendto(s, mbuf_data(mbp->mb_top), mbp->mb_count, 0,
-			   (struct sockaddr*)&rqp->nr_dest, (socklen_t)sizeof(rqp->nr_dest)) < 0)
-		return errno;
-	return 0;
+	if (rqp->nr_ndests == 0) {
+		if (sendto(s, mbuf_data(mbp->mb_top), mbp->mb_count, 0,
+				   (struct sockaddr*)&rqp->nr_dest, (socklen_t)sizeof(rqp->nr_dest)) < 0)
+			return errno;
+		return 0;
+	}
+	
+	/* 
+	 * Send it to all of them, we only fail if we could not send to any. No
+	 * point in asking the ones that already said no again.
+	 */
+	for (ii = 0; ii < rqp->nr_ndests; ii++) {
+		if (rqp->nr_replied && rqp->nr_replied[ii])
+			continue;
+		if (sendto(s, mbuf_data(mbp->mb_top), mbp->mb_count, 0,
+				   (struct sockaddr*)&rqp->nr_dests[ii], 
+				   (socklen_t)sizeof(rqp->nr_dests[ii])) < 0)
+			error = errno;
+		else
+			sent++;
+	}
+	return (sent) ? 0 : error;
+}
+
+/*
+ * Find which of the servers we asked sent this reply, -1 if it isn't one of
+ * them.
+ */
+static int nbns_rq_dest_index(struct nbns_rq *rqp)
+{
+	int ii;
+	
+	for (ii = 0; ii < rqp->nr_ndests; ii++) {
+		if ((rqp->nr_dests[ii].sin_addr.s_addr == rqp->nr_sender.sin_addr.s_addr) &&
+			(rqp->nr_dests[ii].sin_port == rqp->nr_sender.sin_port))
+			return ii;
+	}
+	return -1;
 }
 
 static int nbns_rq_run(struct nbns_rq *rqp, uint16_t *cancel)
@@ -227,9 +273,14 @@ static int nbns_rq_run(struct nbns_rq *rqp, uint16_t *cancel)
 	mdchain_t mdp;
 	uint16_t rpid;
 	uint8_t nmflags;
-	int error, retrycount;
+	int error, retrycount, need_send, ii;
 	
 	rqp->nr_if = nb_iflist;
+	if (rqp->nr_ndests && (rqp->nr_replied == NULL)) {
+		rqp->nr_replied = calloc(rqp->nr_ndests, sizeof(*rqp->nr_replied));
+		if (rqp->nr_replied == NULL)
+			return ENOMEM;
+	}
 again:
 	error = nbns_rq_opensocket(rqp);
 	if (error)
@@ -241,15 +292,21 @@ again:
 	 * wait. So NetBIOSResolverTimeout * 2 is the number of retries we will attmept.
 	 */
 	retrycount = rqp->nr_timo * 2;
+	need_send = TRUE;
 	for (;;) {
 		if (cancel && *cancel)
 			return ECANCELED;
 		
-		error = nbns_rq_send(rqp);
-		if (error)
-			return error;
+		/* Only resend after a time out, not after a reply we ignored */
+		if (need_send) {
+			error = nbns_rq_send(rqp);
+			if (error)
+				return error;
+			need_send = FALSE;
+		}
 		error = nbns_rq_recv(rqp);
 		if (error) {
+			need_send = TRUE;
 			if (error != ETIMEDOUT || --retrycount == 0) {
 				if ((rqp->nr_nmflags & NBNS_NMFLAG_BCAST) &&
 				    rqp->nr_if != NULL &&
@@ -266,18 +323,39 @@ again:
 		if (md_get_uint16be(mdp, &rpid))
 			return EINVAL;
 		
-		if (rpid != rqp->nr_trnid)
+		if (rpid != rqp->nr_trnid) {
+			/* With several servers a late reply to an older query can show up */
+			if (rqp->nr_ndests && (--retrycount > 0))
+				continue;
+			return EINVAL;
+		}
+		
+		if (md_get_uint8(mdp, &nmflags))
+			return EINVAL;
+		
+		rqp->nr_rpnmflags = (nmflags & 7) << 4;
+		if (md_get_uint8(mdp, &nmflags))
 			return EINVAL;
+		rqp->nr_rpnmflags |= (nmflags & 0xf0) >> 4;
+		rqp->nr_rprcode = nmflags & 0xf;
+		
+		/*
+		 * When asking several servers, an error from one of them just means
+		 * we wait for the others. First good answer wins. Only count each
+		 * server once, a fast server answering every resend shouldn't end
+		 * the wait before a slower one that knows the name gets to answer.
+		 */
+		if (rqp->nr_rprcode && rqp->nr_ndests) {
+			ii = nbns_rq_dest_index(rqp);
+			if ((ii >= 0) && !rqp->nr_replied[ii]) {
+				rqp->nr_replied[ii] = 1;
+				rqp->nr_nreplies++;
+			}
+			if ((rqp->nr_nreplies < rqp->nr_ndests) && (--retrycount > 0))
+				continue;
+		}
 		break;
 	}
-	if (md_get_uint8(mdp, &nmflags))
-		return EINVAL;
-	
-	rqp->nr_rpnmflags = (nmflags & 7) << 4;
-	if (md_get_uint8(mdp, &nmflags))
-		return EINVAL;
-	rqp->nr_rpnmflags |= (nmflags & 0xf0) >> 4;
-	rqp->nr_rprcode = nmflags & 0xf;
 	if (rqp->nr_rprcode)
 		return nb_error_to_errno(rqp->nr_rprcode);
 	
@@ -335,38 +413,183 @@ static int nbns_rq_prepare(struct nbns_rq *rqp)
 	return 0;
 }
 
+/*
+ * NetBIOS name cache.
+ *
+ * Every lookup used to go out on the wire, so a tool that looks up the same
+ * name over and over paid the full WINS or broadcast cost every time. We
+ * keep the answers, good and bad, for the life of the process. Positive
+ * answers are kept for the TTL the name server gave us, but never longer
+ * than NBNS_CACHE_MAX_TTL. Names nobody knows about are kept for
+ * NBNS_CACHE_NEG_TTL so we do not keep waiting on timeouts for them.
+ */
+#define NBNS_CACHE_MAX_ENTRIES	128
+#define NBNS_CACHE_MAX_TTL		600		/* secs */
+#define NBNS_CACHE_NEG_TTL		30		/* secs */
+
+struct nbns_cache_entry {
+	struct nbns_cache_entry *next;
+	char name[NB_NAMELEN + 1];
+	uint8_t nodeType;
+	int error;					/* non zero for a negative entry */
+	int naddrs;
+	struct in_addr *addrs;
+	struct sockaddr_in sender;
+	time_t expires;
+};
+
+static pthread_mutex_t nbns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nbns_cache_entry *nbns_cache_list = NULL;
+static int nbns_cache_cnt = 0;
+
+static void nbns_cache_free_entry(struct nbns_cache_entry *entry)
+{
+	if (entry->addrs)
+		free(entry->addrs);
+	free(entry);
+}
+
+/*
+ * Called with the cache lock held. Frees any expired entries and returns the
+ * entry for this name, if one exists.
+ */
+static struct nbns_cache_entry **nbns_cache_find(const char *name, uint8_t nodeType)
+{
+	struct nbns_cache_entry **entryp = &nbns_cache_list;
+	struct nbns_cache_entry **found = NULL;
+	struct nbns_cache_entry *entry;
+	time_t now = time(NULL);
+	
+	while ((entry = *entryp) != NULL) {
+		if (entry->expires <= now) {
+			*entryp = entry->next;
+			nbns_cache_free_entry(entry);
+			nbns_cache_cnt--;
+			continue;
+		}
+		if ((entry->nodeType == nodeType) && (strcasecmp(entry->name, name) == 0))
+			found = entryp;
+		entryp = &entry->next;
+	}
+	return found;
+}
+
+/*
+ * Look the name up in the cache. Returns TRUE if we have an entry for it,
+ * with the cached error or a copy of the cached addresses.
+ */
+static int nbns_cache_lookup(struct nb_ctx *ctx, const char *name, uint8_t nodeType,
+							 struct in_addr **addrs, int *naddrs, int *error)
+{
+	struct nbns_cache_entry **entryp, *entry;
+	int found = FALSE;
+	
+	*addrs = NULL;
+	*naddrs = 0;
+	pthread_mutex_lock(&nbns_cache_lock);
+	entryp = nbns_cache_find(name, nodeType);
+	if (entryp == NULL) {
+		goto done;
+	}
+	entry = *entryp;
+	if (entry->error) {
+		*error = entry->error;
+		found = TRUE;
+	} else {
+		*addrs = malloc(entry->naddrs * sizeof(struct in_addr));
+		if (*addrs) {
+			memcpy(*addrs, entry->addrs, entry->naddrs * sizeof(struct in_addr));
+			*naddrs = entry->naddrs;
+			ctx->nb_sender = entry->sender;
+			*error = 0;
+			found = TRUE;
+		}
+	}
+done:
+	pthread_mutex_unlock(&nbns_cache_lock);
+	return found;
+}
+
+static void nbns_cache_enter(struct nb_ctx *ctx, const char *name, uint8_t nodeType, 
+							 int error, struct in_addr *addrs, int naddrs, uint32_t ttl)
+{
+	struct nbns_cache_entry **entryp, *entry;
+	
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return;
+	strlcpy(entry->name, name, sizeof(entry->name));
+	entry->nodeType = nodeType;
+	if (error) {
+		entry->error = error;
+		ttl = NBNS_CACHE_NEG_TTL;
+	} else {
+		if ((ttl == 0) || (naddrs == 0)) {
+			/* Server does not want it cached */
+			free(entry);
+			return;
+		}
+		entry->addrs = malloc(naddrs * sizeof(struct in_addr));
+		if (entry->addrs == NULL) {
+			free(entry);
+			return;
+		}
+		memcpy(entry->addrs, addrs, naddrs * sizeof(struct in_addr));
+		entry->naddrs = naddrs;
+		entry->sender = ctx->nb_sender;
+		if (ttl > NBNS_CACHE_MAX_TTL)
+			ttl = NBNS_CACHE_MAX_TTL;
+	}
+	entry->expires = time(NULL) + ttl;
+	
+	pthread_mutex_lock(&nbns_cache_lock);
+	entryp = nbns_cache_find(name, nodeType);
+	if (entryp) {
+		/* Replace the old entry */
+		struct nbns_cache_entry *old = *entryp;
+		
+		*entryp = old->next;
+		nbns_cache_free_entry(old);
+		nbns_cache_cnt--;
+	}
+	if (nbns_cache_cnt >= NBNS_CACHE_MAX_ENTRIES) {
+		/* Full, drop the oldest entry which is always at the end */
+		for (entryp = &nbns_cache_list; (*entryp)->next; entryp = &(*entryp)->next)
+			;
+		nbns_cache_free_entry(*entryp);
+		*entryp = NULL;
+		nbns_cache_cnt--;
+	}
+	entry->next = nbns_cache_list;
+	nbns_cache_list = entry;
+	nbns_cache_cnt++;
+	pthread_mutex_unlock(&nbns_cache_lock);
+}
+
 /* 
- * Resolve a NetBIOS name to an set of address.
+ * Query the name servers for a NetBIOS name. If we were given more than one
+ * WINS server the query goes to all of them at once and the first answer 
+ * wins.
  */
-static int nbns_resolvename_internal(struct nb_ctx *ctx, struct smb_prefs *prefs, 
-							  const char *name, uint8_t nodeType,
-							  CFMutableArrayRef *outAddressArray, uint16_t port, 
-							  int allowLocalConn, int tryBothPorts, uint16_t *cancel)
+static int nbns_query_name(struct nb_ctx *ctx, struct smb_prefs *prefs, 
+						   const char *name, uint8_t nodeType,
+						   struct sockaddr_in *servers, int nservers,
+						   struct in_addr **outAddrs, int *outCount,
+						   uint32_t *outTTL, uint16_t *cancel)
 {
-	CFMutableArrayRef addressArray = NULL;
-	CFMutableDataRef addressData;
-	struct connectAddress conn;
 	struct nbns_rq *rqp;
 	struct nb_name nn;
 	struct nbns_rr rr;
-	int error, rdrcount;
+	struct in_addr *addrs = NULL;
+	int error, rdrcount, naddrs = 0;
 	u_char *current_ip, *end_of_rr;
 
-	/* If we are trying both ports always put port 139 in after port 445 */
-	if (tryBothPorts && (port == NBSS_TCP_PORT_139))
-		port = SMB_TCP_PORT_445;
-
-	if (strlen(name) > NB_NAMELEN)
-		return ENAMETOOLONG;
-
-	addressArray = CFArrayCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeArrayCallBacks);
-	if (!addressArray) {
-		return ENOMEM;
-	}
+	*outAddrs = NULL;
+	*outCount = 0;
+	*outTTL = 0;
 	
 	error = nbns_rq_create(NBNS_OPCODE_QUERY, prefs, &rqp);
 	if (error) {
-		CFRelease(addressArray);
 		return error;
 	}
 
@@ -379,6 +602,10 @@ static int nbns_resolvename_internal(struct nb_ctx *ctx, struct smb_prefs *prefs
 	rqp->nr_qdclass = NBNS_QUESTION_CLASS_IN;
 	rqp->nr_qdcount = 1;
 	memcpy(&rqp->nr_dest, &ctx->nb_ns, sizeof(rqp->nr_dest));
+	if (nservers > 1) {
+		rqp->nr_dests = servers;
+		rqp->nr_ndests = nservers;
+	}
 	error = nbns_rq_prepare(rqp);
 	if (error) {
 		goto done;
@@ -400,6 +627,9 @@ static int nbns_resolvename_internal(struct nb_ctx *ctx, struct smb_prefs *prefs
 				break;
 			bcopy(rr.rr_data, &rqp->nr_dest.sin_addr, 4);
 			rqp->nr_flags &= ~NBRQF_BROADCAST;
+			/* Only ask the server we were redirected to */
+			rqp->nr_dests = NULL;
+			rqp->nr_ndests = 0;
 			continue;
 		}
 		if (rqp->nr_rpancount == 0) {
@@ -413,87 +643,160 @@ static int nbns_resolvename_internal(struct nb_ctx *ctx, struct smb_prefs *prefs
 		/* We have an answer, so store away the address of the server that responded */
 		ctx->nb_sender = rqp->nr_sender;
 
+		/* Each entry is two bytes of flags followed by the IPv4 address */
+		addrs = malloc((rr.rr_rdlength / 6 + 1) * sizeof(struct in_addr));
+		if (addrs == NULL) {
+			error = ENOMEM;
+			break;
+		}
 		end_of_rr = rr.rr_data + rr.rr_rdlength;
-		for(current_ip = rr.rr_data + 2; current_ip < end_of_rr; current_ip += 6) {
-			bzero(&conn, sizeof(conn));
-			conn.in4.sin_len = (int)sizeof(struct sockaddr_in);
-			conn.in4.sin_family = AF_INET;
-			conn.in4.sin_port = htons(port);
-			memcpy(&conn.in4.sin_addr, current_ip, 4);
-			/* Check to make sure we are not connecting to ourself */		
-			if (isLocalIPAddress((struct sockaddr *)&conn.addr, port, allowLocalConn)) {
-				smb_log_info("The address for `%s' is a loopback address, not allowed!", 
-							 ASL_LEVEL_DEBUG, name);
-				error = ELOOP;	/* AFP returns ELOOP, so we will do the same */
-				goto done; 
-			}
+		for(current_ip = rr.rr_data + 2; current_ip + 4 <= end_of_rr; current_ip += 6) {
+			memcpy(&addrs[naddrs++], current_ip, 4);
+		}
+		*outTTL = rr.rr_ttl;
+		break;
+	} /* end big for loop */
+
+done:
+	if (!error && (naddrs == 0)) {
+		error = EHOSTUNREACH;
+	}
+	nbns_rq_done(rqp);
+	
+	if (error) {
+		if (addrs)
+			free(addrs);
+	} else {
+		*outAddrs = addrs;
+		*outCount = naddrs;
+	}
+	return error;
+}
+
+/* 
+ * Build the address array for the addresses of a NetBIOS name.
+ */
+static int nbns_create_address_array(const char *name, struct in_addr *addrs, 
+									 int naddrs, CFMutableArrayRef *outAddressArray, 
+									 uint16_t port, int allowLocalConn, int tryBothPorts)
+{
+	CFMutableArrayRef addressArray = NULL;
+	CFMutableDataRef addressData;
+	struct connectAddress conn;
+	int error = 0, ii;
+
+	/* If we are trying both ports always put port 139 in after port 445 */
+	if (tryBothPorts && (port == NBSS_TCP_PORT_139))
+		port = SMB_TCP_PORT_445;
+
+	addressArray = CFArrayCreateMutable(kCFAllocatorSystemDefault, 0, &kCFTypeArrayCallBacks);
+	if (!addressArray) {
+		return ENOMEM;
+	}
+	
+	for (ii = 0; ii < naddrs; ii++) {
+		bzero(&conn, sizeof(conn));
+		conn.in4.sin_len = (int)sizeof(struct sockaddr_in);
+		conn.in4.sin_family = AF_INET;
+		conn.in4.sin_port = htons(port);
+		conn.in4.sin_addr = addrs[ii];
+		/* Check to make sure we are not connecting to ourself */		
+		if (isLocalIPAddress((struct sockaddr *)&conn.addr, port, allowLocalConn)) {
+			smb_log_info("The address for `%s' is a loopback address, not allowed!", 
+						 ASL_LEVEL_DEBUG, name);
+			error = ELOOP;	/* AFP returns ELOOP, so we will do the same */
+			goto done; 
+		}
+		addressData = CFDataCreateMutable(NULL, 0);
+		if (addressData) {
+			/* The name is the netbios name, we need a netbios sockaddr */
+			if (port == NBSS_TCP_PORT_139)
+				convertToNetBIOSaddr(&conn.storage, name);
+			
+			CFDataAppendBytes(addressData, (const UInt8 *)&conn, (CFIndex)sizeof(conn));
+			CFArrayAppendValue(addressArray, addressData);
+			CFRelease(addressData);
+		}
+		/* We only try both ports with IPv4 */
+		if (tryBothPorts) {
+			conn.in4.sin_port = htons(NBSS_TCP_PORT_139);
+			/* The name is the netbios name, we need a netbios sockaddr */
+			convertToNetBIOSaddr(&conn.storage, name);
+			
 			addressData = CFDataCreateMutable(NULL, 0);
 			if (addressData) {
-				/* The name is the netbios name, we need a netbios sockaddr */
-				if (port == NBSS_TCP_PORT_139)
-					convertToNetBIOSaddr(&conn.storage, name);
-				
 				CFDataAppendBytes(addressData, (const UInt8 *)&conn, (CFIndex)sizeof(conn));
 				CFArrayAppendValue(addressArray, addressData);
 				CFRelease(addressData);
 			}
-			/* We only try both ports with IPv4 */
-			if (tryBothPorts) {
-				conn.in4.sin_port = htons(NBSS_TCP_PORT_139);
-				/* The name is the netbios name, we need a netbios sockaddr */
-				convertToNetBIOSaddr(&conn.storage, name);
-				
-				addressData = CFDataCreateMutable(NULL, 0);
-				if (addressData) {
-					CFDataAppendBytes(addressData, (const UInt8 *)&conn, (CFIndex)sizeof(conn));
-					CFArrayAppendValue(addressArray, addressData);
-					CFRelease(addressData);
-				}
-			}
 		}
-		break;
-	} /* end big for loop */
-
+	}
 	
 done:
-	if (CFArrayGetCount(addressArray) == 0) {
+	if (!error && (CFArrayGetCount(addressArray) == 0)) {
 		error = EHOSTUNREACH;
 	}
-	nbns_rq_done(rqp);
-	
 	if (error) {
-		if (addressArray)
-			CFRelease(addressArray);
+		CFRelease(addressArray);
 		addressArray = NULL;
 	}
 	*outAddressArray = addressArray;
-	
 	return error;
 }
 
 /* 
  * Resolve a NetBIOS name to an set of address, We always try WINS first if a
  * server is provide. If no WINS server or we fail to find one with the WINS
- * server then try broadcast.
+ * server then try broadcast. Answers come from the name cache when we have
+ * them.
  */
 int nbns_resolvename(struct nb_ctx *ctx, struct smb_prefs *prefs, const char *name, 
 					 uint8_t nodeType, CFMutableArrayRef *outAddressArray, uint16_t port, 
 					 int allowLocalConn, int tryBothPorts, uint16_t *cancel)
 {
-	int error;
+	struct sockaddr_in *servers = NULL;
+	struct in_addr *addrs = NULL;
+	int error, nservers = 0, naddrs = 0;
+	uint32_t ttl = 0;
 	
-	error = nb_ctx_resolve(ctx, prefs->WINSAddresses);
+	*outAddressArray = NULL;
+	if (strlen(name) > NB_NAMELEN)
+		return ENAMETOOLONG;
+
+	if (nbns_cache_lookup(ctx, name, nodeType, &addrs, &naddrs, &error)) {
+		smb_log_info("%s: Found `%s' in the name cache, syserr = %s", ASL_LEVEL_DEBUG, 
+					 __FUNCTION__, name, strerror(error));
+		goto done;
+	}
+	
+	error = nb_ctx_resolve_wins(ctx, prefs->WINSAddresses, &servers, &nservers);
 	if (!error)
-		error = nbns_resolvename_internal(ctx, prefs, name, nodeType, outAddressArray, 
-										  port,  allowLocalConn, tryBothPorts, cancel);
+		error = nbns_query_name(ctx, prefs, name, nodeType, servers, nservers, 
+								&addrs, &naddrs, &ttl, cancel);
 	/* We tried it with WINS and failed try broadcast now */
-	if (error && (prefs->WINSAddresses != NULL)) {
+	if (error && (error != ECANCELED) && (prefs->WINSAddresses != NULL)) {
 		error = nb_ctx_resolve(ctx, NULL);
 		if (error == 0) {
-			error = nbns_resolvename_internal(ctx, prefs, name, nodeType, outAddressArray, 
-											  port, allowLocalConn, tryBothPorts, cancel);
+			error = nbns_query_name(ctx, prefs, name, nodeType, NULL, 0, 
+									&addrs, &naddrs, &ttl, cancel);
 		}
 	}
+	
+	/* Remember the answer, but not if we just gave up */
+	if ((error == 0) || (error == ENOENT) || (error == EHOSTUNREACH) || 
+		(error == ETIMEDOUT)) {
+		nbns_cache_enter(ctx, name, nodeType, error, addrs, naddrs, ttl);
+	}
+	
+done:
+	if (!error) {
+		error = nbns_create_address_array(name, addrs, naddrs, outAddressArray, 
+										  port, allowLocalConn, tryBothPorts);
+	}
+	if (servers)
+		free(servers);
+	if (addrs)
+		free(addrs);
 	return error;
 }
 
@@ -192,6 +192,16 @@ static void readPreferenceSection(struct rcfile *rcfile, struct smb_prefs *prefs
 		if (prefs->max_resp_timeout > 600) {
 			prefs->max_resp_timeout = 600; /* 10 mins is a long, long time */
 		}
+		
+		/* Socket buffer sizes in bytes, zero lets the kernel tune them */
+		rc_getint(rcfile, sname, "tcp_sndbuf", &prefs->tcp_sndbuf);
+		if (prefs->tcp_sndbuf < 0) {
+			prefs->tcp_sndbuf = 0;
+		}
+		rc_getint(rcfile, sname, "tcp_rcvbuf", &prefs->tcp_rcvbuf);
+		if (prefs->tcp_rcvbuf < 0) {
+			prefs->tcp_rcvbuf = 0;
+		}
 	}
 	
 	/* global, server, user, or share preferences */
@@ -50,6 +50,8 @@ struct smb_prefs {
 	uint32_t			lanman_on;
 	uint32_t			signing_required;
 	int32_t             max_resp_timeout;
+	int32_t             tcp_sndbuf;
+	int32_t             tcp_rcvbuf;
 };
 
 void getDefaultPreferences(struct smb_prefs *prefs);
@@ -27,6 +27,8 @@
 #include "smbclient_internal.h"
 
 #include <stdlib.h>
+#include <pthread.h>
+#include <dispatch/dispatch.h>
 #include <pwd.h>
 #include <unistd.h>
 #include <readpassphrase.h>
@@ -46,8 +48,370 @@ struct smb_server_handle
 {
     volatile refcount_t refcount;
     struct smb_ctx * context;
+    char * pool_key;	/* Non NULL if the context can go back into the pool */
 };
 
+/*
+ * Session pool
+ *
+ * Opening a server handle resolves, negotiates, authenticates and tree
+ * connects, which is a lot of round trips for callers that open thousands of
+ * short lived handles to the same server. When the last reference to a
+ * handle from SMBOpenServerEx goes away we keep its context around, still
+ * authenticated and tree connected, and hand it to the next SMBOpenServerEx
+ * with the same target, options and identity, if it is still connected. A
+ * timer closes contexts that sit idle longer than SMB_POOL_IDLE_TIMEOUT, and
+ * whatever is left is closed when the process exits.
+ */
+#define SMB_POOL_MAX_IDLE		16
+#define SMB_POOL_IDLE_TIMEOUT	60	/* seconds */
+#define SMB_POOL_REAP_INTERVAL	15	/* seconds */
+
+struct smb_pool_entry
+{
+    struct smb_pool_entry * next;
+    char * key;
+    struct smb_ctx * context;
+    time_t idle_since;
+};
+
+static pthread_mutex_t smb_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct smb_pool_entry * smb_pool_list = NULL;
+static struct smb_pool_stats smb_pool_stats;
+static dispatch_source_t smb_pool_timer = NULL;
+static pthread_once_t smb_pool_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Return the identity an open of this context would authenticate as, or NULL
+ * if we can't tell up front, in which case the session is never pooled. The
+ * URL user name wins, otherwise it's whoever owns the default Kerberos
+ * credential. A URL that carries a password is never pooled, handing it an
+ * existing session would skip checking that password.
+ */
+static char *
+SMBPoolCreateIdentity(
+    struct smb_ctx * ctx,
+    uint64_t options)
+{
+    char * identity = NULL;
+    char * principal;
+
+    if (options & kSMBOptionUseAnonymousOnlyAuth) {
+        return strdup("anonymous");
+    }
+    if ((options & kSMBOptionUseGuestOnlyAuth) ||
+        (ctx->ct_setup.ioc_userflags & SMBV_GUEST_ACCESS)) {
+        return strdup("guest");
+    }
+    if (ctx->ct_flags & SMBCF_EXPLICITPWD) {
+        return NULL;
+    }
+    if (ctx->ct_setup.ioc_user[0]) {
+        if (asprintf(&identity, "user:%s\\%s", ctx->ct_setup.ioc_domain,
+                     ctx->ct_setup.ioc_user) < 0) {
+            return NULL;
+        }
+        return identity;
+    }
+    principal = smb_gss_default_principal();
+    if (principal == NULL) {
+        return NULL;
+    }
+    if (asprintf(&identity, "krb5:%s", principal) < 0) {
+        identity = NULL;
+    }
+    free(principal);
+    return identity;
+}
+
+/* 
+ * Did the connect really authenticate as the identity we keyed it on? Guest
+ * or anonymous fallbacks, prompted passwords and shared sessions owned by
+ * someone else don't go in the pool. A prompted password would let the next
+ * open in this process skip the prompt, so those never go in either.
+ */
+static Boolean
+SMBPoolIdentityMatches(
+    struct smb_ctx * ctx,
+    const char * identity,
+    Boolean prompted)
+{
+    const char * clientName;
+    char * userIdentity = NULL;
+    Boolean matches;
+
+    if (strcmp(identity, "anonymous") == 0) {
+        return ((ctx->ct_vc_flags & SMBV_ANONYMOUS_ACCESS) != 0);
+    }
+    if (strcmp(identity, "guest") == 0) {
+        return ((ctx->ct_vc_flags & SMBV_GUEST_ACCESS) != 0);
+    }
+    if ((ctx->ct_vc_flags & (SMBV_ANONYMOUS_ACCESS | SMBV_GUEST_ACCESS)) ||
+        prompted) {
+        return FALSE;
+    }
+    if (strncmp(identity, "user:", 5) == 0) {
+        /* The domain can get filled in during the connect, then it's no match */
+        if (asprintf(&userIdentity, "user:%s\\%s", ctx->ct_setup.ioc_domain,
+                     ctx->ct_setup.ioc_user) < 0) {
+            return FALSE;
+        }
+        matches = (strcasecmp(userIdentity, identity) == 0);
+        free(userIdentity);
+        return matches;
+    }
+    if (ctx->ct_vc_shared) {
+        clientName = (const char *)(uintptr_t)ctx->ct_setup.ioc_gss_client_name;
+        return (clientName && (strcmp(clientName, identity + 5) == 0));
+    }
+    return TRUE;
+}
+
+static char *
+SMBPoolCreateKey(
+    const char * targetServer,
+    uint64_t options,
+    const char * identity)
+{
+    char * key = NULL;
+
+    if ((targetServer == NULL) || (identity == NULL) ||
+        (options & kSMBOptionForceNewSession)) {
+        return NULL;
+    }
+    if (asprintf(&key, "%llx:%u:%s:%s", (unsigned long long)options,
+                 (unsigned)geteuid(), identity, targetServer) < 0) {
+        return NULL;
+    }
+    return key;
+}
+
+/* A pooled context is only worth handing out if its session and tree are up */
+static Boolean
+SMBPoolContextAlive(
+    struct smb_ctx * ctx)
+{
+    struct smbioc_share_properties share_prop;
+
+    if (smb_ctx_connstate(ctx) != EISCONN) {
+        return FALSE;
+    }
+    if (ctx->ct_flags & SMBCF_SHARE_CONN) {
+        memset(&share_prop, 0, sizeof(share_prop));
+        share_prop.ioc_version = SMB_IOC_STRUCT_VERSION;
+        if (smb_ioctl_call(ctx->ct_fd, SMBIOC_SHARE_PROPERTIES, &share_prop) == -1) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Called with the pool lock held. Unlinks every entry that has been idle too
+ * long, or all entries past the first maxIdle, and returns them so they can
+ * be closed without holding the lock.
+ */
+static struct smb_pool_entry *
+SMBPoolExpire(
+    int maxIdle)
+{
+    struct smb_pool_entry ** entryp = &smb_pool_list;
+    struct smb_pool_entry * expired = NULL;
+    struct smb_pool_entry * entry;
+    time_t now = time(NULL);
+    int count = 0;
+
+    while ((entry = *entryp) != NULL) {
+        if ((count >= maxIdle) ||
+            ((entry->idle_since + SMB_POOL_IDLE_TIMEOUT) <= now)) {
+            *entryp = entry->next;
+            entry->next = expired;
+            expired = entry;
+            smb_pool_stats.expired++;
+            smb_pool_stats.idle--;
+            continue;
+        }
+        count++;
+        entryp = &entry->next;
+    }
+    return expired;
+}
+
+static void
+SMBPoolFreeEntries(
+    struct smb_pool_entry * entry)
+{
+    struct smb_pool_entry * next;
+
+    for (; entry; entry = next) {
+        next = entry->next;
+        smb_ctx_done(entry->context);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+/* 
+ * Take an idle context for this key out of the pool, if we have one that is
+ * still connected. Dead ones are closed and we keep looking.
+ */
+static struct smb_ctx *
+SMBPoolTake(
+    const char * key)
+{
+    struct smb_pool_entry ** entryp;
+    struct smb_pool_entry * entry;
+    struct smb_pool_entry * expired;
+    struct smb_ctx * context;
+
+    for (;;) {
+        context = NULL;
+        pthread_mutex_lock(&smb_pool_lock);
+        expired = SMBPoolExpire(SMB_POOL_MAX_IDLE);
+        for (entryp = &smb_pool_list; (entry = *entryp) != NULL; entryp = &entry->next) {
+            if (strcmp(entry->key, key) == 0) {
+                *entryp = entry->next;
+                context = entry->context;
+                smb_pool_stats.idle--;
+                free(entry->key);
+                free(entry);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&smb_pool_lock);
+
+        SMBPoolFreeEntries(expired);
+        if ((context == NULL) || SMBPoolContextAlive(context)) {
+            break;
+        }
+        SMBLogInfo("%s: Pooled session to %s is no longer connected", 
+                   ASL_LEVEL_DEBUG, __FUNCTION__, context->serverName);
+        smb_ctx_done(context);
+        pthread_mutex_lock(&smb_pool_lock);
+        smb_pool_stats.expired++;
+        pthread_mutex_unlock(&smb_pool_lock);
+    }
+
+    pthread_mutex_lock(&smb_pool_lock);
+    if (context) {
+        smb_pool_stats.hits++;
+    } else {
+        smb_pool_stats.misses++;
+    }
+    pthread_mutex_unlock(&smb_pool_lock);
+    return context;
+}
+
+/* Close every pooled context, registered with atexit */
+static void
+SMBPoolDrain(void)
+{
+    struct smb_pool_entry * expired;
+
+    pthread_mutex_lock(&smb_pool_lock);
+    expired = SMBPoolExpire(0);
+    pthread_mutex_unlock(&smb_pool_lock);
+
+    SMBPoolFreeEntries(expired);
+}
+
+static void
+SMBPoolRegisterDrain(void)
+{
+    atexit(SMBPoolDrain);
+}
+
+/* 
+ * Timer handler, closes the contexts that have been idle too long. Once the
+ * pool is empty the timer goes away until the next park.
+ */
+static void
+SMBPoolReap(
+    void * context __unused)
+{
+    struct smb_pool_entry * expired;
+
+    pthread_mutex_lock(&smb_pool_lock);
+    expired = SMBPoolExpire(SMB_POOL_MAX_IDLE);
+    if ((smb_pool_list == NULL) && smb_pool_timer) {
+        dispatch_source_cancel(smb_pool_timer);
+        dispatch_release(smb_pool_timer);
+        smb_pool_timer = NULL;
+    }
+    pthread_mutex_unlock(&smb_pool_lock);
+
+    SMBPoolFreeEntries(expired);
+}
+
+/* Called with the pool lock held */
+static void
+SMBPoolStartTimer(void)
+{
+    if (smb_pool_timer) {
+        return;
+    }
+    smb_pool_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+                                            dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+    if (smb_pool_timer == NULL) {
+        return;
+    }
+    dispatch_source_set_timer(smb_pool_timer,
+                              dispatch_time(DISPATCH_TIME_NOW, SMB_POOL_REAP_INTERVAL * NSEC_PER_SEC),
+                              SMB_POOL_REAP_INTERVAL * NSEC_PER_SEC, NSEC_PER_SEC);
+    dispatch_source_set_event_handler_f(smb_pool_timer, SMBPoolReap);
+    dispatch_resume(smb_pool_timer);
+}
+
+/* 
+ * Put an idle context back into the pool, the pool now owns the key and the
+ * context. The most recently used context is always at the front.
+ */
+static void
+SMBPoolPark(
+    char * key,
+    struct smb_ctx * context)
+{
+    struct smb_pool_entry * entry;
+    struct smb_pool_entry * expired;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        smb_ctx_done(context);
+        free(key);
+        return;
+    }
+    entry->key = key;
+    entry->context = context;
+    entry->idle_since = time(NULL);
+
+    pthread_once(&smb_pool_once, SMBPoolRegisterDrain);
+
+    pthread_mutex_lock(&smb_pool_lock);
+    entry->next = smb_pool_list;
+    smb_pool_list = entry;
+    smb_pool_stats.parked++;
+    smb_pool_stats.idle++;
+    expired = SMBPoolExpire(SMB_POOL_MAX_IDLE);
+    SMBPoolStartTimer();
+    pthread_mutex_unlock(&smb_pool_lock);
+
+    SMBPoolFreeEntries(expired);
+}
+
+void
+SMBGetSessionPoolStatistics(
+    struct smb_pool_stats * outStats)
+{
+    struct smb_pool_entry * expired;
+
+    pthread_mutex_lock(&smb_pool_lock);
+    expired = SMBPoolExpire(SMB_POOL_MAX_IDLE);
+    *outStats = smb_pool_stats;
+    pthread_mutex_unlock(&smb_pool_lock);
+
+    SMBPoolFreeEntries(expired);
+}
+
 static NTSTATUS
 SMBLibraryInit(void)
 {
@@ -323,6 +687,12 @@ SMBMountShareEx(
         goto done;
     }
 
+	/* Mounting changes the context, never reuse it */
+	if (inConnection->pool_key) {
+		free(inConnection->pool_key);
+		inConnection->pool_key = NULL;
+	}
+
 	mOptions = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, 
 										 &kCFTypeDictionaryValueCallBacks);
 	if (mOptions == NULL) {
@@ -443,6 +813,11 @@ SMBOpenServerEx(
 
     CFMutableDictionaryRef netfsOptions = NULL;
 	CFDictionaryRef ServerParams = NULL;
+	char *		poolIdentity = NULL;
+	char *		poolKey = NULL;
+	struct smb_ctx * pooledContext;
+	Boolean		prompted = FALSE;
+	Boolean		reused = FALSE;
 
     *outConnection = NULL;
 
@@ -466,6 +841,24 @@ SMBOpenServerEx(
 	if (!NT_SUCCESS(status)) {
         goto done;
     }
+
+	/* See if we have an idle session to this server, as the same user, we can reuse */
+	if (!(options & kSMBOptionForceNewSession)) {
+		poolIdentity = SMBPoolCreateIdentity(hContext, options);
+		poolKey = SMBPoolCreateKey(targetServer, options, poolIdentity);
+	}
+	if (poolKey) {
+		pooledContext = SMBPoolTake(poolKey);
+		if (pooledContext) {
+			smb_ctx_done(hContext);
+			(*outConnection)->context = pooledContext;
+			reused = TRUE;
+			SMBLogInfo("%s: Reusing session to %s", ASL_LEVEL_DEBUG, 
+					   __FUNCTION__, pooledContext->serverName);
+			status = STATUS_SUCCESS;
+			goto done;
+		}
+	}
 	
 	err = smb_get_server_info(hContext, NULL, netfsOptions, &ServerParams);
 	if (err) {
@@ -509,6 +902,7 @@ SMBOpenServerEx(
 	
 	/* See if we need to prompt for a password */
 	if (SMBPasswordPrompt(*outConnection, options)) {
+		prompted = TRUE;
 		/* Attempt an authenticated connect again , could be kerberos or ntlm. */
 		status = SMBServerConnect(*outConnection, NULL, netfsOptions, kSMBAuthTypeAuthenticated);
 		if (NT_SUCCESS(status)) {
@@ -580,6 +974,18 @@ done:
         SMBReleaseServer(*outConnection);
         *outConnection = NULL;
     }
+	if (NT_SUCCESS(status) && *outConnection && poolKey &&
+		(reused || SMBPoolIdentityMatches(hContext, poolIdentity, prompted))) {
+		/* The handle owns the key now, so its context can go back in the pool */
+		(*outConnection)->pool_key = poolKey;
+		poolKey = NULL;
+	}
+	if (poolKey) {
+		free(poolKey);
+	}
+	if (poolIdentity) {
+		free(poolIdentity);
+	}
 
     return status;
 }
@@ -793,6 +1199,38 @@ SMBGetShareAttributes(SMBHANDLE inConnection, void *outAttrs)
     return STATUS_SUCCESS;
 }
 
+NTSTATUS
+SMBGetTransportAttributes(
+    SMBHANDLE inConnection,
+    struct smb_transport_attrs * outAttrs,
+    size_t inAttrsSize)
+{
+    struct smbioc_vc_properties vc_prop;
+    NTSTATUS status;
+    struct smb_ctx *ctx;
+    
+    if (!inConnection || !outAttrs || (inAttrsSize != sizeof(*outAttrs)))
+        return STATUS_INVALID_PARAMETER;
+    
+    status = SMBServerContext(inConnection, (void **)&ctx);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    
+    memset(&vc_prop, 0, sizeof(vc_prop));
+	vc_prop.ioc_version = SMB_IOC_STRUCT_VERSION;
+	if (smb_ioctl_call(ctx->ct_fd, SMBIOC_VC_PROPERTIES, &vc_prop) == -1) {
+		smb_log_info("%s: Getting the vc properties failed, syserr = %s",
+					 ASL_LEVEL_ERR, __FUNCTION__, strerror(errno));
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    outAttrs->tcp_sndbuf = vc_prop.tcp_sndbuf;
+    outAttrs->tcp_rcvbuf = vc_prop.tcp_rcvbuf;
+    outAttrs->tcp_rtt_usecs = vc_prop.tcp_rtt_usecs;
+    
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS
 SMBRetainServer(
     SMBHANDLE inConnection)
@@ -809,7 +1247,13 @@ SMBReleaseServer(
 
     refcount = OSAtomicDecrement32(&inConnection->refcount);
     if (refcount == 0) {
-        smb_ctx_done(inConnection->context);
+        if (inConnection->pool_key && inConnection->context &&
+            (inConnection->context->ct_flags & SMBCF_CONNECTED)) {
+            SMBPoolPark(inConnection->pool_key, inConnection->context);
+        } else {
+            smb_ctx_done(inConnection->context);
+            free(inConnection->pool_key);
+        }
         free(inConnection);
     }
 
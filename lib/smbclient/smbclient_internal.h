@@ -226,6 +226,57 @@ __OSX_AVAILABLE_STARTING(__MAC_10_9, __IPHONE_NA)
 ;
 
 
+/*
+ * Session pool statistics, see SMBGetSessionPoolStatistics
+ */
+struct smb_pool_stats {
+	uint64_t	hits;		/* SMBOpenServerEx reused an idle session */
+	uint64_t	misses;		/* SMBOpenServerEx had to open a new session */
+	uint64_t	parked;		/* Sessions put back into the pool */
+	uint64_t	expired;	/* Idle sessions closed by the pool */
+	uint64_t	idle;		/* Sessions currently in the pool */
+};
+
+/*!
+ * @function SMBGetSessionPoolStatistics
+ * @abstract Private routine for getting the usage statistics of the process
+ * wide session pool used by SMBOpenServerEx.
+ * @outStats - On return the current statistics
+ */
+SMBCLIENT_EXPORT
+void
+SMBGetSessionPoolStatistics(
+    struct smb_pool_stats * outStats)
+__OSX_AVAILABLE_STARTING(__MAC_10_9, __IPHONE_NA)
+;
+
+/*
+ * Transport attributes of a connection, see SMBGetTransportAttributes
+ */
+struct smb_transport_attrs {
+	uint32_t	tcp_sndbuf;		/* Socket buffer sizes in use */
+	uint32_t	tcp_rcvbuf;
+	uint64_t	tcp_rtt_usecs;	/* Last measured round trip time */
+};
+
+/*!
+ * @function SMBGetTransportAttributes
+ * @abstract Private routine for getting the socket buffer sizes and round
+ * trip time of the connection.
+ * @param inConnection A SMBHANDLE created by SMBOpenServerEx.
+ * @param outAttrs On return the transport attributes
+ * @param inAttrsSize The size of outAttrs, must be sizeof(struct smb_transport_attrs)
+ * @result Returns an NTSTATUS error code.
+ */
+SMBCLIENT_EXPORT
+NTSTATUS
+SMBGetTransportAttributes(
+    SMBHANDLE inConnection,
+    struct smb_transport_attrs * outAttrs,
+    size_t inAttrsSize)
+__OSX_AVAILABLE_STARTING(__MAC_10_9, __IPHONE_NA)
+;
+
 #endif // KERNEL
 
 	
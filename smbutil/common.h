@@ -25,6 +25,8 @@
 
 #include <CoreFoundation/CFDictionary.h>
 #include <CoreFoundation/CFArray.h>
+#include <CoreFoundation/CFPropertyList.h>
+#include <sys/time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,8 +35,15 @@ extern "C" {
 #define iprintf(ident,args...)	do { printf("%-" # ident "s", ""); \
 				printf(args);}while(0)
 
+/* Worker limits for the batch modes of view and statshares */
+#define SMBUTIL_DEFAULT_JOBS	8
+#define SMBUTIL_MAX_JOBS		64
+
 extern int verbose;
 
+typedef void cmd_usage_t (void);
+typedef void batch_fn_t (int index, void *arg);
+
 int  cmd_lookup(int argc, char *argv[]);
 int  cmd_status(int argc, char *argv[]);
 int  cmd_view(int argc, char *argv[]);
@@ -47,9 +56,14 @@ void view_usage(void);
 void dfs_usage(void);
 void identity_usage(void);
 void ntstatus_to_err(NTSTATUS status);
+int ntstatus_to_errno(NTSTATUS status);
 void statshares_usage(void);
 struct statfs *smb_getfsstat(int *fs_cnt);
 CFArrayRef createShareArrayFromShareDictionary(CFDictionaryRef shareDict);
+int parse_batch_jobs(const char *str, cmd_usage_t *usage);
+uint64_t elapsed_msecs(const struct timeval *start);
+void run_batch_jobs(int count, int maxjobs, batch_fn_t *fn, void *arg);
+void print_plist(FILE *fp, CFPropertyListRef plist);
 	
 #ifdef __cplusplus
 } // extern "C"
@@ -35,10 +35,12 @@
 #include <sys/time.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <err.h>
 #include <sysexits.h>
+#include <pthread.h>
 
 #include <smbclient/smbclient.h>
 #include <smbclient/ntstatus.h>
@@ -55,7 +57,6 @@ static int  cmd_help(int argc, char *argv[]);
 int verbose = 0;
 
 typedef int cmd_fn_t (int argc, char *argv[]);
-typedef void cmd_usage_t (void);
 
 
 static struct commands {
@@ -122,6 +123,151 @@ ntstatus_to_err(NTSTATUS status)
 	}
 }
 
+/*
+ * Same mapping as ntstatus_to_err, for the batch modes that report the
+ * failure and keep going.
+ */
+int
+ntstatus_to_errno(NTSTATUS status)
+{
+	switch (status) {
+		case STATUS_SUCCESS:
+			return 0;
+		case STATUS_NO_SUCH_DEVICE:
+			return ENXIO;
+		case STATUS_LOGON_FAILURE:
+		case STATUS_NO_SUCH_USER:
+			return EAUTH;
+		case STATUS_ACCESS_DENIED:
+			return EACCES;
+		case STATUS_CONNECTION_REFUSED:
+			return ECONNREFUSED;
+		case STATUS_INVALID_HANDLE:
+			return EBADF;
+		case STATUS_NO_MEMORY:
+			return ENOMEM;
+		case STATUS_INVALID_PARAMETER:
+			return EINVAL;
+		case STATUS_BAD_NETWORK_NAME:
+			return ENOENT;
+		case STATUS_NOT_SUPPORTED:
+			return ENOTSUP;
+		default:
+			return EIO;
+	}
+}
+
+/*
+ * Parse the -j argument used by the batch modes. Exits through the supplied
+ * usage routine if the value is not a sane worker count.
+ */
+int
+parse_batch_jobs(const char *str, cmd_usage_t *usage)
+{
+	char *end = NULL;
+	long jobs;
+
+	jobs = strtol(str, &end, 10);
+	if ((end == str) || (*end != 0) || (jobs < 1) || (jobs > SMBUTIL_MAX_JOBS)) {
+		warnx("invalid job count %s, must be 1 to %d", str, SMBUTIL_MAX_JOBS);
+		usage();
+	}
+	return (int)jobs;
+}
+
+/*
+ * Return the number of milliseconds that have elapsed since start.
+ */
+uint64_t
+elapsed_msecs(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((uint64_t)(now.tv_sec - start->tv_sec) * 1000) +
+		   ((int64_t)(now.tv_usec - start->tv_usec) / 1000);
+}
+
+struct batch_pool {
+	pthread_mutex_t	lock;
+	int				next;
+	int				count;
+	batch_fn_t		*fn;
+	void			*arg;
+};
+
+static void *
+batch_worker(void *arg)
+{
+	struct batch_pool *pool = arg;
+	int index;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		index = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (index >= pool->count)
+			break;
+		pool->fn(index, pool->arg);
+	}
+	return NULL;
+}
+
+/*
+ * Run count jobs on at most maxjobs threads. Each worker keeps pulling the next
+ * unclaimed job, so a handful of slow or dead servers only hold up the workers
+ * that are waiting on them. The calling thread is one of the workers, so if we
+ * can't create any threads the jobs still run, just serially.
+ */
+void
+run_batch_jobs(int count, int maxjobs, batch_fn_t *fn, void *arg)
+{
+	struct batch_pool pool;
+	pthread_t *threads = NULL;
+	int nthreads = 0;
+	int ii;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.next = 0;
+	pool.count = count;
+	pool.fn = fn;
+	pool.arg = arg;
+
+	if (maxjobs > count)
+		maxjobs = count;
+	if (maxjobs > 1)
+		threads = calloc(maxjobs - 1, sizeof(*threads));
+	for (ii = 0; threads && (ii < maxjobs - 1); ii++) {
+		if (pthread_create(&threads[nthreads], NULL, batch_worker, &pool) != 0) {
+			warnx("only able to start %d of %d workers", nthreads + 1, maxjobs);
+			break;
+		}
+		nthreads++;
+	}
+	batch_worker(&pool);
+	for (ii = 0; ii < nthreads; ii++)
+		pthread_join(threads[ii], NULL);
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+}
+
+/*
+ * Write a property list to fp in XML format.
+ */
+void
+print_plist(FILE *fp, CFPropertyListRef plist)
+{
+	CFDataRef data;
+
+	data = CFPropertyListCreateData(kCFAllocatorDefault, plist,
+									kCFPropertyListXMLFormat_v1_0, 0, NULL);
+	if (data == NULL) {
+		errx(EX_SOFTWARE, "unable to create property list");
+	}
+	fwrite(CFDataGetBytePtr(data), 1, (size_t)CFDataGetLength(data), fp);
+	CFRelease(data);
+}
+
 int
 cmd_help(int argc, char *argv[])
 {
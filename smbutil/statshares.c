@@ -40,6 +40,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <strings.h>
+#include <string.h>
 #include <stdlib.h>
 #include <sysexits.h>
 
@@ -100,7 +101,8 @@ print_delimeter(FILE *fp)
 }
 
 static void
-interpret_and_display(char *share, SMBShareAttributes *sattrs)
+interpret_and_display(char *share, SMBShareAttributes *sattrs,
+                      struct smb_transport_attrs *tattrs)
 {
     int ret = 0;
     
@@ -244,6 +246,11 @@ interpret_and_display(char *share, SMBShareAttributes *sattrs)
                   "TRUE", &ret);
 
 	if (verbose) {
+        /* Socket buffer sizes the connection is using */
+        fprintf(stdout, "%-30s%-30s%u\n", "", "TCP_SNDBUF", tattrs->tcp_sndbuf);
+        fprintf(stdout, "%-30s%-30s%u\n", "", "TCP_RCVBUF", tattrs->tcp_rcvbuf);
+        fprintf(stdout, "%-30s%-30s%llu\n", "", "TCP_RTT_USECS", tattrs->tcp_rtt_usecs);
+
         fprintf(stdout, "vc_flags: 0x%x\n", sattrs->vc_flags);
         fprintf(stdout, "vc_hflags: 0x%x\n", sattrs->vc_hflags);
         fprintf(stdout, "vc_hflags2: 0x%x\n", sattrs->vc_hflags2);
@@ -260,16 +267,22 @@ interpret_and_display(char *share, SMBShareAttributes *sattrs)
     }
 }
 
+/*
+ * Get the attributes of the share mounted at share_mp. The share name is
+ * returned in share_name, which must be at least MNAMELEN bytes.
+ */
 static NTSTATUS
-stat_share(char *share_mp, bool disablePrintingHeader)
+get_share_attributes(const char *share_mp, char *share_name,
+                     SMBShareAttributes *sattrs, struct smb_transport_attrs *tattrs)
 {
     SMBHANDLE inConnection = NULL;
     NTSTATUS status = STATUS_SUCCESS;
     struct statfs statbuf;
     char tmp_name[MNAMELEN];
-    char *share_name = NULL, *end = NULL;
+    char *name = NULL, *end = NULL;
     
-    if ((statfs((const char*)share_mp, &statbuf) == -1) || (strncmp(statbuf.f_fstypename, "smbfs", 5) != 0)) {
+    share_name[0] = 0;
+    if ((statfs(share_mp, &statbuf) == -1) || (strncmp(statbuf.f_fstypename, "smbfs", 5) != 0)) {
         status = STATUS_INVALID_PARAMETER;
         errno = EINVAL;
         return  status;
@@ -281,17 +294,18 @@ stat_share(char *share_mp, bool disablePrintingHeader)
      * mountpath and skip the initial "//"
      */
     strlcpy(tmp_name, &statbuf.f_mntfromname[2], sizeof(tmp_name));
-    share_name = strchr(tmp_name, '/');
-    if (share_name != NULL) {
+    name = strchr(tmp_name, '/');
+    if (name != NULL) {
         /* skip over the / to point at share name */
-        share_name += 1;
+        name += 1;
         
         /* Check for submount and if found, strip it off */
-        end = strchr(share_name, '/');
+        end = strchr(name, '/');
         if (end != NULL) {
             /* Found submount, just null it out as we only want sharepoint */
             *end = 0x00;
         }
+        strlcpy(share_name, name, MNAMELEN);
     }
     else {
         fprintf(stderr, "%s : Failed to find share name in %s\n",
@@ -310,19 +324,15 @@ stat_share(char *share_mp, bool disablePrintingHeader)
                 __FUNCTION__, share_mp, share_name);
     }
     else {
-        SMBShareAttributes sattrs;
-        
-        status = SMBGetShareAttributes(inConnection, &sattrs);
+        status = SMBGetShareAttributes(inConnection, sattrs);
         if (!NT_SUCCESS(status)) {
             fprintf(stderr, "%s : SMBGetShareAttributes() failed for %s <%s>\n",
                     __FUNCTION__, share_mp, share_name);
         }
-        else {
-            if (!disablePrintingHeader)
-                print_header(stdout);
-
-            interpret_and_display(share_name, &sattrs);
-            print_delimeter(stdout);
+        /* Only informational, leave them zero if we can't get them */
+        else if (!NT_SUCCESS(SMBGetTransportAttributes(inConnection, tattrs,
+                                                       sizeof(*tattrs)))) {
+            memset(tattrs, 0, sizeof(*tattrs));
         }
         SMBReleaseServer(inConnection);
     }
@@ -330,35 +340,185 @@ stat_share(char *share_mp, bool disablePrintingHeader)
     return status;
 }
 
+/*
+ * One entry per mounted share. The workers only fill in their own entry, the
+ * results are displayed afterwards in mount order.
+ */
+struct share_job {
+    const char          *share_mp;
+    char                share_name[MNAMELEN];
+    SMBShareAttributes  sattrs;
+    struct smb_transport_attrs tattrs;
+    NTSTATUS            status;
+    uint64_t            elapsed;    /* msecs to connect and get attributes */
+};
+
+static void
+stat_share_job(int index, void *arg)
+{
+    struct share_job *job = &((struct share_job *)arg)[index];
+    struct timeval start;
+    
+    gettimeofday(&start, NULL);
+    job->status = get_share_attributes(job->share_mp, job->share_name,
+                                       &job->sattrs, &job->tattrs);
+    job->elapsed = elapsed_msecs(&start);
+}
+
+static void
+add_number(CFMutableDictionaryRef dict, CFStringRef key, CFNumberType type,
+           const void *value)
+{
+    CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, type, value);
+    
+    if (num) {
+        CFDictionarySetValue(dict, key, num);
+        CFRelease(num);
+    }
+}
+
+static void
+add_string(CFMutableDictionaryRef dict, CFStringRef key, const char *value)
+{
+    CFStringRef str = CFStringCreateWithCString(kCFAllocatorDefault, value,
+                                                kCFStringEncodingUTF8);
+    
+    if (str) {
+        CFDictionarySetValue(dict, key, str);
+        CFRelease(str);
+    }
+}
+
+/*
+ * Machine readable form of the share attributes. We just hand back the raw
+ * flags, the consumer can decode them the same way interpret_and_display does.
+ */
+static void
+print_share_jobs_plist(struct share_job *jobs, int count)
+{
+    CFMutableArrayRef results;
+    CFMutableDictionaryRef dict;
+    int i;
+    
+    results = CFArrayCreateMutable(kCFAllocatorDefault, count,
+                                   &kCFTypeArrayCallBacks);
+    if (results == NULL) {
+        errx(EX_UNAVAILABLE, "no memory, internal error");
+    }
+    for (i = 0; i < count; i++) {
+        struct share_job *job = &jobs[i];
+        SMBShareAttributes *sattrs = &job->sattrs;
+        
+        dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                         &kCFTypeDictionaryKeyCallBacks,
+                                         &kCFTypeDictionaryValueCallBacks);
+        if (dict == NULL) {
+            continue;
+        }
+        add_string(dict, CFSTR("MountPath"), job->share_mp);
+        add_string(dict, CFSTR("ShareName"), job->share_name);
+        add_number(dict, CFSTR("NTStatus"), kCFNumberSInt32Type, &job->status);
+        add_number(dict, CFSTR("Time"), kCFNumberSInt64Type, &job->elapsed);
+        if (NT_SUCCESS(job->status)) {
+            add_string(dict, CFSTR("ServerName"), sattrs->server_name);
+            add_number(dict, CFSTR("vc_uid"), kCFNumberSInt32Type, &sattrs->vc_uid);
+            add_number(dict, CFSTR("vc_flags"), kCFNumberSInt32Type, &sattrs->vc_flags);
+            add_number(dict, CFSTR("vc_hflags"), kCFNumberSInt32Type, &sattrs->vc_hflags);
+            add_number(dict, CFSTR("vc_hflags2"), kCFNumberSInt32Type, &sattrs->vc_hflags2);
+            add_number(dict, CFSTR("vc_misc_flags"), kCFNumberSInt64Type, &sattrs->vc_misc_flags);
+            add_number(dict, CFSTR("vc_smb1_caps"), kCFNumberSInt32Type, &sattrs->vc_smb1_caps);
+            add_number(dict, CFSTR("vc_smb2_caps"), kCFNumberSInt32Type, &sattrs->vc_smb2_caps);
+            add_number(dict, CFSTR("vc_tcp_sndbuf"), kCFNumberSInt32Type, &job->tattrs.tcp_sndbuf);
+            add_number(dict, CFSTR("vc_tcp_rcvbuf"), kCFNumberSInt32Type, &job->tattrs.tcp_rcvbuf);
+            add_number(dict, CFSTR("vc_tcp_rtt_usecs"), kCFNumberSInt64Type, &job->tattrs.tcp_rtt_usecs);
+            add_number(dict, CFSTR("ss_attrs"), kCFNumberSInt32Type, &sattrs->ss_attrs);
+            add_number(dict, CFSTR("ss_caps"), kCFNumberSInt32Type, &sattrs->ss_caps);
+            add_number(dict, CFSTR("ss_flags"), kCFNumberSInt32Type, &sattrs->ss_flags);
+            add_number(dict, CFSTR("ss_fstype"), kCFNumberSInt16Type, &sattrs->ss_fstype);
+            add_number(dict, CFSTR("ss_type"), kCFNumberSInt32Type, &sattrs->ss_type);
+        }
+        CFArrayAppendValue(results, dict);
+        CFRelease(dict);
+    }
+    print_plist(stdout, results);
+    CFRelease(results);
+}
+
 static NTSTATUS
-stat_all_shares()
+stat_share(char *share_mp, bool plistOutput)
+{
+    struct share_job job;
+    
+    memset(&job, 0, sizeof(job));
+    job.share_mp = share_mp;
+    stat_share_job(0, &job);
+    if (plistOutput) {
+        print_share_jobs_plist(&job, 1);
+    }
+    else if (NT_SUCCESS(job.status)) {
+        print_header(stdout);
+        interpret_and_display(job.share_name, &job.sattrs, &job.tattrs);
+        print_delimeter(stdout);
+    }
+    
+    return job.status;
+}
+
+/*
+ * Stat every mounted share, up to maxjobs at a time. A server that has gone
+ * away only stalls the worker waiting on it instead of the whole listing.
+ */
+static NTSTATUS
+stat_all_shares(int maxjobs, bool plistOutput)
 {
     NTSTATUS error = STATUS_SUCCESS;
     struct statfs *fs = NULL;
+    struct share_job *jobs = NULL;
     int fs_cnt = 0;
+    int count = 0;
     int i = 0;
-    int disablePrintingHeader = 1;
     
     fs = smb_getfsstat(&fs_cnt);
     if (!fs || fs_cnt < 0)
         return ENOENT;
-    print_header(stdout);
+    
+    jobs = calloc(fs_cnt ? fs_cnt : 1, sizeof(*jobs));
+    if (jobs == NULL)
+        return STATUS_NO_MEMORY;
     for (i = 0; i < fs_cnt; i++, fs++) {
-        NTSTATUS status;
-        
         if (strncmp(fs->f_fstypename, "smbfs", 5) != 0)
 			continue;
 		if (fs->f_flags & MNT_AUTOMOUNTED)
             continue;
-        
-        status = stat_share(fs->f_mntonname, disablePrintingHeader) ;
-        if (!NT_SUCCESS(status)) {
-            fprintf(stderr, "%s : stat_share() failed for %s\n",
-                    __FUNCTION__, fs->f_mntonname);
-            print_delimeter(stderr);
-            error = status;
+        jobs[count++].share_mp = fs->f_mntonname;
+    }
+    
+    run_batch_jobs(count, maxjobs, stat_share_job, jobs);
+    
+    if (plistOutput) {
+        print_share_jobs_plist(jobs, count);
+    }
+    else {
+        print_header(stdout);
+    }
+    for (i = 0; i < count; i++) {
+        if (!NT_SUCCESS(jobs[i].status)) {
+            if (!plistOutput) {
+                fprintf(stderr, "%s : stat_share() failed for %s\n",
+                        __FUNCTION__, jobs[i].share_mp);
+                print_delimeter(stderr);
+            }
+            error = jobs[i].status;
+        }
+        else if (!plistOutput) {
+            interpret_and_display(jobs[i].share_name, &jobs[i].sattrs,
+                                  &jobs[i].tattrs);
+            if (verbose)
+                fprintf(stdout, "time: %llu ms\n", jobs[i].elapsed);
+            print_delimeter(stdout);
         }
     }
+    free(jobs);
     
     return error;
 }
@@ -368,27 +528,40 @@ cmd_statshares(int argc, char *argv[])
 {
     NTSTATUS status = STATUS_SUCCESS;
     int opt;
-    bool disablePrintingHeader = 0;
+    char *share_mp = NULL;
+    bool allShares = FALSE;
+    bool plistOutput = FALSE;
+    int maxjobs = SMBUTIL_DEFAULT_JOBS;
     
-    if ((opt = getopt(argc, argv, "am:")) != EOF) {
+    while ((opt = getopt(argc, argv, "am:j:x")) != EOF) {
 		switch(opt) {
 			case 'a':
-                if (argc != 2)
-                    statshares_usage();
-                status = stat_all_shares();
+                allShares = TRUE;
                 break;
             case 'm':
-                if (argc != 3)
-                    statshares_usage();
-                status = stat_share(optarg, disablePrintingHeader);
+                share_mp = optarg;
+                break;
+            case 'j':
+                maxjobs = parse_batch_jobs(optarg, statshares_usage);
+                break;
+            case 'x':
+                plistOutput = TRUE;
                 break;
             default:
+                statshares_usage();
                 break;
         }
     }
-    else
+    
+    /* -a and -m are mutually exclusive, but one of them is required */
+    if ((optind != argc) || (allShares == (share_mp != NULL)))
         statshares_usage();
     
+    if (allShares)
+        status = stat_all_shares(maxjobs, plistOutput);
+    else
+        status = stat_share(share_mp, plistOutput);
+    
     if (!NT_SUCCESS(status))
         ntstatus_to_err(status);
     
@@ -398,12 +571,14 @@ cmd_statshares(int argc, char *argv[])
 void
 statshares_usage(void)
 {
-	fprintf(stderr, "usage : smbutil statshares [-m <mount_path>] | [-a]\n");
+	fprintf(stderr, "usage : smbutil statshares [-m <mount_path>] | [-a [-j <jobs>]] [-x]\n");
     fprintf(stderr, "\
             [\n \
             description :\n \
             -a : attributes of all mounted shares\n \
             -m <mount_path> : attributes of share mounted at mount_path\n \
+            -j <jobs> : number of shares to query at once with -a\n \
+            -x : print the attributes as an XML property list\n \
             ]\n");
     exit(1);
 }
@@ -41,6 +41,7 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <sysexits.h>
+#include <string.h>
 
 #include <smbclient/smbclient.h>
 #include <smbclient/ntstatus.h>
@@ -94,6 +95,259 @@ CFArrayRef createShareArrayFromShareDictionary(CFDictionaryRef shareDict)
 	return keyArray;
 }
 
+/*
+ * Print the share dictionary returned by smb_netshareenum as a table.
+ */
+static void
+print_share_table(CFDictionaryRef shareDict)
+{
+	CFArrayRef shareArray = createShareArrayFromShareDictionary(shareDict);
+	CFStringRef shareStr, shareTypeStr, commentStr;
+	CFDictionaryRef theDict;
+	CFIndex ii;
+	char *share, *sharetype, *comments;
+	
+	fprintf(stdout, "%-48s%-8s%s\n", "Share", "Type", "Comments");
+	fprintf(stdout, "-------------------------------\n");
+	for (ii=0; shareArray && (ii < CFArrayGetCount(shareArray)); ii++) {
+		shareStr = CFArrayGetValueAtIndex(shareArray, ii);
+		/* Should never happen, but just to be safe */
+		if (shareStr == NULL) {
+			continue;
+		}
+		theDict = CFDictionaryGetValue(shareDict, shareStr);
+		/* Should never happen, but just to be safe */
+		if (theDict == NULL) {
+			continue;
+		}
+		shareTypeStr = CFDictionaryGetValue(theDict, kNetShareTypeStrKey);
+		commentStr = CFDictionaryGetValue(theDict, kNetCommentStrKey);
+		
+		share = CStringCreateWithCFString(shareStr);
+		sharetype = CStringCreateWithCFString(shareTypeStr);
+		comments = CStringCreateWithCFString(commentStr);
+		fprintf(stdout, "%-48s%-8s%s\n", share ? share : "",  
+				sharetype ? sharetype : "", comments ? comments : "");
+		free(share);
+		free(sharetype);
+		free(comments);
+	}
+	if (shareArray) {
+		fprintf(stdout, "\n%ld shares listed\n", CFArrayGetCount(shareArray));
+		CFRelease(shareArray);
+	} else {
+		fprintf(stdout, "\n0 shares listed\n");
+	}
+}
+
+/*
+ * Batch mode state. Each server gets its own job entry, the workers only ever
+ * touch their own entry so no locking is needed beyond the job dispatch.
+ */
+struct view_job {
+	const char		*url;
+	NTSTATUS		status;
+	int				error;
+	uint64_t		connect_time;	/* msecs to open and authenticate */
+	uint64_t		enum_time;		/* msecs to enumerate the shares */
+	CFDictionaryRef	shareDict;
+};
+
+struct view_batch {
+	uint64_t		options;
+	struct view_job	*jobs;
+};
+
+static void
+view_batch_job(int index, void *arg)
+{
+	struct view_batch *batch = arg;
+	struct view_job *job = &batch->jobs[index];
+	SMBHANDLE serverConnection = NULL;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	job->status = SMBOpenServerEx(job->url, &serverConnection, batch->options);
+	job->connect_time = elapsed_msecs(&start);
+	if (!NT_SUCCESS(job->status)) {
+		job->error = ntstatus_to_errno(job->status);
+		return;
+	}
+	if ((batch->options & kSMBOptionSessionOnly) == 0) {
+		gettimeofday(&start, NULL);
+		job->error = smb_netshareenum(serverConnection, &job->shareDict, FALSE);
+		job->enum_time = elapsed_msecs(&start);
+	}
+	SMBReleaseServer(serverConnection);
+}
+
+static void
+addNumberToDictionary(CFMutableDictionaryRef dict, CFStringRef key,
+					  CFNumberType type, const void *value)
+{
+	CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, type, value);
+	
+	if (num) {
+		CFDictionarySetValue(dict, key, num);
+		CFRelease(num);
+	}
+}
+
+static void
+print_view_job_plist(struct view_job *jobs, int count)
+{
+	CFMutableArrayRef results;
+	CFMutableDictionaryRef dict;
+	CFStringRef urlStr;
+	int ii;
+
+	results = CFArrayCreateMutable(kCFAllocatorDefault, count, &kCFTypeArrayCallBacks);
+	if (results == NULL) {
+		errx(EX_UNAVAILABLE, "no memory, internal error");
+	}
+	for (ii = 0; ii < count; ii++) {
+		dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+										 &kCFTypeDictionaryKeyCallBacks,
+										 &kCFTypeDictionaryValueCallBacks);
+		if (dict == NULL) {
+			continue;
+		}
+		urlStr = CFStringCreateWithCString(kCFAllocatorDefault, jobs[ii].url,
+										   kCFStringEncodingUTF8);
+		if (urlStr) {
+			CFDictionarySetValue(dict, CFSTR("Server"), urlStr);
+			CFRelease(urlStr);
+		}
+		addNumberToDictionary(dict, CFSTR("NTStatus"), kCFNumberSInt32Type,
+							  &jobs[ii].status);
+		addNumberToDictionary(dict, CFSTR("Error"), kCFNumberIntType,
+							  &jobs[ii].error);
+		addNumberToDictionary(dict, CFSTR("ConnectTime"), kCFNumberSInt64Type,
+							  &jobs[ii].connect_time);
+		addNumberToDictionary(dict, CFSTR("EnumerateTime"), kCFNumberSInt64Type,
+							  &jobs[ii].enum_time);
+		if (jobs[ii].shareDict) {
+			CFDictionarySetValue(dict, CFSTR("Shares"), jobs[ii].shareDict);
+		}
+		CFArrayAppendValue(results, dict);
+		CFRelease(dict);
+	}
+	print_plist(stdout, results);
+	CFRelease(results);
+}
+
+static void
+free_view_urls(const char **urls, int count)
+{
+	int ii;
+
+	for (ii = 0; ii < count; ii++) {
+		free((char *)urls[ii]);
+	}
+	free(urls);
+}
+
+/*
+ * Read server URLs from stdin, one per line, for "smbutil view -j N -". On
+ * failure nothing read so far is handed back.
+ */
+static int
+read_view_urls(const char ***urls, int *count)
+{
+	char *line = NULL;
+	char *url;
+	size_t linecap = 0;
+	ssize_t len;
+	int max = *count;
+	int error = 0;
+
+	while ((len = getline(&line, &linecap, stdin)) > 0) {
+		while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+			line[--len] = 0;
+		}
+		if ((len == 0) || (line[0] == '#')) {
+			continue;
+		}
+		if (*count == max) {
+			const char **tmp;
+
+			max = max ? max * 2 : 64;
+			tmp = realloc(*urls, max * sizeof(**urls));
+			if (tmp == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			*urls = tmp;
+		}
+		url = strdup(line);
+		if (url == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		(*urls)[(*count)++] = url;
+	}
+	free(line);
+	if (error) {
+		free_view_urls(*urls, *count);
+		*urls = NULL;
+		*count = 0;
+	}
+	return error;
+}
+
+/*
+ * Enumerate the shares on each server with a bounded number of workers. The
+ * results are reported in the order the servers were given, either as the
+ * usual table per server or as an XML property list that includes the time
+ * it took to connect to and enumerate each server.
+ */
+static int
+view_batch(const char **urls, int count, uint64_t options, int maxjobs,
+		   int plistOutput)
+{
+	struct view_batch batch;
+	int ii, failed = 0;
+
+	batch.options = options;
+	batch.jobs = calloc(count, sizeof(*batch.jobs));
+	if (batch.jobs == NULL) {
+		errx(EX_UNAVAILABLE, "no memory, internal error");
+	}
+	for (ii = 0; ii < count; ii++) {
+		batch.jobs[ii].url = urls[ii];
+	}
+	run_batch_jobs(count, maxjobs, view_batch_job, &batch);
+	
+	if (plistOutput) {
+		print_view_job_plist(batch.jobs, count);
+	}
+	for (ii = 0; ii < count; ii++) {
+		struct view_job *job = &batch.jobs[ii];
+		
+		if (!NT_SUCCESS(job->status) || job->error) {
+			failed++;
+		}
+		if (!plistOutput) {
+			fprintf(stdout, "\n%s: connect %llu ms, enumerate %llu ms\n",
+					job->url, job->connect_time, job->enum_time);
+			if (!NT_SUCCESS(job->status)) {
+				fprintf(stdout, "unable to connect: %s\n", strerror(job->error));
+			} else if (job->error) {
+				fprintf(stdout, "unable to list resources: %s\n", strerror(job->error));
+			} else if (options & kSMBOptionSessionOnly) {
+				fprintf(stdout, "Authenticate successfully with %s\n", job->url);
+			} else {
+				print_share_table(job->shareDict);
+			}
+		}
+		if (job->shareDict) {
+			CFRelease(job->shareDict);
+		}
+	}
+	free(batch.jobs);
+	return failed ? EX_IOERR : 0;
+}
+
 int
 cmd_view(int argc, char *argv[])
 {
@@ -104,8 +358,10 @@ cmd_view(int argc, char *argv[])
 	NTSTATUS	status;
 	int			error;
 	CFDictionaryRef shareDict= NULL;
+	int			maxjobs = 0;
+	int			plistOutput = FALSE;
 	
-	while ((opt = getopt(argc, argv, "ANGgaf")) != EOF) {
+	while ((opt = getopt(argc, argv, "ANGgafj:x")) != EOF) {
 		switch(opt){
 			case 'A':
 				options |= kSMBOptionSessionOnly;
@@ -131,6 +387,12 @@ cmd_view(int argc, char *argv[])
 			case 'f':
 				options |= kSMBOptionForceNewSession;
 				break;
+			case 'j':
+				maxjobs = parse_batch_jobs(optarg, view_usage);
+				break;
+			case 'x':
+				plistOutput = TRUE;
+				break;
 			default:
 				view_usage();
 				/*NOTREACHED*/
@@ -141,9 +403,35 @@ cmd_view(int argc, char *argv[])
 		view_usage();
 	url = argv[optind];
 	argc -= optind;
-	/* One more check to make sure we have the correct number of arguments */
-	if (argc != 1)
-		view_usage();
+	
+	/*
+	 * More than one server, a server list on stdin, a worker count or plist
+	 * output puts us in batch mode. Never prompt for a password in batch mode, we could have any
+	 * number of servers in flight at once.
+	 */
+	if ((argc > 1) || (strcmp(url, "-") == 0) || maxjobs || plistOutput) {
+		const char **urls = NULL;
+		int count = 0;
+		
+		options |= kSMBOptionNoPrompt;
+		if (maxjobs == 0)
+			maxjobs = SMBUTIL_DEFAULT_JOBS;
+		if ((argc == 1) && (strcmp(url, "-") == 0)) {
+			error = read_view_urls(&urls, &count);
+			if (error) {
+				errno = error;
+				err(EX_IOERR, "unable to read server list");
+			}
+			if (count == 0)
+				view_usage();
+			error = view_batch(urls, count, options, maxjobs, plistOutput);
+			free_view_urls(urls, count);
+			return error;
+		}
+		urls = (const char **)&argv[optind];
+		count = argc;
+		return view_batch(urls, count, options, maxjobs, plistOutput);
+	}
 	
 	status = SMBOpenServerEx(url, &serverConnection, options);
 	/* 
@@ -158,8 +446,6 @@ cmd_view(int argc, char *argv[])
 		fprintf(stdout, "Authenticate successfully with %s\n", url);
 		goto done;
 	}
-	fprintf(stdout, "%-48s%-8s%s\n", "Share", "Type", "Comments");
-	fprintf(stdout, "-------------------------------\n");
 
 	error = smb_netshareenum(serverConnection, &shareDict, FALSE);
 	if (error) {
@@ -167,41 +453,7 @@ cmd_view(int argc, char *argv[])
 		SMBReleaseServer(serverConnection);
 		err(EX_IOERR, "unable to list resources");
 	} else {
-		CFArrayRef shareArray = createShareArrayFromShareDictionary(shareDict);
-		CFStringRef shareStr, shareTypeStr, commentStr;
-		CFDictionaryRef theDict;
-		CFIndex ii;
-		char *share, *sharetype, *comments;
-						
-		for (ii=0; shareArray && (ii < CFArrayGetCount(shareArray)); ii++) {
-			shareStr = CFArrayGetValueAtIndex(shareArray, ii);
-			/* Should never happen, but just to be safe */
-			if (shareStr == NULL) {
-				continue;
-			}
-			theDict = CFDictionaryGetValue(shareDict, shareStr);
-			/* Should never happen, but just to be safe */
-			if (theDict == NULL) {
-				continue;
-			}
-			shareTypeStr = CFDictionaryGetValue(theDict, kNetShareTypeStrKey);
-			commentStr = CFDictionaryGetValue(theDict, kNetCommentStrKey);
-			
-			share = CStringCreateWithCFString(shareStr);
-			sharetype = CStringCreateWithCFString(shareTypeStr);
-			comments = CStringCreateWithCFString(commentStr);
-			fprintf(stdout, "%-48s%-8s%s\n", share ? share : "",  
-					sharetype ? sharetype : "", comments ? comments : "");
-			free(share);
-			free(sharetype);
-			free(comments);
-		}
-		if (shareArray) {
-			fprintf(stdout, "\n%ld shares listed\n", CFArrayGetCount(shareArray));
-			CFRelease(shareArray);
-		} else {
-			fprintf(stdout, "\n0 shares listed\n");
-		}
+		print_share_table(shareDict);
 		if (shareDict) {
 			CFRelease(shareDict);
 		}
@@ -217,7 +469,8 @@ view_usage(void)
 {
 	fprintf(stderr, "usage: smbutil view [connection options] //"
 		"[domain;][user[:password]@]"
-	"server\n");
+	"server ...\n");
+	fprintf(stderr, "       smbutil view [connection options] [-j jobs] [-x] -\n");
 	
 	fprintf(stderr, "where options are:\n"
 					"    -A    authorize only\n"
@@ -225,6 +478,8 @@ view_usage(void)
 					"    -G    allow guest access\n"
 					"    -g    authorize with guest only\n"
 					"    -a    authorize with anonymous only\n"
-					"    -f    don't share session\n");
+					"    -f    don't share session\n"
+					"    -j    number of servers to query at once (batch mode)\n"
+					"    -x    print the results as an XML property list\n");
 	exit(1);
 }
\ No newline at end of file